@@ -9,23 +9,73 @@
 #include <libgen.h>
 #include <math.h>
 #include <iostream>
+#include <string>
+#include <vector>
 
 #include "filesystem.hpp"
+#include "diskbackend.hpp"
 
 const int USER_OPT_COUNT = 2;
+const int OPTIONAL_OPT_COUNT = 2;
 
 int main(int argc, char *argv[]) {
 	try {
-		if (argc - 1 != USER_OPT_COUNT) {
-			fprintf(stdout, "Expected argument: <backing file> <file size in bytes>\n");
+		// the file system can be made to deduplicate file data and to keep its 
+		// metadata on a separate fast device, both given as the last arguments
+		bool dedup = false;
+		std::string fast_path;
+		unsigned long long fast_size_in_bytes = 0;
+		while (argc - 1 > USER_OPT_COUNT) {
+			if (strcmp(argv[argc - 1], "dedup") == 0) {
+				dedup = true;
+			} else if (strncmp(argv[argc - 1], "fast=", 5) == 0) {
+				fast_path = argv[argc - 1] + 5;
+				size_t colon = fast_path.rfind(':');
+				if (colon != std::string::npos) {
+					fast_size_in_bytes = strtoull(fast_path.c_str() + colon + 1, NULL, 10);
+					fast_path.resize(colon);
+				}
+			} else {
+				break ;
+			}
+			argc--;
+		}
+
+		if (argc - 1 < USER_OPT_COUNT || argc - 1 > USER_OPT_COUNT + OPTIONAL_OPT_COUNT) {
+			fprintf(stdout, "Expected argument: <backing file>[,<backing file>...] <file size in bytes> "
+				"[chunk size in bytes, default 4096] [stripe unit in bytes, default 65536] [dedup] "
+				"[fast=<fast device>[:<size in bytes>]]\n");
 			return 1;
 		}
 
-		const char *backing_file_path = argv[1];
+		// several backing files make one disk striped over all of them, each 
+		// is file_size_in_bytes large
+		std::vector<std::string> backing_file_paths;
+		{
+			std::string paths = argv[1];
+			size_t start = 0;
+			for (size_t comma = paths.find(','); comma != std::string::npos; comma = paths.find(',', start)) {
+				backing_file_paths.push_back(paths.substr(start, comma - start));
+				start = comma + 1;
+			}
+			backing_file_paths.push_back(paths.substr(start));
+		}
 		const unsigned long long file_size_in_bytes = strtol(argv[2], NULL, 10);
 
-		const size_t CHUNK_SIZE = 4096;
-		const size_t CHUNK_COUNT = file_size_in_bytes / CHUNK_SIZE;
+		// larger chunks make for shallower indirection trees and larger device I/O, 
+		// the chunk size is stored in the superblock so myfs picks it up from there
+		const size_t CHUNK_SIZE = argc - 1 > USER_OPT_COUNT ? strtoull(argv[3], NULL, 10) : SuperBlock::DEFAULT_CHUNK_SIZE;
+		if (!SuperBlock::valid_chunk_size(CHUNK_SIZE)) {
+			fprintf(stdout, "the chunk size must be a power of two from %lu to %lu bytes\n", 
+				(unsigned long)SuperBlock::MIN_CHUNK_SIZE, (unsigned long)SuperBlock::MAX_CHUNK_SIZE);
+			return 1;
+		}
+
+		const size_t STRIPE_UNIT = argc - 1 > USER_OPT_COUNT + 1 ? strtoull(argv[4], NULL, 10) : StripedBackend::DEFAULT_STRIPE_UNIT;
+		if (backing_file_paths.size() > 1 && (STRIPE_UNIT == 0 || STRIPE_UNIT % CHUNK_SIZE != 0)) {
+			fprintf(stdout, "the stripe unit must be a multiple of the chunk size\n");
+			return 1;
+		}
 
 		fprintf(stdout, "initializing the disk.\n");
 
@@ -33,27 +83,68 @@ int main(int argc, char *argv[]) {
 		std::unique_ptr<Disk> disk = nullptr;
 		SuperBlock *superblock = nullptr;
 
-		int fh = open(backing_file_path, O_RDWR | O_CREAT, 0666);
-		lseek(fh, file_size_in_bytes - 1, SEEK_SET);
-		const char *empty = "";
-		write(fh, empty, 1);
+		std::vector<int> fhs;
+		for (const std::string &backing_file_path : backing_file_paths) {
+			int fh = open(backing_file_path.c_str(), O_RDWR | O_CREAT, 0666);
+			if (fh == -1) {
+				fprintf(stdout, "failed to get a handle on the requestd file: %s\n", backing_file_path.c_str());
+				return 1;
+			}
+			lseek(fh, file_size_in_bytes - 1, SEEK_SET);
+			const char *empty = "";
+			write(fh, empty, 1);
+			fhs.push_back(fh);
+		}
 
 		// truncate(backing_file_path, file_size_in_bytes);
-		if (fh == -1) {
-			fprintf(stdout, "failed to get a handle on the requestd file: %s\n", backing_file_path);
-			return 1;
+		std::unique_ptr<DiskBackend> backend = make_disk_backend("mmap", fhs, file_size_in_bytes, STRIPE_UNIT);
+
+		// the fast device goes in front of the others, the superblock and all the 
+		// metadata end up on it. without a size it is used whole
+		int fast_fh = -1;
+		if (!fast_path.empty()) {
+			fast_fh = open(fast_path.c_str(), O_RDWR | O_CREAT, 0666);
+			if (fast_fh == -1) {
+				fprintf(stdout, "failed to get a handle on the fast device: %s\n", fast_path.c_str());
+				return 1;
+			}
+			if (fast_size_in_bytes == 0) {
+				fast_size_in_bytes = lseek(fast_fh, 0, SEEK_END);
+			} else if ((unsigned long long)lseek(fast_fh, 0, SEEK_END) < fast_size_in_bytes) {
+				lseek(fast_fh, fast_size_in_bytes - 1, SEEK_SET);
+				const char *empty = "";
+				write(fast_fh, empty, 1);
+			}
+			fast_size_in_bytes -= fast_size_in_bytes % CHUNK_SIZE;
+			if (fast_size_in_bytes == 0) {
+				fprintf(stdout, "the fast device needs a size: fast=%s:<size in bytes>\n", fast_path.c_str());
+				return 1;
+			}
+			backend = std::unique_ptr<DiskBackend>(new TieredBackend(
+				make_disk_backend("mmap", fast_fh, fast_size_in_bytes), std::move(backend), fast_size_in_bytes));
 		}
+		const size_t CHUNK_COUNT = backend->size_bytes() / CHUNK_SIZE;
 		
-		fprintf(stdout, "disk size in chunks is %d, chunk size %d, total size %llu\n", CHUNK_COUNT, CHUNK_SIZE, CHUNK_COUNT * CHUNK_SIZE);
-		disk = std::unique_ptr<Disk>(new Disk(CHUNK_COUNT, CHUNK_SIZE, MAP_FILE | MAP_SHARED, fh));
+		fprintf(stdout, "disk size in chunks is %lu, chunk size %lu, total size %llu over %lu device(s)%s\n", 
+			(unsigned long)CHUNK_COUNT, (unsigned long)CHUNK_SIZE, (unsigned long long)CHUNK_COUNT * CHUNK_SIZE, 
+			(unsigned long)fhs.size(), fast_fh != -1 ? " and a fast device" : "");
+		disk = std::unique_ptr<Disk>(new Disk(CHUNK_COUNT, CHUNK_SIZE, std::move(backend)));
 		fs = std::unique_ptr<FileSystem>(new FileSystem(disk.get()));
+		fs->superblock->device_count = fhs.size();
+		fs->superblock->stripe_unit_bytes = fhs.size() > 1 ? STRIPE_UNIT : 0;
+		fs->superblock->dedup = dedup;
+		fs->superblock->fast_size_chunks = fast_size_in_bytes / CHUNK_SIZE;
 		fs->superblock->init(0.1);
 		superblock = fs->superblock.get();
-		
-		close(fh);
 
 		fs = nullptr;
 		disk = nullptr;
+		for (int fh : fhs) {
+			close(fh);
+		}
+		if (fast_fh != -1) {
+			close(fast_fh);
+		}
 
 		fprintf(stdout, "disk successfully initialized");
 	} catch (FileSystemException& e) {
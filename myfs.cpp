@@ -20,12 +20,16 @@
 #include <mutex>
 #include <limits.h>
 #include <memory>
+#include <string>
+#include <vector>
 #include <unistd.h>
 #include <libgen.h>
 #include <math.h>
 #include <signal.h>
+#include <stddef.h>
 
 #include "filesystem.hpp"
+#include "diskbackend.hpp"
 
 std::mutex lock_g;
 std::unique_ptr<Disk> disk = nullptr;
@@ -331,6 +335,10 @@ static int myfs_read(const char *path, char *buf, size_t size, off_t offset,
 	} catch (const UnixError &e) {
 		fprintf(stdout, "\tmyfs_read encountered error %d\n", e.errorcode);
 		return -e.errorcode;
+	} catch (const DiskException &e) {
+		// the backing device failed the I/O
+		fprintf(stdout, "\tmyfs_read disk error: %s\n", e.message.c_str());
+		return -EIO;
 	}
 }
 
@@ -358,6 +366,10 @@ static int myfs_write(const char *path, const char *buf, size_t size, off_t offs
 	} catch (const UnixError &e) {
 		fprintf(stdout, "\tmyfs_write encountered error %d\n", e.errorcode);
 		return -e.errorcode;
+	} catch (const DiskException &e) {
+		// the backing device failed the I/O
+		fprintf(stdout, "\tmyfs_write disk error: %s\n", e.message.c_str());
+		return -EIO;
 	}
 }
 
@@ -472,6 +484,33 @@ static int myfs_chown(const char *path, uid_t owner, gid_t group){
 
 }
 
+// flush runs on every close of every descriptor, making each close wait for 
+// the device would stall everything else behind it. what was written stays 
+// in the chunk cache and goes out with the writeback thread or the next fsync
+static int myfs_flush(const char *path, struct fuse_file_info *fi) {
+	fprintf(stdout, "myfs_flush(%s)\n", path);
+	return 0;
+}
+
+// fsync makes everything written so far durable, a handful of large syncs over 
+// the runs of chunks that changed. a file's own chunks are not enough, the 
+// inode, its indirection tables and the segment summaries and usage that say 
+// its chunks are in use have to be on the disk as well. it holds the lock the 
+// other operations do, a change of theirs that is only half applied would be 
+// made durable as it is, i.e. a segment usage without its chunk's owner
+static int myfs_fsync(const char *path, int datasync, struct fuse_file_info *fi) {
+	fprintf(stdout, "myfs_fsync(%s, %d)\n", path, datasync);
+	std::lock_guard<std::mutex> g(lock_g);
+	try {
+		disk->sync_all();
+	} catch (const DiskException &e) {
+		// the backing device failed the I/O
+		fprintf(stdout, "\tmyfs_fsync disk error: %s\n", e.message.c_str());
+		return -EIO;
+	}
+	return 0;
+}
+
 // CHECK TO MAKE SURE THEY CAN'T REMOVE . AND ..
 // static int myfs_rmdir(const char *path) {
 // 	fprintf(stdout, "myfs_unlink(%s)\n", path);
@@ -592,6 +631,45 @@ static int myfs_mkdir(const char *path) {
 const int USER_OPT_COUNT = 1;
 std::vector<std::string> user_options;
 
+// options understood by myfs itself, passed with -o like any other mount option 
+// i.e. -o backend=direct,cache_mb=256
+struct myfs_config {
+	char *backend; // how the backing file is accessed: mmap (default), pread, direct, uring, uring-direct or sim-hdd|ssd|nvme
+	unsigned long cache_mb; // memory budget of the chunk buffer cache
+	int zero_copy; // hand out chunks that point into the mapping, mmap backend only
+	int huge_pages; // carve the chunk buffers out of 2 MB huge pages
+	int pin_metadata; // keep the superblock, bitmaps and segment summaries in memory
+	unsigned dirty_expire_ms; // chunks dirty for longer than this are written back in the background
+	unsigned dirty_ratio; // percentage of the cache that may be dirty before writeback starts early
+	int no_writeback; // only write chunks back when they are released, as before
+	int compress; // have the cleaner compress the segments it writes
+	char *fast_device; // the device mkfs put the metadata on, for a file system made with fast=
+	int io_sched; // put the I/O scheduler in front of the device
+	unsigned writeback_mb_s; // rate limits of the background I/O classes, 0 for none, imply io_sched
+	unsigned cleaner_mb_s;
+	int discard; // give segments that become free back to the device
+	unsigned discard_mb_s; // how fast, implies discard
+};
+
+static struct fuse_opt myfs_opts[] = {
+	{"backend=%s", offsetof(struct myfs_config, backend), 0},
+	{"cache_mb=%lu", offsetof(struct myfs_config, cache_mb), 0},
+	{"zero_copy", offsetof(struct myfs_config, zero_copy), 1},
+	{"huge_pages", offsetof(struct myfs_config, huge_pages), 1},
+	{"pin_metadata", offsetof(struct myfs_config, pin_metadata), 1},
+	{"dirty_expire_ms=%u", offsetof(struct myfs_config, dirty_expire_ms), 0},
+	{"dirty_ratio=%u", offsetof(struct myfs_config, dirty_ratio), 0},
+	{"no_writeback", offsetof(struct myfs_config, no_writeback), 1},
+	{"compress", offsetof(struct myfs_config, compress), 1},
+	{"fast_device=%s", offsetof(struct myfs_config, fast_device), 0},
+	{"io_sched", offsetof(struct myfs_config, io_sched), 1},
+	{"writeback_mb_s=%u", offsetof(struct myfs_config, writeback_mb_s), 0},
+	{"cleaner_mb_s=%u", offsetof(struct myfs_config, cleaner_mb_s), 0},
+	{"discard", offsetof(struct myfs_config, discard), 1},
+	{"discard_mb_s=%u", offsetof(struct myfs_config, discard_mb_s), 0},
+	FUSE_OPT_END
+};
+
 static int myfs_opt_proc(void *data, const char *arg, int key, struct fuse_args *outargs) {
 	if (key == FUSE_OPT_KEY_NONOPT && user_options.size() != USER_OPT_COUNT) {
 		user_options.push_back(arg);
@@ -608,24 +686,129 @@ int main(int argc, char *argv[])
 
 	// parse arguments from the command line
 	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
-	fuse_opt_parse(&args, NULL, NULL, myfs_opt_proc);
+	struct myfs_config config;
+	memset(&config, 0, sizeof(config));
+	config.cache_mb = Disk::DEFAULT_CACHE_BUDGET_BYTES / (1024 * 1024);
+	config.dirty_expire_ms = Disk::DEFAULT_DIRTY_EXPIRE_MS;
+	config.dirty_ratio = Disk::DEFAULT_DIRTY_RATIO_PERCENT;
+	fuse_opt_parse(&args, &config, myfs_opts, myfs_opt_proc);
 
 	if (user_options.size() != USER_OPT_COUNT) {
-		fprintf(stdout, "Expected argument: <backing file> \n");
+		fprintf(stdout, "Expected argument: <backing file>[,<backing file>...] [-o backend=mmap|pread|direct|uring|uring-direct|sim-hdd|sim-ssd|sim-nvme,cache_mb=N,zero_copy,huge_pages,pin_metadata,dirty_expire_ms=N,dirty_ratio=N,no_writeback,compress,fast_device=<path>,io_sched,writeback_mb_s=N,cleaner_mb_s=N,discard,discard_mb_s=N]\n");
 		return 1;
 	}
 
-	const char *backing_file_path = user_options[0].c_str();
-	int fh = open(backing_file_path, O_RDWR);
-	off_t file_size_in_bytes = lseek(fh, 0, SEEK_END);
-	const size_t CHUNK_SIZE = 4096;
-	const size_t CHUNK_COUNT = file_size_in_bytes / CHUNK_SIZE;
+	// a striped disk is given as its devices separated by commas, in the 
+	// order they were handed to mkfs
+	std::vector<std::string> backing_file_paths;
+	{
+		const std::string &paths = user_options[0];
+		size_t start = 0;
+		for (size_t comma = paths.find(','); comma != std::string::npos; comma = paths.find(',', start)) {
+			backing_file_paths.push_back(paths.substr(start, comma - start));
+			start = comma + 1;
+		}
+		backing_file_paths.push_back(paths.substr(start));
+	}
+
+	std::vector<int> fhs;
+	off_t file_size_in_bytes = 0;
+	for (const std::string &backing_file_path : backing_file_paths) {
+		int fh = open(backing_file_path.c_str(), O_RDWR);
+		if (fh == -1) {
+			fprintf(stdout, "failed to open the backing file: %s\n", backing_file_path.c_str());
+			return 1;
+		}
+		// every device is used up to the size of the smallest
+		off_t size = lseek(fh, 0, SEEK_END);
+		if (fhs.empty() || size < file_size_in_bytes) 
+			file_size_in_bytes = size;
+		fhs.push_back(fh);
+	}
+
+	// a tiered file system keeps its superblock on the fast device
+	int fast_fh = -1;
+	if (config.fast_device != nullptr) {
+		fast_fh = open(config.fast_device, O_RDWR);
+		if (fast_fh == -1) {
+			fprintf(stdout, "failed to open the fast device: %s\n", config.fast_device);
+			return 1;
+		}
+	}
+	const std::string superblock_path = fast_fh != -1 ? config.fast_device : backing_file_paths[0];
+
+	// the chunk size and striping were chosen by mkfs, the Disk must be built the same way
+	SuperBlock::DeviceLayout layout;
+	try {
+		layout = SuperBlock::read_device_layout(fast_fh != -1 ? fast_fh : fhs[0]);
+	} catch (const FileSystemException &e) {
+		fprintf(stdout, "failed to mount %s: %s\n", superblock_path.c_str(), e.message.c_str());
+		return 1;
+	}
+	if ((layout.fast_size_bytes != 0) != (fast_fh != -1)) {
+		fprintf(stdout, layout.fast_size_bytes != 0 ? 
+			"the file system was made with a fast device, give it with -o fast_device=<path>\n" : 
+			"the file system was made without a fast device\n");
+		return 1;
+	}
+	if (layout.device_count != fhs.size()) {
+		fprintf(stdout, "the file system was made on %lu device(s) but %lu were given\n", 
+			(unsigned long)layout.device_count, (unsigned long)fhs.size());
+		return 1;
+	}
+	const size_t CHUNK_SIZE = layout.chunk_size;
+
+	try {
+		std::string backend_name = config.backend != nullptr ? config.backend : "mmap";
+		std::unique_ptr<DiskBackend> backend = make_disk_backend(backend_name, fhs, file_size_in_bytes, 
+			fhs.size() > 1 ? layout.stripe_unit_bytes : StripedBackend::DEFAULT_STRIPE_UNIT);
+		if (fast_fh != -1) {
+			backend = std::unique_ptr<DiskBackend>(new TieredBackend(
+				make_disk_backend(backend_name, fast_fh, layout.fast_size_bytes), std::move(backend), layout.fast_size_bytes));
+		}
+		if (config.io_sched || config.writeback_mb_s != 0 || config.cleaner_mb_s != 0) {
+			std::unique_ptr<ScheduledBackend> scheduler(new ScheduledBackend(std::move(backend)));
+			// a tenth of a second's worth may go at once
+			const std::pair<IOClass, unsigned> limits[] = {
+				{IOClass::WRITEBACK, config.writeback_mb_s}, {IOClass::CLEANER, config.cleaner_mb_s}};
+			for (const std::pair<IOClass, unsigned> &limit : limits) {
+				if (limit.second == 0) 
+					continue ;
+				ScheduledBackend::ClassConfig class_config = scheduler->config(limit.first);
+				class_config.rate_bytes_per_sec = (uint64_t)limit.second * 1024 * 1024;
+				class_config.burst_bytes = class_config.rate_bytes_per_sec / 10;
+				scheduler->configure(limit.first, class_config);
+			}
+			backend = std::move(scheduler);
+		}
+		const size_t CHUNK_COUNT = backend->size_bytes() / CHUNK_SIZE;
+		//truncate("realdisk.myanfest", CHUNK_COUNT * CHUNK_SIZE);
+		disk = std::unique_ptr<Disk>(new Disk(CHUNK_COUNT, CHUNK_SIZE, std::move(backend), config.zero_copy));
+		disk->configure_cache(config.cache_mb * 1024 * 1024);
+		disk->configure_buffers(config.huge_pages);
+		if (!config.no_writeback) {
+			disk->configure_writeback(config.dirty_expire_ms, config.dirty_ratio);
+		}
+		if (config.discard || config.discard_mb_s != 0) {
+			disk->configure_discard(config.discard_mb_s != 0 ? 
+				(Size)config.discard_mb_s * 1024 * 1024 : Disk::DEFAULT_DISCARD_BYTES_PER_SEC);
+		}
+	} catch (const DiskException &e) {
+		fprintf(stdout, "failed to open the disk: %s\n", e.message.c_str());
+		return 1;
+	}
+	fprintf(stdout, "using the %s backend with %lu byte chunks and a %lu MB chunk cache\n", 
+		disk->backend_name(), (unsigned long)CHUNK_SIZE, config.cache_mb);
 
-	//truncate("realdisk.myanfest", CHUNK_COUNT * CHUNK_SIZE);
-	disk = std::unique_ptr<Disk>(new Disk(CHUNK_COUNT, CHUNK_SIZE, MAP_FILE | MAP_SHARED, fh));
 	fs = std::unique_ptr<FileSystem>(new FileSystem(disk.get()));
 	//fs->superblock->init(0.1);
-	fs->superblock->load_from_disk();
+	fs->superblock->compression = config.compress;
+	try {
+		fs->superblock->load_from_disk(config.pin_metadata);
+	} catch (const FileSystemException &e) {
+		fprintf(stdout, "failed to mount %s: %s\n", superblock_path.c_str(), e.message.c_str());
+		return 1;
+	}
 	superblock = fs->superblock.get();
 	
 	static struct fuse_operations myfs_oper;
@@ -641,6 +824,8 @@ int main(int argc, char *argv[])
 	myfs_oper.chmod = myfs_chmod;
 	myfs_oper.chown = myfs_chown;
 	myfs_oper.rmdir = myfs_rmdir;
+	myfs_oper.flush = myfs_flush;
+	myfs_oper.fsync = myfs_fsync;
 	
 	return fuse_main(args.argc, args.argv, &myfs_oper, NULL);
 }
@@ -0,0 +1,141 @@
+#include <cassert>
+#include <cerrno>
+#include <thread>
+#include <functional>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "chunkpool.hpp"
+
+constexpr size_t ChunkPool::HUGE_PAGE_SIZE;
+constexpr size_t ChunkPool::FREE_LISTS;
+
+static size_t round_up(size_t value, size_t multiple) {
+	return (value + multiple - 1) / multiple * multiple;
+}
+
+ChunkPool::ChunkPool(size_t buffer_size, size_t alignment, bool huge_pages)
+	: _buffer_size(buffer_size), _stride(round_up(buffer_size, alignment)),
+	_slab_size(round_up(_stride > HUGE_PAGE_SIZE ? _stride : HUGE_PAGE_SIZE, HUGE_PAGE_SIZE)),
+	_huge_pages(huge_pages) {
+	assert(buffer_size > 0);
+	assert(alignment > 0 && (alignment & (alignment - 1)) == 0);
+}
+
+ChunkPool::~ChunkPool() {
+	// every buffer must have been released by now, they all live in the slabs
+	assert(this->in_use == 0);
+	for (Slab &slab : slabs) {
+		munmap(slab.base, slab.size_bytes);
+	}
+}
+
+ChunkPool::FreeList &ChunkPool::free_list_for_thread() {
+	return free_lists[std::hash<std::thread::id>()(std::this_thread::get_id()) % FREE_LISTS];
+}
+
+Byte *ChunkPool::grow(FreeList &list) {
+	std::lock_guard<std::mutex> g(slab_lock);
+
+	Slab slab;
+	slab.size_bytes = this->_slab_size;
+
+	if (this->_huge_pages) {
+		// reserved huge pages first, they are only there if the admin set some aside
+		void *base = mmap(NULL, slab.size_bytes, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (base != MAP_FAILED) {
+			slab.base = (Byte *)base;
+			slab.huge_pages = true;
+		} else {
+			// otherwise ask for transparent huge pages, which the kernel can only
+			// use for a slab that is aligned to the huge page size. map an extra
+			// huge page worth and trim it down to an aligned slab
+			size_t padded = slab.size_bytes + HUGE_PAGE_SIZE;
+			base = mmap(NULL, padded, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+			if (base != MAP_FAILED) {
+				size_t start = round_up((size_t)base, HUGE_PAGE_SIZE);
+				size_t head = start - (size_t)base;
+				if (head > 0)
+					munmap(base, head);
+				if (padded - head - slab.size_bytes > 0)
+					munmap((Byte *)start + slab.size_bytes, padded - head - slab.size_bytes);
+				slab.base = (Byte *)start;
+				slab.huge_pages = madvise(slab.base, slab.size_bytes, MADV_HUGEPAGE) == 0;
+			}
+		}
+	} else {
+		void *base = mmap(NULL, slab.size_bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (base != MAP_FAILED)
+			slab.base = (Byte *)base;
+	}
+
+	if (slab.base == nullptr) {
+		throw DiskException(std::string("failed to map a slab for chunk buffers: ") + strerror(errno));
+	}
+	slabs.push_back(slab);
+
+	const size_t buffer_count = slab.size_bytes / this->_stride;
+	total_buffers += buffer_count;
+
+	// the buffers are handed out from the back, so push them in reverse to
+	// hand them out in address order
+	std::lock_guard<std::mutex> list_guard(list.lock);
+	for (size_t idx = buffer_count; idx > 1; --idx) {
+		list.buffers.push_back(slab.base + (idx - 1) * this->_stride);
+	}
+	return slab.base;
+}
+
+Byte *ChunkPool::allocate() {
+	FreeList &own = this->free_list_for_thread();
+	Byte *buffer = nullptr;
+
+	{
+		std::lock_guard<std::mutex> g(own.lock);
+		if (!own.buffers.empty()) {
+			buffer = own.buffers.back();
+			own.buffers.pop_back();
+		}
+	}
+
+	// take from the other lists before mapping more memory, a thread that
+	// mostly releases would otherwise pile up buffers no one else can use
+	for (size_t idx = 0; buffer == nullptr && idx < FREE_LISTS; ++idx) {
+		FreeList &other = free_lists[idx];
+		std::lock_guard<std::mutex> g(other.lock);
+		if (!other.buffers.empty()) {
+			buffer = other.buffers.back();
+			other.buffers.pop_back();
+		}
+	}
+
+	if (buffer == nullptr) {
+		buffer = this->grow(own);
+	}
+
+	this->in_use++;
+	return buffer;
+}
+
+void ChunkPool::release(Byte *buffer) {
+	assert(buffer != nullptr);
+	FreeList &own = this->free_list_for_thread();
+	std::lock_guard<std::mutex> g(own.lock);
+	own.buffers.push_back(buffer);
+	this->in_use--;
+}
+
+ChunkPool::Stats ChunkPool::stats() {
+	Stats stats;
+	std::lock_guard<std::mutex> g(slab_lock);
+	stats.slabs = slabs.size();
+	for (const Slab &slab : slabs) {
+		if (slab.huge_pages)
+			stats.huge_page_slabs++;
+		stats.slab_bytes += slab.size_bytes;
+	}
+	stats.buffers = total_buffers;
+	stats.buffers_in_use = this->in_use;
+	return stats;
+}
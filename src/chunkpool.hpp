@@ -0,0 +1,87 @@
+#ifndef CHUNKPOOL_HPP
+#define CHUNKPOOL_HPP
+
+#include <mutex>
+#include <atomic>
+#include <array>
+#include <vector>
+
+#include "diskinterface.hpp"
+
+/*
+	a slab allocator for the buffers of a Disk's chunks. buffers are all the
+	same size and carved out of large slabs mapped straight from the kernel,
+	so a cache miss costs no trip through malloc and a buffer of a chunk at
+	least a page in size starts on a page boundary. released buffers go onto
+	free lists which are split up like the chunk cache, each thread sticks to
+	the list its id hashes to so threads rarely meet on the same lock.
+	with huge_pages set the slabs are 2 MB huge pages (MAP_HUGETLB when the
+	system has them reserved, otherwise transparent huge pages) so the whole
+	cache needs only a handful of TLB entries. slabs are only given back to the
+	system when the pool is destroyed
+*/
+class ChunkPool {
+public:
+	static constexpr size_t HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+	static constexpr size_t FREE_LISTS = 16;
+
+	struct Stats {
+		Size slabs = 0;
+		Size huge_page_slabs = 0; // slabs that are backed by huge pages
+		Size slab_bytes = 0;
+		Size buffers = 0; // buffers carved out of the slabs so far
+		Size buffers_in_use = 0;
+	};
+
+private:
+	struct Slab {
+		Byte *base = nullptr;
+		size_t size_bytes = 0;
+		bool huge_pages = false;
+	};
+
+	struct FreeList {
+		std::mutex lock;
+		std::vector<Byte *> buffers;
+	};
+
+	const size_t _buffer_size;
+	const size_t _stride; // distance between buffers in a slab, keeps them aligned
+	const size_t _slab_size;
+	const bool _huge_pages;
+
+	std::mutex slab_lock;
+	std::vector<Slab> slabs;
+	Size total_buffers = 0;
+
+	std::array<FreeList, FREE_LISTS> free_lists;
+	std::atomic<Size> in_use {0};
+
+	FreeList &free_list_for_thread();
+
+	// maps a new slab and puts all but one of its buffers onto the list,
+	// returning the one that is left over
+	Byte *grow(FreeList &list);
+
+public:
+	ChunkPool(size_t buffer_size, size_t alignment, bool huge_pages = false);
+	ChunkPool(const ChunkPool &) = delete;
+	ChunkPool &operator=(const ChunkPool &) = delete;
+	~ChunkPool();
+
+	inline size_t buffer_size() const {
+		return _buffer_size;
+	}
+
+	inline bool huge_pages() const {
+		return _huge_pages;
+	}
+
+	// throws a DiskException when no more memory can be mapped
+	Byte *allocate();
+	void release(Byte *buffer);
+
+	Stats stats();
+};
+
+#endif
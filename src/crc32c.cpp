@@ -0,0 +1,137 @@
+#include <cstring>
+
+#include "crc32c.hpp"
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#elif defined(__aarch64__)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+
+// the Castagnoli polynomial, bit reversed
+static const uint32_t POLYNOMIAL = 0x82F63B78;
+
+// table[k][b] is the crc of byte b followed by k zero bytes
+struct Crc32cTables {
+	uint32_t table[8][256];
+
+	Crc32cTables() {
+		for (uint32_t b = 0; b < 256; ++b) {
+			uint32_t crc = b;
+			for (int bit = 0; bit < 8; ++bit) {
+				crc = (crc >> 1) ^ (crc & 1 ? POLYNOMIAL : 0);
+			}
+			table[0][b] = crc;
+		}
+		for (uint32_t b = 0; b < 256; ++b) {
+			for (int k = 1; k < 8; ++k) {
+				table[k][b] = (table[k - 1][b] >> 8) ^ table[0][table[k - 1][b] & 0xFF];
+			}
+		}
+	}
+};
+
+static const Crc32cTables tables;
+
+static uint32_t crc32c_software(const uint8_t *data, size_t length, uint32_t crc) {
+	// eight bytes at a time, each looked up in its own table
+	while (length >= 8) {
+		uint64_t word;
+		std::memcpy(&word, data, 8);
+		word ^= crc;
+		crc = tables.table[7][word & 0xFF] ^
+			tables.table[6][(word >> 8) & 0xFF] ^
+			tables.table[5][(word >> 16) & 0xFF] ^
+			tables.table[4][(word >> 24) & 0xFF] ^
+			tables.table[3][(word >> 32) & 0xFF] ^
+			tables.table[2][(word >> 40) & 0xFF] ^
+			tables.table[1][(word >> 48) & 0xFF] ^
+			tables.table[0][word >> 56];
+		data += 8;
+		length -= 8;
+	}
+	while (length > 0) {
+		crc = (crc >> 8) ^ tables.table[0][(crc ^ *data) & 0xFF];
+		data++;
+		length--;
+	}
+	return crc;
+}
+
+#if defined(__x86_64__)
+
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_instruction(const uint8_t *data, size_t length, uint32_t crc) {
+	uint64_t crc64 = crc;
+	while (length >= 8) {
+		uint64_t word;
+		std::memcpy(&word, data, 8);
+		crc64 = _mm_crc32_u64(crc64, word);
+		data += 8;
+		length -= 8;
+	}
+	crc = (uint32_t)crc64;
+	while (length > 0) {
+		crc = _mm_crc32_u8(crc, *data);
+		data++;
+		length--;
+	}
+	return crc;
+}
+
+static bool detect_instruction() {
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("sse4.2");
+}
+
+#elif defined(__aarch64__)
+
+__attribute__((target("+crc")))
+static uint32_t crc32c_instruction(const uint8_t *data, size_t length, uint32_t crc) {
+	while (length >= 8) {
+		uint64_t word;
+		std::memcpy(&word, data, 8);
+		crc = __builtin_aarch64_crc32cx(crc, word);
+		data += 8;
+		length -= 8;
+	}
+	while (length > 0) {
+		crc = __builtin_aarch64_crc32cb(crc, *data);
+		data++;
+		length--;
+	}
+	return crc;
+}
+
+static bool detect_instruction() {
+	return (getauxval(AT_HWCAP) & HWCAP_CRC32) != 0;
+}
+
+#else
+
+static uint32_t crc32c_instruction(const uint8_t *data, size_t length, uint32_t crc) {
+	return crc32c_software(data, length, crc);
+}
+
+static bool detect_instruction() {
+	return false;
+}
+
+#endif
+
+static const bool has_instruction = detect_instruction();
+
+uint32_t crc32c(const void *data, size_t length, uint32_t crc) {
+	// the checksum is kept inverted while it is worked on
+	crc = ~crc;
+	if (has_instruction)
+		crc = crc32c_instruction((const uint8_t *)data, length, crc);
+	else
+		crc = crc32c_software((const uint8_t *)data, length, crc);
+	return ~crc;
+}
+
+bool crc32c_hardware() {
+	return has_instruction;
+}
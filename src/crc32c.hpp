@@ -0,0 +1,23 @@
+#ifndef CRC32C_HPP
+#define CRC32C_HPP
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+	CRC32C (the Castagnoli polynomial, as used by iSCSI, ext4 and btrfs) for
+	checksumming chunks. on x86-64 with SSE 4.2 and on ARMv8 with the CRC
+	extension it is computed by the CPU's crc32 instruction, several bytes a
+	cycle, so checksumming a chunk costs far less than the copy that goes with
+	reading or writing it. anywhere else a table driven version (slicing by 8)
+	is used instead, which gives the same results
+*/
+
+// the checksum of length bytes at data, continuing from crc for a checksum
+// computed in pieces
+uint32_t crc32c(const void *data, size_t length, uint32_t crc = 0);
+
+// whether crc32c runs on the CPU's crc32 instruction
+bool crc32c_hardware();
+
+#endif
@@ -0,0 +1,1384 @@
+#include <cassert>
+#include <cerrno>
+#include <cmath>
+#include <algorithm>
+#include <thread>
+#include <exception>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "diskbackend.hpp"
+
+constexpr size_t PreadBackend::DIRECT_IO_ALIGNMENT;
+constexpr unsigned UringBackend::DEFAULT_QUEUE_DEPTH;
+constexpr Size StripedBackend::DEFAULT_STRIPE_UNIT;
+constexpr unsigned ScheduledBackend::DEFAULT_MAX_IN_FLIGHT;
+constexpr Size ScheduledBackend::BACKGROUND_PIECE_BYTES;
+constexpr size_t ScheduledBackend::LATENCY_BUCKETS;
+
+static std::string describe_error(const char *what, Size offset) {
+	return std::string(what) + " at offset " + std::to_string(offset) + ": " + strerror(errno);
+}
+
+static void enable_direct_io(int fd) {
+	int flags = fcntl(fd, F_GETFL);
+	if (flags == -1 || fcntl(fd, F_SETFL, flags | O_DIRECT) == -1) {
+		throw DiskException(describe_error("failed to switch the file descriptor to O_DIRECT", 0));
+	}
+}
+
+// a failed fadvise is harmless, the hint is simply not taken
+static void fadvise_range(int fd, Size offset, Size length, AccessPattern pattern) {
+	int advice = POSIX_FADV_NORMAL;
+	if (pattern == AccessPattern::RANDOM) 
+		advice = POSIX_FADV_RANDOM;
+	else if (pattern == AccessPattern::SEQUENTIAL) 
+		advice = POSIX_FADV_SEQUENTIAL;
+	posix_fadvise(fd, offset, length, advice);
+}
+
+// returns false when neither the device nor the file system can discard
+static bool discard_range(int fd, Size offset, Size length) {
+	struct stat st;
+	if (fstat(fd, &st) != 0) {
+		throw DiskException(describe_error("failed to stat the device to discard", offset));
+	}
+	if (S_ISBLK(st.st_mode)) {
+		uint64_t range[2] = {offset, length};
+		if (ioctl(fd, BLKDISCARD, &range) == 0) 
+			return true;
+	} else if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, length) == 0) {
+		return true;
+	}
+	if (errno == EOPNOTSUPP || errno == ENOTTY || errno == ENOSYS) 
+		return false;
+	throw DiskException(describe_error("failed to discard", offset));
+}
+
+void DiskBackend::read_batch(const std::vector<IORequest> &requests) {
+	for (const IORequest &request : requests) {
+		this->read(request.offset, request.buf, request.length);
+	}
+}
+
+void DiskBackend::write_batch(const std::vector<IORequest> &requests) {
+	for (const IORequest &request : requests) {
+		this->write(request.offset, request.buf, request.length);
+	}
+}
+
+void DiskBackend::sync_ranges(const std::vector<SyncRange> &ranges) {
+	for (const SyncRange &range : ranges) {
+		this->sync(range.offset, range.length);
+	}
+}
+
+void DiskBackend::zero_fill() {
+	// write the zeros out a block at a time, aligned so any backend accepts the buffer
+	const Size block_size = 1024 * 1024;
+	void *zeros = nullptr;
+	if (posix_memalign(&zeros, 4096, block_size) != 0) {
+		throw DiskException("failed to allocate a buffer to zero fill the disk");
+	}
+	std::memset(zeros, 0, block_size);
+
+	try {
+		for (Size offset = 0; offset < this->size_bytes(); offset += block_size) {
+			Size length = this->size_bytes() - offset < block_size ? this->size_bytes() - offset : block_size;
+			this->write(offset, (const Byte *)zeros, length);
+		}
+	} catch (const DiskException &e) {
+		free(zeros);
+		throw;
+	}
+	free(zeros);
+}
+
+/*
+	MmapBackend
+*/
+
+MmapBackend::MmapBackend(Size size_bytes, int flags, int fd) : fd(fd), flags(flags), _size_bytes(size_bytes) {
+	this->data = (Byte *)mmap64(NULL, this->_size_bytes, PROT_READ | PROT_WRITE, flags, fd, 0);
+	if (this->data == MAP_FAILED) {
+		this->data = nullptr;
+		fprintf(stdout, "MMAP failed for file handle %d\n", fd);
+		throw DiskException("failed to create the memory mapped file to back the disk");
+	}
+}
+
+MmapBackend::~MmapBackend() {
+	this->unlock_from_memory();
+	if (this->data != nullptr) {
+		munmap(this->data, this->_size_bytes);
+	}
+}
+
+void MmapBackend::read(Size offset, Byte *buf, Size length) {
+	assert(offset + length <= this->_size_bytes);
+	std::memcpy(buf, this->data + offset, length);
+}
+
+void MmapBackend::write(Size offset, const Byte *buf, Size length) {
+	assert(offset + length <= this->_size_bytes);
+
+	// in zero copy mode the chunk already is the mapping, nothing to copy
+	if (buf != this->data + offset) {
+		std::memcpy(this->data + offset, buf, length);
+	}
+}
+
+void MmapBackend::sync(Size offset, Size length) {
+	if (this->fd == -1) {
+		return ;
+	}
+
+	// chunks need not be page aligned, so round down to the page holding the
+	// start of the range, the kernel can only sync whole pages anyway
+	size_t start = offset & ~(this->_mempage_size - 1);
+	if (msync(this->data + start, offset + length - start, MS_SYNC) != 0) {
+		throw DiskException(describe_error("failed to msync the mapping", offset));
+	}
+}
+
+void MmapBackend::zero_fill() {
+	// zero out the memory mapped file
+	std::memset(this->data, 0, this->_size_bytes);
+}
+
+DiskBackend::SyncRange MmapBackend::page_range(Size offset, Size length) const {
+	assert(offset + length <= this->_size_bytes);
+	Size start = offset & ~(this->_mempage_size - 1);
+	Size end = (offset + length + this->_mempage_size - 1) & ~(this->_mempage_size - 1);
+	if (end > this->_size_bytes) 
+		end = this->_size_bytes;
+	return SyncRange{start, end - start};
+}
+
+void MmapBackend::advise(Size offset, Size length, AccessPattern pattern) {
+	int advice = MADV_NORMAL;
+	if (pattern == AccessPattern::RANDOM) 
+		advice = MADV_RANDOM;
+	else if (pattern == AccessPattern::SEQUENTIAL) 
+		advice = MADV_SEQUENTIAL;
+	SyncRange range = this->page_range(offset, length);
+	madvise(this->data + range.offset, range.length, advice);
+}
+
+bool MmapBackend::lock_in_memory(Size offset, Size length) {
+	SyncRange range = this->page_range(offset, length);
+	if (range.length == 0) 
+		return false;
+
+	if (mlock(this->data + range.offset, range.length) != 0) {
+		// usually RLIMIT_MEMLOCK, at least fault the pages in ahead of time
+		madvise(this->data + range.offset, range.length, MADV_WILLNEED);
+		return false;
+	}
+
+	std::lock_guard<std::mutex> g(this->locked_lock);
+	this->locked.push_back(range);
+	return true;
+}
+
+void MmapBackend::unlock_from_memory() {
+	std::lock_guard<std::mutex> g(this->locked_lock);
+	for (const SyncRange &range : this->locked) {
+		munlock(this->data + range.offset, range.length);
+	}
+	this->locked.clear();
+}
+
+bool MmapBackend::discard(Size offset, Size length) {
+	assert(offset + length <= this->_size_bytes);
+	if (this->fd != -1 && (this->flags & MAP_SHARED)) {
+		// the hole shows through the mapping straight away
+		return discard_range(this->fd, offset, length);
+	}
+
+	// only the pages wholly inside the range, rounded in rather than out
+	Size start = (offset + this->_mempage_size - 1) & ~(this->_mempage_size - 1);
+	Size end = (offset + length) & ~(this->_mempage_size - 1);
+	if (start < end) 
+		madvise(this->data + start, end - start, MADV_DONTNEED);
+	return true;
+}
+
+/*
+	PreadBackend
+*/
+
+PreadBackend::PreadBackend(int fd, Size size_bytes, bool direct)
+	: fd(fd), _size_bytes(size_bytes), direct(direct) {
+	if (fd == -1) {
+		throw DiskException("the pread backend needs a file descriptor to do I/O on");
+	}
+
+	if (direct) {
+		enable_direct_io(fd);
+	}
+}
+
+void PreadBackend::read(Size offset, Byte *buf, Size length) {
+	assert(offset + length <= this->_size_bytes);
+	assert(!direct || ((size_t)buf % DIRECT_IO_ALIGNMENT == 0 && offset % DIRECT_IO_ALIGNMENT == 0));
+
+	while (length > 0) {
+		ssize_t bytes = pread(this->fd, buf, length, offset);
+		if (bytes < 0) {
+			if (errno == EINTR)
+				continue ;
+			throw DiskException(describe_error("pread failed", offset));
+		}
+		if (bytes == 0) {
+			// past the end of a sparse file that was never written, reads as zeros
+			std::memset(buf, 0, length);
+			return ;
+		}
+		buf += bytes;
+		offset += bytes;
+		length -= bytes;
+	}
+}
+
+void PreadBackend::write(Size offset, const Byte *buf, Size length) {
+	assert(offset + length <= this->_size_bytes);
+	assert(!direct || ((size_t)buf % DIRECT_IO_ALIGNMENT == 0 && offset % DIRECT_IO_ALIGNMENT == 0));
+
+	while (length > 0) {
+		ssize_t bytes = pwrite(this->fd, buf, length, offset);
+		if (bytes < 0) {
+			if (errno == EINTR)
+				continue ;
+			throw DiskException(describe_error("pwrite failed", offset));
+		}
+		if (bytes == 0) {
+			// nothing was written and trying again would not change that
+			errno = EIO;
+			throw DiskException(describe_error("pwrite wrote nothing", offset));
+		}
+		buf += bytes;
+		offset += bytes;
+		length -= bytes;
+	}
+}
+
+void PreadBackend::sync(Size offset, Size /* length */) {
+	if (fdatasync(this->fd) != 0) {
+		throw DiskException(describe_error("fdatasync failed", offset));
+	}
+}
+
+void PreadBackend::sync_ranges(const std::vector<SyncRange> &ranges) {
+	if (!ranges.empty()) {
+		this->sync(ranges.front().offset, 0);
+	}
+}
+
+void PreadBackend::advise(Size offset, Size length, AccessPattern pattern) {
+	fadvise_range(this->fd, offset, length, pattern);
+}
+
+bool PreadBackend::discard(Size offset, Size length) {
+	return discard_range(this->fd, offset, length);
+}
+
+/*
+	UringBackend
+*/
+
+struct UringBackend::Ring {
+	int ring_fd = -1;
+	unsigned entries = 0;
+
+	void *sq_ptr = MAP_FAILED;
+	size_t sq_size = 0;
+	unsigned *sq_head = nullptr;
+	unsigned *sq_tail = nullptr;
+	unsigned *sq_mask = nullptr;
+	unsigned *sq_array = nullptr;
+
+	struct io_uring_sqe *sqes = (struct io_uring_sqe *)MAP_FAILED;
+	size_t sqes_size = 0;
+
+	void *cq_ptr = MAP_FAILED;
+	size_t cq_size = 0;
+	unsigned *cq_head = nullptr;
+	unsigned *cq_tail = nullptr;
+	unsigned *cq_mask = nullptr;
+	struct io_uring_cqe *cqes = nullptr;
+
+	~Ring() {
+		if (sqes != MAP_FAILED)
+			munmap(sqes, sqes_size);
+		if (cq_ptr != MAP_FAILED && cq_ptr != sq_ptr)
+			munmap(cq_ptr, cq_size);
+		if (sq_ptr != MAP_FAILED)
+			munmap(sq_ptr, sq_size);
+		if (ring_fd != -1)
+			close(ring_fd);
+	}
+};
+
+UringBackend::UringBackend(int fd, Size size_bytes, bool direct, unsigned queue_depth)
+	: ring(new Ring), fd(fd), _size_bytes(size_bytes), direct(direct) {
+	if (fd == -1) {
+		throw DiskException("the io_uring backend needs a file descriptor to do I/O on");
+	}
+
+	struct io_uring_params params;
+	std::memset(&params, 0, sizeof(params));
+	ring->ring_fd = syscall(__NR_io_uring_setup, queue_depth, &params);
+	if (ring->ring_fd < 0) {
+		ring->ring_fd = -1;
+		throw DiskException(describe_error("io_uring is not available", 0));
+	}
+	ring->entries = params.sq_entries;
+
+	ring->sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	ring->cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	const bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+	if (single_mmap && ring->cq_size > ring->sq_size)
+		ring->sq_size = ring->cq_size;
+
+	ring->sq_ptr = mmap(NULL, ring->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		ring->ring_fd, IORING_OFF_SQ_RING);
+	if (ring->sq_ptr == MAP_FAILED) {
+		throw DiskException(describe_error("failed to map the io_uring submission queue", 0));
+	}
+
+	if (single_mmap) {
+		ring->cq_ptr = ring->sq_ptr;
+	} else {
+		ring->cq_ptr = mmap(NULL, ring->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			ring->ring_fd, IORING_OFF_CQ_RING);
+		if (ring->cq_ptr == MAP_FAILED) {
+			throw DiskException(describe_error("failed to map the io_uring completion queue", 0));
+		}
+	}
+
+	ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = (struct io_uring_sqe *)mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, ring->ring_fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED) {
+		throw DiskException(describe_error("failed to map the io_uring submission entries", 0));
+	}
+
+	Byte *sq = (Byte *)ring->sq_ptr;
+	ring->sq_head = (unsigned *)(sq + params.sq_off.head);
+	ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+	ring->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+	ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+
+	Byte *cq = (Byte *)ring->cq_ptr;
+	ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+	ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+	ring->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+	if (direct) {
+		enable_direct_io(fd);
+	}
+}
+
+UringBackend::~UringBackend() {
+}
+
+unsigned UringBackend::queue_depth() const {
+	return ring->entries;
+}
+
+void UringBackend::submit(bool is_write, const std::vector<IORequest> &requests) {
+	std::lock_guard<std::mutex> g(lock);
+
+	// what is left of each request, short transfers are resubmitted for the rest
+	std::vector<struct iovec> remaining(requests.size());
+	std::vector<Size> offsets(requests.size());
+	std::vector<size_t> queue; // indexes of requests waiting to be submitted
+	for (size_t idx = requests.size(); idx > 0; --idx) {
+		remaining[idx - 1].iov_base = requests[idx - 1].buf;
+		remaining[idx - 1].iov_len = requests[idx - 1].length;
+		offsets[idx - 1] = requests[idx - 1].offset;
+		queue.push_back(idx - 1);
+	}
+
+	unsigned in_flight = 0;
+	unsigned unsubmitted = 0;
+	int error = 0;
+	Size error_offset = 0;
+	const char *error_what = is_write ? "io_uring write failed" : "io_uring read failed";
+
+	while (!queue.empty() || in_flight > 0) {
+		// fill the submission queue, never more in flight than there are entries
+		// so that the completion queue (twice as large) can not overflow
+		unsigned tail = *ring->sq_tail;
+		while (!queue.empty() && in_flight < ring->entries && error == 0) {
+			size_t idx = queue.back();
+			queue.pop_back();
+
+			unsigned slot = tail & *ring->sq_mask;
+			struct io_uring_sqe *sqe = &ring->sqes[slot];
+			std::memset(sqe, 0, sizeof(*sqe));
+			sqe->opcode = is_write ? IORING_OP_WRITEV : IORING_OP_READV;
+			sqe->fd = this->fd;
+			sqe->off = offsets[idx];
+			sqe->addr = (unsigned long)&remaining[idx];
+			sqe->len = 1;
+			sqe->user_data = idx;
+			ring->sq_array[slot] = slot;
+
+			tail++;
+			in_flight++;
+			unsubmitted++;
+		}
+		__atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+
+		int submitted = syscall(__NR_io_uring_enter, ring->ring_fd, unsubmitted, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+		if (submitted < 0) {
+			if (errno == EINTR || errno == EAGAIN || errno == EBUSY)
+				continue ;
+			if (unsubmitted > 0) {
+				// the entries the kernel has not taken are taken back, so that none 
+				// of them is submitted later on pointing at what is gone by then
+				const unsigned sq_head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+				const unsigned taken_back = tail - sq_head;
+				__atomic_store_n(ring->sq_tail, sq_head, __ATOMIC_RELEASE);
+				in_flight -= taken_back;
+				unsubmitted = 0;
+			}
+			if (error == 0) {
+				error = errno;
+				error_offset = 0;
+				error_what = "io_uring_enter failed";
+			}
+			// what was submitted still completes, without a way to wait for it 
+			// the completion queue is looked at until it has
+			std::this_thread::yield();
+			submitted = 0;
+		}
+		unsubmitted -= submitted;
+
+		// reap whatever has completed
+		unsigned head = *ring->cq_head;
+		const unsigned cq_tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+		while (head != cq_tail) {
+			struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+			size_t idx = cqe->user_data;
+			int res = cqe->res;
+			head++;
+			in_flight--;
+
+			if (res < 0) {
+				if (res == -EINTR || res == -EAGAIN) {
+					queue.push_back(idx);
+				} else if (error == 0) {
+					error = -res;
+					error_offset = offsets[idx];
+				}
+			} else if (res == 0 && !is_write) {
+				// past the end of a sparse file that was never written, reads as zeros
+				std::memset(remaining[idx].iov_base, 0, remaining[idx].iov_len);
+			} else if (res == 0) {
+				// a write that wrote nothing would only do so again
+				if (error == 0) {
+					error = EIO;
+					error_offset = offsets[idx];
+				}
+			} else if ((size_t)res < remaining[idx].iov_len) {
+				remaining[idx].iov_base = (Byte *)remaining[idx].iov_base + res;
+				remaining[idx].iov_len -= res;
+				offsets[idx] += res;
+				queue.push_back(idx);
+			}
+		}
+		__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+
+		if (error != 0) {
+			// stop queueing, but the requests in flight still point at the
+			// caller's buffers so let them drain before reporting the error
+			queue.clear();
+		}
+	}
+
+	if (error != 0) {
+		errno = error;
+		throw DiskException(describe_error(error_what, error_offset));
+	}
+}
+
+void UringBackend::read(Size offset, Byte *buf, Size length) {
+	assert(offset + length <= this->_size_bytes);
+	this->submit(false, std::vector<IORequest>{IORequest{offset, buf, length}});
+}
+
+void UringBackend::write(Size offset, const Byte *buf, Size length) {
+	assert(offset + length <= this->_size_bytes);
+	this->submit(true, std::vector<IORequest>{IORequest{offset, (Byte *)buf, length}});
+}
+
+void UringBackend::read_batch(const std::vector<IORequest> &requests) {
+	this->submit(false, requests);
+}
+
+void UringBackend::write_batch(const std::vector<IORequest> &requests) {
+	this->submit(true, requests);
+}
+
+void UringBackend::sync(Size offset, Size /* length */) {
+	if (fdatasync(this->fd) != 0) {
+		throw DiskException(describe_error("fdatasync failed", offset));
+	}
+}
+
+void UringBackend::sync_ranges(const std::vector<SyncRange> &ranges) {
+	if (!ranges.empty()) {
+		this->sync(ranges.front().offset, 0);
+	}
+}
+
+void UringBackend::advise(Size offset, Size length, AccessPattern pattern) {
+	fadvise_range(this->fd, offset, length, pattern);
+}
+
+bool UringBackend::discard(Size offset, Size length) {
+	return discard_range(this->fd, offset, length);
+}
+
+/*
+	StripedBackend
+*/
+
+StripedBackend::StripedBackend(std::vector<std::unique_ptr<DiskBackend>> devices, Size stripe_unit)
+	: devices(std::move(devices)), _stripe_unit(stripe_unit) {
+	if (this->devices.empty()) {
+		throw DiskException("a striped backend needs at least one device");
+	}
+
+	Size smallest = this->devices[0]->size_bytes();
+	for (std::unique_ptr<DiskBackend> &device : this->devices) {
+		if (device->alignment() > this->_alignment) 
+			this->_alignment = device->alignment();
+		if (device->size_bytes() < smallest) 
+			smallest = device->size_bytes();
+	}
+	if (stripe_unit == 0 || stripe_unit % this->_alignment != 0) {
+		throw DiskException("the stripe unit must be a multiple of every device's alignment");
+	}
+
+	// only whole stripe units, and as many of them as the smallest device holds
+	this->_size_bytes = smallest / stripe_unit * stripe_unit * this->devices.size();
+
+	// a single device is always done on the calling thread
+	if (this->devices.size() > 1) {
+		for (size_t idx = 0; idx < this->devices.size(); ++idx) {
+			this->workers.emplace_back(new DeviceWorker());
+			DeviceWorker &worker = *this->workers.back();
+			worker.thread = std::thread([this, &worker]() { this->run_worker(worker); });
+		}
+	}
+}
+
+StripedBackend::~StripedBackend() {
+	for (std::unique_ptr<DeviceWorker> &worker : this->workers) {
+		{
+			std::lock_guard<std::mutex> g(worker->lock);
+			worker->stopping = true;
+		}
+		worker->cv.notify_one();
+	}
+	for (std::unique_ptr<DeviceWorker> &worker : this->workers) {
+		worker->thread.join();
+	}
+}
+
+void StripedBackend::run_worker(DeviceWorker &worker) {
+	std::unique_lock<std::mutex> l(worker.lock);
+	for (;;) {
+		worker.cv.wait(l, [&worker]() { return worker.stopping || !worker.jobs.empty(); });
+		if (worker.jobs.empty()) 
+			return ;
+		std::function<void()> job = std::move(worker.jobs.front());
+		worker.jobs.pop_front();
+		l.unlock();
+		job();
+		l.lock();
+	}
+}
+
+std::vector<std::vector<DiskBackend::IORequest>> StripedBackend::split(const std::vector<IORequest> &requests) const {
+	std::vector<std::vector<IORequest>> per_device(devices.size());
+	for (const IORequest &request : requests) {
+		assert(request.offset + request.length <= this->_size_bytes);
+		Size offset = request.offset;
+		Byte *buf = request.buf;
+		Size length = request.length;
+		while (length > 0) {
+			const Size in_unit = this->_stripe_unit - offset % this->_stripe_unit;
+			const Size piece = length < in_unit ? length : in_unit;
+			per_device[this->device_for(offset)].push_back(IORequest{this->device_offset(offset), buf, piece});
+			offset += piece;
+			buf += piece;
+			length -= piece;
+		}
+	}
+	return per_device;
+}
+
+template<typename F>
+void StripedBackend::on_each_device(const std::vector<bool> &involved, F work) {
+	std::vector<std::exception_ptr> errors(devices.size());
+	std::mutex done_lock;
+	std::condition_variable done_cv;
+	size_t pending = 0;
+
+	// the calling thread takes the first device, nothing is handed to the 
+	// workers when only one device is involved (i.e. a single chunk)
+	size_t own = devices.size();
+	for (size_t idx = 0; idx < devices.size(); ++idx) {
+		if (!involved[idx]) 
+			continue ;
+		if (own == devices.size()) {
+			own = idx;
+			continue ;
+		}
+		{
+			std::lock_guard<std::mutex> g(done_lock);
+			pending++;
+		}
+		DeviceWorker &worker = *this->workers[idx];
+		{
+			std::lock_guard<std::mutex> g(worker.lock);
+			worker.jobs.push_back([this, idx, &errors, &work, &done_lock, &done_cv, &pending]() {
+				try {
+					work(*this->devices[idx], idx);
+				} catch (...) {
+					errors[idx] = std::current_exception();
+				}
+				std::lock_guard<std::mutex> g(done_lock);
+				if (--pending == 0) 
+					done_cv.notify_one();
+			});
+		}
+		worker.cv.notify_one();
+	}
+	if (own != devices.size()) {
+		try {
+			work(*this->devices[own], own);
+		} catch (...) {
+			errors[own] = std::current_exception();
+		}
+	}
+
+	// every device must be done with the caller's buffers before an error is reported
+	{
+		std::unique_lock<std::mutex> l(done_lock);
+		done_cv.wait(l, [&pending]() { return pending == 0; });
+	}
+	for (std::exception_ptr &error : errors) {
+		if (error) 
+			std::rethrow_exception(error);
+	}
+}
+
+void StripedBackend::read(Size offset, Byte *buf, Size length) {
+	this->read_batch(std::vector<IORequest>{IORequest{offset, buf, length}});
+}
+
+void StripedBackend::write(Size offset, const Byte *buf, Size length) {
+	this->write_batch(std::vector<IORequest>{IORequest{offset, (Byte *)buf, length}});
+}
+
+void StripedBackend::read_batch(const std::vector<IORequest> &requests) {
+	std::vector<std::vector<IORequest>> per_device = this->split(requests);
+	std::vector<bool> involved(devices.size());
+	for (size_t idx = 0; idx < devices.size(); ++idx) {
+		involved[idx] = !per_device[idx].empty();
+	}
+	this->on_each_device(involved, [&per_device](DiskBackend &device, size_t idx) {
+		device.read_batch(per_device[idx]);
+	});
+}
+
+void StripedBackend::write_batch(const std::vector<IORequest> &requests) {
+	std::vector<std::vector<IORequest>> per_device = this->split(requests);
+	std::vector<bool> involved(devices.size());
+	for (size_t idx = 0; idx < devices.size(); ++idx) {
+		involved[idx] = !per_device[idx].empty();
+	}
+	this->on_each_device(involved, [&per_device](DiskBackend &device, size_t idx) {
+		device.write_batch(per_device[idx]);
+	});
+}
+
+void StripedBackend::sync(Size offset, Size length) {
+	this->sync_ranges(std::vector<SyncRange>{SyncRange{offset, length}});
+}
+
+void StripedBackend::sync_ranges(const std::vector<SyncRange> &ranges) {
+	// a range is cut up just like a request, the buffers do not matter here
+	std::vector<IORequest> as_requests;
+	for (const SyncRange &range : ranges) {
+		as_requests.push_back(IORequest{range.offset, nullptr, range.length});
+	}
+	std::vector<std::vector<IORequest>> per_device = this->split(as_requests);
+
+	std::vector<std::vector<SyncRange>> device_ranges(devices.size());
+	std::vector<bool> involved(devices.size());
+	for (size_t idx = 0; idx < devices.size(); ++idx) {
+		for (const IORequest &piece : per_device[idx]) {
+			// pieces of one range that are adjacent on the device sync together
+			if (!device_ranges[idx].empty() && 
+				device_ranges[idx].back().offset + device_ranges[idx].back().length == piece.offset) {
+				device_ranges[idx].back().length += piece.length;
+			} else {
+				device_ranges[idx].push_back(SyncRange{piece.offset, piece.length});
+			}
+		}
+		involved[idx] = !device_ranges[idx].empty();
+	}
+	this->on_each_device(involved, [&device_ranges](DiskBackend &device, size_t idx) {
+		device.sync_ranges(device_ranges[idx]);
+	});
+}
+
+void StripedBackend::zero_fill() {
+	std::vector<bool> involved(devices.size(), true);
+	this->on_each_device(involved, [](DiskBackend &device, size_t /* idx */) {
+		device.zero_fill();
+	});
+}
+
+void StripedBackend::advise(Size offset, Size length, AccessPattern pattern) {
+	std::vector<std::vector<IORequest>> per_device = this->split(
+		std::vector<IORequest>{IORequest{offset, nullptr, length}});
+	for (size_t idx = 0; idx < devices.size(); ++idx) {
+		if (per_device[idx].empty()) 
+			continue ;
+		// every device holds its share of the range as one span
+		const Size first = per_device[idx].front().offset;
+		const Size end = per_device[idx].back().offset + per_device[idx].back().length;
+		devices[idx]->advise(first, end - first, pattern);
+	}
+}
+
+bool StripedBackend::discard(Size offset, Size length) {
+	std::vector<std::vector<IORequest>> per_device = this->split(
+		std::vector<IORequest>{IORequest{offset, nullptr, length}});
+	bool discarded = true;
+	for (size_t idx = 0; idx < devices.size(); ++idx) {
+		if (per_device[idx].empty()) 
+			continue ;
+		// unlike a hint a discard must not spill over, so only pieces that are 
+		// adjacent on the device are merged
+		SyncRange range{per_device[idx].front().offset, 0};
+		for (const IORequest &piece : per_device[idx]) {
+			if (range.offset + range.length != piece.offset) {
+				discarded = devices[idx]->discard(range.offset, range.length) && discarded;
+				range = SyncRange{piece.offset, 0};
+			}
+			range.length += piece.length;
+		}
+		discarded = devices[idx]->discard(range.offset, range.length) && discarded;
+	}
+	return discarded;
+}
+
+/*
+	TieredBackend
+*/
+
+TieredBackend::TieredBackend(std::unique_ptr<DiskBackend> fast, std::unique_ptr<DiskBackend> bulk, Size fast_bytes)
+	: fast(std::move(fast)), bulk(std::move(bulk)), _fast_bytes(fast_bytes) {
+	this->_alignment = std::max(this->fast->alignment(), this->bulk->alignment());
+	if (fast_bytes == 0 || fast_bytes > this->fast->size_bytes()) {
+		throw DiskException("the fast part of a tiered disk must fit on the fast device");
+	}
+	if (fast_bytes % this->_alignment != 0) {
+		throw DiskException("the fast part of a tiered disk must be a multiple of both devices' alignment");
+	}
+}
+
+void TieredBackend::split(const std::vector<IORequest> &requests, 
+	std::vector<IORequest> &on_fast, std::vector<IORequest> &on_bulk) const {
+	for (const IORequest &request : requests) {
+		assert(request.offset + request.length <= this->size_bytes());
+		if (request.offset + request.length <= this->_fast_bytes) {
+			on_fast.push_back(request);
+		} else if (request.offset >= this->_fast_bytes) {
+			on_bulk.push_back(IORequest{request.offset - this->_fast_bytes, request.buf, request.length});
+		} else {
+			const Size piece = this->_fast_bytes - request.offset;
+			on_fast.push_back(IORequest{request.offset, request.buf, piece});
+			on_bulk.push_back(IORequest{0, request.buf == nullptr ? nullptr : request.buf + piece, request.length - piece});
+		}
+	}
+}
+
+void TieredBackend::read(Size offset, Byte *buf, Size length) {
+	this->read_batch(std::vector<IORequest>{IORequest{offset, buf, length}});
+}
+
+void TieredBackend::write(Size offset, const Byte *buf, Size length) {
+	this->write_batch(std::vector<IORequest>{IORequest{offset, (Byte *)buf, length}});
+}
+
+void TieredBackend::read_batch(const std::vector<IORequest> &requests) {
+	std::vector<IORequest> on_fast, on_bulk;
+	this->split(requests, on_fast, on_bulk);
+	if (!on_fast.empty()) 
+		this->fast->read_batch(on_fast);
+	if (!on_bulk.empty()) 
+		this->bulk->read_batch(on_bulk);
+}
+
+void TieredBackend::write_batch(const std::vector<IORequest> &requests) {
+	std::vector<IORequest> on_fast, on_bulk;
+	this->split(requests, on_fast, on_bulk);
+	if (!on_fast.empty()) 
+		this->fast->write_batch(on_fast);
+	if (!on_bulk.empty()) 
+		this->bulk->write_batch(on_bulk);
+}
+
+void TieredBackend::sync(Size offset, Size length) {
+	this->sync_ranges(std::vector<SyncRange>{SyncRange{offset, length}});
+}
+
+void TieredBackend::sync_ranges(const std::vector<SyncRange> &ranges) {
+	// a range is cut up just like a request, the buffers do not matter here
+	std::vector<IORequest> as_requests;
+	for (const SyncRange &range : ranges) {
+		as_requests.push_back(IORequest{range.offset, nullptr, range.length});
+	}
+	std::vector<IORequest> on_fast, on_bulk;
+	this->split(as_requests, on_fast, on_bulk);
+
+	std::vector<SyncRange> fast_ranges, bulk_ranges;
+	for (const IORequest &piece : on_fast) {
+		fast_ranges.push_back(SyncRange{piece.offset, piece.length});
+	}
+	for (const IORequest &piece : on_bulk) {
+		bulk_ranges.push_back(SyncRange{piece.offset, piece.length});
+	}
+	if (!fast_ranges.empty()) 
+		this->fast->sync_ranges(fast_ranges);
+	if (!bulk_ranges.empty()) 
+		this->bulk->sync_ranges(bulk_ranges);
+}
+
+void TieredBackend::zero_fill() {
+	this->fast->zero_fill();
+	this->bulk->zero_fill();
+}
+
+void TieredBackend::advise(Size offset, Size length, AccessPattern pattern) {
+	std::vector<IORequest> on_fast, on_bulk;
+	this->split(std::vector<IORequest>{IORequest{offset, nullptr, length}}, on_fast, on_bulk);
+	for (const IORequest &piece : on_fast) {
+		this->fast->advise(piece.offset, piece.length, pattern);
+	}
+	for (const IORequest &piece : on_bulk) {
+		this->bulk->advise(piece.offset, piece.length, pattern);
+	}
+}
+
+bool TieredBackend::discard(Size offset, Size length) {
+	std::vector<IORequest> on_fast, on_bulk;
+	this->split(std::vector<IORequest>{IORequest{offset, nullptr, length}}, on_fast, on_bulk);
+	bool discarded = true;
+	for (const IORequest &piece : on_fast) {
+		discarded = this->fast->discard(piece.offset, piece.length) && discarded;
+	}
+	for (const IORequest &piece : on_bulk) {
+		discarded = this->bulk->discard(piece.offset, piece.length) && discarded;
+	}
+	return discarded;
+}
+
+/*
+	SimulatedBackend
+*/
+
+DeviceModel DeviceModel::hdd() {
+	DeviceModel model;
+	model.name = "hdd";
+	model.read_latency_ns = 100 * 1000;
+	model.write_latency_ns = 100 * 1000;
+	model.seek_min_ns = 1000 * 1000;
+	model.seek_max_ns = 16 * 1000 * 1000;
+	model.rotation_ns = 4167 * 1000; // half a turn at 7200 rpm
+	model.read_bytes_per_sec = 200ull * 1000 * 1000;
+	model.write_bytes_per_sec = 200ull * 1000 * 1000;
+	model.queue_depth = 1;
+	model.sync_ns = 5 * 1000 * 1000;
+	return model;
+}
+
+DeviceModel DeviceModel::sata_ssd() {
+	DeviceModel model;
+	model.name = "ssd";
+	model.read_latency_ns = 80 * 1000;
+	model.write_latency_ns = 40 * 1000;
+	model.read_bytes_per_sec = 550ull * 1000 * 1000;
+	model.write_bytes_per_sec = 500ull * 1000 * 1000;
+	model.queue_depth = 32;
+	model.sync_ns = 1000 * 1000;
+	return model;
+}
+
+DeviceModel DeviceModel::nvme() {
+	DeviceModel model;
+	model.name = "nvme";
+	model.read_latency_ns = 20 * 1000;
+	model.write_latency_ns = 15 * 1000;
+	model.read_bytes_per_sec = 3500ull * 1000 * 1000;
+	model.write_bytes_per_sec = 3000ull * 1000 * 1000;
+	model.queue_depth = 128;
+	model.sync_ns = 200 * 1000;
+	return model;
+}
+
+DeviceModel DeviceModel::named(const std::string &name) {
+	if (name == "hdd") {
+		return hdd();
+	} else if (name == "ssd") {
+		return sata_ssd();
+	} else if (name == "nvme") {
+		return nvme();
+	}
+	throw DiskException("unknown device model: " + name);
+}
+
+// the time length bytes take at bytes_per_sec, without overflowing for large lengths
+static uint64_t transfer_ns(Size length, uint64_t bytes_per_sec) {
+	if (bytes_per_sec == 0) 
+		return 0;
+	return length / bytes_per_sec * 1000000000ull + length % bytes_per_sec * 1000000000ull / bytes_per_sec;
+}
+
+SimulatedBackend::SimulatedBackend(std::unique_ptr<DiskBackend> device, const DeviceModel &model, bool realtime)
+	: device(std::move(device)), model(model), _name("sim-" + model.name), realtime(realtime), 
+	busy_until(std::chrono::steady_clock::now()) {
+	if (model.queue_depth == 0) {
+		throw DiskException("a simulated device needs a queue depth of at least 1");
+	}
+}
+
+uint64_t SimulatedBackend::seek_ns(Size distance) const {
+	const double fraction = std::sqrt((double)distance / (double)this->device->size_bytes());
+	return this->model.seek_min_ns + (uint64_t)((this->model.seek_max_ns - this->model.seek_min_ns) * fraction);
+}
+
+std::chrono::steady_clock::time_point SimulatedBackend::charge(bool is_write, const std::vector<IORequest> &requests) {
+	std::lock_guard<std::mutex> g(this->lock);
+
+	// every request goes to whichever slot in the queue frees up first
+	std::vector<uint64_t> in_flight(std::min<size_t>(this->model.queue_depth, requests.size()), 0);
+	const uint64_t bytes_per_sec = is_write ? this->model.write_bytes_per_sec : this->model.read_bytes_per_sec;
+	Size bytes = 0;
+	for (const IORequest &request : requests) {
+		uint64_t ns = is_write ? this->model.write_latency_ns : this->model.read_latency_ns;
+		if (request.offset != this->head) {
+			const Size distance = request.offset > this->head ? request.offset - this->head : this->head - request.offset;
+			if (this->model.seek_max_ns != 0 || this->model.rotation_ns != 0) {
+				ns += this->seek_ns(distance) + this->model.rotation_ns;
+				this->_stats.seeks++;
+			}
+		}
+		ns += transfer_ns(request.length, bytes_per_sec);
+		this->head = request.offset + request.length;
+		*std::min_element(in_flight.begin(), in_flight.end()) += ns;
+		bytes += request.length;
+	}
+
+	// however many are in flight, no more than the bandwidth gets through
+	uint64_t busy = in_flight.empty() ? 0 : *std::max_element(in_flight.begin(), in_flight.end());
+	busy = std::max(busy, transfer_ns(bytes, bytes_per_sec));
+
+	if (is_write) {
+		this->_stats.writes += requests.size();
+		this->_stats.bytes_written += bytes;
+	} else {
+		this->_stats.reads += requests.size();
+		this->_stats.bytes_read += bytes;
+	}
+	this->_stats.busy_ns += busy;
+
+	const std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+	if (this->busy_until < now) 
+		this->busy_until = now;
+	this->busy_until += std::chrono::nanoseconds(busy);
+	return this->busy_until;
+}
+
+std::chrono::steady_clock::time_point SimulatedBackend::charge_sync() {
+	std::lock_guard<std::mutex> g(this->lock);
+	this->_stats.syncs++;
+	this->_stats.busy_ns += this->model.sync_ns;
+
+	const std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+	if (this->busy_until < now) 
+		this->busy_until = now;
+	this->busy_until += std::chrono::nanoseconds(this->model.sync_ns);
+	return this->busy_until;
+}
+
+SimulatedBackend::Stats SimulatedBackend::stats() const {
+	std::lock_guard<std::mutex> g(this->lock);
+	return this->_stats;
+}
+
+void SimulatedBackend::read(Size offset, Byte *buf, Size length) {
+	this->read_batch(std::vector<IORequest>{IORequest{offset, buf, length}});
+}
+
+void SimulatedBackend::write(Size offset, const Byte *buf, Size length) {
+	this->write_batch(std::vector<IORequest>{IORequest{offset, (Byte *)buf, length}});
+}
+
+void SimulatedBackend::read_batch(const std::vector<IORequest> &requests) {
+	const std::chrono::steady_clock::time_point done = this->charge(false, requests);
+	this->device->read_batch(requests);
+	if (this->realtime) 
+		std::this_thread::sleep_until(done);
+}
+
+void SimulatedBackend::write_batch(const std::vector<IORequest> &requests) {
+	const std::chrono::steady_clock::time_point done = this->charge(true, requests);
+	this->device->write_batch(requests);
+	if (this->realtime) 
+		std::this_thread::sleep_until(done);
+}
+
+void SimulatedBackend::sync(Size offset, Size length) {
+	const std::chrono::steady_clock::time_point done = this->charge_sync();
+	this->device->sync(offset, length);
+	if (this->realtime) 
+		std::this_thread::sleep_until(done);
+}
+
+void SimulatedBackend::sync_ranges(const std::vector<SyncRange> &ranges) {
+	if (ranges.empty()) 
+		return ;
+	const std::chrono::steady_clock::time_point done = this->charge_sync();
+	this->device->sync_ranges(ranges);
+	if (this->realtime) 
+		std::this_thread::sleep_until(done);
+}
+
+void SimulatedBackend::zero_fill() {
+	this->device->zero_fill();
+}
+
+void SimulatedBackend::advise(Size offset, Size length, AccessPattern pattern) {
+	this->device->advise(offset, length, pattern);
+}
+
+bool SimulatedBackend::lock_in_memory(Size offset, Size length) {
+	return this->device->lock_in_memory(offset, length);
+}
+
+void SimulatedBackend::unlock_from_memory() {
+	this->device->unlock_from_memory();
+}
+
+bool SimulatedBackend::discard(Size offset, Size length) {
+	return this->device->discard(offset, length);
+}
+
+/*
+	ScheduledBackend
+*/
+
+uint64_t ScheduledBackend::ClassStats::percentile_ns(double fraction) const {
+	uint64_t total = 0;
+	for (uint64_t count : this->histogram) {
+		total += count;
+	}
+	if (total == 0) 
+		return 0;
+
+	const uint64_t target = (uint64_t)std::ceil(fraction * total);
+	uint64_t seen = 0;
+	for (size_t bucket = 0; bucket < LATENCY_BUCKETS; ++bucket) {
+		seen += this->histogram[bucket];
+		if (seen >= target && seen != 0) 
+			return (2ull << bucket) * 1000;
+	}
+	return this->max_latency_ns;
+}
+
+ScheduledBackend::ScheduledBackend(std::unique_ptr<DiskBackend> device, unsigned max_in_flight)
+	: device(std::move(device)), max_in_flight(max_in_flight) {
+	if (max_in_flight == 0) {
+		throw DiskException("the scheduler must let at least one I/O through at a time");
+	}
+	const unsigned weights[IO_CLASS_COUNT] = {8, 4, 2, 1};
+	for (size_t idx = 0; idx < IO_CLASS_COUNT; ++idx) {
+		ClassConfig config;
+		config.weight = weights[idx];
+		this->configure((IOClass)idx, config);
+	}
+}
+
+void ScheduledBackend::configure(IOClass io_class, const ClassConfig &config) {
+	if (config.weight == 0) {
+		throw DiskException("an I/O class must have a weight");
+	}
+	if (config.rate_bytes_per_sec != 0 && config.burst_bytes == 0) {
+		throw DiskException("a rate limited I/O class must be allowed a burst");
+	}
+	std::lock_guard<std::mutex> g(this->lock);
+	ClassState &state = this->classes[(size_t)io_class];
+	state.config = config;
+	state.tokens = config.burst_bytes;
+	state.refilled = std::chrono::steady_clock::now();
+	this->admitted_cv.notify_all();
+}
+
+ScheduledBackend::ClassConfig ScheduledBackend::config(IOClass io_class) const {
+	std::lock_guard<std::mutex> g(this->lock);
+	return this->classes[(size_t)io_class].config;
+}
+
+ScheduledBackend::ClassStats ScheduledBackend::stats(IOClass io_class) const {
+	std::lock_guard<std::mutex> g(this->lock);
+	return this->classes[(size_t)io_class].stats;
+}
+
+size_t ScheduledBackend::waiting() const {
+	std::lock_guard<std::mutex> g(this->lock);
+	return this->waiting_count;
+}
+
+void ScheduledBackend::refill(ClassState &state, std::chrono::steady_clock::time_point now) {
+	if (state.config.rate_bytes_per_sec == 0) 
+		return ;
+	const double elapsed = std::chrono::duration<double>(now - state.refilled).count();
+	state.tokens = std::min((double)state.config.burst_bytes, state.tokens + elapsed * state.config.rate_bytes_per_sec);
+	state.refilled = now;
+}
+
+bool ScheduledBackend::may_go(IOClass io_class, Size bytes) {
+	// the last slot is kept for the foreground
+	const unsigned slots = background(io_class) && this->max_in_flight > 1 ? this->max_in_flight - 1 : this->max_in_flight;
+	if (this->in_flight >= slots) 
+		return false;
+
+	// one larger than the burst waits for a full bucket and leaves it owing
+	const ClassState &state = this->classes[(size_t)io_class];
+	if (state.config.rate_bytes_per_sec != 0 && state.tokens < std::min((double)bytes, (double)state.config.burst_bytes)) 
+		return false;
+
+	// and it has to be the turn of the class, of the ones that could go now 
+	// the one with the earliest start goes first (the foreground on a tie)
+	const uint64_t start = std::max(state.virtual_time, this->virtual_now);
+	for (size_t idx = 0; idx < IO_CLASS_COUNT; ++idx) {
+		const ClassState &other = this->classes[idx];
+		if (idx == (size_t)io_class || other.queue.empty()) 
+			continue ;
+		const uint64_t other_start = std::max(other.virtual_time, this->virtual_now);
+		if (other_start > start || (other_start == start && idx > (size_t)io_class)) 
+			continue ;
+		const unsigned other_slots = background((IOClass)idx) && this->max_in_flight > 1 ? this->max_in_flight - 1 : this->max_in_flight;
+		const bool other_limited = other.config.rate_bytes_per_sec != 0 && 
+			other.tokens < std::min((double)other.queue.front(), (double)other.config.burst_bytes);
+		if (this->in_flight < other_slots && !other_limited) 
+			return false;
+	}
+	return true;
+}
+
+std::chrono::steady_clock::time_point ScheduledBackend::admit(IOClass io_class, Size bytes) {
+	const std::chrono::steady_clock::time_point asked = std::chrono::steady_clock::now();
+	std::unique_lock<std::mutex> l(this->lock);
+	ClassState &state = this->classes[(size_t)io_class];
+	const uint64_t ticket = state.next_ticket++;
+	state.queue.push_back(bytes);
+	this->waiting_count++;
+
+	for (;;) {
+		const std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+		for (ClassState &each : this->classes) {
+			this->refill(each, now);
+		}
+		if (ticket == state.serving && this->may_go(io_class, bytes)) 
+			break ;
+
+		// an empty bucket fills up whether or not anything else happens
+		const double short_by = std::min((double)bytes, (double)state.config.burst_bytes) - state.tokens;
+		if (ticket == state.serving && state.config.rate_bytes_per_sec != 0 && short_by > 0) {
+			this->admitted_cv.wait_for(l, std::chrono::duration<double>(short_by / state.config.rate_bytes_per_sec));
+		} else {
+			this->admitted_cv.wait(l);
+		}
+	}
+
+	state.queue.pop_front();
+	state.serving++;
+	this->waiting_count--;
+	this->in_flight++;
+	const uint64_t start = std::max(state.virtual_time, this->virtual_now);
+	this->virtual_now = start;
+	state.virtual_time = start + bytes / state.config.weight;
+	if (state.config.rate_bytes_per_sec != 0) 
+		state.tokens -= bytes;
+
+	// the next of the class may be able to go as well
+	this->admitted_cv.notify_all();
+	return asked;
+}
+
+void ScheduledBackend::done(IOClass io_class, Size bytes, std::chrono::steady_clock::time_point asked, 
+	std::chrono::steady_clock::time_point admitted) {
+	const std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+	const uint64_t latency_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(now - asked).count();
+
+	std::lock_guard<std::mutex> g(this->lock);
+	this->in_flight--;
+	ClassStats &stats = this->classes[(size_t)io_class].stats;
+	stats.requests++;
+	stats.bytes += bytes;
+	stats.wait_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(admitted - asked).count();
+	stats.latency_ns += latency_ns;
+	stats.max_latency_ns = std::max(stats.max_latency_ns, latency_ns);
+	size_t bucket = 0;
+	for (uint64_t us = latency_ns / 1000; us > 1 && bucket < LATENCY_BUCKETS - 1; us >>= 1) {
+		bucket++;
+	}
+	stats.histogram[bucket]++;
+	this->admitted_cv.notify_all();
+}
+
+void ScheduledBackend::schedule(bool is_write, const std::vector<IORequest> &requests) {
+	const IOClass io_class = IOClassScope::current(is_write);
+
+	// the foreground goes as a whole, the background in pieces
+	std::vector<std::vector<IORequest>> pieces;
+	if (!background(io_class)) {
+		pieces.push_back(requests);
+	} else {
+		pieces.emplace_back();
+		Size piece_bytes = 0;
+		for (IORequest request : requests) {
+			while (request.length > 0) {
+				if (piece_bytes == BACKGROUND_PIECE_BYTES) {
+					pieces.emplace_back();
+					piece_bytes = 0;
+				}
+				const Size length = std::min(request.length, BACKGROUND_PIECE_BYTES - piece_bytes);
+				pieces.back().push_back(IORequest{request.offset, request.buf, length});
+				piece_bytes += length;
+				request.offset += length;
+				request.buf += length;
+				request.length -= length;
+			}
+		}
+	}
+
+	for (const std::vector<IORequest> &piece : pieces) {
+		Size bytes = 0;
+		for (const IORequest &request : piece) {
+			bytes += request.length;
+		}
+		const std::chrono::steady_clock::time_point asked = this->admit(io_class, bytes);
+		struct Done {
+			ScheduledBackend &scheduler;
+			IOClass io_class;
+			Size bytes;
+			std::chrono::steady_clock::time_point asked, admitted;
+			~Done() { scheduler.done(io_class, bytes, asked, admitted); }
+		} done{*this, io_class, bytes, asked, std::chrono::steady_clock::now()};
+
+		if (is_write) 
+			this->device->write_batch(piece);
+		else 
+			this->device->read_batch(piece);
+	}
+}
+
+void ScheduledBackend::read(Size offset, Byte *buf, Size length) {
+	this->schedule(false, std::vector<IORequest>{IORequest{offset, buf, length}});
+}
+
+void ScheduledBackend::write(Size offset, const Byte *buf, Size length) {
+	this->schedule(true, std::vector<IORequest>{IORequest{offset, (Byte *)buf, length}});
+}
+
+void ScheduledBackend::read_batch(const std::vector<IORequest> &requests) {
+	this->schedule(false, requests);
+}
+
+void ScheduledBackend::write_batch(const std::vector<IORequest> &requests) {
+	this->schedule(true, requests);
+}
+
+void ScheduledBackend::sync(Size offset, Size length) {
+	this->device->sync(offset, length);
+}
+
+void ScheduledBackend::sync_ranges(const std::vector<SyncRange> &ranges) {
+	this->device->sync_ranges(ranges);
+}
+
+void ScheduledBackend::zero_fill() {
+	this->device->zero_fill();
+}
+
+void ScheduledBackend::advise(Size offset, Size length, AccessPattern pattern) {
+	this->device->advise(offset, length, pattern);
+}
+
+bool ScheduledBackend::lock_in_memory(Size offset, Size length) {
+	return this->device->lock_in_memory(offset, length);
+}
+
+void ScheduledBackend::unlock_from_memory() {
+	this->device->unlock_from_memory();
+}
+
+bool ScheduledBackend::discard(Size offset, Size length) {
+	return this->device->discard(offset, length);
+}
+
+std::unique_ptr<DiskBackend> make_disk_backend(const std::string &name, int fd, Size size_bytes) {
+	if (name.compare(0, 4, "sim-") == 0) {
+		const DeviceModel model = DeviceModel::named(name.substr(4));
+		std::unique_ptr<DiskBackend> mapping(new MmapBackend(size_bytes, MAP_FILE | MAP_SHARED, fd));
+		return std::unique_ptr<DiskBackend>(new SimulatedBackend(std::move(mapping), model));
+	} else if (name == "mmap") {
+		return std::unique_ptr<DiskBackend>(new MmapBackend(size_bytes, MAP_FILE | MAP_SHARED, fd));
+	} else if (name == "pread") {
+		return std::unique_ptr<DiskBackend>(new PreadBackend(fd, size_bytes, false));
+	} else if (name == "direct") {
+		return std::unique_ptr<DiskBackend>(new PreadBackend(fd, size_bytes, true));
+	} else if (name == "uring" || name == "uring-direct") {
+		const bool direct = name == "uring-direct";
+		try {
+			return std::unique_ptr<DiskBackend>(new UringBackend(fd, size_bytes, direct));
+		} catch (const DiskException &e) {
+			// the backend's name tells the caller which one it got
+			return std::unique_ptr<DiskBackend>(new PreadBackend(fd, size_bytes, direct));
+		}
+	}
+	throw DiskException("unknown disk backend: " + name);
+}
+
+std::unique_ptr<DiskBackend> make_disk_backend(const std::string &name, const std::vector<int> &fds, 
+	Size size_bytes, Size stripe_unit) {
+	if (fds.size() == 1) {
+		return make_disk_backend(name, fds[0], size_bytes);
+	}
+
+	std::vector<std::unique_ptr<DiskBackend>> devices;
+	for (int fd : fds) {
+		devices.push_back(make_disk_backend(name, fd, size_bytes));
+	}
+	return std::unique_ptr<DiskBackend>(new StripedBackend(std::move(devices), stripe_unit));
+}
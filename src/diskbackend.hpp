@@ -0,0 +1,617 @@
+#ifndef DISKBACKEND_HPP
+#define DISKBACKEND_HPP
+
+#include <memory>
+#include <string>
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <array>
+#include <deque>
+#include <thread>
+#include <functional>
+#include <sys/mman.h>
+
+#include "diskinterface.hpp"
+
+/*
+	the storage underneath a Disk. Disk caches chunks on top of a backend and
+	talks to it in byte offsets, every offset and length it passes is a
+	multiple of the chunk size which in turn must be a multiple of alignment()
+*/
+class DiskBackend {
+public:
+	virtual ~DiskBackend() { };
+
+	virtual const char *name() const = 0;
+
+	virtual Size size_bytes() const = 0;
+
+	// when the whole device is addressable memory (i.e. a memory map) this
+	// returns its base address, chunks can then point directly into it
+	virtual Byte *mapping() {
+		return nullptr;
+	}
+
+	// buffers, offsets and lengths handed to read and write must be aligned to this
+	virtual size_t alignment() const {
+		return 1;
+	}
+
+	// these throw a DiskException if the device reports an error
+	virtual void read(Size offset, Byte *buf, Size length) = 0;
+	virtual void write(Size offset, const Byte *buf, Size length) = 0;
+
+	// one transfer of a batch, length bytes between offset on the device and buf
+	struct IORequest {
+		Size offset;
+		Byte *buf;
+		Size length;
+	};
+
+	// hands the backend a whole batch at once so that it can keep many of them
+	// in flight, by default they are simply done one after another
+	virtual void read_batch(const std::vector<IORequest> &requests);
+	virtual void write_batch(const std::vector<IORequest> &requests);
+
+	// makes everything written to the range durable
+	virtual void sync(Size offset, Size length) = 0;
+
+	// a byte range of the device
+	struct SyncRange {
+		Size offset;
+		Size length;
+	};
+
+	// makes several ranges durable, by default with one sync per range
+	virtual void sync_ranges(const std::vector<SyncRange> &ranges);
+
+	virtual void zero_fill();
+
+	// a hint about how the range is going to be accessed, ignored by default
+	virtual void advise(Size /* offset */, Size /* length */, AccessPattern /* pattern */) { };
+
+	// tries to keep the range resident in memory, returns false when the
+	// backend cannot (or is not allowed to) do so. unlock_from_memory gives
+	// every range locked so far back
+	virtual bool lock_in_memory(Size /* offset */, Size /* length */) {
+		return false;
+	}
+	virtual void unlock_from_memory() { };
+
+	// gives the range back to the device, what it reads as afterwards is 
+	// undefined (zeros on every backend here). returns false when the device 
+	// can not do that at all, i.e. a file system without hole punching, and 
+	// throws a DiskException if it reports any other error
+	virtual bool discard(Size /* offset */, Size /* length */) {
+		return false;
+	}
+};
+
+/*
+	maps the entire device into memory with mmap64, this is how Disk has always
+	worked. I/O is done by page faults and a failed write arrives as a SIGBUS.
+	writes only dirty the mapping, nothing reaches the file until sync msyncs it
+	when you just want a disk use
+	flags: MAP_PRIVATE | MAP_ANONYMOUS
+	when you want a disk backed by a file, provide a file descriptor and set
+	flags: MAP_FILE | MAP_SHARED
+	a good explanation of these flags can be found here: https://www.gnu.org/software/hurd/glibc/mmap.html
+*/
+class MmapBackend : public DiskBackend {
+private:
+	int fd = -1;
+	int flags = 0;
+	Size _size_bytes = 0;
+	Byte *data = nullptr;
+	const size_t _mempage_size = sysconf(_SC_PAGESIZE); // get the memory page size;
+
+	std::mutex locked_lock;
+	std::vector<SyncRange> locked; // page rounded ranges that are mlocked
+
+	// rounds the range out to whole pages
+	SyncRange page_range(Size offset, Size length) const;
+
+public:
+	MmapBackend(Size size_bytes, int flags = MAP_PRIVATE | MAP_ANONYMOUS, int fd = -1);
+	~MmapBackend();
+
+	const char *name() const override {
+		return "mmap";
+	}
+
+	Size size_bytes() const override {
+		return _size_bytes;
+	}
+
+	Byte *mapping() override {
+		return data;
+	}
+
+	void read(Size offset, Byte *buf, Size length) override;
+	void write(Size offset, const Byte *buf, Size length) override;
+	void sync(Size offset, Size length) override;
+	void zero_fill() override;
+	void advise(Size offset, Size length, AccessPattern pattern) override;
+	// mlocks the pages, limited by RLIMIT_MEMLOCK
+	bool lock_in_memory(Size offset, Size length) override;
+	void unlock_from_memory() override;
+	// punches a hole into the file, or drops the pages of an anonymous mapping
+	bool discard(Size offset, Size length) override;
+};
+
+/*
+	explicit I/O with pread/pwrite on a file descriptor, errors come back as
+	exceptions instead of signals. with direct set the descriptor is switched to
+	O_DIRECT so the page cache is bypassed, this requires every buffer, offset
+	and length to be aligned to the device's logical block size
+*/
+class PreadBackend : public DiskBackend {
+private:
+	int fd = -1;
+	Size _size_bytes = 0;
+	bool direct = false;
+
+public:
+	static constexpr size_t DIRECT_IO_ALIGNMENT = 4096;
+
+	PreadBackend(int fd, Size size_bytes, bool direct = false);
+
+	const char *name() const override {
+		return direct ? "direct" : "pread";
+	}
+
+	Size size_bytes() const override {
+		return _size_bytes;
+	}
+
+	size_t alignment() const override {
+		return direct ? DIRECT_IO_ALIGNMENT : 1;
+	}
+
+	void read(Size offset, Byte *buf, Size length) override;
+	void write(Size offset, const Byte *buf, Size length) override;
+	void sync(Size offset, Size length) override;
+	// fdatasync covers the whole file, so any number of ranges take one call
+	void sync_ranges(const std::vector<SyncRange> &ranges) override;
+	// posix_fadvise, which tunes the page cache's readahead for the range
+	void advise(Size offset, Size length, AccessPattern pattern) override;
+	// BLKDISCARD on a block device, a hole punched into a file otherwise
+	bool discard(Size offset, Size length) override;
+};
+
+/*
+	asynchronous I/O through an io_uring, talking to the kernel with the raw
+	system calls. a batch is pushed through the ring with up to queue_depth
+	requests in flight at once, instead of one blocking call per chunk.
+	construction throws a DiskException when the kernel does not support
+	io_uring (or it has been disabled), make_disk_backend falls back to
+	PreadBackend in that case
+*/
+class UringBackend : public DiskBackend {
+private:
+	struct Ring; // the mapped submission and completion queues
+	std::unique_ptr<Ring> ring;
+	std::mutex lock; // one batch at a time goes through the ring
+
+	int fd = -1;
+	Size _size_bytes = 0;
+	bool direct = false;
+
+	void submit(bool is_write, const std::vector<IORequest> &requests);
+
+public:
+	static constexpr unsigned DEFAULT_QUEUE_DEPTH = 64;
+
+	UringBackend(int fd, Size size_bytes, bool direct = false, unsigned queue_depth = DEFAULT_QUEUE_DEPTH);
+	~UringBackend();
+
+	const char *name() const override {
+		return direct ? "uring-direct" : "uring";
+	}
+
+	Size size_bytes() const override {
+		return _size_bytes;
+	}
+
+	size_t alignment() const override {
+		return direct ? PreadBackend::DIRECT_IO_ALIGNMENT : 1;
+	}
+
+	unsigned queue_depth() const;
+
+	void read(Size offset, Byte *buf, Size length) override;
+	void write(Size offset, const Byte *buf, Size length) override;
+	void read_batch(const std::vector<IORequest> &requests) override;
+	void write_batch(const std::vector<IORequest> &requests) override;
+	void sync(Size offset, Size length) override;
+	void sync_ranges(const std::vector<SyncRange> &ranges) override;
+	void advise(Size offset, Size length, AccessPattern pattern) override;
+	bool discard(Size offset, Size length) override;
+};
+
+/*
+	stripes one device over several others, i.e. a number of NVMe drives. the 
+	device is cut into stripe units which are dealt out to the devices in 
+	turn, unit i lands on device i % N at unit i / N. a batch is split up by 
+	device and every device works through its share at the same time, so 
+	sequential I/O (like the segment controller filling a segment) is spread 
+	over every device. all devices must have the same alignment requirements 
+	and the stripe unit must be a multiple of it
+*/
+class StripedBackend : public DiskBackend {
+private:
+	std::vector<std::unique_ptr<DiskBackend>> devices;
+	const Size _stripe_unit;
+	Size _size_bytes = 0;
+	size_t _alignment = 1;
+
+	// where a byte of the striped device lives
+	inline size_t device_for(Size offset) const {
+		return (offset / _stripe_unit) % devices.size();
+	}
+	inline Size device_offset(Size offset) const {
+		return (offset / _stripe_unit / devices.size()) * _stripe_unit + offset % _stripe_unit;
+	}
+
+	// one long lived thread per device, so that a batch does not pay for 
+	// starting threads. jobs for a device run in the order they were queued
+	struct DeviceWorker {
+		std::thread thread;
+		std::mutex lock;
+		std::condition_variable cv;
+		std::deque<std::function<void()>> jobs;
+		bool stopping = false;
+	};
+	std::vector<std::unique_ptr<DeviceWorker>> workers;
+
+	void run_worker(DeviceWorker &worker);
+
+	// cuts the requests up at stripe unit boundaries, one list per device
+	std::vector<std::vector<IORequest>> split(const std::vector<IORequest> &requests) const;
+
+	// runs work(device, idx) for every device that has something to do, in 
+	// parallel on the device workers, and rethrows the first error once all are done
+	template<typename F>
+	void on_each_device(const std::vector<bool> &involved, F work);
+
+public:
+	static constexpr Size DEFAULT_STRIPE_UNIT = 64 * 1024;
+
+	StripedBackend(std::vector<std::unique_ptr<DiskBackend>> devices, Size stripe_unit = DEFAULT_STRIPE_UNIT);
+	~StripedBackend() override;
+
+	const char *name() const override {
+		return "striped";
+	}
+
+	Size size_bytes() const override {
+		return _size_bytes;
+	}
+
+	size_t alignment() const override {
+		return _alignment;
+	}
+
+	inline size_t device_count() const {
+		return devices.size();
+	}
+
+	inline Size stripe_unit() const {
+		return _stripe_unit;
+	}
+
+	inline DiskBackend &device(size_t idx) {
+		return *devices[idx];
+	}
+
+	void read(Size offset, Byte *buf, Size length) override;
+	void write(Size offset, const Byte *buf, Size length) override;
+	void read_batch(const std::vector<IORequest> &requests) override;
+	void write_batch(const std::vector<IORequest> &requests) override;
+	void sync(Size offset, Size length) override;
+	void sync_ranges(const std::vector<SyncRange> &ranges) override;
+	void zero_fill() override;
+	void advise(Size offset, Size length, AccessPattern pattern) override;
+	bool discard(Size offset, Size length) override;
+};
+
+/*
+	puts a small fast device (i.e. an NVMe drive) in front of a large bulk 
+	one (i.e. a hard disk or an array of them). the fast device holds the 
+	first fast_bytes of the disk and the bulk device everything after, so 
+	whatever the file system lays out at the start of the disk, its metadata, 
+	lands on the fast device. a batch is split up between the two, both must 
+	have the same alignment requirements and fast_bytes must be a multiple of it
+*/
+class TieredBackend : public DiskBackend {
+private:
+	std::unique_ptr<DiskBackend> fast;
+	std::unique_ptr<DiskBackend> bulk;
+	const Size _fast_bytes;
+	size_t _alignment = 1;
+
+	// cuts the requests up where the devices meet, the bulk device's share 
+	// is moved to its own offsets
+	void split(const std::vector<IORequest> &requests, 
+		std::vector<IORequest> &on_fast, std::vector<IORequest> &on_bulk) const;
+
+public:
+	TieredBackend(std::unique_ptr<DiskBackend> fast, std::unique_ptr<DiskBackend> bulk, Size fast_bytes);
+
+	const char *name() const override {
+		return "tiered";
+	}
+
+	Size size_bytes() const override {
+		return _fast_bytes + bulk->size_bytes();
+	}
+
+	size_t alignment() const override {
+		return _alignment;
+	}
+
+	inline Size fast_bytes() const {
+		return _fast_bytes;
+	}
+
+	inline DiskBackend &fast_device() {
+		return *fast;
+	}
+
+	inline DiskBackend &bulk_device() {
+		return *bulk;
+	}
+
+	void read(Size offset, Byte *buf, Size length) override;
+	void write(Size offset, const Byte *buf, Size length) override;
+	void read_batch(const std::vector<IORequest> &requests) override;
+	void write_batch(const std::vector<IORequest> &requests) override;
+	void sync(Size offset, Size length) override;
+	void sync_ranges(const std::vector<SyncRange> &ranges) override;
+	void zero_fill() override;
+	void advise(Size offset, Size length, AccessPattern pattern) override;
+	bool discard(Size offset, Size length) override;
+};
+
+/*
+	how long a device takes over its I/O, for SimulatedBackend. every I/O 
+	costs its latency plus its length at the device's bandwidth, one that 
+	does not start where the last one ended also costs a seek (which grows 
+	with the square root of the distance, from seek_min_ns for the shortest 
+	to seek_max_ns across the whole device) and rotation_ns. the presets are 
+	ballpark figures for a 7200 rpm hard disk, a SATA SSD and an NVMe drive
+*/
+struct DeviceModel {
+	std::string name;
+	uint64_t read_latency_ns = 0;
+	uint64_t write_latency_ns = 0;
+	uint64_t seek_min_ns = 0;
+	uint64_t seek_max_ns = 0;
+	uint64_t rotation_ns = 0;
+	uint64_t read_bytes_per_sec = 0;
+	uint64_t write_bytes_per_sec = 0;
+	unsigned queue_depth = 1; // how many I/Os of a batch the device works on at once
+	uint64_t sync_ns = 0; // flushing the device's write cache
+
+	static DeviceModel hdd();
+	static DeviceModel sata_ssd();
+	static DeviceModel nvme();
+
+	// one of the presets by name: "hdd", "ssd" or "nvme"
+	static DeviceModel named(const std::string &name);
+};
+
+/*
+	puts a simulated device in front of another backend (i.e. an anonymous or 
+	file mapping), which holds the data. every I/O is charged what it would 
+	take on the modelled device: the head is tracked for the seeks, a batch 
+	is dealt out over queue_depth requests in flight and is never done faster 
+	than the bandwidth allows. the time is added up on a simulated clock, so 
+	the same I/O always costs the same, and with realtime set every call also 
+	sleeps until the device would have been done with it (one call waits for 
+	the ones before it to finish, as they would queue on the device). 
+	mapping() is left out, zero copy chunks would never reach the model
+*/
+class SimulatedBackend : public DiskBackend {
+public:
+	struct Stats {
+		uint64_t reads = 0;
+		uint64_t writes = 0;
+		uint64_t bytes_read = 0;
+		uint64_t bytes_written = 0;
+		uint64_t seeks = 0; // I/Os that moved the head, on a device that has one
+		uint64_t syncs = 0;
+		uint64_t busy_ns = 0; // the simulated time the device was busy for
+	};
+
+private:
+	std::unique_ptr<DiskBackend> device;
+	const DeviceModel model;
+	const std::string _name;
+	const bool realtime;
+
+	mutable std::mutex lock;
+	Size head = 0; // where the last I/O ended
+	Stats _stats;
+	std::chrono::steady_clock::time_point busy_until;
+
+	uint64_t seek_ns(Size distance) const;
+
+	// charges a batch to the device, returns when it would be done
+	std::chrono::steady_clock::time_point charge(bool is_write, const std::vector<IORequest> &requests);
+	std::chrono::steady_clock::time_point charge_sync();
+
+public:
+	SimulatedBackend(std::unique_ptr<DiskBackend> device, const DeviceModel &model, bool realtime = true);
+
+	const char *name() const override {
+		return _name.c_str();
+	}
+
+	Size size_bytes() const override {
+		return device->size_bytes();
+	}
+
+	size_t alignment() const override {
+		return device->alignment();
+	}
+
+	Stats stats() const;
+
+	void read(Size offset, Byte *buf, Size length) override;
+	void write(Size offset, const Byte *buf, Size length) override;
+	void read_batch(const std::vector<IORequest> &requests) override;
+	void write_batch(const std::vector<IORequest> &requests) override;
+	// a flush covers the whole device, a sync of any number of ranges costs one
+	void sync(Size offset, Size length) override;
+	void sync_ranges(const std::vector<SyncRange> &ranges) override;
+	// not charged, it is how a device is set up rather than how it is used
+	void zero_fill() override;
+	void advise(Size offset, Size length, AccessPattern pattern) override;
+	bool lock_in_memory(Size offset, Size length) override;
+	void unlock_from_memory() override;
+	// not charged either, the device does it in the background
+	bool discard(Size offset, Size length) override;
+};
+
+/*
+	an I/O scheduler in front of another backend. every read and write is 
+	given a class (see IOClassScope) and has to be admitted before it goes to 
+	the device, with at most max_in_flight admitted at once. when several 
+	classes wait the one that has had the least of the device for its weight 
+	goes next (start time fair queueing over bytes), and the background 
+	classes (writeback and the cleaner) never take the last slot so there is 
+	always one left for foreground I/O. a class can also be limited to a rate 
+	by a token bucket, which fills at rate_bytes_per_sec up to burst_bytes. a 
+	background batch is cut into pieces of at most BACKGROUND_PIECE_BYTES 
+	that are admitted one at a time, so a cleaner burst can not hold the 
+	device for long. the time every I/O took, from asking to be admitted to 
+	being done, is kept per class. syncs and everything else are passed 
+	straight on, and so is the mapping, chunks pointing into it bypass the 
+	scheduler
+*/
+class ScheduledBackend : public DiskBackend {
+public:
+	static constexpr unsigned DEFAULT_MAX_IN_FLIGHT = 4;
+	static constexpr Size BACKGROUND_PIECE_BYTES = 256 * 1024;
+
+	// latencies are counted in buckets of powers of two microseconds
+	static constexpr size_t LATENCY_BUCKETS = 32;
+
+	struct ClassConfig {
+		unsigned weight = 1;
+		uint64_t rate_bytes_per_sec = 0; // 0 for no limit
+		uint64_t burst_bytes = 0; // how much may be done at once after a pause
+	};
+
+	struct ClassStats {
+		uint64_t requests = 0; // admissions, a batch or a piece of one
+		uint64_t bytes = 0;
+		uint64_t wait_ns = 0; // waiting to be admitted, in total
+		uint64_t latency_ns = 0; // waiting and being done, in total
+		uint64_t max_latency_ns = 0;
+		std::array<uint64_t, LATENCY_BUCKETS> histogram {};
+
+		// the latency that fraction of the requests took at most, to within 
+		// a factor of two (the upper end of its bucket)
+		uint64_t percentile_ns(double fraction) const;
+	};
+
+private:
+	std::unique_ptr<DiskBackend> device;
+	const unsigned max_in_flight;
+
+	struct ClassState {
+		ClassConfig config;
+		ClassStats stats;
+		uint64_t virtual_time = 0; // bytes done over the weight
+		double tokens = 0;
+		std::chrono::steady_clock::time_point refilled;
+		// the bytes of each I/O waiting in the class, which is admitted in order 
+		// of arrival. the front is ticket serving, the back next_ticket - 1
+		std::deque<Size> queue;
+		uint64_t next_ticket = 0;
+		uint64_t serving = 0;
+	};
+
+	mutable std::mutex lock;
+	std::condition_variable admitted_cv;
+	std::array<ClassState, IO_CLASS_COUNT> classes;
+	unsigned in_flight = 0;
+	uint64_t virtual_now = 0; // the start of the I/O admitted last
+	size_t waiting_count = 0;
+
+	static inline bool background(IOClass io_class) {
+		return io_class == IOClass::WRITEBACK || io_class == IOClass::CLEANER;
+	}
+
+	// tops up the class's bucket, the lock must be held
+	void refill(ClassState &state, std::chrono::steady_clock::time_point now);
+
+	// whether the front of the class may be admitted now, the lock must be held
+	bool may_go(IOClass io_class, Size bytes);
+
+	// waits for the I/O to be admitted, returns when it asked
+	std::chrono::steady_clock::time_point admit(IOClass io_class, Size bytes);
+	void done(IOClass io_class, Size bytes, std::chrono::steady_clock::time_point asked, 
+		std::chrono::steady_clock::time_point admitted);
+
+	// runs the requests through the scheduler, background ones in pieces
+	void schedule(bool is_write, const std::vector<IORequest> &requests);
+
+public:
+	ScheduledBackend(std::unique_ptr<DiskBackend> device, unsigned max_in_flight = DEFAULT_MAX_IN_FLIGHT);
+
+	const char *name() const override {
+		return device->name();
+	}
+
+	Size size_bytes() const override {
+		return device->size_bytes();
+	}
+
+	Byte *mapping() override {
+		return device->mapping();
+	}
+
+	size_t alignment() const override {
+		return device->alignment();
+	}
+
+	// by default interactive reads weigh 8, foreground writes 4, writeback 2 
+	// and the cleaner 1, none of them is rate limited
+	void configure(IOClass io_class, const ClassConfig &config);
+	ClassConfig config(IOClass io_class) const;
+	ClassStats stats(IOClass io_class) const;
+
+	// how many I/Os are waiting to be admitted
+	size_t waiting() const;
+
+	void read(Size offset, Byte *buf, Size length) override;
+	void write(Size offset, const Byte *buf, Size length) override;
+	void read_batch(const std::vector<IORequest> &requests) override;
+	void write_batch(const std::vector<IORequest> &requests) override;
+	void sync(Size offset, Size length) override;
+	void sync_ranges(const std::vector<SyncRange> &ranges) override;
+	void zero_fill() override;
+	void advise(Size offset, Size length, AccessPattern pattern) override;
+	bool lock_in_memory(Size offset, Size length) override;
+	void unlock_from_memory() override;
+	bool discard(Size offset, Size length) override;
+};
+
+// builds a backend for the file descriptor by name: "mmap", "pread", "direct",
+// "uring" or "uring-direct". the io_uring backends fall back to pread when
+// io_uring is unavailable, the name of the backend returned shows which it 
+// is. "sim-hdd", "sim-ssd" and "sim-nvme" map the file behind a 
+// SimulatedBackend with that preset
+std::unique_ptr<DiskBackend> make_disk_backend(const std::string &name, int fd, Size size_bytes);
+
+// as above for every file descriptor, striped over them when there is more 
+// than one. size_bytes is what is used of each device
+std::unique_ptr<DiskBackend> make_disk_backend(const std::string &name, const std::vector<int> &fds, 
+	Size size_bytes, Size stripe_unit = StripedBackend::DEFAULT_STRIPE_UNIT);
+
+#endif
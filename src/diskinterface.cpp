@@ -1,85 +1,1732 @@
 #include <bitset>
 #include <cassert>
+#include <thread>
+#include <algorithm>
+#include <limits>
 
 #include "diskinterface.hpp"
+#include "diskbackend.hpp"
+#include "chunkpool.hpp"
+#include "crc32c.hpp"
+#include "lz4.hpp"
+
+const char *io_class_name(IOClass io_class) {
+	switch (io_class) {
+		case IOClass::INTERACTIVE_READ: return "interactive";
+		case IOClass::FOREGROUND_WRITE: return "foreground";
+		case IOClass::WRITEBACK: return "writeback";
+		case IOClass::CLEANER: return "cleaner";
+	}
+	return "unknown";
+}
+
+// -1 outside of any IOClassScope
+static thread_local int current_io_class = -1;
+
+IOClassScope::IOClassScope(IOClass io_class) : previous(current_io_class) {
+	current_io_class = (int)io_class;
+}
+
+IOClassScope::~IOClassScope() {
+	current_io_class = this->previous;
+}
+
+IOClass IOClassScope::current(bool is_write) {
+	if (current_io_class != -1) 
+		return (IOClass)current_io_class;
+	return is_write ? IOClass::FOREGROUND_WRITE : IOClass::INTERACTIVE_READ;
+}
+
+constexpr Size Disk::DEFAULT_CACHE_BUDGET_BYTES;
+constexpr size_t Disk::CHUNK_CACHE_SHARDS;
+constexpr size_t Disk::READAHEAD_QUEUE_LIMIT;
+constexpr unsigned Disk::DEFAULT_DIRTY_EXPIRE_MS;
+constexpr unsigned Disk::DEFAULT_DIRTY_RATIO_PERCENT;
+constexpr unsigned Disk::WRITEBACK_INTERVAL_MS;
+constexpr size_t Disk::WRITEBACK_MAX_RUN_CHUNKS;
+constexpr unsigned Disk::DEFAULT_WARM_SET_CHECKPOINT_MS;
+constexpr size_t Disk::WARM_SET_BATCH_CHUNKS;
+constexpr Size Disk::DEFAULT_DISCARD_BYTES_PER_SEC;
+constexpr size_t EpochDomain::STRIPES;
 
 Chunk::~Chunk() {
 	// whenever the last reference to a chunk is released, we flush the chunk
-	// out to the disk 
-	this->parent->flush_chunk(*this);
+	// out to the disk if it has been changed
+	this->parent->release_chunk(*this);
 
 	assert(this->data != nullptr);
-	free(this->data);
+	if (!this->parent->zero_copy()) {
+		// in zero copy mode the data belongs to the mapping, not to us
+		this->parent->pool->release(this->data);
+	}
 }
 
-std::shared_ptr<Chunk> Disk::get_chunk(Size chunk_idx) {
-	std::lock_guard<std::recursive_mutex> g(lock); // acquire the lock
+/*
+	EpochDomain
+*/
 
-	if (chunk_idx > this->size_chunks()) {
-		throw DiskException("chunk index out of bounds");
+EpochDomain::EpochDomain() {
+	for (Stripe &stripe : stripes) {
+		stripe.active[0].store(0, std::memory_order_relaxed);
+		stripe.active[1].store(0, std::memory_order_relaxed);
 	}
-	
-	if (auto chunk_ref = this->chunk_cache.get(chunk_idx)) {
-		return chunk_ref;
+}
+
+// each thread keeps to one stripe, handed out in turn as threads first enter
+static size_t epoch_stripe() {
+	static std::atomic<size_t> next_stripe {0};
+	static thread_local size_t stripe = next_stripe++;
+	return stripe;
+}
+
+EpochDomain::Guard::Guard(EpochDomain &domain) {
+	Stripe &stripe = domain.stripes[epoch_stripe() % STRIPES];
+	for (;;) {
+		// once the epoch is seen unchanged after counting ourselves in, a 
+		// writer moving it on has to wait for us
+		const uint64_t epoch = domain.epoch.load();
+		this->counter = &stripe.active[epoch & 1];
+		this->counter->fetch_add(1);
+		if (domain.epoch.load() == epoch) 
+			break ;
+		this->counter->fetch_sub(1);
+	}
+}
+
+EpochDomain::Guard::~Guard() {
+	this->counter->fetch_sub(1, std::memory_order_release);
+}
+
+void EpochDomain::synchronize() {
+	std::lock_guard<std::mutex> g(this->synchronize_lock);
+	// readers entering from now on count in the other half, so the ones that 
+	// are left in this half only drain
+	const uint64_t epoch = this->epoch.fetch_add(1);
+	for (Stripe &stripe : stripes) {
+		while (stripe.active[epoch & 1].load() != 0) {
+			std::this_thread::yield();
+		}
+	}
+}
+
+/*
+	ChunkSpan
+*/
+
+ChunkSpan::ChunkSpan(Size first_chunk, Size chunk_size, std::vector<ChunkRef> chunks)
+	: _first_chunk(first_chunk), _chunk_size(chunk_size), chunks(std::move(chunks)) {
+}
+
+Byte *ChunkSpan::contiguous_data() const {
+	if (chunks.empty()) 
+		return nullptr;
+	for (Size idx = 1; idx < chunks.size(); ++idx) {
+		if (chunks[idx]->data != chunks[0]->data + idx * _chunk_size) 
+			return nullptr;
+	}
+	return chunks[0]->data;
+}
+
+void ChunkSpan::read(Size offset, void *dst, Size length) const {
+	assert(offset + length <= this->size_bytes());
+	if (Byte *base = this->contiguous_data()) {
+		std::memcpy(dst, base + offset, length);
+		return ;
+	}
+
+	Byte *out = (Byte *)dst;
+	while (length > 0) {
+		const Chunk &chunk = *chunks[offset / _chunk_size];
+		const Size in_chunk = offset % _chunk_size;
+		const Size bytes = length < _chunk_size - in_chunk ? length : _chunk_size - in_chunk;
+		std::memcpy(out, chunk.data + in_chunk, bytes);
+		out += bytes;
+		offset += bytes;
+		length -= bytes;
+	}
+}
+
+void ChunkSpan::write(Size offset, const void *src, Size length) {
+	assert(offset + length <= this->size_bytes());
+	if (Byte *base = this->contiguous_data()) {
+		std::memcpy(base + offset, src, length);
+		for (Size idx = offset / _chunk_size; length > 0 && idx <= (offset + length - 1) / _chunk_size; ++idx) {
+			chunks[idx]->mark_dirty();
+		}
+		return ;
+	}
+
+	const Byte *in = (const Byte *)src;
+	while (length > 0) {
+		Chunk &chunk = *chunks[offset / _chunk_size];
+		const Size in_chunk = offset % _chunk_size;
+		const Size bytes = length < _chunk_size - in_chunk ? length : _chunk_size - in_chunk;
+		chunk.memcpy(chunk.data + in_chunk, in, bytes);
+		in += bytes;
+		offset += bytes;
+		length -= bytes;
+	}
+}
+
+void ChunkSpan::fill(Size offset, Byte value, Size length) {
+	assert(offset + length <= this->size_bytes());
+	while (length > 0) {
+		Chunk &chunk = *chunks[offset / _chunk_size];
+		const Size in_chunk = offset % _chunk_size;
+		const Size bytes = length < _chunk_size - in_chunk ? length : _chunk_size - in_chunk;
+		chunk.memset(chunk.data + in_chunk, value, bytes);
+		offset += bytes;
+		length -= bytes;
+	}
+}
+
+void ChunkSpan::copy_chunks(Size dst_idx, const ChunkSpan &src, Size src_idx, Size chunk_count) {
+	assert(src._chunk_size == _chunk_size);
+	assert(dst_idx + chunk_count <= chunks.size() && src_idx + chunk_count <= src.chunks.size());
+	for (Size idx = 0; idx < chunk_count; ++idx) {
+		Chunk &to = *chunks[dst_idx + idx];
+		to.memcpy(to.data, src.chunks[src_idx + idx]->data, _chunk_size);
+	}
+}
+
+void ChunkSpan::release() {
+	chunks.clear();
+}
+
+/*
+	Disk
+*/
+
+Disk::Disk(Size size_chunk_ctr, Size chunk_size_ctr, int flags, int fd, bool zero_copy) 
+	: Disk(size_chunk_ctr, chunk_size_ctr, 
+		std::unique_ptr<DiskBackend>(new MmapBackend(size_chunk_ctr * chunk_size_ctr, flags, fd)), 
+		zero_copy) {
+}
+
+Disk::Disk(Size size_chunk_ctr, Size chunk_size_ctr, std::unique_ptr<DiskBackend> backend, bool zero_copy) 
+	: _chunk_size(chunk_size_ctr), _size_chunks(size_chunk_ctr), _zero_copy(zero_copy), 
+	backend(std::move(backend)) {
+
+	if (this->backend->size_bytes() < this->size_bytes()) {
+		throw DiskException("the disk backend is smaller than the requested disk size");
+	}
+	if (this->chunk_size() % this->backend->alignment() != 0) {
+		throw DiskException("the chunk size is not a multiple of the disk backend's alignment");
 	}
 
+	this->data = this->backend->mapping();
+	if (this->_zero_copy && this->data == nullptr) {
+		throw DiskException(std::string("zero copy mode needs a memory mapped backend, not ") + this->backend->name());
+	}
+
+	// chunks of a page or more start on a page, smaller ones are packed on 
+	// cache lines rather than each wasting most of a page
+	const size_t page_size = sysconf(_SC_PAGESIZE);
+	this->buffer_alignment = this->chunk_size() >= page_size ? page_size : 64;
+	if (this->buffer_alignment < this->backend->alignment()) 
+		this->buffer_alignment = this->backend->alignment();
+
+	this->pool = std::unique_ptr<ChunkPool>(new ChunkPool(this->chunk_size(), this->buffer_alignment));
+	this->configure_cache(DEFAULT_CACHE_BUDGET_BYTES);
+}
+
+void Disk::zero_fill() {
+	this->backend->zero_fill();
+}
+
+const char *Disk::backend_name() const {
+	return this->backend->name();
+}
+
+ChunkRef Disk::new_chunk(Size chunk_idx) {
+	// get the buffer first, a chunk must never exist without its data
+	Byte *buffer = this->_zero_copy ? this->data + chunk_idx * this->chunk_size() : this->pool->allocate();
+
 	// initialize the new chunk
-	std::shared_ptr<Chunk> chunk(new Chunk);
+	ChunkRef chunk(new Chunk);
 	chunk->parent = this; 
 	chunk->size_bytes = this->chunk_size();
 	chunk->chunk_idx = chunk_idx;
+	chunk->data = buffer;
+
+	return chunk;
+}
+
+void Disk::read_chunk(Chunk &chunk) {
+	std::shared_ptr<ChunkExtents> extents = std::atomic_load(&this->extents);
+	Size extent_offset = 0, extent_length = 0;
+	if (extents != nullptr && extents->extent(chunk.chunk_idx, extent_offset, extent_length)) {
+		this->read_extent(chunk, extent_offset, extent_length);
+	} else if (!this->_zero_copy) {
+		this->backend->read(chunk.chunk_idx * this->chunk_size(), chunk.data, this->chunk_size());
+	}
+	if (std::shared_ptr<ChunkChecksums> checksums = std::atomic_load(&this->checksums)) {
+		this->verify_checksum(*checksums, chunk);
+	}
+}
 
-	// chunk->data = this->data + chunk_idx * this->chunk_size();
-	chunk->data = new Byte[this->chunk_size() * 4];
-	chunk->memcpy(chunk->data, this->data + chunk_idx * this->chunk_size(), 
-		this->chunk_size());
+void Disk::finish_load(const std::vector<ChunkRef> &chunks, bool loaded) {
+	if (!loaded) {
+		// the entries go so that the next get reads the chunks again, anyone 
+		// waiting on these copies tries again on their own
+		for (const ChunkRef &chunk : chunks) {
+			ChunkShard &shard = this->shard_for(chunk->chunk_idx);
+			std::lock_guard<std::recursive_mutex> g(shard.lock); // acquire the lock
+			auto ref = shard.chunks.find(chunk->chunk_idx);
+			if (ref != shard.chunks.end() && ref->second == chunk.get()) {
+				shard.chunks.erase(ref);
+			}
+			chunk->load_failed = true;
+		}
+	}
 
-	// store it into the chunk cache so that it can be shared if requested again
-	this->chunk_cache.put(chunk_idx, chunk); 
-	return std::move(chunk);
+	{
+		std::lock_guard<std::mutex> g(this->load_lock);
+		for (const ChunkRef &chunk : chunks) {
+			chunk->loading = false;
+		}
+	}
+	this->load_cv.notify_all();
 }
 
-void Disk::flush_chunk(const Chunk& chunk) {
-	std::lock_guard<std::recursive_mutex> g(lock); // acquire the lock
+bool Disk::wait_loaded(Chunk &chunk) {
+	if (chunk.loading.load(std::memory_order_acquire)) {
+		std::unique_lock<std::mutex> l(this->load_lock);
+		this->load_cv.wait(l, [&chunk]() {
+			return !chunk.loading;
+		});
+	}
+	return !chunk.load_failed;
+}
+
+ChunkRef Disk::get_chunk(Size chunk_idx) {
+	if (chunk_idx >= this->size_chunks()) {
+		throw DiskException("chunk index out of bounds");
+	}
+
+	ChunkShard &shard = this->shard_for(chunk_idx);
+	for (;;) {
+		ChunkRef chunk = nullptr;
+		bool load = false;
+		{
+			std::lock_guard<std::recursive_mutex> g(shard.lock); // acquire the lock
+
+			auto ref = shard.chunks.find(chunk_idx);
+			if (ref == shard.chunks.end()) {
+				shard.misses++;
+				// store it into the chunk cache before it is read in so that the read 
+				// happens outside of the lock, anyone asking for it meanwhile waits 
+				// for this load instead of starting another
+				chunk = this->new_chunk(chunk_idx);
+				chunk->loading = true;
+				shard.chunks[chunk_idx] = chunk.get();
+				load = true;
+			} else if ((chunk = ChunkRef::acquire(ref->second))) {
+				this->note_hit(shard, *chunk);
+				shard.resident.touch(chunk_idx);
+			}
+		}
+
+		if (load) {
+			try {
+				this->read_chunk(*chunk);
+			} catch (...) {
+				this->finish_load({chunk}, false);
+				throw;
+			}
+
+			// keep it resident, the victim (if any) is written back when it is 
+			// released, outside of the lock, provided no one else still holds it
+			ChunkRef victim = nullptr;
+			{
+				std::lock_guard<std::recursive_mutex> g(shard.lock); // acquire the lock
+				victim = shard.resident.insert(chunk_idx, chunk);
+			}
+			this->finish_load({chunk}, true);
+			return chunk;
+		}
+
+		if (chunk == nullptr) {
+			// the last reference was just dropped and the chunk is still being 
+			// written back, loading it now would read stale data so back off 
+			// until its release removes the entry
+			std::this_thread::yield();
+			continue ;
+		}
+
+		if (this->wait_loaded(*chunk)) 
+			return chunk;
+		// whoever loaded it failed to, try again (most likely running into the same error)
+	}
+}
+
+std::vector<ChunkRef> Disk::get_chunks(const std::vector<Size> &chunk_idxs) {
+	std::array<bool, CHUNK_CACHE_SHARDS> involved;
+	involved.fill(false);
+	for (Size chunk_idx : chunk_idxs) {
+		if (chunk_idx >= this->size_chunks()) {
+			throw DiskException("chunk index out of bounds");
+		}
+		involved[chunk_idx % CHUNK_CACHE_SHARDS] = true;
+	}
+
+	std::vector<ChunkRef> chunks;
+	// the chunks this batch reads in, and where in chunks those are that 
+	// someone else is reading in
+	std::vector<ChunkRef> loaded;
+	std::vector<size_t> waiting;
+
+	for (;;) {
+		// the shards of the batch are locked while its chunks are looked up and 
+		// the missing ones are cached (but not while they are read), always taking 
+		// them in ascending order keeps two batches from deadlocking on each other
+		std::vector<std::unique_lock<std::recursive_mutex>> locks;
+		for (size_t idx = 0; idx < CHUNK_CACHE_SHARDS; ++idx) {
+			if (involved[idx]) 
+				locks.emplace_back(shards[idx].lock);
+		}
+
+		// a chunk that is still being written back can not be loaded yet (see 
+		// get_chunk), the cached chunks are taken before anything is changed so 
+		// backing off only means dropping the locks
+		chunks.assign(chunk_idxs.size(), nullptr);
+		bool release_in_flight = false;
+		for (size_t pos = 0; pos < chunk_idxs.size(); ++pos) {
+			ChunkShard &shard = this->shard_for(chunk_idxs[pos]);
+			auto ref = shard.chunks.find(chunk_idxs[pos]);
+			if (ref == shard.chunks.end()) 
+				continue ;
+			chunks[pos] = ChunkRef::acquire(ref->second);
+			if (chunks[pos] == nullptr) {
+				release_in_flight = true;
+				break ;
+			}
+		}
+		if (release_in_flight) {
+			locks.clear();
+			chunks.clear();
+			std::this_thread::yield();
+			continue ;
+		}
 
+		for (size_t pos = 0; pos < chunk_idxs.size(); ++pos) {
+			const Size chunk_idx = chunk_idxs[pos];
+			ChunkShard &shard = this->shard_for(chunk_idx);
+			if (chunks[pos] == nullptr) {
+				// unless it came up earlier in this batch
+				auto ref = shard.chunks.find(chunk_idx);
+				if (ref != shard.chunks.end()) 
+					chunks[pos] = ChunkRef::acquire(ref->second);
+			}
+			if (chunks[pos] != nullptr) {
+				this->note_hit(shard, *chunks[pos]);
+				shard.resident.touch(chunk_idx);
+				if (chunks[pos]->loading) 
+					waiting.push_back(pos);
+				continue ;
+			}
+
+			shard.misses++;
+			ChunkRef chunk = this->new_chunk(chunk_idx);
+			chunk->loading = true;
+			shard.chunks[chunk_idx] = chunk.get();
+			loaded.push_back(chunk);
+			chunks[pos] = std::move(chunk);
+		}
+		break ;
+	}
+
+	if (!loaded.empty()) {
+		std::vector<DiskBackend::IORequest> requests;
+		std::shared_ptr<ChunkExtents> extents = std::atomic_load(&this->extents);
+		struct ExtentRead {
+			Chunk *chunk;
+			Size offset;
+			Size length;
+		};
+		std::vector<ExtentRead> extent_reads;
+		try {
+			for (ChunkRef &chunk : loaded) {
+				Size extent_offset = 0, extent_length = 0;
+				if (extents != nullptr && extents->extent(chunk->chunk_idx, extent_offset, extent_length)) {
+					extent_reads.push_back(ExtentRead{chunk.get(), extent_offset, extent_length});
+				} else if (!this->_zero_copy) {
+					requests.push_back(DiskBackend::IORequest{chunk->chunk_idx * this->chunk_size(), chunk->data, this->chunk_size()});
+				}
+			}
+
+			this->backend->read_batch(requests);
+			// compressed chunks are read one by one, each from its own extent
+			for (const ExtentRead &read : extent_reads) {
+				this->read_extent(*read.chunk, read.offset, read.length);
+			}
+			if (std::shared_ptr<ChunkChecksums> checksums = std::atomic_load(&this->checksums)) {
+				for (ChunkRef &chunk : loaded) {
+					this->verify_checksum(*checksums, *chunk);
+				}
+			}
+		} catch (...) {
+			this->finish_load(loaded, false);
+			throw;
+		}
+
+		std::vector<ChunkRef> victims;
+		for (ChunkRef &chunk : loaded) {
+			ChunkShard &shard = this->shard_for(chunk->chunk_idx);
+			std::lock_guard<std::recursive_mutex> g(shard.lock); // acquire the lock
+			victims.push_back(shard.resident.insert(chunk->chunk_idx, chunk));
+		}
+		this->finish_load(loaded, true);
+		// the victims are released here, outside of the locks
+	}
+
+	for (size_t pos : waiting) {
+		if (!this->wait_loaded(*chunks[pos])) 
+			chunks[pos] = this->get_chunk(chunk_idxs[pos]);
+	}
+	return chunks;
+}
+
+ChunkSpan Disk::get_span(Size first_chunk, Size chunk_count) {
+	if (first_chunk > this->size_chunks() || chunk_count > this->size_chunks() - first_chunk) {
+		throw DiskException("span out of bounds");
+	}
+
+	std::vector<Size> chunk_idxs;
+	chunk_idxs.reserve(chunk_count);
+	for (Size chunk_idx = first_chunk; chunk_idx < first_chunk + chunk_count; ++chunk_idx) {
+		chunk_idxs.push_back(chunk_idx);
+	}
+	return ChunkSpan(first_chunk, this->chunk_size(), this->get_chunks(chunk_idxs));
+}
+
+// adds [first_chunk, end_chunk) to runs keyed by their first chunk and mapping 
+// to one past their last
+static void add_run(std::map<Size, Size> &runs, Size first_chunk, Size end_chunk) {
+	// swallow the run this one starts in or right after, and every run it reaches
+	auto run = runs.upper_bound(first_chunk);
+	if (run != runs.begin() && std::prev(run)->second >= first_chunk) {
+		run = std::prev(run);
+		first_chunk = run->first;
+		if (run->second > end_chunk) 
+			end_chunk = run->second;
+		run = runs.erase(run);
+	}
+	while (run != runs.end() && run->first <= end_chunk) {
+		if (run->second > end_chunk) 
+			end_chunk = run->second;
+		run = runs.erase(run);
+	}
+	runs[first_chunk] = end_chunk;
+}
+
+// takes [first_chunk, end_chunk) out of the runs
+static void cut_run(std::map<Size, Size> &runs, Size first_chunk, Size end_chunk) {
+	auto run = runs.upper_bound(first_chunk);
+	if (run != runs.begin() && std::prev(run)->second > first_chunk) 
+		run = std::prev(run);
+	while (run != runs.end() && run->first < end_chunk) {
+		const Size run_first = run->first;
+		const Size run_end = run->second;
+		run = runs.erase(run);
+		if (run_first < first_chunk) 
+			runs[run_first] = first_chunk;
+		if (run_end > end_chunk) 
+			runs[end_chunk] = run_end;
+	}
+}
+
+void Disk::write_back(ChunkShard &shard, Chunk& chunk) {
 	assert(chunk.size_bytes == this->chunk_size());
 	assert(chunk.parent == this);
-	
-	std::memcpy(this->data + chunk.chunk_idx * this->chunk_size(), 
-		chunk.data, this->chunk_size());
 
-	size_t chunk_addr = (size_t)chunk.data;
-	chunk_addr &= ~(this->_mempage_size - 1);
+	chunk.dirty = false;
+	shard.writebacks++;
+
+	// the checksum and the write are made from one copy, taken once the chunk 
+	// is clean. a change made meanwhile dirties it again, what is written still 
+	// matches its checksum. in zero copy mode the chunk is its own mapping, the 
+	// backend sees that and does not copy it
+	const Byte *source = chunk.data;
+	std::unique_ptr<Byte, decltype(&free)> staging(nullptr, &free);
+	if (!this->_zero_copy) {
+		void *buffer = nullptr;
+		if (posix_memalign(&buffer, this->buffer_alignment, this->chunk_size()) != 0) {
+			chunk.dirty = true;
+			throw DiskException("failed to allocate a buffer to write back a chunk");
+		}
+		staging.reset((Byte *)buffer);
+		std::memcpy(buffer, chunk.data, this->chunk_size());
+		source = staging.get();
+	}
+
+	// the chunk the checksum is recorded in is left to go out on its own
+	std::shared_ptr<ChunkChecksums> checksums = std::atomic_load(&this->checksums);
+	if (checksums != nullptr && checksums->covers(chunk.chunk_idx)) {
+		checksums->record(chunk.chunk_idx, crc32c(source, this->chunk_size()));
+		this->checksums_computed++;
+	}
+
+	this->keep_from_discard(chunk.chunk_idx, chunk.chunk_idx + 1);
+	this->backend->write(chunk.chunk_idx * this->chunk_size(), source, this->chunk_size());
+
+	std::lock_guard<std::mutex> g(this->sync_lock);
+	this->mark_unsynced(chunk.chunk_idx, chunk.chunk_idx + 1);
+}
+
+void Disk::record_checksums(ChunkChecksums &checksums, const std::vector<Chunk *> &chunks, 
+	const std::vector<const Byte *> &copies, std::vector<Chunk *> &stored_in) {
+	for (size_t idx = 0; idx < chunks.size(); ++idx) {
+		if (!checksums.covers(chunks[idx]->chunk_idx)) 
+			continue ;
+		Chunk *stored = checksums.record(chunks[idx]->chunk_idx, crc32c(copies[idx], this->chunk_size()));
+		this->checksums_computed++;
+		if (stored != nullptr && stored->dirty && 
+			std::find(stored_in.begin(), stored_in.end(), stored) == stored_in.end()) 
+			stored_in.push_back(stored);
+	}
+	// the chunks the checksums went into are only taken once all are recorded
+	for (Chunk *chunk : stored_in) {
+		chunk->dirty = false;
+	}
+}
+
+void Disk::write_back_batch(std::vector<Chunk *> &chunks) {
+	// a chunk that went into a compressed extent since the caller picked it 
+	// is no longer the batch's to write, see write_through
+	std::lock_guard<std::mutex> wt(this->write_through_lock);
+	chunks.erase(std::remove_if(chunks.begin(), chunks.end(), [](const Chunk *chunk) {
+		return chunk->compressed.load();
+	}), chunks.end());
+
+	// in ascending order the device sees one sweep rather than random writes
+	auto by_idx = [](const Chunk *a, const Chunk *b) {
+		return a->chunk_idx < b->chunk_idx;
+	};
+	std::sort(chunks.begin(), chunks.end(), by_idx);
+	chunks.erase(std::unique(chunks.begin(), chunks.end()), chunks.end());
+
+	// cleared before the data is copied (as in write_back), a change made 
+	// meanwhile dirties the chunk again
+	for (Chunk *chunk : chunks) {
+		assert(chunk->parent == this);
+		chunk->dirty = false;
+	}
+
+	// the checksums are computed from and the writes made of one copy of each 
+	// chunk, so a chunk that is changed while the batch is underway can not 
+	// land on the disk torn under a checksum of something else. in zero copy 
+	// mode the chunks are the mapping itself and are written as they are
+	std::vector<std::unique_ptr<Byte, decltype(&free)>> staging;
+	auto copy_chunks = [&](const std::vector<Chunk *> &from, std::vector<const Byte *> &copies) {
+		if (this->_zero_copy || from.empty()) {
+			for (const Chunk *chunk : from) 
+				copies.push_back(chunk->data);
+			return ;
+		}
+		void *buffer = nullptr;
+		if (posix_memalign(&buffer, this->buffer_alignment, from.size() * this->chunk_size()) != 0) {
+			throw DiskException("failed to allocate a buffer to write back chunks");
+		}
+		staging.emplace_back((Byte *)buffer, &free);
+		for (size_t idx = 0; idx < from.size(); ++idx) {
+			Byte *copy = (Byte *)buffer + idx * this->chunk_size();
+			std::memcpy(copy, from[idx]->data, this->chunk_size());
+			copies.push_back(copy);
+		}
+	};
 
-	size_t page_count = this->_chunk_size / this->_mempage_size;
-	if (this->_chunk_size % this->_mempage_size != 0) 
-		page_count++;
+	std::vector<std::pair<Chunk *, const Byte *>> batch;
+	std::vector<Chunk *> stored_in;
+	try {
+		std::vector<const Byte *> copies;
+		copy_chunks(chunks, copies);
 
-	if (this->fd != -1) {
-		int sync_retval = msync((void *)chunk_addr, page_count * this->_mempage_size, MS_ASYNC);
-		if (sync_retval != 0) {
-			// char buff[1024];
-			// fprintf(stdout, "msync failed to synchronize the chunk segment with the disk, error code %d for chunk %d\n"
-			// 	"\tmessage: %s\n", sync_retval, chunk.chunk_idx, strerror(errno));
-			throw DiskException("failed to msync the chunk\n");
-		} else {
-			// fprintf(stdout, "msync successful\n");
+		// the checksums are stored before anything is written, so the chunks 
+		// they are stored in can go out with the batch. one that was in it 
+		// already is copied again, the first copy lacks the checksums
+		if (std::shared_ptr<ChunkChecksums> checksums = std::atomic_load(&this->checksums)) {
+			this->record_checksums(*checksums, chunks, copies, stored_in);
 		}
+		std::vector<const Byte *> stored_in_copies;
+		copy_chunks(stored_in, stored_in_copies);
+
+		for (size_t idx = 0; idx < chunks.size(); ++idx) {
+			batch.emplace_back(chunks[idx], copies[idx]);
+		}
+		for (size_t idx = 0; idx < stored_in.size(); ++idx) {
+			auto found = std::lower_bound(chunks.begin(), chunks.end(), stored_in[idx], by_idx);
+			if (found != chunks.end() && *found == stored_in[idx]) {
+				batch[found - chunks.begin()].second = stored_in_copies[idx];
+			} else {
+				batch.emplace_back(stored_in[idx], stored_in_copies[idx]);
+				chunks.push_back(stored_in[idx]);
+			}
+		}
+	} catch (const DiskException &e) {
+		for (Chunk *chunk : chunks) {
+			chunk->dirty = true;
+		}
+		for (Chunk *chunk : stored_in) {
+			chunk->dirty = true;
+		}
+		throw;
+	}
+	std::sort(batch.begin(), batch.end(), [&](const std::pair<Chunk *, const Byte *> &a, 
+		const std::pair<Chunk *, const Byte *> &b) {
+		return by_idx(a.first, b.first);
+	});
+
+	// writing into a mapping is only a copy, there is nothing to gain from merging
+	const bool coalesce = this->data == nullptr;
+
+	std::vector<DiskBackend::IORequest> requests;
+	size_t run = 0;
+	while (run < batch.size()) {
+		size_t end = run + 1;
+		bool adjacent = true;
+		while (coalesce && end < batch.size() && end - run < WRITEBACK_MAX_RUN_CHUNKS && 
+			batch[end].first->chunk_idx == batch[end - 1].first->chunk_idx + 1) {
+			adjacent = adjacent && batch[end].second == batch[end - 1].second + this->chunk_size();
+			end++;
+		}
+
+		for (size_t idx = run; idx < end; ++idx) {
+			this->shard_for(batch[idx].first->chunk_idx).writebacks++;
+		}
+
+		const Size offset = batch[run].first->chunk_idx * this->chunk_size();
+		const Byte *source = batch[run].second;
+		if (!adjacent) {
+			// a chunk a checksum was stored in was copied apart from the others
+			void *buffer = nullptr;
+			if (posix_memalign(&buffer, this->buffer_alignment, (end - run) * this->chunk_size()) != 0) {
+				for (Chunk *chunk : chunks) {
+					chunk->dirty = true;
+				}
+				throw DiskException("failed to allocate a buffer to write back a run of chunks");
+			}
+			staging.emplace_back((Byte *)buffer, &free);
+			for (size_t idx = run; idx < end; ++idx) {
+				std::memcpy((Byte *)buffer + (idx - run) * this->chunk_size(), batch[idx].second, this->chunk_size());
+			}
+			source = (Byte *)buffer;
+		}
+		requests.push_back(DiskBackend::IORequest{offset, const_cast<Byte *>(source), (end - run) * this->chunk_size()});
+		if (end - run > 1) 
+			this->writeback_runs++;
+		run = end;
+	}
+	try {
+		for (const DiskBackend::IORequest &request : requests) {
+			this->keep_from_discard(request.offset / this->chunk_size(), 
+				(request.offset + request.length) / this->chunk_size());
+		}
+		this->backend->write_batch(requests);
+	} catch (const DiskException &e) {
+		// none of them is known to be on the disk, they must be written again
+		for (Chunk *chunk : chunks) {
+			chunk->dirty = true;
+		}
+		throw;
+	}
+
+	std::lock_guard<std::mutex> g(this->sync_lock);
+	for (Chunk *chunk : chunks) {
+		this->mark_unsynced(chunk->chunk_idx, chunk->chunk_idx + 1);
+	}
+}
+
+void Disk::mark_unsynced(Size first_chunk, Size end_chunk) {
+	add_run(this->unsynced, first_chunk, end_chunk);
+}
+
+void Disk::verify_checksum(ChunkChecksums &checksums, const Chunk &chunk) {
+	if (!checksums.covers(chunk.chunk_idx)) 
+		return ;
+	const uint32_t expected = checksums.checksum(chunk.chunk_idx);
+	if (expected == 0) 
+		return ;
+
+	this->checksums_verified++;
+	if (crc32c(chunk.data, this->chunk_size()) != expected) {
+		this->checksum_failures++;
+		throw DiskException("checksum mismatch in chunk " + std::to_string(chunk.chunk_idx) + 
+			", it is not what was written to the disk");
+	}
+}
+
+void Disk::read_extent(Chunk &chunk, Size offset, Size length) {
+	assert(!this->_zero_copy);
+	if (length == 0 || length > this->chunk_size() || offset + length > this->size_bytes()) {
+		throw DiskException("bad compressed extent for chunk " + std::to_string(chunk.chunk_idx));
 	}
+
+	// the extent is read as the whole chunks it lies in, any backend can do that
+	const Size first = offset / this->chunk_size();
+	const Size end = (offset + length + this->chunk_size() - 1) / this->chunk_size();
+	void *buffer = nullptr;
+	if (posix_memalign(&buffer, this->buffer_alignment, (end - first) * this->chunk_size()) != 0) {
+		throw DiskException("failed to allocate a buffer to read a compressed extent");
+	}
+	std::unique_ptr<Byte, decltype(&free)> staging((Byte *)buffer, &free);
+	this->backend->read(first * this->chunk_size(), staging.get(), (end - first) * this->chunk_size());
+
+	const Byte *extent = staging.get() + (offset - first * this->chunk_size());
+	if (length == this->chunk_size()) {
+		// it did not compress, the chunk is kept as it is
+		std::memcpy(chunk.data, extent, length);
+	} else if (!lz4_decompress(extent, length, chunk.data, this->chunk_size())) {
+		throw DiskException("the compressed extent of chunk " + std::to_string(chunk.chunk_idx) + " is corrupt");
+	}
+	chunk.compressed = true;
+	this->extent_reads++;
+	this->extent_bytes_read += length;
+}
+
+void Disk::expand_compressed(Chunk &chunk) {
+	std::shared_ptr<ChunkExtents> extents = std::atomic_load(&this->extents);
+	if (extents != nullptr) {
+		extents->expand(chunk.chunk_idx);
+		this->expansions++;
+	}
+	chunk.compressed = false;
+}
+
+void Disk::set_extents(std::shared_ptr<ChunkExtents> extents) {
+	if (extents != nullptr && this->_zero_copy) {
+		throw DiskException("compressed chunks can not be read in zero copy mode");
+	}
+	std::atomic_store(&this->extents, extents);
+}
+
+void Disk::write_through(Size first_chunk, Size chunk_count, const Byte *data) {
+	if (first_chunk > this->size_chunks() || chunk_count > this->size_chunks() - first_chunk) {
+		throw DiskException("write through range out of bounds");
+	}
+
+	// a copy that was dirty could be on its way out right now. a single chunk 
+	// is written back under its shard lock, a batch under write_through_lock 
+	// and without the chunks flagged compressed, so whichever of them comes 
+	// first, the plain copy never lands last
+	std::lock_guard<std::mutex> g(this->write_through_lock);
+	std::array<bool, CHUNK_CACHE_SHARDS> involved;
+	involved.fill(false);
+	for (Size chunk_idx = first_chunk; chunk_idx < first_chunk + chunk_count && 
+		chunk_idx < first_chunk + CHUNK_CACHE_SHARDS; ++chunk_idx) {
+		involved[chunk_idx % CHUNK_CACHE_SHARDS] = true;
+	}
+	std::vector<std::unique_lock<std::recursive_mutex>> locks;
+	for (size_t idx = 0; idx < CHUNK_CACHE_SHARDS; ++idx) {
+		if (involved[idx]) 
+			locks.emplace_back(shards[idx].lock);
+	}
+
+	// the backend may need the buffer aligned
+	void *buffer = nullptr;
+	if (posix_memalign(&buffer, this->buffer_alignment, chunk_count * this->chunk_size()) != 0) {
+		throw DiskException("failed to allocate a buffer to write through");
+	}
+	std::unique_ptr<Byte, decltype(&free)> staging((Byte *)buffer, &free);
+	std::memcpy(staging.get(), data, chunk_count * this->chunk_size());
+	this->keep_from_discard(first_chunk, first_chunk + chunk_count);
+	this->backend->write(first_chunk * this->chunk_size(), staging.get(), chunk_count * this->chunk_size());
+
+	std::lock_guard<std::mutex> s(this->sync_lock);
+	this->mark_unsynced(first_chunk, first_chunk + chunk_count);
+}
+
+void Disk::set_checksums(std::shared_ptr<ChunkChecksums> checksums) {
+	std::atomic_store(&this->checksums, checksums);
+}
+
+void Disk::flush_chunk(Chunk& chunk) {
+	ChunkShard &shard = this->shard_for(chunk.chunk_idx);
+	std::lock_guard<std::recursive_mutex> g(shard.lock); // acquire the lock
+	this->write_back(shard, chunk);
+}
+
+void Disk::prefetch(const std::vector<Size> &chunk_idxs) {
+	if (chunk_idxs.empty()) 
+		return ;
+	for (Size chunk_idx : chunk_idxs) {
+		if (chunk_idx >= this->size_chunks()) {
+			throw DiskException("chunk index out of bounds");
+		}
+	}
+
+	if (this->data != nullptr) {
+		// get the kernel reading the pages in now, one call per run of adjacent chunks
+		const size_t page_size = sysconf(_SC_PAGESIZE);
+		size_t run = 0;
+		while (run < chunk_idxs.size()) {
+			size_t end = run + 1;
+			while (end < chunk_idxs.size() && chunk_idxs[end] == chunk_idxs[end - 1] + 1) 
+				end++;
+
+			size_t start = (size_t)(this->data + chunk_idxs[run] * this->chunk_size());
+			size_t stop = (size_t)(this->data + (chunk_idxs[end - 1] + 1) * this->chunk_size());
+			start &= ~(page_size - 1);
+			madvise((void *)start, stop - start, MADV_WILLNEED);
+			run = end;
+		}
+	}
+
+	// without a cache anything read ahead would be dropped again at once
+	if (this->cache_capacity_chunks == 0) 
+		return ;
+
+	std::lock_guard<std::mutex> g(this->readahead_lock);
+	if (this->readahead_stop || this->readahead_queue.size() >= READAHEAD_QUEUE_LIMIT) 
+		return ;
+	if (!this->readahead_thread.joinable()) {
+		this->readahead_thread = std::thread(&Disk::readahead_worker, this);
+	}
+	this->readahead_queue.push_back(chunk_idxs);
+	this->readahead_cv.notify_one();
+}
+
+void Disk::wait_for_readahead() {
+	std::unique_lock<std::mutex> l(this->readahead_lock);
+	this->readahead_idle_cv.wait(l, [this]() {
+		return this->readahead_queue.empty() && !this->readahead_busy;
+	});
+}
+
+void Disk::readahead_worker() {
+	std::unique_lock<std::mutex> l(this->readahead_lock);
+	for (;;) {
+		this->readahead_cv.wait(l, [this]() {
+			return this->readahead_stop || !this->readahead_queue.empty();
+		});
+		if (this->readahead_stop) 
+			break ;
+
+		std::vector<Size> chunk_idxs = std::move(this->readahead_queue.front());
+		this->readahead_queue.pop_front();
+		this->readahead_busy = true;
+		l.unlock();
+
+		try {
+			this->load_prefetched(chunk_idxs);
+		} catch (const DiskException &e) {
+			// the reader will run into the error itself if it gets that far
+		}
+
+		l.lock();
+		this->readahead_busy = false;
+		this->readahead_idle_cv.notify_all();
+	}
+
+	// whatever is still queued is never going to be loaded
+	this->readahead_queue.clear();
+	this->readahead_idle_cv.notify_all();
+}
+
+void Disk::load_prefetched(const std::vector<Size> &chunk_idxs) {
+	// only what is not in memory already, those chunks were not read ahead
+	std::vector<Size> missing;
+	for (Size chunk_idx : chunk_idxs) {
+		ChunkShard &shard = this->shard_for(chunk_idx);
+		std::lock_guard<std::recursive_mutex> g(shard.lock); // acquire the lock
+		if (shard.chunks.find(chunk_idx) == shard.chunks.end()) 
+			missing.push_back(chunk_idx);
+	}
+	if (missing.empty()) 
+		return ;
+
+	// the chunks stay resident once these references are dropped
+	std::vector<ChunkRef> chunks = this->get_chunks(missing);
+	for (ChunkRef &chunk : chunks) {
+		chunk->prefetched = true;
+	}
+	this->readahead_chunks += chunks.size();
+}
+
+void Disk::advise(Size first_chunk, Size chunk_count, AccessPattern pattern) {
+	if (first_chunk > this->size_chunks() || chunk_count > this->size_chunks() - first_chunk) {
+		throw DiskException("advise range out of bounds");
+	}
+	this->backend->advise(first_chunk * this->chunk_size(), chunk_count * this->chunk_size(), pattern);
+}
+
+void Disk::pin(Size first_chunk, Size chunk_count, bool lock_pages) {
+	if (first_chunk > this->size_chunks() || chunk_count > this->size_chunks() - first_chunk) {
+		throw DiskException("pin range out of bounds");
+	}
+
+	// locking populates the pages, so the loads below do not fault
+	const bool locked = lock_pages && 
+		this->backend->lock_in_memory(first_chunk * this->chunk_size(), chunk_count * this->chunk_size());
+
+	std::vector<Size> chunk_idxs;
+	for (Size chunk_idx = first_chunk; chunk_idx < first_chunk + chunk_count; ++chunk_idx) {
+		chunk_idxs.push_back(chunk_idx);
+	}
+	std::vector<ChunkRef> chunks = this->get_chunks(chunk_idxs);
+
+	std::lock_guard<std::mutex> g(this->pin_lock);
+	for (ChunkRef &chunk : chunks) {
+		this->pinned.emplace(chunk->chunk_idx, std::move(chunk));
+	}
+	if (locked) 
+		this->locked_bytes += chunk_count * this->chunk_size();
+}
+
+void Disk::unpin_all() {
+	std::unordered_map<Size, ChunkRef> unpinned;
+	{
+		std::lock_guard<std::mutex> g(this->pin_lock);
+		unpinned.swap(this->pinned);
+		this->locked_bytes = 0;
+	}
+	this->backend->unlock_from_memory();
+
+	// the chunks are released (and written back when dirty) here, outside of the lock
+}
+
+void Disk::release_chunk(Chunk& chunk) {
+	ChunkShard &shard = this->shard_for(chunk.chunk_idx);
+	std::lock_guard<std::recursive_mutex> g(shard.lock); // acquire the lock
+
+	// this runs as the chunk is deleted, a failed write has no one to be thrown 
+	// at. what the chunk held is lost, the next sync reports it
+	if (chunk.dirty) {
+		try {
+			this->write_back(shard, chunk);
+		} catch (const DiskException &e) {
+			this->defer_error("writing back chunk " + std::to_string(chunk.chunk_idx) + 
+				" as it was released failed: " + e.message);
+		}
+	}
+
+	// only now that the chunk is safely on the disk can get_chunk load it again. 
+	// there is no entry if loading the chunk failed before it was cached
+	auto ref = shard.chunks.find(chunk.chunk_idx);
+	if (ref != shard.chunks.end() && ref->second == &chunk) {
+		shard.chunks.erase(ref);
+	}
+}
+
+void Disk::note_dirtied() {
+	const Size threshold = this->writeback_wake_threshold;
+	// only the one crossing the threshold wakes the thread, not every one after it
+	if (threshold != 0 && ++this->dirtied_since_pass == threshold) {
+		std::lock_guard<std::mutex> g(this->writeback_lock);
+		this->writeback_kicked = true;
+		this->writeback_cv.notify_one();
+	}
+}
+
+void Disk::configure_writeback(unsigned dirty_expire_ms, unsigned dirty_ratio_percent, unsigned interval_ms) {
+	if (dirty_ratio_percent > 100 || interval_ms == 0) {
+		throw DiskException("the dirty ratio must be a percentage and the writeback interval not 0");
+	}
+
+	std::lock_guard<std::mutex> g(this->writeback_lock);
+	this->dirty_expire = std::chrono::milliseconds(dirty_expire_ms);
+	this->dirty_ratio_percent = dirty_ratio_percent;
+	this->writeback_interval = std::chrono::milliseconds(interval_ms);
+	this->writeback_wake_threshold = 1; // the first pass works out the real threshold
+	if (!this->writeback_thread.joinable()) {
+		this->writeback_stop = false;
+		this->writeback_thread = std::thread(&Disk::writeback_worker, this);
+	}
+	this->writeback_kicked = true;
+	this->writeback_cv.notify_one();
+}
+
+void Disk::stop_writeback() {
+	{
+		std::lock_guard<std::mutex> g(this->writeback_lock);
+		this->writeback_stop = true;
+		this->writeback_wake_threshold = 0;
+		this->writeback_cv.notify_one();
+	}
+	if (this->writeback_thread.joinable()) {
+		this->writeback_thread.join();
+	}
+}
+
+void Disk::writeback_worker() {
+	std::unique_lock<std::mutex> l(this->writeback_lock);
+	while (!this->writeback_stop) {
+		this->writeback_cv.wait_for(l, this->writeback_interval, [this]() {
+			return this->writeback_stop || this->writeback_kicked;
+		});
+		if (this->writeback_stop) 
+			break ;
+		this->writeback_kicked = false;
+		l.unlock();
+
+		try {
+			this->writeback_pass();
+		} catch (const DiskException &e) {
+			// the chunks that did not make it are dirty again and are retried next round
+			this->defer_error("background writeback failed: " + e.message);
+		}
+		try {
+			this->checkpoint_warm_set();
+		} catch (const DiskException &e) {
+			this->defer_error("saving the warm set failed: " + e.message);
+		}
+		try {
+			this->issue_discards(false);
+		} catch (const DiskException &e) {
+			// the range is left as it is, which costs nothing but the space
+			this->defer_error("discarding freed chunks failed: " + e.message);
+		}
+
+		l.lock();
+	}
+}
+
+void Disk::run_writeback() {
+	this->writeback_pass();
+	this->issue_discards(false);
+}
+
+void Disk::writeback_pass() {
+	IOClassScope scope(IOClass::WRITEBACK);
+	std::chrono::milliseconds expire;
+	unsigned ratio_percent;
+	{
+		std::lock_guard<std::mutex> g(this->writeback_lock);
+		expire = this->dirty_expire;
+		ratio_percent = this->dirty_ratio_percent;
+	}
+	this->dirtied_since_pass = 0;
+
+	// every dirty chunk in memory, resident or in use. holding a reference 
+	// keeps each from being released (and written back) underneath us, so the 
+	// shard locks are only held for the scan and not for the I/O. the time 
+	// each became dirty is taken once, it may change while they are sorted
+	const int64_t scanned_at = std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+	std::vector<std::pair<int64_t, ChunkRef>> dirty;
+	for (ChunkShard &shard : shards) {
+		std::lock_guard<std::recursive_mutex> g(shard.lock); // acquire the lock
+		for (auto &entry : shard.chunks) {
+			ChunkRef chunk = ChunkRef::acquire(entry.second);
+			if (chunk != nullptr && chunk->dirty) 
+				dirty.emplace_back(chunk->dirty_since.load(), std::move(chunk));
+		}
+	}
+
+	// the dirty ratio is measured against the buffer cache, above it the 
+	// oldest chunks go out until only half the limit is left dirty
+	const Size limit = this->cache_capacity_chunks * ratio_percent / 100;
+	const Size target = limit != 0 && dirty.size() > limit ? dirty.size() - limit / 2 : 0;
+
+	std::sort(dirty.begin(), dirty.end(), 
+		[](const std::pair<int64_t, ChunkRef> &a, const std::pair<int64_t, ChunkRef> &b) {
+		return a.first < b.first;
+	});
+	const int64_t expired_before = std::chrono::duration_cast<std::chrono::nanoseconds>(
+		(std::chrono::steady_clock::now() - expire).time_since_epoch()).count();
+
+	std::vector<Chunk *> to_write;
+	for (auto &entry : dirty) {
+		if (to_write.size() >= target && entry.first > expired_before) 
+			break ;
+		to_write.push_back(entry.second.get());
+	}
+
+	// the next pass is due early once this many more chunks have been dirtied, 
+	// without a cache to measure against only age counts
+	const Size still_dirty = dirty.size() - to_write.size();
+	{
+		std::lock_guard<std::mutex> g(this->writeback_lock);
+		if (!this->writeback_stop && this->writeback_thread.joinable()) {
+			if (limit == 0) 
+				this->writeback_wake_threshold = std::numeric_limits<Size>::max();
+			else 
+				this->writeback_wake_threshold = limit > still_dirty ? limit - still_dirty : 1;
+		}
+	}
+
+	std::vector<Chunk *> batch(to_write);
+	this->write_back_batch(batch);
+	this->writeback_passes++;
+	this->background_writebacks += to_write.size();
+
+	// whatever was dirtied before the scan and before the oldest chunk that 
+	// is still dirty is on the device now, so are the chunks moved out of a 
+	// range queued for discard by then
+	const int64_t left_since = to_write.size() < dirty.size() ? dirty[to_write.size()].first : scanned_at;
+	this->ready_discards(std::min(scanned_at, left_since));
+
+	// the references are dropped here, a chunk no one else was holding any 
+	// more is released now and is already clean
+}
+
+std::vector<Size> Disk::hot_chunks(Size max_chunks) {
+	// each shard's chunks in order, in use ones first
+	std::vector<std::vector<Size>> by_shard(CHUNK_CACHE_SHARDS);
+	for (size_t idx = 0; idx < CHUNK_CACHE_SHARDS; ++idx) {
+		ChunkShard &shard = shards[idx];
+		std::lock_guard<std::recursive_mutex> g(shard.lock); // acquire the lock
+		for (auto &entry : shard.chunks) {
+			if (entry.second->refs != 0 && !shard.resident.contains(entry.first)) 
+				by_shard[idx].push_back(entry.first);
+		}
+		shard.resident.hottest_keys(by_shard[idx]);
+	}
+
+	// a chunk's shard says nothing about how hot it is, so they take turns
+	std::vector<Size> chunk_idxs;
+	for (size_t rank = 0; chunk_idxs.size() < max_chunks; ++rank) {
+		bool any = false;
+		for (size_t idx = 0; idx < CHUNK_CACHE_SHARDS && chunk_idxs.size() < max_chunks; ++idx) {
+			if (rank < by_shard[idx].size()) {
+				chunk_idxs.push_back(by_shard[idx][rank]);
+				any = true;
+			}
+		}
+		if (!any) 
+			break ;
+	}
+	return chunk_idxs;
+}
+
+void Disk::configure_warm_set(Size first_chunk, Size chunk_count, unsigned checkpoint_ms) {
+	if (first_chunk > this->size_chunks() || chunk_count > this->size_chunks() - first_chunk) {
+		throw DiskException("warm set range out of bounds");
+	}
+	if (chunk_count != 0 && chunk_count * this->chunk_size() < 2 * sizeof(uint64_t)) {
+		throw DiskException("the warm set range can not hold a single chunk id");
+	}
+	std::lock_guard<std::mutex> g(this->warm_set_lock);
+	this->warm_set_first = first_chunk;
+	this->warm_set_chunks = chunk_count;
+	this->warm_set_interval = std::chrono::milliseconds(checkpoint_ms);
+	this->warm_set_due = std::chrono::steady_clock::now() + this->warm_set_interval;
+}
+
+void Disk::checkpoint_warm_set() {
+	{
+		std::lock_guard<std::mutex> g(this->warm_set_lock);
+		if (this->warm_set_chunks == 0 || std::chrono::steady_clock::now() < this->warm_set_due) 
+			return ;
+	}
+	IOClassScope scope(IOClass::WRITEBACK);
+	this->save_warm_set();
+}
+
+void Disk::save_warm_set() {
+	Size first_chunk, chunk_count;
+	{
+		std::lock_guard<std::mutex> g(this->warm_set_lock);
+		first_chunk = this->warm_set_first;
+		chunk_count = this->warm_set_chunks;
+		this->warm_set_due = std::chrono::steady_clock::now() + this->warm_set_interval;
+	}
+	if (chunk_count == 0) 
+		return ;
+
+	// a count followed by that many chunk ids, hottest first. the range's own 
+	// chunks are always hot by now and are left out
+	const Size capacity = chunk_count * this->chunk_size() / sizeof(uint64_t) - 1;
+	std::vector<uint64_t> entries(1, 0);
+	for (Size chunk_idx : this->hot_chunks(capacity + chunk_count)) {
+		if (entries.size() > capacity) 
+			break ;
+		if (chunk_idx < first_chunk || chunk_idx >= first_chunk + chunk_count) 
+			entries.push_back(chunk_idx);
+	}
+	entries[0] = entries.size() - 1;
+
+	ChunkSpan span = this->get_span(first_chunk, chunk_count);
+	span.write(0, &entries[0], entries.size() * sizeof(uint64_t));
+	this->warm_set_saves++;
+}
+
+Size Disk::load_warm_set() {
+	Size first_chunk, chunk_count;
+	{
+		std::lock_guard<std::mutex> g(this->warm_set_lock);
+		first_chunk = this->warm_set_first;
+		chunk_count = this->warm_set_chunks;
+	}
+	// without a cache anything read ahead would be dropped again at once
+	if (chunk_count == 0 || this->cache_capacity_chunks == 0) 
+		return 0;
+
+	std::vector<uint64_t> entries;
+	{
+		ChunkSpan span = this->get_span(first_chunk, chunk_count);
+		uint64_t count = 0;
+		span.read(0, &count, sizeof(count));
+		// anything else was not written by save_warm_set, there is nothing to go on
+		if (count == 0 || count > chunk_count * this->chunk_size() / sizeof(uint64_t) - 1) 
+			return 0;
+		entries.resize(count);
+		span.read(sizeof(count), &entries[0], count * sizeof(uint64_t));
+	}
+
+	// the hottest chunks that fit in the cache, read in order of where they 
+	// are so that neighbours end up in the same batch
+	std::vector<Size> chunk_idxs;
+	for (uint64_t chunk_idx : entries) {
+		if (chunk_idxs.size() >= this->cache_capacity_chunks) 
+			break ;
+		if (chunk_idx < this->size_chunks() && (chunk_idx < first_chunk || chunk_idx >= first_chunk + chunk_count)) 
+			chunk_idxs.push_back(chunk_idx);
+	}
+	std::sort(chunk_idxs.begin(), chunk_idxs.end());
+	chunk_idxs.erase(std::unique(chunk_idxs.begin(), chunk_idxs.end()), chunk_idxs.end());
+
+	// batches large enough that the whole set fits in the readahead queue
+	const size_t batch_chunks = std::max(WARM_SET_BATCH_CHUNKS, 
+		(chunk_idxs.size() + READAHEAD_QUEUE_LIMIT - 1) / READAHEAD_QUEUE_LIMIT);
+	for (size_t start = 0; start < chunk_idxs.size(); start += batch_chunks) {
+		const size_t end = std::min(chunk_idxs.size(), start + batch_chunks);
+		this->prefetch(std::vector<Size>(chunk_idxs.begin() + start, chunk_idxs.begin() + end));
+	}
+	this->warm_set_prefetched += chunk_idxs.size();
+	return chunk_idxs.size();
+}
+
+void Disk::configure_discard(Size bytes_per_sec) {
+	if (this->_zero_copy) {
+		throw DiskException("freed chunks can not be discarded in zero copy mode, the chunks handed out are the mapping");
+	}
+	if (bytes_per_sec == 0) {
+		throw DiskException("discards need a rate above 0");
+	}
+	std::lock_guard<std::mutex> g(this->discard_lock);
+	this->discard_bytes_per_sec = bytes_per_sec;
+	// a second's worth may go at once
+	this->discard_budget = bytes_per_sec;
+	this->discard_refilled = std::chrono::steady_clock::now();
+	this->discard_enabled = true;
+}
+
+void Disk::discard(Size first_chunk, Size chunk_count) {
+	if (first_chunk > this->size_chunks() || chunk_count > this->size_chunks() - first_chunk) {
+		throw DiskException("discard range out of bounds");
+	}
+	if (!this->discard_enabled || chunk_count == 0) 
+		return ;
+	const int64_t now = std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+	std::lock_guard<std::mutex> g(this->discard_lock);
+	this->discards_queued.push_back(QueuedDiscard{now, first_chunk, first_chunk + chunk_count});
+}
+
+void Disk::keep_from_discard(Size first_chunk, Size end_chunk) {
+	if (!this->discard_enabled.load(std::memory_order_relaxed)) 
+		return ;
+	std::lock_guard<std::mutex> g(this->discard_lock);
+	cut_run(this->discards_ready, first_chunk, end_chunk);
+
+	// what is left of a queued range on either side stays queued
+	const size_t queued = this->discards_queued.size();
+	for (size_t idx = 0; idx < queued; ++idx) {
+		const QueuedDiscard whole = this->discards_queued[idx];
+		if (whole.end_chunk <= first_chunk || whole.first_chunk >= end_chunk) 
+			continue ;
+		this->discards_queued[idx].end_chunk = std::max(whole.first_chunk, first_chunk);
+		if (whole.end_chunk > end_chunk) 
+			this->discards_queued.push_back(QueuedDiscard{whole.queued_at, end_chunk, whole.end_chunk});
+	}
+	this->discards_queued.erase(std::remove_if(this->discards_queued.begin(), this->discards_queued.end(), 
+		[](const QueuedDiscard &discard) { return discard.first_chunk == discard.end_chunk; }), 
+		this->discards_queued.end());
+}
+
+void Disk::ready_discards(int64_t queued_before) {
+	std::lock_guard<std::mutex> g(this->discard_lock);
+	std::deque<QueuedDiscard> waiting;
+	for (const QueuedDiscard &discard : this->discards_queued) {
+		if (discard.queued_at < queued_before) 
+			add_run(this->discards_ready, discard.first_chunk, discard.end_chunk);
+		else 
+			waiting.push_back(discard);
+	}
+	this->discards_queued.swap(waiting);
+}
+
+Size Disk::issue_discards(bool all) {
+	if (!this->discard_enabled) 
+		return 0;
+	// held throughout, a write to a range waits until its discard is done
+	std::lock_guard<std::mutex> g(this->discard_lock);
+	Size budget = std::numeric_limits<Size>::max();
+	if (all) {
+		for (const QueuedDiscard &discard : this->discards_queued) {
+			add_run(this->discards_ready, discard.first_chunk, discard.end_chunk);
+		}
+		this->discards_queued.clear();
+	} else {
+		const std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+		const double elapsed = std::chrono::duration<double>(now - this->discard_refilled).count();
+		this->discard_budget = std::min((double)this->discard_bytes_per_sec, 
+			this->discard_budget + elapsed * this->discard_bytes_per_sec);
+		this->discard_refilled = now;
+		budget = (Size)this->discard_budget;
+	}
+
+	Size issued = 0;
+	while (!this->discards_ready.empty()) {
+		// a run the budget does not cover goes in part, the rest waits for the next round
+		const Size first_chunk = this->discards_ready.begin()->first;
+		Size end_chunk = this->discards_ready.begin()->second;
+		const Size chunks_left = (budget - issued) / this->chunk_size();
+		if (chunks_left == 0) 
+			break ;
+		if (end_chunk - first_chunk > chunks_left) 
+			end_chunk = first_chunk + chunks_left;
+		cut_run(this->discards_ready, first_chunk, end_chunk);
+
+		const Size length = (end_chunk - first_chunk) * this->chunk_size();
+		if (!this->backend->discard(first_chunk * this->chunk_size(), length)) {
+			// nothing more is queued, the device would not take it either. this is 
+			// no error, freed chunks are left as they are (see CacheStats::discard_enabled)
+			this->discard_enabled = false;
+			this->discards_queued.clear();
+			this->discards_ready.clear();
+			break ;
+		}
+		issued += length;
+		this->discards++;
+		this->discarded_bytes += length;
+	}
+	if (!all) 
+		this->discard_budget -= issued;
+	return issued;
+}
+
+void Disk::configure_cache(Size budget_bytes, CachePolicy policy) {
+	const Size budget_chunks = budget_bytes / this->chunk_size();
+	this->cache_capacity_chunks = budget_chunks;
+
+	for (size_t idx = 0; idx < CHUNK_CACHE_SHARDS; ++idx) {
+		// split the budget evenly, the first few shards take the remainder
+		Size shard_chunks = budget_chunks / CHUNK_CACHE_SHARDS;
+		if (idx < budget_chunks % CHUNK_CACHE_SHARDS) 
+			shard_chunks++;
+
+		std::vector<ChunkRef> evicted;
+		{
+			std::lock_guard<std::recursive_mutex> g(shards[idx].lock); // acquire the lock
+			shards[idx].resident.configure(shard_chunks, policy, evicted);
+		}
+	}
+}
+
+void Disk::configure_buffers(bool huge_pages) {
+	if (this->pool->huge_pages() == huge_pages) 
+		return ;
+	if (this->pool->stats().buffers_in_use != 0) {
+		throw DiskException("the chunk buffers can not be reconfigured while chunks are in memory");
+	}
+	this->pool = std::unique_ptr<ChunkPool>(new ChunkPool(this->chunk_size(), this->buffer_alignment, huge_pages));
+}
+
+void Disk::evict_chunk(Size chunk_idx) {
+	ChunkShard &shard = this->shard_for(chunk_idx);
+	ChunkRef evicted = nullptr;
+	{
+		std::lock_guard<std::recursive_mutex> g(shard.lock); // acquire the lock
+		evicted = shard.resident.remove(chunk_idx);
+	}
+}
+
+void Disk::evict_unshared(ChunkRef &chunk) {
+	// counted before the count of references is looked at, a reference dropped 
+	// after that sees the waiter and has to take release_lock to wake it
+	this->release_waiters.fetch_add(1, std::memory_order_seq_cst);
+	for (;;) {
+		this->evict_chunk(chunk->chunk_idx);
+		std::unique_lock<std::mutex> l(this->release_lock);
+		if (chunk.unique()) 
+			break ;
+		this->release_cv.wait(l);
+	}
+	this->release_waiters.fetch_sub(1, std::memory_order_seq_cst);
+}
+
+void Disk::note_released() {
+	std::lock_guard<std::mutex> g(this->release_lock);
+	this->release_cv.notify_all();
+}
+
+void Disk::flush_all() {
+	// the dirty chunks are taken one shard at a time and go out to the backend 
+	// together once no lock is held, the references keep them from being 
+	// released (and written back) meanwhile
+	std::vector<ChunkRef> held;
+	for (ChunkShard &shard : shards) {
+		std::lock_guard<std::recursive_mutex> g(shard.lock); // acquire the lock
+		shard.resident.for_each([&held](ChunkRef &chunk) {
+			if (chunk->dirty) 
+				held.push_back(chunk);
+		});
+	}
+
+	// pinned chunks need not be resident, one that is both is taken once by write_back_batch
+	{
+		std::lock_guard<std::mutex> g(this->pin_lock);
+		for (auto &entry : this->pinned) {
+			if (entry.second->dirty) 
+				held.push_back(entry.second);
+		}
+	}
+
+	std::vector<Chunk *> dirty;
+	for (ChunkRef &chunk : held) {
+		dirty.push_back(chunk.get());
+	}
+	this->write_back_batch(dirty);
+}
+
+void Disk::sync(Size first_chunk, Size chunk_count) {
+	if (first_chunk > this->size_chunks() || chunk_count > this->size_chunks() - first_chunk) {
+		throw DiskException("sync range out of bounds");
+	}
+	const Size end_chunk = first_chunk + chunk_count;
+
+	// first the dirty chunks of the range go out, the ones that are in use 
+	// included. they are taken one shard at a time and written once no lock 
+	// is held, so lookups go on meanwhile
+	{
+		std::vector<ChunkRef> held;
+		std::vector<Chunk *> dirty;
+		auto take = [&dirty, &held](Chunk *entry) {
+			ChunkRef chunk = ChunkRef::acquire(entry);
+			if (chunk != nullptr && chunk->dirty) {
+				dirty.push_back(chunk.get());
+				held.push_back(std::move(chunk));
+			}
+		};
+		for (size_t shard_idx = 0; shard_idx < CHUNK_CACHE_SHARDS; ++shard_idx) {
+			ChunkShard &shard = shards[shard_idx];
+			std::lock_guard<std::recursive_mutex> g(shard.lock); // acquire the lock
+			if (chunk_count / CHUNK_CACHE_SHARDS < shard.chunks.size()) {
+				// a range smaller than the shard is looked up chunk by chunk
+				Size chunk_idx = first_chunk + (shard_idx + CHUNK_CACHE_SHARDS - first_chunk % CHUNK_CACHE_SHARDS) % CHUNK_CACHE_SHARDS;
+				for (; chunk_idx < end_chunk; chunk_idx += CHUNK_CACHE_SHARDS) {
+					auto entry = shard.chunks.find(chunk_idx);
+					if (entry != shard.chunks.end()) 
+						take(entry->second);
+				}
+			} else {
+				for (auto &entry : shard.chunks) {
+					if (entry.first >= first_chunk && entry.first < end_chunk) 
+						take(entry.second);
+				}
+			}
+		}
+		this->write_back_batch(dirty);
+	}
+
+	// then take the unsynced runs overlapping the range, cut down to it
+	std::vector<DiskBackend::SyncRange> ranges;
+	{
+		std::lock_guard<std::mutex> g(this->sync_lock);
+		auto run = this->unsynced.upper_bound(first_chunk);
+		if (run != this->unsynced.begin() && std::prev(run)->second > first_chunk) 
+			run = std::prev(run);
+		while (run != this->unsynced.end() && run->first < end_chunk) {
+			const Size run_first = run->first;
+			const Size run_end = run->second;
+			const Size start = run_first < first_chunk ? first_chunk : run_first;
+			const Size end = run_end > end_chunk ? end_chunk : run_end;
+			ranges.push_back(DiskBackend::SyncRange{start * this->chunk_size(), (end - start) * this->chunk_size()});
+
+			run = this->unsynced.erase(run);
+			if (run_first < start) 
+				this->unsynced[run_first] = start;
+			if (run_end > end) 
+				this->unsynced[end] = run_end;
+		}
+		this->syncs += ranges.size();
+	}
+
+	try {
+		this->backend->sync_ranges(ranges);
+	} catch (const DiskException &e) {
+		// nothing was made durable, a later sync has to try again
+		std::lock_guard<std::mutex> g(this->sync_lock);
+		for (const DiskBackend::SyncRange &range : ranges) {
+			this->mark_unsynced(range.offset / this->chunk_size(), (range.offset + range.length) / this->chunk_size());
+		}
+		throw;
+	}
+
+	// what the background work ran into earlier is reported now, even though 
+	// what it failed to write has just been written after all
+	this->raise_deferred_error();
+}
+
+void Disk::sync_all() {
+	this->sync(0, this->size_chunks());
+}
+
+void Disk::defer_error(const std::string &message) {
+	std::lock_guard<std::mutex> g(this->deferred_error_lock);
+	this->deferred_errors++;
+	if (this->deferred_error.empty()) 
+		this->deferred_error = message;
+}
+
+void Disk::raise_deferred_error() {
+	std::string message;
+	{
+		std::lock_guard<std::mutex> g(this->deferred_error_lock);
+		message.swap(this->deferred_error);
+	}
+	if (!message.empty()) 
+		throw DiskException(message);
+}
+
+Disk::CacheStats Disk::cache_stats() {
+	CacheStats stats;
+	for (ChunkShard &shard : shards) {
+		std::lock_guard<std::recursive_mutex> g(shard.lock); // acquire the lock
+		stats.hits += shard.hits;
+		stats.readahead_hits += shard.readahead_hits;
+		stats.misses += shard.misses;
+		stats.evictions += shard.resident.eviction_count();
+		stats.writebacks += shard.writebacks;
+		stats.resident_chunks += shard.resident.size();
+		stats.capacity_chunks += shard.resident.max_size();
+		shard.resident.for_each([&stats](ChunkRef &chunk) {
+			if (chunk->dirty) 
+				stats.dirty_chunks++;
+		});
+	}
+
+	ChunkPool::Stats pool_stats = this->pool->stats();
+	stats.pool_slabs = pool_stats.slabs;
+	stats.pool_huge_page_slabs = pool_stats.huge_page_slabs;
+	stats.pool_bytes = pool_stats.slab_bytes;
+	stats.pool_buffers = pool_stats.buffers;
+	stats.pool_buffers_in_use = pool_stats.buffers_in_use;
+
+	stats.readahead_chunks = this->readahead_chunks;
+	stats.warm_set_saves = this->warm_set_saves;
+	stats.warm_set_prefetched = this->warm_set_prefetched;
+	stats.discards = this->discards;
+	stats.discarded_bytes = this->discarded_bytes;
+	stats.discard_enabled = this->discard_enabled;
+	{
+		std::lock_guard<std::mutex> g(this->discard_lock);
+		for (const QueuedDiscard &discard : this->discards_queued) {
+			stats.discard_pending_chunks += discard.end_chunk - discard.first_chunk;
+		}
+		for (const auto &run : this->discards_ready) {
+			stats.discard_pending_chunks += run.second - run.first;
+		}
+	}
+	stats.writeback_runs = this->writeback_runs;
+	stats.writeback_passes = this->writeback_passes;
+	stats.background_writebacks = this->background_writebacks;
+	stats.deferred_errors = this->deferred_errors;
+	stats.checksums_computed = this->checksums_computed;
+	stats.checksums_verified = this->checksums_verified;
+	stats.checksum_failures = this->checksum_failures;
+	stats.extent_reads = this->extent_reads;
+	stats.extent_bytes_read = this->extent_bytes_read;
+	stats.expansions = this->expansions;
+	{
+		std::lock_guard<std::mutex> g(this->pin_lock);
+		stats.pinned_chunks = this->pinned.size();
+		stats.locked_bytes = this->locked_bytes;
+	}
+
+	std::lock_guard<std::mutex> g(this->sync_lock);
+	stats.syncs = this->syncs;
+	for (const auto &run : this->unsynced) {
+		stats.unsynced_chunks += run.second - run.first;
+	}
+	return stats;
 }
 
 void Disk::try_close() {
-	std::lock_guard<std::recursive_mutex> g(lock); // acquire the lock
-	this->chunk_cache.sweep(true);
-	if (this->chunk_cache.size() > 0) {
-		throw DiskException("there are still chunks referenced in other parts of the program");
+	// the readahead and writeback threads may be holding chunks
+	this->wait_for_readahead();
+	this->stop_writeback();
+	this->save_warm_set();
+	{
+		// once is enough, saving it again as the disk goes away would find nothing hot
+		std::lock_guard<std::mutex> g(this->warm_set_lock);
+		this->warm_set_chunks = 0;
+	}
+	this->unpin_all();
+
+	for (ChunkShard &shard : shards) {
+		// write back and release everything the buffer cache is holding on to
+		std::vector<ChunkRef> evicted;
+		{
+			std::lock_guard<std::recursive_mutex> g(shard.lock); // acquire the lock
+			shard.resident.clear(evicted);
+		}
+	}
+
+	// the checksums may be holding on to the chunks they are kept in
+	this->set_checksums(nullptr);
+	this->set_extents(nullptr);
+
+	// everything has been written back, whatever was freed can go now
+	this->issue_discards(true);
+
+	for (ChunkShard &shard : shards) {
+		std::lock_guard<std::recursive_mutex> g(shard.lock); // acquire the lock
+		if (shard.chunks.size() > 0) {
+			throw DiskException("there are still chunks referenced in other parts of the program");
+		}
 	}
+	this->raise_deferred_error();
 }
 
 Disk::~Disk() {
-	if (this->data != NULL) {
-		munmap(this->data, this->size_bytes());
+	{
+		std::lock_guard<std::mutex> g(this->readahead_lock);
+		this->readahead_stop = true;
+		this->readahead_cv.notify_all();
 	}
+	if (this->readahead_thread.joinable()) {
+		this->readahead_thread.join();
+	}
+	this->stop_writeback();
+
+	// while what was hot is still in memory
+	try {
+		this->save_warm_set();
+	} catch (const DiskException &e) {
+		this->defer_error("saving the warm set failed: " + e.message);
+	}
+	this->unpin_all();
+
+	for (ChunkShard &shard : shards) {
+		// the resident chunks write themselves back into the mapping as they 
+		// are released, so this must happen before it is unmapped
+		std::vector<ChunkRef> evicted;
+		{
+			std::lock_guard<std::recursive_mutex> g(shard.lock); // acquire the lock
+			shard.resident.clear(evicted);
+		}
+	}
+
+	// the chunks the checksums were recorded in go last, after every chunk 
+	// that could still record one
+	this->set_checksums(nullptr);
+	this->set_extents(nullptr);
+
+	try {
+		this->issue_discards(true);
+	} catch (const DiskException &e) {
+		this->defer_error("discarding freed chunks failed: " + e.message);
+	}
+
+	// no one asked for what went wrong in the background, this is the last 
+	// chance to tell anyone
+	if (!this->deferred_error.empty()) 
+		fprintf(stderr, "%s\n", this->deferred_error.c_str());
+
+	// the backend unmaps or closes whatever it was using once it is released
 }
 
 
@@ -92,29 +1739,30 @@ DiskBitMap::DiskBitMap(Disk *disk, Size chunk_start, Size size_in_bits) {
 	this->disk_chunk_size = disk->chunk_size();
 	this->size_in_bits = size_in_bits;
 	this->disk = disk;
-	for (uint64_t idx = 0; idx < this->size_chunks(); ++idx) {
-		auto chunk = disk->get_chunk(idx + chunk_start);
-		chunk->lock.lock();
-		this->chunks.push_back(std::move(chunk));
+	this->chunks = disk->get_span(chunk_start, this->size_chunks());
+	for (Size idx = 0; idx < this->chunks.size_chunks(); ++idx) {
+		this->chunks.chunk(idx).lock.lock();
 	}
 }
 
 DiskBitMap::~DiskBitMap() {
-	for (auto &chunk : chunks) {
-		chunk->lock.unlock();
+	for (Size idx = 0; idx < this->chunks.size_chunks(); ++idx) {
+		this->chunks.chunk(idx).lock.unlock();
 	}
 }
 
 void DiskBitMap::clear_all() {
-	for (std::shared_ptr<Chunk>& chunk : chunks) {
-		chunk->memset(chunk->data, 0, chunk->size_bytes);
-	}
+	this->chunks.fill(0, 0, this->chunks.size_bytes());
 
 	for (uint64_t idx = this->size_in_bits; idx < this->size_in_bits + 8; ++idx) {
 		this->set_oob(idx);
 	}
 }
 
+void DiskBitMap::clear_first(Size bit_count) {
+	this->chunks.fill(0, 0, std::min<Size>(bit_count / 8 + 1, this->chunks.size_bytes()));
+}
+
 
 std::array<DiskBitMap::BitRange, 256> DiskBitMap::find_unset_cache;
 
@@ -146,7 +1794,7 @@ DiskBitMap::BitRange DiskBitMap::find_unset_bits(Size length) {
 
 	BitRange retval;
 	for (Size idx = last_search_idx; idx < this->size_in_bits; idx += 8) {
-		const Byte byte = (size_t)this->get_byte_for_idx(idx);
+		const Byte byte = (size_t)static_cast<const DiskBitMap *>(this)->get_byte_for_idx(idx);
 		BitRange res = find_unset_cache[byte];
 		res.start_idx += idx;
 
@@ -3,7 +3,14 @@
 
 #include <stdint.h>
 #include <mutex>
+#include <atomic>
+#include <thread>
+#include <condition_variable>
+#include <chrono>
+#include <deque>
 #include <unordered_map>
+#include <list>
+#include <map>
 #include <string>
 #include <vector>
 #include <array>
@@ -18,7 +25,45 @@
 typedef uint8_t Byte;
 typedef uint64_t Size;
 
+// how a range of the disk is going to be accessed, see Disk::advise
+enum class AccessPattern {
+	NORMAL,
+	RANDOM, // scattered small accesses, reading ahead only wastes I/O
+	SEQUENTIAL, // read once from front to back
+};
+
+// what an I/O is done for, the scheduler (see ScheduledBackend) arbitrates 
+// between them. the background writeback thread's and the segment cleaner's 
+// I/O is tagged as such by an IOClassScope, all other I/O is foreground: 
+// reads are interactive reads and writes foreground writes
+enum class IOClass {
+	INTERACTIVE_READ,
+	FOREGROUND_WRITE,
+	WRITEBACK,
+	CLEANER,
+};
+static constexpr size_t IO_CLASS_COUNT = 4;
+
+// the name of the class, i.e. "cleaner"
+const char *io_class_name(IOClass io_class);
+
+// tags the I/O the calling thread does with the class for as long as it lives, 
+// scopes nest
+class IOClassScope {
+private:
+	int previous;
+
+public:
+	explicit IOClassScope(IOClass io_class);
+	~IOClassScope();
+
+	// the class of a read or write the calling thread does now
+	static IOClass current(bool is_write);
+};
+
 class Disk;
+class DiskBackend;
+class ChunkPool;
 
 struct StorageException : public std::exception {
 	const std::string message;
@@ -37,9 +82,40 @@ struct Chunk {
 	size_t chunk_idx = 0;
 	Byte *data = nullptr;
 
+	// set when the in memory copy may differ from what is on the disk, cleared 
+	// when the chunk is written back. a chunk that is only ever read stays 
+	// clean and is dropped without being written back
+	std::atomic<bool> dirty {false};
+
+	// when dirty was last set on a clean chunk, in steady clock nanoseconds. 
+	// the writeback thread writes back the chunks that have been dirty the longest
+	std::atomic<int64_t> dirty_since {0};
+
+	// set while the chunk was loaded by readahead and no one has asked for it yet
+	std::atomic<bool> prefetched {false};
+
+	// set while the chunk was read in from a compressed extent (see ChunkExtents) 
+	// and has not been changed since
+	std::atomic<bool> compressed {false};
+
+	// set while the chunk is cached but its contents are still being read in, 
+	// and for good if that failed (see Disk::get_chunk)
+	std::atomic<bool> loading {false};
+	std::atomic<bool> load_failed {false};
+
+	// the number of ChunkRefs to the chunk, it is deleted when the last goes
+	std::atomic<uint32_t> refs {0};
+
 	~Chunk();
+
+	// for changes made other than through memcpy/memset, i.e. storing a value 
+	// through a cast pointer, so they are not lost when the chunk is dropped. 
+	// called after the store: a writeback clears dirty before it copies the 
+	// data, so one that runs in between sees the change or leaves it dirty. 
+	// defined below Disk
+	inline void mark_dirty();
 	
-	inline void memcpy(void *dst, const void *src, size_t length, std::shared_ptr<Chunk> src_chunk = nullptr) {
+	inline void memcpy(void *dst, const void *src, size_t length, const Chunk *src_chunk = nullptr) {
 		assert((Byte *)dst >= this->data && (Byte *)dst + length <= this->data + this->size_bytes);
 		if (src_chunk != nullptr) {
 			assert(src_chunk->size_bytes == this->size_bytes);
@@ -47,74 +123,683 @@ struct Chunk {
 		}
 
 		std::memcpy(dst, src, length);
+		this->mark_dirty();
 	}
 
 	inline void memset(void *dst, Byte value, size_t length) {
 		assert((Byte *)dst >= this->data & (Byte *)dst + length <= this->data + size_bytes);
 		std::memset(dst, value, length);
+		this->mark_dirty();
 	}
 };
 
+/*
+	a counted reference to a chunk, the count lives in the chunk itself so 
+	that handing out a chunk costs no allocation beyond the chunk and copying 
+	a reference is a single atomic increment. moving a reference touches no 
+	count at all, so prefer passing them by const reference or moving them 
+	over copying. when the last reference goes the chunk is deleted, which 
+	writes it back when it is dirty (see ~Chunk). 
+	
+	the chunk cache keeps plain pointers to the chunks it has handed out, 
+	acquire takes a reference through such a pointer for as long as the 
+	count has not yet dropped to zero (like locking a weak_ptr)
+*/
+class ChunkRef {
+private:
+	Chunk *chunk = nullptr;
+
+	// defined below Disk
+	inline void drop();
 
-template<typename K, typename V, size_t cache_size = 0>
-class SharedObjectCache {
+public:
+	ChunkRef() { };
+	ChunkRef(std::nullptr_t) { };
+
+	// takes the first reference to a chunk that was just created
+	explicit ChunkRef(Chunk *chunk) : chunk(chunk) {
+		if (chunk != nullptr) 
+			chunk->refs.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	ChunkRef(const ChunkRef &other) : ChunkRef(other.chunk) { };
+
+	ChunkRef(ChunkRef &&other) noexcept : chunk(other.chunk) {
+		other.chunk = nullptr;
+	}
+
+	~ChunkRef() {
+		drop();
+	}
+
+	ChunkRef &operator=(const ChunkRef &other) {
+		if (other.chunk != nullptr) 
+			other.chunk->refs.fetch_add(1, std::memory_order_relaxed);
+		drop();
+		chunk = other.chunk;
+		return *this;
+	}
+
+	ChunkRef &operator=(ChunkRef &&other) noexcept {
+		if (this != &other) {
+			drop();
+			chunk = other.chunk;
+			other.chunk = nullptr;
+		}
+		return *this;
+	}
+
+	// a reference to the chunk, or nullptr if its last reference is already 
+	// gone and it is on its way out. the caller must keep the chunk from being 
+	// deleted meanwhile, i.e. by holding the lock its release takes
+	static ChunkRef acquire(Chunk *chunk) {
+		ChunkRef ref;
+		uint32_t refs = chunk->refs.load(std::memory_order_relaxed);
+		while (refs != 0) {
+			if (chunk->refs.compare_exchange_weak(refs, refs + 1, std::memory_order_relaxed)) {
+				ref.chunk = chunk;
+				break ;
+			}
+		}
+		return ref;
+	}
+
+	inline void reset() {
+		drop();
+		chunk = nullptr;
+	}
+
+	inline Chunk *get() const {
+		return chunk;
+	}
+
+	inline Chunk *operator->() const {
+		return chunk;
+	}
+
+	inline Chunk &operator*() const {
+		return *chunk;
+	}
+
+	explicit operator bool() const {
+		return chunk != nullptr;
+	}
+
+	// whether this is the only reference to the chunk
+	inline bool unique() const {
+		return chunk != nullptr && chunk->refs.load(std::memory_order_acquire) == 1;
+	}
+
+	inline uint32_t use_count() const {
+		return chunk != nullptr ? chunk->refs.load(std::memory_order_acquire) : 0;
+	}
+
+	friend bool operator==(const ChunkRef &a, const ChunkRef &b) { return a.chunk == b.chunk; }
+	friend bool operator!=(const ChunkRef &a, const ChunkRef &b) { return a.chunk != b.chunk; }
+	friend bool operator==(const ChunkRef &a, std::nullptr_t) { return a.chunk == nullptr; }
+	friend bool operator!=(const ChunkRef &a, std::nullptr_t) { return a.chunk != nullptr; }
+	friend bool operator==(std::nullptr_t, const ChunkRef &b) { return b.chunk == nullptr; }
+	friend bool operator!=(std::nullptr_t, const ChunkRef &b) { return b.chunk != nullptr; }
+};
+
+/*
+	a run of adjacent chunks handed out by Disk::get_span as one handle. the 
+	span holds on to every chunk of the run so they stay in memory for as 
+	long as it lives, and reads and writes through it address the run as one 
+	range of bytes rather than chunk by chunk. the chunks are only back to 
+	back in memory in zero copy mode, see contiguous_data
+*/
+class ChunkSpan {
 private:
-	size_t size_next_sweep = 16 + cache_size * 2;
-	std::unordered_map<K, std::weak_ptr<V>> map;
-	std::shared_ptr<V> cache[cache_size];
+	Size _first_chunk = 0;
+	Size _chunk_size = 0;
+	std::vector<ChunkRef> chunks;
+
 public:
-	SharedObjectCache() {
-		this->sweep(true);
+	ChunkSpan() { };
+	ChunkSpan(Size first_chunk, Size chunk_size, std::vector<ChunkRef> chunks);
+
+	inline Size first_chunk() const {
+		return _first_chunk;
 	}
 
-	void sweep(bool force) {
-		if (!force && map.size() < size_next_sweep)
-			return ;
+	inline Size size_chunks() const {
+		return chunks.size();
+	}
+
+	inline Size size_bytes() const {
+		return chunks.size() * _chunk_size;
+	}
+
+	// the idx'th chunk of the span (not of the disk)
+	inline Chunk &chunk(Size idx) const {
+		assert(idx < chunks.size());
+		return *chunks[idx];
+	}
+
+	// the start of the span when its chunks lie back to back in memory, 
+	// which is the case for chunks pointing into a mapping, nullptr otherwise
+	Byte *contiguous_data() const;
+
+	// offsets are in bytes from the start of the span, writes mark every 
+	// chunk they touch dirty
+	void read(Size offset, void *dst, Size length) const;
+	void write(Size offset, const void *src, Size length);
+	void fill(Size offset, Byte value, Size length);
+
+	// copies chunk_count whole chunks from src, starting at its src_idx'th 
+	// chunk, over this span's chunks starting at dst_idx
+	void copy_chunks(Size dst_idx, const ChunkSpan &src, Size src_idx, Size chunk_count);
+
+	// drops the span's references to its chunks
+	void release();
+};
+
+/*
+	lets lock free readers know when what they might still be looking at can 
+	be freed. a reader holds a Guard for as long as it looks, a writer that 
+	has unlinked something calls synchronize, once that returns every reader 
+	that could have seen it is done. readers only touch a counter of their 
+	own stripe, picked per thread, so they do not contend with each other
+*/
+class EpochDomain {
+private:
+	static constexpr size_t STRIPES = 64;
 
-		// fprintf(stdout, "sweeping map, size: %d\n", map.size());
+	// the readers that entered in an even and in an odd epoch, a cache line each
+	struct Stripe {
+		std::atomic<uint64_t> active[2];
+		char padding[64 - 2 * sizeof(std::atomic<uint64_t>)];
+	};
+
+	std::atomic<uint64_t> epoch {0};
+	Stripe stripes[STRIPES];
+	// two writers moving the epoch on at once would each only wait for half the readers
+	std::mutex synchronize_lock;
+
+public:
+	EpochDomain();
+
+	class Guard {
+	private:
+		std::atomic<uint64_t> *counter;
+	public:
+		Guard(EpochDomain &domain);
+		~Guard();
+		Guard(const Guard &) = delete;
+		Guard &operator=(const Guard &) = delete;
+	};
+
+	// waits for every reader that entered before the call, writers take turns
+	void synchronize();
+};
+
+/*
+	a concurrent map from keys to weak references, a shared object can be 
+	looked up by its key for as long as someone holds on to it. it is an open 
+	addressing table (linear probing) of pointers to entries that never change 
+	once they are in it, so lookups take no lock: they probe the table inside 
+	an epoch and an entry or table that is replaced meanwhile is only freed 
+	once they are done. changes are serialized by a mutex, the wait for the 
+	readers happens after it is released. expired entries are dropped a few at 
+	a time as others are put rather than in a sweep over the whole table, which 
+	only happens when it has to grow anyway
+*/
+template<typename K, typename V>
+class SharedObjectCache {
+private:
+	struct Entry {
+		K key;
+		std::weak_ptr<V> value;
+	};
+
+	struct Table {
+		size_t mask; // the capacity less one, it is a power of two
+		std::unique_ptr<std::atomic<Entry *>[]> slots;
 
-		if (force) {
-			for (size_t i = 0; i < cache_size; ++i) {
-				cache[i] = nullptr;
+		Table(size_t capacity) : mask(capacity - 1), slots(new std::atomic<Entry *>[capacity]) {
+			for (size_t idx = 0; idx < capacity; ++idx) {
+				slots[idx].store(nullptr, std::memory_order_relaxed);
 			}
 		}
-		
+	};
 
-		for (auto it = this->map.cbegin(); it != this->map.cend();){
-			if ((*it).second.expired()) {
-				this->map.erase(it++);    // or "it = m.erase(it)" since C++11
-			} else {
-				++it;
+	static constexpr size_t MIN_CAPACITY = 16;
+	// slots checked for expired entries by each put
+	static constexpr size_t EXPIRE_STEP = 4;
+	// replaced entries are freed in batches, each takes a synchronize
+	static constexpr size_t RECLAIM_BATCH = 64;
+
+	// an entry that was removed, probing goes on past it. an empty slot ends a probe
+	static Entry *tombstone() {
+		static Entry entry;
+		return &entry;
+	}
+
+	EpochDomain epoch;
+	std::atomic<Table *> table;
+
+	// only touched under the lock
+	std::mutex lock;
+	size_t live = 0; // slots holding an entry
+	size_t used = 0; // slots holding an entry or a tombstone
+	size_t expire_cursor = 0;
+	std::vector<Entry *> retired;
+	std::vector<Table *> retired_tables;
+
+	static size_t home(const Table &table, const K &k) {
+		return std::hash<K>()(k) & table.mask;
+	}
+
+	// the slot holding the key, or the slot it would go in and false
+	std::pair<size_t, bool> find_slot(const Table &table, const K &k) {
+		size_t free_slot = table.mask + 1;
+		for (size_t idx = home(table, k);; idx = (idx + 1) & table.mask) {
+			Entry *entry = table.slots[idx].load(std::memory_order_relaxed);
+			if (entry == nullptr) 
+				return std::make_pair(free_slot <= table.mask ? free_slot : idx, false);
+			if (entry == tombstone()) {
+				if (free_slot > table.mask) 
+					free_slot = idx;
+			} else if (entry->key == k) {
+				return std::make_pair(idx, true);
 			}
 		}
+	}
+
+	void retire(Entry *entry) {
+		this->retired.push_back(entry);
+	}
+
+	// under the lock, takes what was retired once there is a batch of it (or 
+	// a table) to be freed by reclaim after the lock is released
+	void take_retired(std::vector<Entry *> &entries, std::vector<Table *> &tables, bool always) {
+		if (always || this->retired.size() >= RECLAIM_BATCH || !this->retired_tables.empty()) {
+			entries.swap(this->retired);
+			tables.swap(this->retired_tables);
+		}
+	}
+
+	// without the lock, so a slow reader holds up this writer and not all of them
+	void reclaim(std::vector<Entry *> &entries, std::vector<Table *> &tables) {
+		this->epoch.synchronize();
+		for (Entry *entry : entries) {
+			delete entry;
+		}
+		for (Table *table : tables) {
+			delete table;
+		}
+	}
 
-		size_next_sweep = this->map.size() * 2 < 16 ? 16 : this->map.size() * 2;
+	void remove_at(Table &table, size_t idx) {
+		Entry *entry = table.slots[idx].load(std::memory_order_relaxed);
+		table.slots[idx].store(tombstone(), std::memory_order_release);
+		this->live--;
+		this->retire(entry);
 	}
 
+	// looks at the next few slots for entries whose objects are gone
+	void expire_some(Table &table) {
+		for (size_t step = 0; step < EXPIRE_STEP; ++step) {
+			const size_t idx = this->expire_cursor++ & table.mask;
+			Entry *entry = table.slots[idx].load(std::memory_order_relaxed);
+			if (entry != nullptr && entry != tombstone() && entry->value.expired()) 
+				this->remove_at(table, idx);
+		}
+	}
+
+	// moves the live entries into a table with room for twice as many (and no 
+	// tombstones), readers still probing the old one find the same entries there. 
+	// the old one is retired
+	void rehash() {
+		Table *old_table = this->table.load(std::memory_order_relaxed);
+		size_t capacity = MIN_CAPACITY;
+		while (capacity < this->live * 4) {
+			capacity *= 2;
+		}
+		Table *new_table = new Table(capacity);
+		this->live = 0;
+		for (size_t idx = 0; idx <= old_table->mask; ++idx) {
+			Entry *entry = old_table->slots[idx].load(std::memory_order_relaxed);
+			if (entry == nullptr || entry == tombstone()) 
+				continue ;
+			if (entry->value.expired()) {
+				this->retired.push_back(entry);
+				continue ;
+			}
+			size_t slot = home(*new_table, entry->key);
+			while (new_table->slots[slot].load(std::memory_order_relaxed) != nullptr) {
+				slot = (slot + 1) & new_table->mask;
+			}
+			new_table->slots[slot].store(entry, std::memory_order_relaxed);
+			this->live++;
+		}
+		this->used = this->live;
+		this->table.store(new_table, std::memory_order_release);
+		this->retired_tables.push_back(old_table);
+	}
+
+public:
+	SharedObjectCache() : table(new Table(MIN_CAPACITY)) {
+	}
+
+	~SharedObjectCache() {
+		Table *table = this->table.load();
+		for (size_t idx = 0; idx <= table->mask; ++idx) {
+			Entry *entry = table->slots[idx].load();
+			if (entry != nullptr && entry != tombstone()) 
+				delete entry;
+		}
+		delete table;
+		for (Entry *entry : this->retired) {
+			delete entry;
+		}
+		for (Table *table : this->retired_tables) {
+			delete table;
+		}
+	}
+
+	SharedObjectCache(const SharedObjectCache &) = delete;
+	SharedObjectCache &operator=(const SharedObjectCache &) = delete;
+
 	void put(const K& k, std::shared_ptr<V> v) {
-		map[k] = v;
-		this->sweep(false);
-		if (cache_size > 0) {
-			cache[rand() % cache_size] = v;
+		Entry *entry = new Entry{k, v};
+		std::vector<Entry *> entries;
+		std::vector<Table *> tables;
+		{
+			std::lock_guard<std::mutex> g(this->lock);
+			Table *table = this->table.load(std::memory_order_relaxed);
+			std::pair<size_t, bool> slot = this->find_slot(*table, k);
+			Entry *previous = table->slots[slot.first].load(std::memory_order_relaxed);
+			table->slots[slot.first].store(entry, std::memory_order_release);
+			if (slot.second) {
+				this->retire(previous);
+			} else {
+				this->live++;
+				if (previous == nullptr) 
+					this->used++;
+			}
+
+			this->expire_some(*table);
+			// there is always an empty slot left to end a probe
+			if (this->used * 4 > (table->mask + 1) * 3) 
+				this->rehash();
+			this->take_retired(entries, tables, false);
 		}
+		if (!entries.empty() || !tables.empty()) 
+			this->reclaim(entries, tables);
 	}
 
 	std::shared_ptr<V> get(const K& k) {
-		auto ref = this->map.find(k);
-		if (ref != this->map.end()) {
-			if (std::shared_ptr<V> v = (*ref).second.lock()) {
-				return v;
-			}
-		} 
+		EpochDomain::Guard guard(this->epoch);
+		const Table *table = this->table.load(std::memory_order_acquire);
+		for (size_t idx = home(*table, k);; idx = (idx + 1) & table->mask) {
+			const Entry *entry = table->slots[idx].load(std::memory_order_acquire);
+			if (entry == nullptr) 
+				return nullptr;
+			if (entry != tombstone() && entry->key == k) 
+				return entry->value.lock();
+		}
+	}
 
-		return nullptr;
+	// once it returns no lookup hands out the object any more, not even one 
+	// that found the entry just before it was removed
+	void erase(const K& k) {
+		std::vector<Entry *> entries;
+		std::vector<Table *> tables;
+		{
+			std::lock_guard<std::mutex> g(this->lock);
+			Table *table = this->table.load(std::memory_order_relaxed);
+			std::pair<size_t, bool> slot = this->find_slot(*table, k);
+			if (slot.second) 
+				this->remove_at(*table, slot.first);
+			this->take_retired(entries, tables, true);
+		}
+		this->reclaim(entries, tables);
 	}
 
+	// the entries in the table, some of which may have expired
 	inline size_t size() {
-		return this->map.size();
+		std::lock_guard<std::mutex> g(this->lock);
+		return this->live;
+	}
+
+	inline size_t capacity() {
+		return this->table.load()->mask + 1;
 	}
 };
 
+template<typename K, typename V>
+constexpr size_t SharedObjectCache<K, V>::MIN_CAPACITY;
+template<typename K, typename V>
+constexpr size_t SharedObjectCache<K, V>::EXPIRE_STEP;
+template<typename K, typename V>
+constexpr size_t SharedObjectCache<K, V>::RECLAIM_BATCH;
+
+/*
+	A bounded set of strong references, used to keep recently used objects alive 
+	after their last outside reference is dropped. When the set is full, 
+	inserting evicts a victim chosen by either CLOCK (second chance) or LRU. 
+	Evicted values are handed back to the caller so that it can decide where 
+	they are released (i.e. outside of a lock). V is the reference itself, 
+	anything nullable and movable like a shared_ptr or a ChunkRef.
+*/
+template<typename K, typename V>
+class ResidentCache {
+public:
+	enum Policy {
+		CLOCK,
+		LRU
+	};
+
+private:
+	struct Entry {
+		K key;
+		V value;
+		bool referenced;
+	};
+
+	Policy policy = CLOCK;
+	size_t capacity = 0;
+	uint64_t evictions = 0;
+
+	// for LRU the front of the list is the most recently used entry, for CLOCK
+	// the list is treated as a ring that the hand sweeps around
+	std::list<Entry> entries;
+	std::unordered_map<K, typename std::list<Entry>::iterator> index;
+	typename std::list<Entry>::iterator hand = entries.end();
+
+	V evict_one() {
+		if (entries.empty())
+			return nullptr;
+
+		typename std::list<Entry>::iterator victim;
+		if (policy == LRU) {
+			victim = std::prev(entries.end());
+		} else {
+			// give every referenced entry a second chance, terminates after at 
+			// most one full lap since each pass clears the bit
+			while (true) {
+				if (hand == entries.end())
+					hand = entries.begin();
+				if (!hand->referenced)
+					break ;
+				hand->referenced = false;
+				++hand;
+			}
+			victim = hand++;
+		}
+
+		V value = std::move(victim->value);
+		index.erase(victim->key);
+		entries.erase(victim);
+		evictions++;
+		return value;
+	}
+
+public:
+	void configure(size_t capacity, Policy policy, std::vector<V> &evicted) {
+		this->capacity = capacity;
+		if (this->policy != policy) {
+			this->policy = policy;
+			hand = entries.begin();
+		}
+		while (entries.size() > capacity) {
+			evicted.push_back(evict_one());
+		}
+	}
+
+	// marks the entry as recently used, returns false if it is not resident
+	bool touch(const K& k) {
+		auto ref = index.find(k);
+		if (ref == index.end())
+			return false;
+
+		if (policy == LRU) {
+			entries.splice(entries.begin(), entries, ref->second);
+		} else {
+			ref->second->referenced = true;
+		}
+		return true;
+	}
+
+	// inserts the value, returns the victim that was evicted to make room (if any)
+	V insert(const K& k, V v) {
+		if (capacity == 0)
+			return nullptr;
+		if (this->touch(k))
+			return nullptr;
+
+		V victim = nullptr;
+		if (entries.size() >= capacity) {
+			victim = evict_one();
+		}
+
+		// new entries go in just behind the hand so that they are the last to 
+		// be considered on the current lap
+		auto pos = (policy == LRU) ? entries.begin() : hand;
+		auto it = entries.insert(pos, Entry{k, std::move(v), false});
+		index[k] = it;
+		return victim;
+	}
+
+	V remove(const K& k) {
+		auto ref = index.find(k);
+		if (ref == index.end())
+			return nullptr;
+
+		auto it = ref->second;
+		if (it == hand)
+			++hand;
+		V value = std::move(it->value);
+		index.erase(ref);
+		entries.erase(it);
+		return value;
+	}
+
+	void clear(std::vector<V> &evicted) {
+		for (Entry &entry : entries) {
+			evicted.push_back(std::move(entry.value));
+		}
+		entries.clear();
+		index.clear();
+		hand = entries.end();
+	}
+
+	template<typename F>
+	void for_each(F f) {
+		for (Entry &entry : entries) {
+			f(entry.value);
+		}
+	}
+
+	inline bool contains(const K& k) const {
+		return index.find(k) != index.end();
+	}
+
+	// appends the keys from the most to the least likely to be used again: in 
+	// LRU order, or for CLOCK the referenced entries and then the others, 
+	// each in the order the hand is going to reach them
+	void hottest_keys(std::vector<K> &keys) const {
+		if (policy == LRU) {
+			for (const Entry &entry : entries) {
+				keys.push_back(entry.key);
+			}
+			return ;
+		}
+		for (int referenced = 1; referenced >= 0; --referenced) {
+			typename std::list<Entry>::const_iterator it = hand;
+			for (size_t count = 0; count < entries.size(); ++count) {
+				if (it == entries.end())
+					it = entries.begin();
+				if (it->referenced == (referenced == 1))
+					keys.push_back(it->key);
+				++it;
+			}
+		}
+	}
+
+	inline size_t size() const {
+		return entries.size();
+	}
+
+	inline size_t max_size() const {
+		return capacity;
+	}
+
+	inline uint64_t eviction_count() const {
+		return evictions;
+	}
+};
+
+/*
+	end to end checksums of chunks, kept wherever the layer above the disk has 
+	room for them (the file system keeps them in its segment summaries). the 
+	disk computes a chunk's checksum as it writes the chunk back and checks it 
+	whenever the chunk is read back in on a miss, chunks found in memory are 
+	trusted. a checksum of 0 means there is nothing to check against. these 
+	are called while the disk holds its shard locks, so they must never get a 
+	chunk from the disk themselves
+*/
+class ChunkChecksums {
+public:
+	virtual ~ChunkChecksums() { };
+
+	// whether the chunk has a checksum kept for it at all
+	virtual bool covers(Size chunk_idx) = 0;
+
+	// the checksum recorded for a covered chunk, 0 if there is none yet
+	virtual uint32_t checksum(Size chunk_idx) = 0;
+
+	// records the checksum of a covered chunk that is being written back, 
+	// returns the chunk the checksum was stored in (which is dirty now and 
+	// should go out along with it) or nullptr
+	virtual Chunk *record(Size chunk_idx, uint32_t checksum) = 0;
+};
+
+/*
+	chunks that are stored compressed. such a chunk's contents are not in its 
+	own place on the device but in a compressed extent somewhere else, an LZ4 
+	block (or the chunk as it is when the extent is a whole chunk long). the 
+	disk reads the extent and decompresses it when the chunk is read in on a 
+	miss. before such a chunk is changed it is expanded, after which it and 
+	whatever else needs to be are written back to their own places like any 
+	other chunk. extent is called while the disk holds its shard locks and 
+	must never get a chunk from the disk, expand is called without any
+*/
+class ChunkExtents {
+public:
+	virtual ~ChunkExtents() { };
+
+	// the compressed extent of the chunk in bytes of the device, false when 
+	// the chunk is stored as it is in its own place
+	virtual bool extent(Size chunk_idx, Size &offset, Size &length) = 0;
+
+	// called the first time a chunk that was read from an extent is about to 
+	// change, its Chunk::compressed must be cleared by the time this returns
+	virtual void expand(Size chunk_idx) = 0;
+};
+
 /*
 	acts as an interface onto the disk as well as a cache for chunks on disk
 	in this way the same chunk can be accessed and modified in multiple places
@@ -123,45 +808,331 @@ public:
 class Disk {
 private:
 	// properties of the class
-	int fd = -1;
 	const Size _size_chunks;
 	const Size _chunk_size;
-	const size_t _mempage_size = sysconf(_SC_PAGESIZE); // get the memory page size;
 
-	Byte* data;
+	// when set, chunks are not copied out of the mapping, Chunk::data points 
+	// directly into the memory mapped region instead
+	const bool _zero_copy;
+
+	// where the chunks actually live
+	std::unique_ptr<DiskBackend> backend;
+
+	// the backend's memory mapping, nullptr if it does not have one
+	Byte* data = nullptr;
 
-	// a mutex which protects access to the disk
-	std::recursive_mutex lock;
+	// chunk buffers are aligned to this so that any backend can do I/O on them
+	size_t buffer_alignment = 0;
 
-	// a cache of chunks that are loaded in
-	SharedObjectCache<Size, Chunk, 0> chunk_cache;
+	// where the chunk buffers come from (unused in zero copy mode), declared 
+	// before the shards so it outlives every chunk they hold on to
+	std::unique_ptr<ChunkPool> pool;
 
-	// loops over weak pointers, if any of them are expired, it deletes 
-	// the entries from the unordered map 
-	void sweep_chunk_cache(); 
 public:
+	using CachePolicy = ResidentCache<Size, ChunkRef>::Policy;
+
+	static constexpr Size DEFAULT_CACHE_BUDGET_BYTES = 16 * 1024 * 1024;
+
+	// the chunk cache is split into this many independently locked shards, 
+	// chunk i lives in shard i % CHUNK_CACHE_SHARDS
+	static constexpr size_t CHUNK_CACHE_SHARDS = 16;
+
+	// prefetch requests beyond this many waiting are dropped, readahead is only a hint
+	static constexpr size_t READAHEAD_QUEUE_LIMIT = 64;
+
+	// defaults of the background writeback thread, see configure_writeback
+	static constexpr unsigned DEFAULT_DIRTY_EXPIRE_MS = 3000;
+	static constexpr unsigned DEFAULT_DIRTY_RATIO_PERCENT = 20;
+	static constexpr unsigned WRITEBACK_INTERVAL_MS = 500;
+
+	// adjacent dirty chunks are written back together, up to this many at once
+	static constexpr size_t WRITEBACK_MAX_RUN_CHUNKS = 64;
+
+	// how often the writeback thread saves the warm set, see configure_warm_set
+	static constexpr unsigned DEFAULT_WARM_SET_CHECKPOINT_MS = 60 * 1000;
+
+	// the warm set is read back in batches of at least this many chunks
+	static constexpr size_t WARM_SET_BATCH_CHUNKS = 256;
+
+	// how fast freed ranges are given back to the device, see configure_discard
+	static constexpr Size DEFAULT_DISCARD_BYTES_PER_SEC = 64ull * 1024 * 1024;
+
+private:
+	struct ChunkShard {
+		// a mutex which protects access to this shard of the chunk cache
+		std::recursive_mutex lock;
+
+		// every chunk of this shard that is currently in memory, not counted as 
+		// references (see ChunkRef::acquire). entries are only removed by the 
+		// chunk itself once it has been released, so an entry that can no longer 
+		// be acquired means the chunk is still being written back and must not 
+		// be loaded again until that finishes
+		std::unordered_map<Size, Chunk *> chunks;
+
+		// the buffer cache, keeps up to a budget worth of chunks resident after 
+		// their last outside reference goes away so hot chunks are not re-read and 
+		// written back on every use
+		ResidentCache<Size, ChunkRef> resident;
+
+		uint64_t hits = 0;
+		uint64_t misses = 0;
+		std::atomic<uint64_t> writebacks {0}; // the writeback thread counts these without the lock
+		uint64_t readahead_hits = 0;
+	};
+
+	std::array<ChunkShard, CHUNK_CACHE_SHARDS> shards;
+
+	inline ChunkShard &shard_for(Size chunk_idx) {
+		return shards[chunk_idx % CHUNK_CACHE_SHARDS];
+	}
+
+	// allocates a chunk, its contents are not read in yet
+	ChunkRef new_chunk(Size chunk_idx);
+
+	// reads a chunk's contents in, no shard lock may be held
+	void read_chunk(Chunk &chunk);
+
+	// a missing chunk is cached before it is read in, so that no shard lock is 
+	// held across the read. anyone else who asks for it meanwhile waits on 
+	// load_cv until the load is finished, one that failed removes the entries
+	std::mutex load_lock;
+	std::condition_variable load_cv;
+	void finish_load(const std::vector<ChunkRef> &chunks, bool loaded);
+
+	// waits for someone else's load of the chunk, false if that failed
+	bool wait_loaded(Chunk &chunk);
 
+	// called by a chunk once its last reference is gone
+	void release_chunk(Chunk& chunk);
+	friend struct Chunk;
+
+	// writes the chunk back, the shard lock must be held
+	void write_back(ChunkShard &shard, Chunk& chunk);
+
+	// checksums of the chunks, see set_checksums. always read and replaced 
+	// with std::atomic_load/atomic_store, a batch holds on to the one it started with
+	std::shared_ptr<ChunkChecksums> checksums;
+	std::atomic<uint64_t> checksums_computed {0};
+	std::atomic<uint64_t> checksums_verified {0};
+	std::atomic<uint64_t> checksum_failures {0};
+
+	// records the checksum of every covered chunk in the batch, computed from 
+	// the copy of it that is written, and adds the dirty chunks they were 
+	// recorded in to stored_in
+	void record_checksums(ChunkChecksums &checksums, const std::vector<Chunk *> &chunks, 
+		const std::vector<const Byte *> &copies, std::vector<Chunk *> &stored_in);
+
+	// throws a DiskException if a chunk that was just read in does not match its checksum
+	void verify_checksum(ChunkChecksums &checksums, const Chunk &chunk);
+
+	// chunks stored in compressed extents, see set_extents. like checksums 
+	// only ever read and replaced atomically
+	std::shared_ptr<ChunkExtents> extents;
+	std::atomic<uint64_t> extent_reads {0};
+	std::atomic<uint64_t> extent_bytes_read {0};
+	std::atomic<uint64_t> expansions {0};
+	// held by write_back_batch and by write_through, so that a batch never 
+	// puts a chunk's plain copy over a compressed extent
+	std::mutex write_through_lock;
+
+	// reads the chunk's contents in from a compressed extent
+	void read_extent(Chunk &chunk, Size offset, Size length);
+
+	// called by a chunk that was read from an extent as it is first changed
+	void expand_compressed(Chunk &chunk);
+
+	// writes a batch of chunks back in ascending order, the caller holds a 
+	// reference to each of them but none of the shard locks. chunks that went 
+	// into a compressed extent meanwhile are left out. without a mapping runs 
+	// of adjacent chunks are staged into one buffer and go out as a single write
+	void write_back_batch(std::vector<Chunk *> &chunks);
+	std::atomic<uint64_t> writeback_runs {0};
+
+	// runs of chunks that were written to the backend but not synced since, 
+	// keyed by the first chunk of the run and mapping to one past its last. 
+	// sync_lock is only ever taken after (never before) a shard lock
+	std::mutex sync_lock;
+	std::map<Size, Size> unsynced;
+	uint64_t syncs = 0;
+
+	// adds [first_chunk, end_chunk) to the unsynced runs, sync_lock must be held
+	void mark_unsynced(Size first_chunk, Size end_chunk);
+
+	// counts a hit on a chunk that readahead brought in, the shard lock must be held
+	inline void note_hit(ChunkShard &shard, Chunk &chunk) {
+		shard.hits++;
+		if (chunk.prefetched.exchange(false)) 
+			shard.readahead_hits++;
+	}
+
+	// readahead, the chunks handed to prefetch are loaded into the cache by a 
+	// background thread which is started the first time it is needed
+	std::mutex readahead_lock;
+	std::condition_variable readahead_cv;
+	std::condition_variable readahead_idle_cv;
+	std::deque<std::vector<Size>> readahead_queue;
+	bool readahead_busy = false;
+	bool readahead_stop = false;
+	std::thread readahead_thread;
+	std::atomic<uint64_t> readahead_chunks {0};
+	std::atomic<Size> cache_capacity_chunks {0};
+
+	void readahead_worker();
+	void load_prefetched(const std::vector<Size> &chunk_idxs);
+
+	// chunks held in memory for as long as the disk is open, see pin
+	std::mutex pin_lock;
+	std::unordered_map<Size, ChunkRef> pinned;
+	Size locked_bytes = 0;
+
+	// background writeback, started by configure_writeback. the thread wakes 
+	// up every interval, or early once enough chunks were dirtied to push the 
+	// cache over its dirty ratio
+	std::mutex writeback_lock;
+	std::condition_variable writeback_cv;
+	std::thread writeback_thread;
+	bool writeback_stop = false;
+	bool writeback_kicked = false;
+	std::chrono::milliseconds dirty_expire {DEFAULT_DIRTY_EXPIRE_MS};
+	std::chrono::milliseconds writeback_interval {WRITEBACK_INTERVAL_MS};
+	unsigned dirty_ratio_percent = DEFAULT_DIRTY_RATIO_PERCENT;
+	std::atomic<Size> dirtied_since_pass {0};
+	std::atomic<Size> writeback_wake_threshold {0}; // 0 while there is no thread to wake
+	std::atomic<uint64_t> writeback_passes {0};
+	std::atomic<uint64_t> background_writebacks {0};
+
+	// errors of work that has no caller to throw them at, see defer_error. 
+	// only the first one since the last was raised is kept
+	std::mutex deferred_error_lock;
+	std::string deferred_error;
+	std::atomic<uint64_t> deferred_errors {0};
+
+	// throws the deferred error (if any) and forgets it
+	void raise_deferred_error();
+
+	// counts a chunk that just became dirty, kicking the writeback thread 
+	// when that pushes the cache over its dirty ratio
+	void note_dirtied();
+
+	// the threads in evict_unshared. while there are any, every reference 
+	// that is dropped (other than a chunk's last) wakes them up
+	std::atomic<uint32_t> release_waiters {0};
+	std::mutex release_lock;
+	std::condition_variable release_cv;
+	void note_released();
+	friend class ChunkRef;
+	void writeback_worker();
+	void writeback_pass();
+
+	// where the warm set is kept, nothing when warm_set_chunks is 0. the 
+	// writeback thread saves it again once it is due
+	std::mutex warm_set_lock;
+	Size warm_set_first = 0;
+	Size warm_set_chunks = 0;
+	std::chrono::milliseconds warm_set_interval {DEFAULT_WARM_SET_CHECKPOINT_MS};
+	std::chrono::steady_clock::time_point warm_set_due;
+	std::atomic<uint64_t> warm_set_saves {0};
+	std::atomic<uint64_t> warm_set_prefetched {0};
+
+	// saves the warm set if a checkpoint is due
+	void checkpoint_warm_set();
+
+	// ranges handed to discard, each only goes to the backend once whatever was 
+	// dirty when it was queued (i.e. the data the cleaner moved out of it) has 
+	// been written back. queued ones wait for that, ready ones for the rate 
+	// limit. discard_lock is held while they are issued, so a write to a range 
+	// waits for its discard (and takes it back if it has not gone out yet). 
+	// it is only ever taken after (never before) a shard lock
+	struct QueuedDiscard {
+		int64_t queued_at; // steady clock nanoseconds, as Chunk::dirty_since
+		Size first_chunk;
+		Size end_chunk;
+	};
+	std::mutex discard_lock;
+	std::atomic<bool> discard_enabled {false};
+	std::deque<QueuedDiscard> discards_queued;
+	std::map<Size, Size> discards_ready; // runs as in unsynced
+	Size discard_bytes_per_sec = DEFAULT_DISCARD_BYTES_PER_SEC;
+	double discard_budget = 0; // bytes that may be discarded right now
+	std::chrono::steady_clock::time_point discard_refilled;
+	std::atomic<uint64_t> discards {0};
+	std::atomic<uint64_t> discarded_bytes {0};
+
+	// takes [first_chunk, end_chunk) out of the discards that have not gone out 
+	// yet, called before the range is written
+	void keep_from_discard(Size first_chunk, Size end_chunk);
+	// makes the discards queued before this time ready
+	void ready_discards(int64_t queued_before);
+	// issues the ready discards the rate limit allows, or with all every one 
+	// queued, returns the bytes discarded
+	Size issue_discards(bool all);
+
+public:
+
+	struct CacheStats {
+		uint64_t hits = 0;
+		uint64_t misses = 0;
+		uint64_t evictions = 0;
+		uint64_t writebacks = 0;
+		uint64_t writeback_runs = 0; // writes of several adjacent chunks at once
+		uint64_t writeback_passes = 0; // rounds of the writeback thread
+		uint64_t background_writebacks = 0; // chunks written back by the writeback thread
+		uint64_t deferred_errors = 0; // failures of background work, see defer_error
+		Size resident_chunks = 0;
+		Size capacity_chunks = 0;
+		Size dirty_chunks = 0;
+		uint64_t syncs = 0; // merged ranges handed to the backend to sync
+		Size unsynced_chunks = 0;
+
+		uint64_t checksums_computed = 0; // as chunks were written back
+		uint64_t checksums_verified = 0; // as chunks were read in on a miss
+		uint64_t checksum_failures = 0;
+
+		uint64_t extent_reads = 0; // chunks read in from compressed extents
+		uint64_t extent_bytes_read = 0; // and the bytes read from the device for them
+		uint64_t expansions = 0; // compressed chunks that were changed
+
+		Size pinned_chunks = 0;
+		Size locked_bytes = 0; // bytes of the device the backend keeps in memory for pinned chunks
+
+		uint64_t readahead_chunks = 0; // chunks loaded by readahead
+		uint64_t readahead_hits = 0; // of those, the ones that were asked for
+
+		uint64_t warm_set_saves = 0;
+		uint64_t warm_set_prefetched = 0; // chunks of the warm set handed to readahead
+
+		uint64_t discards = 0; // ranges handed to the backend to discard
+		uint64_t discarded_bytes = 0;
+		Size discard_pending_chunks = 0; // queued or ready, not yet discarded
+		bool discard_enabled = false; // configured, and the backend has not turned a discard down
+
+		// occupancy of the chunk buffer pool
+		Size pool_slabs = 0;
+		Size pool_huge_page_slabs = 0;
+		Size pool_bytes = 0;
+		Size pool_buffers = 0;
+		Size pool_buffers_in_use = 0;
+	};
+
+	// creates a disk on a memory mapped backend (see MmapBackend)
 	// when you just want a disk use 
 	// flags: MAP_PRIVATE | MAP_ANONYMOUS
 	// when you want a disk backed by a file, provide a file descriptor and set 
 	// flags: MAP_FILE | MAP_SHARED
-	// a good explanation of these flags can be found here: https://www.gnu.org/software/hurd/glibc/mmap.html
+	// zero_copy: hand out chunks that point straight into the mapping rather 
+	// than copies of it, writes land in place and are msync'd at page granularity. 
+	// the pages are not write protected, what changed is still known from 
+	// mark_dirty: a chunk may be smaller than a page, and catching the faults 
+	// would take a process wide SIGSEGV handler
 	Disk(Size size_chunk_ctr, Size chunk_size_ctr, 
-		int flags = MAP_PRIVATE | MAP_ANONYMOUS, int fd = -1) 
-		: _chunk_size(chunk_size_ctr), _size_chunks(size_chunk_ctr) {
-		
-		this->fd = fd;
-		this->data = (Byte *)mmap64(NULL, this->size_bytes(), PROT_READ | PROT_WRITE, flags, fd, 0);
-		if (this->data == MAP_FAILED) {
-			fprintf(stdout, "MMAP failed for file handle %d\n", fd);
-			throw DiskException("failed to create the memory mapped file to back the disk");
-		}
-	}
+		int flags = MAP_PRIVATE | MAP_ANONYMOUS, int fd = -1, bool zero_copy = false);
 
-	void zero_fill() {
-		// zero out the memory mapped file
-		std::memset(this->data, 0, this->size_bytes());
-	}
+	// creates a disk on top of any backend, zero_copy is only possible when 
+	// the backend has a memory mapping
+	Disk(Size size_chunk_ctr, Size chunk_size_ctr, 
+		std::unique_ptr<DiskBackend> backend, bool zero_copy = false);
+
+	void zero_fill();
 
 	inline const Size size_bytes() const {
 		return _size_chunks * _chunk_size;
@@ -175,15 +1146,179 @@ public:
 		return _chunk_size;
 	}
 
-	std::shared_ptr<Chunk> get_chunk(Size chunk_idx);
+	inline const bool zero_copy() const {
+		return _zero_copy;
+	}
+
+	// the name of the backend, i.e. "mmap"
+	const char *backend_name() const;
+
+	ChunkRef get_chunk(Size chunk_idx);
+
+	// gets many chunks at once, returned in the order they were asked for. the 
+	// chunks that are not in memory are read in by one batch to the backend so 
+	// that an asynchronous backend can have all of those reads in flight together
+	std::vector<ChunkRef> get_chunks(const std::vector<Size> &chunk_idxs);
+
+	// gets [first_chunk, first_chunk + chunk_count) as one span, the missing 
+	// chunks are read in by a single batch as with get_chunks
+	ChunkSpan get_span(Size first_chunk, Size chunk_count);
+
+	void flush_chunk(Chunk& chunk);
+
+	// has the checksums of the chunks they cover computed as the chunks are 
+	// written back and verified as they are read in on a miss, a read that 
+	// does not match throws a DiskException. nullptr turns checksums off
+	void set_checksums(std::shared_ptr<ChunkChecksums> checksums);
+
+	// has the chunks the extents know of read in from their compressed 
+	// extents. not possible in zero copy mode, where a chunk's data can only 
+	// be its own place. nullptr turns it off
+	void set_extents(std::shared_ptr<ChunkExtents> extents);
+
+	// writes whole chunks straight to the device, bypassing the cache, for 
+	// filling chunks no one reads as chunks (i.e. compressed extents). the 
+	// copies of them in memory are left alone, they must be clean by now and 
+	// stay that way, a writeback of one that is already under way is waited for
+	void write_through(Size first_chunk, Size chunk_count, const Byte *data);
+
+	// starts bringing the chunks into memory in the background and returns 
+	// straight away. a memory mapped device is also told to start reading the 
+	// pages in (MADV_WILLNEED), other backends are read by the readahead thread
+	void prefetch(const std::vector<Size> &chunk_idxs);
+
+	// blocks until every prefetch handed to the disk so far has been dealt with
+	void wait_for_readahead();
+
+	// the chunks in memory, hottest first: the ones in use and then the buffer 
+	// cache's in the order it would keep them, taken from every shard in turn. 
+	// at most max_chunks of them
+	std::vector<Size> hot_chunks(Size max_chunks);
+
+	// keeps the warm set, the ids of the hottest chunks, in the chunks of 
+	// [first_chunk, first_chunk + chunk_count) so that the cache can be warmed 
+	// up again after a restart. it is saved when the disk is closed and by the 
+	// writeback thread every checkpoint_ms. the range must hold a count of 0 
+	// (or a warm set saved earlier) before it is first used
+	void configure_warm_set(Size first_chunk, Size chunk_count, 
+		unsigned checkpoint_ms = DEFAULT_WARM_SET_CHECKPOINT_MS);
+
+	// writes the warm set out now
+	void save_warm_set();
+
+	// hands the warm set that was saved last to readahead, as many of its 
+	// hottest chunks as the cache can hold in batches of adjacent ones, and 
+	// returns straight away with the number of chunks it asked for
+	Size load_warm_set();
+
+	// gives freed ranges back to the device (see DiskBackend::discard) so that a 
+	// thin provisioned or sparse image shrinks and an SSD knows what it need not 
+	// keep. the writeback thread issues them at up to bytes_per_sec, whatever 
+	// is left when the disk is closed. not possible in zero copy mode
+	void configure_discard(Size bytes_per_sec = DEFAULT_DISCARD_BYTES_PER_SEC);
+
+	// the contents of [first_chunk, first_chunk + chunk_count) no longer matter, 
+	// the range is discarded once the data moved out of it has been written 
+	// back, unless it is written again before that. nothing happens unless 
+	// configure_discard was called
+	void discard(Size first_chunk, Size chunk_count);
 
-	void flush_chunk(const Chunk& chunk);
+	// tells the backend how [first_chunk, first_chunk + chunk_count) is going to 
+	// be accessed, i.e. madvise on a memory mapped device
+	void advise(Size first_chunk, Size chunk_count, AccessPattern pattern);
+
+	// keeps the chunks of the range in memory until the disk is closed: they 
+	// are loaded now and held outside of the buffer cache so that no scan can 
+	// evict them. with lock_pages a memory mapped device also has their pages 
+	// locked (mlock) when the limits allow it. pinning a chunk again changes nothing
+	void pin(Size first_chunk, Size chunk_count, bool lock_pages = true);
+	void unpin_all();
+
+	// sets the memory budget of the buffer cache, a budget of 0 disables it 
+	// so chunks are written back as soon as their last reference is dropped
+	void configure_cache(Size budget_bytes, CachePolicy policy = CachePolicy::CLOCK);
+
+	// switches the chunk buffers over to slabs of 2 MB huge pages (or back), 
+	// only possible while no chunk is in memory
+	void configure_buffers(bool huge_pages);
+
+	// drops the buffer cache's reference to the chunk, used when the contents of 
+	// a chunk no longer matter (i.e. it was freed)
+	void evict_chunk(Size chunk_idx);
+
+	// evicts the chunk and waits until the caller's reference is the only one 
+	// left. the disk's own threads (readahead, writeback, a flush or sync, the 
+	// warm set) only hold chunks for as long as their I/O takes, the wait is 
+	// for them. evicting again each time one lets go, in case readahead has 
+	// just made the chunk resident again
+	void evict_unshared(ChunkRef &chunk);
+
+	// starts the writeback thread (or retunes it): dirty chunks are written 
+	// back in the background once they have been dirty for dirty_expire_ms, 
+	// or, oldest first, whenever more than dirty_ratio_percent of the cache's 
+	// capacity is dirty. chunks are then mostly clean by the time they are 
+	// evicted or released, so that no longer costs a write on whichever thread 
+	// happens to drop them
+	void configure_writeback(unsigned dirty_expire_ms = DEFAULT_DIRTY_EXPIRE_MS, 
+		unsigned dirty_ratio_percent = DEFAULT_DIRTY_RATIO_PERCENT, 
+		unsigned interval_ms = WRITEBACK_INTERVAL_MS);
+
+	// stops the writeback thread, chunks are then written back when released again
+	void stop_writeback();
+
+	// runs one round of background writeback right away, on the calling thread 
+	// (with the default thresholds if the thread was never configured), and 
+	// then issues the discards that became due
+	void run_writeback();
+
+	// writes back every dirty chunk held in the buffer cache, as a single batch
+	void flush_all();
+
+	// writes back every dirty chunk in [first_chunk, first_chunk + chunk_count), 
+	// resident or still in use, and makes everything written there durable. 
+	// adjacent chunks are merged so that each run takes a single sync
+	void sync(Size first_chunk, Size chunk_count);
+	void sync_all();
+
+	// records a failure of work done for the disk where there is no one to 
+	// throw it at, i.e. on the writeback thread. the next sync, sync_all or 
+	// try_close throws it once it has done its own work
+	void defer_error(const std::string &message);
+
+	CacheStats cache_stats();
 
 	void try_close();
 
 	~Disk();
 };
 
+inline void Chunk::mark_dirty() {
+	// a chunk stored in a compressed extent can not simply be written back in 
+	// place, that has to be dealt with before it is changed
+	if (this->compressed.load(std::memory_order_relaxed)) 
+		this->parent->expand_compressed(*this);
+
+	// only a clean chunk becoming dirty is of interest, which spares the 
+	// common case of writing to an already dirty chunk the atomic exchange
+	if (this->dirty.load(std::memory_order_relaxed) || this->dirty.exchange(true)) 
+		return ;
+	this->dirty_since = std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+	this->parent->note_dirtied();
+}
+
+inline void ChunkRef::drop() {
+	if (chunk == nullptr) 
+		return ;
+	// the chunk may be gone as soon as the count is down, the disk is not
+	Disk *parent = chunk->parent;
+	if (chunk->refs.fetch_sub(1, std::memory_order_seq_cst) == 1) {
+		delete chunk;
+	} else if (parent->release_waiters.load(std::memory_order_seq_cst) != 0) {
+		parent->note_released();
+	}
+}
+
 /*
 	A utility class that implements a bitmap ontop of a range of chunks
 */
@@ -192,7 +1327,7 @@ struct DiskBitMap {
 
 	Disk *disk;
 	Size size_in_bits;
-	std::vector<std::shared_ptr<Chunk>> chunks;
+	ChunkSpan chunks;
 	Size last_search_idx = 0;
 	Size disk_chunk_size = 0;
 	
@@ -202,6 +1337,10 @@ struct DiskBitMap {
 
 	void clear_all();
 
+	// clears the bytes holding the first bit_count bits only, for a map 
+	// whose other bits are never looked at
+	void clear_first(Size bit_count);
+
 	inline Size size_bytes() const {
 		// add an extra byte which will be used for padding
 		return size_in_bits / 8 + 8; // plenty of padding
@@ -213,14 +1352,21 @@ struct DiskBitMap {
 
 	inline const Byte get_byte_for_idx(Size idx) const {
 		uint64_t byte_idx = idx / 8;
-		Byte *data = this->chunks[byte_idx / disk_chunk_size]->data;
+		Byte *data = this->chunks.chunk(byte_idx / disk_chunk_size).data;
 		return data[byte_idx % disk_chunk_size];
 	}
 
-	inline Byte &get_byte_for_idx(Size idx) {
+	// sets or clears the bit, the chunk is marked dirty once it is changed
+	inline void store_bit_for_idx(Size idx, bool value) {
 		uint64_t byte_idx = idx / 8;
-		Byte *data = this->chunks[byte_idx / disk_chunk_size]->data;
-		return data[byte_idx % disk_chunk_size];
+		Chunk &chunk = this->chunks.chunk(byte_idx / disk_chunk_size);
+		Byte &byte = chunk.data[byte_idx % disk_chunk_size];
+		if (value) {
+			byte |= (1 << (idx % 8));
+		} else {
+			byte &= ~(1 << (idx % 8));
+		}
+		chunk.mark_dirty();
 	}
 
 	inline bool get(Size idx) const {
@@ -233,24 +1379,21 @@ struct DiskBitMap {
 
 	// allows setting 'out of bounds'
 	inline void set_oob(Size idx) {
-		Byte& byte = get_byte_for_idx(idx);
-		byte |= (1 << (idx % 8));
+		store_bit_for_idx(idx, true);
 	}
 
 	inline void set(Size idx) {
 		if (idx >= size_in_bits) {
 			throw DiskException("BitMap index out of range");
 		}
-		Byte& byte = get_byte_for_idx(idx);
-		byte |= (1 << (idx % 8));
+		store_bit_for_idx(idx, true);
 	}
 
 	inline void clr(Size idx) {
 		if (idx >= size_in_bits) {
 			throw DiskException("BitMap index out of range");
 		}
-		Byte& byte = get_byte_for_idx(idx);
-		byte &= ~(1 << (idx % 8));
+		store_bit_for_idx(idx, false);
 	}
 
 	struct BitRange {
@@ -2,92 +2,98 @@
 #include <array>
 #include <vector>
 #include <memory>
+#include <algorithm>
 #include <cassert>
+#include <cstring>
 #include <sstream>
+#include <unistd.h>
+#include <sys/stat.h>
 
 #include "diskinterface.hpp"
 #include "filesystem.hpp"
+#include "crc32c.hpp"
+#include "lz4.hpp"
 
 // #define DEBUG
 
 using Size = uint64_t;
 
 const uint64_t INode::INDIRECT_TABLE_SIZES[4] = {DIRECT_ADDRESS_COUNT, INDIRECT_ADDRESS_COUNT, DOUBLE_INDIRECT_ADDRESS_COUNT, TRIPPLE_INDIRECT_ADDRESS_COUNT};
-
-uint64_t INode::read(uint64_t starting_offset, char *buf, uint64_t bytes_to_write) {
+constexpr uint64_t SuperBlock::MIN_CHUNK_SIZE;
+constexpr uint64_t SuperBlock::MAX_CHUNK_SIZE;
+constexpr uint64_t SuperBlock::DEFAULT_CHUNK_SIZE;
+constexpr uint64_t SuperBlock::SUMMARY_CHECKSUMS_CRC32C;
+constexpr uint64_t SuperBlock::WARM_SET_MAX_CHUNKS;
+constexpr uint32_t SegmentSummaries::EXTENT_DROPPED;
+constexpr uint64_t DedupIndex::ENTRY_BYTES;
+constexpr uint64_t SegmentController::SHARED_CHUNK_OWNER;
+constexpr uint64_t INode::READ_BATCH_CHUNKS;
+constexpr uint64_t INode::READAHEAD_MIN_CHUNKS;
+constexpr uint64_t INode::READAHEAD_MAX_CHUNKS;
+
+uint64_t INode::read(uint64_t starting_offset, char *buf, uint64_t bytes_to_read) {
 	const uint64_t chunk_size = this->superblock->disk_chunk_size;
-    int64_t n = bytes_to_write;
-    uint64_t bytes_written = bytes_to_write;
-
-    if (starting_offset + bytes_to_write > this->data.file_size) {
-        // TODO: test this error case
-        if (starting_offset > this->data.file_size) 
-            return 0;
-
-        bytes_to_write = this->data.file_size - starting_offset;
-    }
-    
-    // room to write for the first chunk
-    const uint64_t room_first_chunk = chunk_size - starting_offset % chunk_size;
-    uint64_t bytes_write_first_chunk = room_first_chunk;
-    if (n < room_first_chunk) {
-        bytes_write_first_chunk = n;
-    }
-
-    {
-        std::shared_ptr<Chunk> chunk = this->resolve_indirection(starting_offset / chunk_size, false);
-        if (chunk == nullptr) {
-            std::memset(buf, 0, bytes_write_first_chunk);
-        } else {
-            std::lock_guard<std::mutex> g(chunk->lock);
-            std::memcpy(buf, chunk->data + starting_offset % chunk_size, bytes_write_first_chunk);
+    uint64_t n = bytes_to_read;
+
+    if (starting_offset > this->data.file_size) 
+        return 0;
+
+    // nothing past the end of the file is read, batched or read ahead
+    if (n > this->data.file_size - starting_offset) 
+        n = this->data.file_size - starting_offset;
+    const uint64_t bytes_read = n;
+
+    if (n > 0) 
+        this->read_ahead(starting_offset / chunk_size, (starting_offset + n + chunk_size - 1) / chunk_size);
+
+    // the chunks of the range are requested from the disk in batches, so the 
+    // reads of a large request can all be in flight at once
+    while (n > 0) {
+        const uint64_t first_chunk_number = starting_offset / chunk_size;
+        const uint64_t offset_in_first_chunk = starting_offset % chunk_size;
+        uint64_t chunk_count = (offset_in_first_chunk + n + chunk_size - 1) / chunk_size;
+        if (chunk_count > READ_BATCH_CHUNKS) 
+            chunk_count = READ_BATCH_CHUNKS;
+
+        // holes in the file (location 0) read as zeros and are not requested
+        std::vector<uint64_t> locations(chunk_count);
+        std::vector<Size> chunk_idxs;
+        for (uint64_t idx = 0; idx < chunk_count; ++idx) {
+            locations[idx] = this->lookup_chunk_idx(first_chunk_number + idx);
+            if (locations[idx] != 0) 
+                chunk_idxs.push_back(locations[idx]);
         }
-        
-        buf += bytes_write_first_chunk;
-        n -= bytes_write_first_chunk;
-    }
-    
+        std::vector<ChunkRef> chunks = this->superblock->disk->get_chunks(chunk_idxs);
 
-    if (n == 0) { // early return if we wrote less than a chunk
-        return bytes_to_write;
-    }
-
-    // fix the starting offset
-    starting_offset += bytes_write_first_chunk;
-    assert(starting_offset % chunk_size == 0);
+        auto next_chunk = chunks.begin();
+        for (uint64_t idx = 0; idx < chunk_count; ++idx) {
+            const uint64_t offset_in_chunk = idx == 0 ? offset_in_first_chunk : 0;
+            uint64_t bytes_this_chunk = chunk_size - offset_in_chunk;
+            if (n < bytes_this_chunk) 
+                bytes_this_chunk = n;
 
-    while (n > chunk_size) {
-        std::shared_ptr<Chunk> chunk = this->resolve_indirection(starting_offset / chunk_size, false);
-        if (chunk == nullptr) {
-            std::memset(buf, 0, chunk_size);
-        } else {
-            std::lock_guard<std::mutex> g(chunk->lock);
-            std::memcpy(buf, chunk->data, chunk_size);
-        }
+            if (locations[idx] == 0) {
+                std::memset(buf, 0, bytes_this_chunk);
+            } else {
+                ChunkRef &chunk = *next_chunk++;
+                std::lock_guard<std::mutex> g(chunk->lock);
+                std::memcpy(buf, chunk->data + offset_in_chunk, bytes_this_chunk);
+            }
 
-        buf += chunk_size;
-        n -= chunk_size;
-        starting_offset += chunk_size;
-    }
-    
-    {
-        std::shared_ptr<Chunk> chunk = this->resolve_indirection(starting_offset / chunk_size, false);
-        if (chunk == nullptr) {
-            std::memset(buf, 0, n);
-        } else {
-            std::lock_guard<std::mutex> g(chunk->lock);
-            std::memcpy(buf, chunk->data, n);
+            buf += bytes_this_chunk;
+            n -= bytes_this_chunk;
+            starting_offset += bytes_this_chunk;
         }
     }
 
-    return bytes_written;
+    return bytes_read;
 }
 
 uint64_t INode::write(uint64_t starting_offset, const char *buf, uint64_t bytes_to_write) {
     //clean whenever we have less than this percentage of disk free
     const double threshold = 0.25;
 
-    if(this->superblock->segment_controller.num_free_segments <= this->superblock->segment_controller.num_segments * threshold) {
+    if(this->superblock->segment_controller.needs_cleaning(threshold)) {
         this->superblock->segment_controller.clean();
     }
 
@@ -103,11 +109,16 @@ uint64_t INode::write(uint64_t starting_offset, const char *buf, uint64_t bytes_
         }
 
         {
-            std::shared_ptr<Chunk> chunk = this->resolve_indirection(starting_offset / chunk_size, true);
-            std::lock_guard<std::mutex> g(chunk->lock);
-            assert(bytes_write_first_chunk <= chunk_size);
-            assert(starting_offset % chunk_size + bytes_write_first_chunk <= chunk_size);
-            chunk->memcpy(chunk->data + (starting_offset % chunk_size), buf, bytes_write_first_chunk);
+            ChunkRef chunk = this->resolve_indirection(starting_offset / chunk_size, true);
+            {
+                std::lock_guard<std::mutex> g(chunk->lock);
+                assert(bytes_write_first_chunk <= chunk_size);
+                assert(starting_offset % chunk_size + bytes_write_first_chunk <= chunk_size);
+                chunk->memcpy(chunk->data + (starting_offset % chunk_size), buf, bytes_write_first_chunk);
+            }
+            if (bytes_write_first_chunk == chunk_size) {
+                this->deduplicate(starting_offset / chunk_size, std::move(chunk));
+            }
             buf += bytes_write_first_chunk;
             n -= bytes_write_first_chunk;
         }
@@ -125,9 +136,12 @@ uint64_t INode::write(uint64_t starting_offset, const char *buf, uint64_t bytes_
         assert(starting_offset % chunk_size == 0);
 
         while (n > chunk_size) {
-            std::shared_ptr<Chunk> chunk = this->resolve_indirection(starting_offset / chunk_size, true);
-            std::lock_guard<std::mutex> g(chunk->lock);
-            chunk->memcpy(chunk->data, buf, chunk_size);
+            ChunkRef chunk = this->resolve_indirection(starting_offset / chunk_size, true);
+            {
+                std::lock_guard<std::mutex> g(chunk->lock);
+                chunk->memcpy(chunk->data, buf, chunk_size);
+            }
+            this->deduplicate(starting_offset / chunk_size, std::move(chunk));
             buf += chunk_size;
             n -= chunk_size;
             starting_offset += chunk_size;
@@ -135,9 +149,14 @@ uint64_t INode::write(uint64_t starting_offset, const char *buf, uint64_t bytes_
         
         {
             assert(n <= chunk_size);
-            std::shared_ptr<Chunk> chunk = this->resolve_indirection(starting_offset / chunk_size, true);
-            std::lock_guard<std::mutex> g(chunk->lock);
-            chunk->memcpy(chunk->data, buf, n);
+            ChunkRef chunk = this->resolve_indirection(starting_offset / chunk_size, true);
+            {
+                std::lock_guard<std::mutex> g(chunk->lock);
+                chunk->memcpy(chunk->data, buf, n);
+            }
+            if (n == chunk_size) {
+                this->deduplicate(starting_offset / chunk_size, std::move(chunk));
+            }
         }
     } catch (const FileSystemException& e) {
         // make sure the filesize at the end is correct no matter what happens
@@ -155,7 +174,7 @@ uint64_t INode::write(uint64_t starting_offset, const char *buf, uint64_t bytes_
     return bytes_to_write;
 }
 
-// static std::shared_ptr<Chunk> resolve_indirection_helper(
+// static ChunkRef resolve_indirection_helper(
 //     INode *inode, 
 //     uint64_t *indirect_table, 
 //     const uint64_t chunk_number,
@@ -167,11 +186,11 @@ uint64_t INode::write(uint64_t starting_offset, const char *buf, uint64_t bytes_
 //     const uint64_t num_chunk_address_per_chunk = inode->superblock->disk_chunk_size / sizeof(uint64_t);
 
 //     // go through the process of getting the chunk
-//     std::shared_ptr<Chunk> chunk = nullptr;
+//     ChunkRef chunk = nullptr;
 //     if (createIfNotExists) {
 //         chunk = inode->superblock->allocate_chunk(inode->inode_table_idx);
 //         if (next_chunk_loc == 0) {
-//             std::shared_ptr<Chunk> inherit_from = inode->superblock->disk->get_chunk(next_chunk_loc);
+//             ChunkRef inherit_from = inode->superblock->disk->get_chunk(next_chunk_loc);
 //             std::memcpy(chunk->data, inherit_from->data, chunk->size_bytes);
 //         } else {
 //             std::memset(chunk->data, 0, chunk->size_bytes);
@@ -203,7 +222,7 @@ uint64_t INode::write(uint64_t starting_offset, const char *buf, uint64_t bytes_
 //     }
 // }
 
-// std::shared_ptr<Chunk> INode::resolve_indirection(uint64_t chunk_number, bool createIfNotExists) {
+// ChunkRef INode::resolve_indirection(uint64_t chunk_number, bool createIfNotExists) {
 //     const uint64_t num_chunk_address_per_chunk = superblock->disk_chunk_size / sizeof(uint64_t);
 //     uint64_t indirect_address_count = 1;
 
@@ -241,7 +260,7 @@ uint64_t INode::write(uint64_t starting_offset, const char *buf, uint64_t bytes_
 //     return nullptr;
 // }
 
-std::shared_ptr<Chunk> INode::resolve_indirection(uint64_t chunk_number, bool createIfNotExists) {
+ChunkRef INode::resolve_indirection(uint64_t chunk_number, bool createIfNotExists) {
     const uint64_t num_chunk_address_per_chunk = superblock->disk_chunk_size / sizeof(uint64_t);
     uint64_t indirect_address_count = 1;
 
@@ -274,8 +293,13 @@ std::shared_ptr<Chunk> INode::resolve_indirection(uint64_t chunk_number, bool cr
                 return nullptr;
             }
 
+            // a chunk that was just allocated is handed on as it is rather than 
+            // being looked up again
+            ChunkRef chunk = nullptr;
             if (createIfNotExists) {
-                std::shared_ptr<Chunk> newChunk = this->superblock->allocate_chunk(this->inode_table_idx);
+                // indirection tables and whole directories go with the metadata
+                ChunkRef newChunk = this->superblock->allocate_chunk(this->inode_table_idx, 
+                    indirection != 0 || this->data.file_type == FLAG_IF_DIR);
 #ifdef DEBUG 
                 fprintf(stdout, "next_chunk_loc was 0, so we created new "
                     "chunk id %zu/%llu and placed it in the table\n", 
@@ -283,14 +307,15 @@ std::shared_ptr<Chunk> INode::resolve_indirection(uint64_t chunk_number, bool cr
                     this->superblock->disk->size_chunks());
 #endif
                 if (next_chunk_loc != 0) {
-                    std::shared_ptr<Chunk> oldChunk = this->superblock->disk->get_chunk(next_chunk_loc);
-                    newChunk->memcpy((void *)newChunk->data, (void *)oldChunk->data, newChunk->size_bytes, oldChunk);
+                    ChunkRef oldChunk = this->superblock->disk->get_chunk(next_chunk_loc);
+                    newChunk->memcpy((void *)newChunk->data, (void *)oldChunk->data, newChunk->size_bytes, oldChunk.get());
                     this->superblock->segment_controller.free_chunk(std::move(oldChunk));
                 } else {
                     newChunk->memset((void *)newChunk->data, 0, newChunk->size_bytes);
                 }
                 indirect_table[indirect_table_idx] = newChunk->chunk_idx;
                 next_chunk_loc = newChunk->chunk_idx;
+                chunk = std::move(newChunk);
                 
 #ifdef DEBUG
                 fprintf(stdout, "the real next_chunk_loc is %llu\n", next_chunk_loc);
@@ -300,7 +325,8 @@ std::shared_ptr<Chunk> INode::resolve_indirection(uint64_t chunk_number, bool cr
 #ifdef DEBUG
             fprintf(stdout, "chasing chunk through the indirection table:\n");
 #endif 
-            std::shared_ptr<Chunk> chunk = superblock->disk->get_chunk(next_chunk_loc);
+            if (chunk == nullptr) 
+                chunk = superblock->disk->get_chunk(next_chunk_loc);
             // TODO: implement locking on this chunk, this will be HARD HARD HARD because of all the places
             // the reference to the chunk is changed
 
@@ -324,25 +350,29 @@ std::shared_ptr<Chunk> INode::resolve_indirection(uint64_t chunk_number, bool cr
                     return nullptr;
                 }
 
+                ChunkRef next = nullptr;
                 if (createIfNotExists) {
-                    std::shared_ptr<Chunk> newChunk = this->superblock->allocate_chunk(this->inode_table_idx);
+                    ChunkRef newChunk = this->superblock->allocate_chunk(this->inode_table_idx, 
+                        indirection != 1 || this->data.file_type == FLAG_IF_DIR);
                     if (next_chunk_loc != 0) {
-                        std::shared_ptr<Chunk> oldChunk = this->superblock->disk->get_chunk(next_chunk_loc);
-                        newChunk->memcpy((void *)newChunk->data, (void *)oldChunk->data, newChunk->size_bytes, oldChunk);
+                        ChunkRef oldChunk = this->superblock->disk->get_chunk(next_chunk_loc);
+                        newChunk->memcpy((void *)newChunk->data, (void *)oldChunk->data, newChunk->size_bytes, oldChunk.get());
                         this->superblock->segment_controller.free_chunk(std::move(oldChunk));
                     } else {
                         newChunk->memset((void *)newChunk->data, 0, newChunk->size_bytes);
                     }
                     next_chunk_loc = newChunk->chunk_idx;
                     lookup_table[chunk_number / indirect_address_count] = newChunk->chunk_idx;
+                    chunk->mark_dirty();
 #ifdef DEBUG 
                     fprintf(stdout, "\tnext_chunk_loc was 0, so we created new "
                         "chunk id %zu/%llu and placed it in the table\n", 
                         newChunk->chunk_idx, this->superblock->disk->size_chunks());
 #endif 
+                    next = std::move(newChunk);
                 }
 
-                chunk = superblock->disk->get_chunk(next_chunk_loc);
+                chunk = next != nullptr ? std::move(next) : superblock->disk->get_chunk(next_chunk_loc);
                 chunk_number %= indirect_address_count;
 
                 indirection--;
@@ -366,6 +396,125 @@ std::shared_ptr<Chunk> INode::resolve_indirection(uint64_t chunk_number, bool cr
     return nullptr;
 }
 
+void INode::set_chunk_idx(uint64_t chunk_number, uint64_t chunk_idx) {
+    const uint64_t num_chunk_address_per_chunk = superblock->disk_chunk_size / sizeof(uint64_t);
+    uint64_t indirect_address_count = 1;
+
+    // the same walk as lookup_chunk_idx, but the last entry is changed
+    uint64_t *indirect_table = data.addresses; 
+    for(uint64_t indirection = 0; indirection < sizeof(INDIRECT_TABLE_SIZES) / sizeof(uint64_t); indirection++){
+        if(chunk_number < (indirect_address_count * INDIRECT_TABLE_SIZES[indirection])){
+            if (indirection == 0) {
+                indirect_table[chunk_number] = chunk_idx;
+                return ;
+            }
+            ChunkRef chunk = superblock->disk->get_chunk(indirect_table[chunk_number / indirect_address_count]);
+            chunk_number %= indirect_address_count;
+            while (true) {
+                indirect_address_count /= num_chunk_address_per_chunk;
+                assert(chunk->chunk_idx != 0);
+                if (--indirection == 0) {
+                    ((uint64_t *)chunk->data)[chunk_number / indirect_address_count] = chunk_idx;
+                    chunk->mark_dirty();
+                    return ;
+                }
+                chunk = superblock->disk->get_chunk(((const uint64_t *)chunk->data)[chunk_number / indirect_address_count]);
+                chunk_number %= indirect_address_count;
+            }
+        }
+        chunk_number -= (indirect_address_count * INDIRECT_TABLE_SIZES[indirection]);
+        indirect_table += INDIRECT_TABLE_SIZES[indirection];
+        indirect_address_count *= num_chunk_address_per_chunk;
+    }
+    throw FileSystemException("INode indirection table ran out of space");
+}
+
+void INode::deduplicate(uint64_t chunk_number, ChunkRef chunk) {
+    DedupIndex *index = this->superblock->dedup_index.get();
+    if (index == nullptr) {
+        return ;
+    }
+    const uint64_t stored_idx = index->share(*chunk, this->inode_table_idx);
+    if (stored_idx == 0) {
+        return ;
+    }
+    // the file points at the copy that was already there, the one just written 
+    // is freed again before it was ever written back
+    this->set_chunk_idx(chunk_number, stored_idx);
+    this->superblock->segment_controller.free_chunk(std::move(chunk));
+}
+
+void INode::read_ahead(uint64_t first_chunk_number, uint64_t end_chunk_number) {
+    const uint64_t chunk_size = this->superblock->disk_chunk_size;
+
+    // a read that starts where the last one stopped, or in its last chunk, is sequential
+    const bool sequential = first_chunk_number == readahead.next_chunk_number || 
+        (readahead.next_chunk_number > 0 && first_chunk_number == readahead.next_chunk_number - 1);
+    readahead.next_chunk_number = end_chunk_number;
+    if (!sequential) {
+        readahead.window = 0;
+        readahead.prefetched_until = end_chunk_number;
+        return ;
+    }
+
+    if (readahead.window == 0) {
+        readahead.window = READAHEAD_MIN_CHUNKS;
+    } else if (readahead.window < READAHEAD_MAX_CHUNKS) {
+        readahead.window *= 2;
+    }
+
+    // the next batch is issued once less than half a window is left ahead of the reader
+    if (readahead.prefetched_until < end_chunk_number) 
+        readahead.prefetched_until = end_chunk_number;
+    if (readahead.prefetched_until - end_chunk_number > readahead.window / 2) 
+        return ;
+
+    uint64_t stop = end_chunk_number + readahead.window;
+    const uint64_t file_end_chunk_number = (this->data.file_size + chunk_size - 1) / chunk_size;
+    if (stop > file_end_chunk_number) 
+        stop = file_end_chunk_number;
+    if (stop <= readahead.prefetched_until) 
+        return ;
+
+    std::vector<Size> chunk_idxs;
+    for (uint64_t chunk_number = readahead.prefetched_until; chunk_number < stop; ++chunk_number) {
+        uint64_t chunk_idx = this->lookup_chunk_idx(chunk_number);
+        if (chunk_idx != 0) 
+            chunk_idxs.push_back(chunk_idx);
+    }
+    readahead.prefetched_until = stop;
+    this->superblock->disk->prefetch(chunk_idxs);
+}
+
+uint64_t INode::lookup_chunk_idx(uint64_t chunk_number) {
+    const uint64_t num_chunk_address_per_chunk = superblock->disk_chunk_size / sizeof(uint64_t);
+    uint64_t indirect_address_count = 1;
+
+    // the same walk as resolve_indirection, but the chunk at the end is not loaded
+    const uint64_t *indirect_table = data.addresses; 
+    for(uint64_t indirection = 0; indirection < sizeof(INDIRECT_TABLE_SIZES) / sizeof(uint64_t); indirection++){
+        if(chunk_number < (indirect_address_count * INDIRECT_TABLE_SIZES[indirection])){
+            uint64_t next_chunk_loc = indirect_table[chunk_number / indirect_address_count];
+
+            while (indirection != 0 && next_chunk_loc != 0) {
+                indirect_address_count /= num_chunk_address_per_chunk;
+                ChunkRef chunk = superblock->disk->get_chunk(next_chunk_loc);
+                const uint64_t *lookup_table = (const uint64_t *)chunk->data;
+                next_chunk_loc = lookup_table[chunk_number / indirect_address_count];
+                chunk_number %= indirect_address_count;
+                indirection--;
+            }
+
+            return next_chunk_loc;
+        }
+        chunk_number -= (indirect_address_count * INDIRECT_TABLE_SIZES[indirection]);
+        indirect_table += INDIRECT_TABLE_SIZES[indirection];
+        indirect_address_count *= num_chunk_address_per_chunk;
+    }
+
+    return 0;
+}
+
 static uint64_t update_indirect_locations(INode *inode, const std::unordered_map<uint64_t, uint64_t> &mapping, const uint64_t old_chunk_idx, const uint64_t indirection) {
     const uint64_t num_chunk_address_per_chunk = inode->superblock->disk_chunk_size / sizeof(uint64_t);
 
@@ -377,12 +526,17 @@ static uint64_t update_indirect_locations(INode *inode, const std::unordered_map
 
     if (indirection > 0) {
         // get a copy of our indirect chunk
-        std::shared_ptr<Chunk> chunk = inode->superblock->disk->get_chunk(chunk_idx);
-        uint64_t *indirect_page = (uint64_t *)chunk->data;
+        ChunkRef chunk = inode->superblock->disk->get_chunk(chunk_idx);
+        const uint64_t *indirect_page = (const uint64_t *)chunk->data;
 
         for (size_t idx = 0; idx < num_chunk_address_per_chunk; idx++) {
             if (indirect_page[idx] != 0) {
-                indirect_page[idx] = update_indirect_locations(inode, mapping, indirect_page[idx], indirection - 1);
+                const uint64_t updated = update_indirect_locations(inode, mapping, indirect_page[idx], indirection - 1);
+                // a table none of whose chunks moved stays clean (and compressed, if it is)
+                if (updated != indirect_page[idx]) {
+                    ((uint64_t *)chunk->data)[idx] = updated;
+                    chunk->mark_dirty();
+                }
             }
         }
     }
@@ -404,11 +558,38 @@ void INode::update_chunk_locations(const std::unordered_map<uint64_t, uint64_t>
     }
 }
 
+static void indirect_chunk_locations(INode *inode, const uint64_t chunk_idx, const uint64_t indirection, std::vector<uint64_t> &locations) {
+    locations.push_back(chunk_idx);
+    if (indirection > 0) {
+        const uint64_t num_chunk_address_per_chunk = inode->superblock->disk_chunk_size / sizeof(uint64_t);
+        ChunkRef chunk = inode->superblock->disk->get_chunk(chunk_idx);
+        const uint64_t *indirect_page = (const uint64_t *)chunk->data;
+        for (size_t idx = 0; idx < num_chunk_address_per_chunk; idx++) {
+            if (indirect_page[idx] != 0) {
+                indirect_chunk_locations(inode, indirect_page[idx], indirection - 1, locations);
+            }
+        }
+    }
+}
+
+void INode::chunk_locations(std::vector<uint64_t> &locations) {
+    const uint64_t *indirect_table = this->data.addresses; 
+
+    for(uint64_t indirection = 0; indirection < sizeof(INDIRECT_TABLE_SIZES) / sizeof(uint64_t); indirection++){
+        for (uint64_t offset = 0; offset < INDIRECT_TABLE_SIZES[indirection]; ++offset) {
+            if (indirect_table[offset] != 0) {
+                indirect_chunk_locations(this, indirect_table[offset], indirection, locations);
+            }
+        }
+        indirect_table += INDIRECT_TABLE_SIZES[indirection];
+    }
+}
+
 void INode::release_chunks() {
     fprintf(stdout, "INode is releasing its allocated chunks: free'd chunks... ");
     uint64_t rough_chunk_count = this->data.file_size / this->superblock->disk->chunk_size() + 1;
     for (size_t idx = 0; idx < rough_chunk_count; ++idx) {
-        std::shared_ptr<Chunk> chunk = resolve_indirection(idx, false);
+        ChunkRef chunk = resolve_indirection(idx, false);
         if (chunk == nullptr) 
             continue ;
         fprintf(stdout, "%d, ", chunk->chunk_idx);
@@ -472,13 +653,19 @@ std::shared_ptr<INode> INodeTable::alloc_inode() {
 }
 
 std::shared_ptr<INode> INodeTable::get_inode(uint64_t idx) {
-    std::lock_guard<std::recursive_mutex> g(this->lock);
-
     if (idx >= inode_count) 
         throw FileSystemException("INode index out of bounds");
+
+    // an inode someone is holding on to is in use, it is handed out without the lock
+    if (auto inode = this->inodecache.get(idx)) {
+        return inode;
+    }
+
+    std::lock_guard<std::recursive_mutex> g(this->lock);
     if (!used_inodes->get(idx)) 
         throw FileSystemException("INode at index is not currently in use. You can't have it.");
     
+    // another thread may have loaded it while we waited for the lock
     if (auto inode = this->inodecache.get(idx)) {
         return inode;
     }
@@ -486,10 +673,12 @@ std::shared_ptr<INode> INodeTable::get_inode(uint64_t idx) {
     std::shared_ptr<INode> inode(new INode);
     uint64_t chunk_idx = inode_ilist_offset + idx / inodes_per_chunk;
     uint64_t chunk_offset = idx % inodes_per_chunk;
-    std::shared_ptr<Chunk> chunk = superblock->disk->get_chunk(chunk_idx);
+    ChunkRef chunk = superblock->disk->get_chunk(chunk_idx);
     std::memcpy((void *)(&(inode->data)), chunk->data + sizeof(INode::INodeData) * chunk_offset, sizeof(INode::INodeData));
     inode->superblock = this->superblock;
     inode->inode_table_idx = idx;
+    // so that everyone using the inode at the same time shares one copy of it
+    this->inodecache.put(idx, inode);
     return inode;
 }
 
@@ -503,25 +692,33 @@ void INodeTable::update_inode(const INode& inode) {
 
     uint64_t chunk_idx = inode_ilist_offset + inode.inode_table_idx / inodes_per_chunk;
     uint64_t chunk_offset = inode.inode_table_idx % inodes_per_chunk;
-    std::shared_ptr<Chunk> chunk = superblock->disk->get_chunk(chunk_idx);
+    ChunkRef chunk = superblock->disk->get_chunk(chunk_idx);
 
     assert((Byte *)(chunk->data + sizeof(INode::INodeData) * chunk_offset + sizeof(INode::INodeData)) < chunk->data + chunk->size_bytes);
 
-    chunk->memcpy((void *)(chunk->data + sizeof(INode::INodeData) * chunk_offset), (void *)(&(inode.data)), sizeof(INode::INodeData));
+    // every inode is stored back when it is released, but only one that changed 
+    // should dirty the ilist chunk
+    Byte *stored = chunk->data + sizeof(INode::INodeData) * chunk_offset;
+    if (std::memcmp(stored, (void *)(&(inode.data)), sizeof(INode::INodeData)) != 0) {
+        chunk->memcpy((void *)stored, (void *)(&(inode.data)), sizeof(INode::INodeData));
+    }
 }
 
 void INodeTable::free_inode(std::shared_ptr<INode> inode) {
     std::lock_guard<std::recursive_mutex> g(this->lock);
 
+    if (inode->inode_table_idx >= inode_count) 
+        throw FileSystemException("INode index out of bounds");
+
+    // get_inode finds a cached inode without the lock, so it is taken out of the 
+    // cache first. once erase returns no one can get another reference to it
+    uint64_t index = inode->inode_table_idx;
+    this->inodecache.erase(index);
     if (!inode.unique()) {
+        this->inodecache.put(index, inode);
         throw FileSystemException("To free an inode you must hand a UNIQUE reference that no other thread currently holds to free_inode");
         // you may optionally spin until you can acquire a unique reference to the inode in order to remove it
     }
-
-    if (inode->inode_table_idx >= inode_count) 
-        throw FileSystemException("INode index out of bounds");
-    
-    uint64_t index = inode->inode_table_idx;
     inode = nullptr;
 
     used_inodes->clr(index);
@@ -533,9 +730,78 @@ SuperBlock::SuperBlock(Disk *disk)
     disk_chunk_size(disk->chunk_size()) {
 }
 
+SuperBlock::~SuperBlock() {
+    if (this->warm_set_size_chunks == 0) {
+        return ;
+    }
+    try {
+        disk->save_warm_set();
+    } catch (const DiskException &e) {
+        // the disk outlives us, its next sync reports it
+        disk->defer_error("saving the warm set failed: " + e.message);
+    }
+    // the disk may outlive the file system, it is not to write there on its own any more
+    disk->configure_warm_set(0, 0);
+}
+
+uint64_t SuperBlock::fast_segments() const {
+    if (this->fast_size_chunks <= this->data_offset) {
+        return 0;
+    }
+    const uint64_t fast = (this->fast_size_chunks - this->data_offset) / this->segment_size_chunks;
+    return fast < this->num_segments ? fast : 0;
+}
+
+bool SuperBlock::valid_chunk_size(uint64_t chunk_size) {
+    return chunk_size >= MIN_CHUNK_SIZE && chunk_size <= MAX_CHUNK_SIZE && 
+        (chunk_size & (chunk_size - 1)) == 0;
+}
+
+SuperBlock::DeviceLayout SuperBlock::read_device_layout(int fd) {
+    // the superblock always starts at byte 0, the size of the fast device is 
+    // the last of the slots needed here
+    uint64_t data_slots[FAST_SIZE_SLOT + 1];
+    if (pread(fd, data_slots, sizeof(data_slots), 0) != sizeof(data_slots)) {
+        throw FileSystemException("failed to read the superblock");
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        throw FileSystemException("failed to stat the device");
+    }
+    // a block device reports no size through stat
+    const uint64_t device_size = S_ISBLK(st.st_mode) ? lseek(fd, 0, SEEK_END) : st.st_size;
+
+    DeviceLayout layout;
+    layout.chunk_size = data_slots[CHUNK_SIZE_SLOT];
+    // file systems made before striping leave these zero
+    layout.device_count = data_slots[DEVICE_COUNT_SLOT] == 0 ? 1 : data_slots[DEVICE_COUNT_SLOT];
+    layout.stripe_unit_bytes = data_slots[STRIPE_UNIT_SLOT];
+    layout.fast_size_bytes = data_slots[FAST_SIZE_SLOT] * data_slots[CHUNK_SIZE_SLOT];
+
+    // only the fast device's share of a tiered disk is on this device, the 
+    // devices it was striped over hold the rest
+    const uint64_t size_here = layout.fast_size_bytes != 0 ? layout.fast_size_bytes : data_slots[DISK_SIZE_BYTES_SLOT];
+    const uint64_t devices_here = layout.fast_size_bytes != 0 ? 1 : layout.device_count;
+    if (data_slots[SUPERBLOCK_SIZE_SLOT] != 1 || !valid_chunk_size(data_slots[CHUNK_SIZE_SLOT]) || 
+        data_slots[DISK_SIZE_BYTES_SLOT] != data_slots[DISK_SIZE_CHUNKS_SLOT] * data_slots[CHUNK_SIZE_SLOT] || 
+        size_here > device_size * devices_here) {
+        throw FileSystemException("the device does not hold a file system, run mkfs.myfs on it first");
+    }
+    return layout;
+}
+
+uint64_t SuperBlock::read_chunk_size(int fd) {
+    return read_device_layout(fd).chunk_size;
+}
+
 void SuperBlock::init(double inode_table_size_rel_to_disk) {
     uint64_t offset = this->superblock_size_chunks; // sspace reserved for the superblock's header
 
+    if (!valid_chunk_size(this->disk_chunk_size)) {
+        throw FileSystemException("the chunk size must be a power of two from 512 bytes to 1 MB");
+    }
+
     if (this->disk->size_chunks() < 16 || disk->size_chunks() * (1.0 - inode_table_size_rel_to_disk) < 16) {
         throw new FileSystemException("Requested size of superblock, inode table, and bitmap will potentially exceed disk size");
     }
@@ -547,7 +813,6 @@ void SuperBlock::init(double inode_table_size_rel_to_disk) {
     {
         this->disk_block_map = std::unique_ptr<DiskBitMap>(
             new DiskBitMap(this->disk, offset, disk->size_chunks()));
-        this->disk_block_map->clear_all();
         // set the properties on the superblock for the blockmap
         this->disk_block_map_offset = offset;
         this->disk_block_map_size_chunks = this->disk_block_map->size_chunks();
@@ -568,36 +833,88 @@ void SuperBlock::init(double inode_table_size_rel_to_disk) {
         offset += this->inode_table->size_chunks();
     }
 
-    // give ourselves an extra margin of 1 chunk
-    offset++;
+    // the warm set, a chunk for every 8192 of the disk is room for the ids of 
+    // an eighth of them (of 4 KB chunks). only its count needs to be zeroed
+    {
+        this->warm_set_offset = offset;
+        this->warm_set_size_chunks = std::min(WARM_SET_MAX_CHUNKS, 1 + disk_size_chunks / 8192);
+        offset += this->warm_set_size_chunks;
+        ChunkRef chunk = disk->get_chunk(this->warm_set_offset);
+        chunk->memset(chunk->data, 0, sizeof(uint64_t));
+        disk->configure_warm_set(this->warm_set_offset, this->warm_set_size_chunks);
+    }
 
-    //set all metadata chunk bits to `used' a la Thomas
-    for(uint64_t bit_i = 0; bit_i < offset; ++bit_i) {
-        disk_block_map->set(bit_i);
+    // the deduplication index gets its table in front of the segments, it is 
+    // only ever read up to its high water mark so it need not be zeroed
+    if (this->dedup) {
+        this->dedup_table_offset = offset;
+        this->dedup_table_size_chunks = DedupIndex::table_chunks_for(disk_size_chunks, disk_chunk_size);
+        offset += this->dedup_table_size_chunks;
     }
 
-    this->data_offset = offset;
+    // give ourselves an extra margin of 1 chunk
+    offset++;
 
      //segment the free data block space
     this->num_segments = 0;
-    segment_size_chunks = 2 * (disk_chunk_size / sizeof(uint64_t));
+    //the summary chunk holds an inode number for each chunk of the segment, and a checksum 
+    //when there are checksums (rounded up to keep segments a power of two in size)
+    const uint64_t summary_bytes_per_chunk = this->checksums ? 2 * sizeof(uint64_t) : sizeof(uint64_t);
+    segment_size_chunks = 2 * (disk_chunk_size / summary_bytes_per_chunk);
     while(this->num_segments < 20) {
         segment_size_chunks /= 2;
-        this->num_segments = (disk_size_chunks - data_offset - 1) / segment_size_chunks;
+        this->num_segments = (disk_size_chunks - offset - 1) / segment_size_chunks;
+    }
+
+    //with a fast device the summaries are kept together on it, in a table in front of the 
+    //segments. it takes away from the segments, so it can only be sized for as many as they are now
+    this->summary_table_offset = 0;
+    if (this->fast_size_chunks != 0) {
+        this->summary_table_offset = offset;
+        offset += this->num_segments;
+        this->num_segments = (disk_size_chunks - offset - 1) / segment_size_chunks;
+        if (offset > this->fast_size_chunks) {
+            throw FileSystemException("the fast device is too small to hold the file system's metadata");
+        }
     }
 
     if (this->num_segments == 0) {
         throw FileSystemException("Num segments is equal to zero, this should never happen.");
     }
 
+    //set all metadata chunk bits to `used' a la Thomas. the bits of the chunks in the 
+    //segments are never looked at, the segment summaries keep track of those
+    disk_block_map->clear_first(offset);
+    for(uint64_t bit_i = 0; bit_i < offset; ++bit_i) {
+        disk_block_map->set(bit_i);
+    }
+
+    this->data_offset = offset;
+
     segment_controller.disk = disk;
     segment_controller.superblock = this;
     segment_controller.data_offset = data_offset;
     segment_controller.segment_size = segment_size_chunks;
     segment_controller.num_segments = num_segments;
-    segment_controller.free_segment_stat_offset = 13;
+    segment_controller.free_segment_stat_offset = FREE_SEGMENTS_SLOT;
+    segment_controller.summary_table_offset = this->summary_table_offset;
+    segment_controller.fast_segments = this->fast_segments();
     segment_controller.clear_all_segments();
     segment_controller.set_new_free_segment();
+    segment_controller.set_new_meta_segment();
+    this->attach_summaries();
+    // the index starts out empty, a file system made on the device before
+    // may have left its high water mark behind
+    {
+        ChunkRef chunk = disk->get_chunk(0);
+        ((uint64_t*)chunk->data)[HIGH_WATER_SLOT] = 0;
+        chunk->mark_dirty();
+    }
+    if (this->dedup) {
+        this->dedup_index = std::unique_ptr<DedupIndex>(
+            new DedupIndex(this, this->dedup_table_offset, this->dedup_table_size_chunks));
+        segment_controller.dedup = this->dedup_index.get();
+    }
 
     // fprintf(stdout, "loaded segment_controller with options:\n"
     //     "\tdata offset: %llu\n" 
@@ -609,11 +926,11 @@ void SuperBlock::init(double inode_table_size_rel_to_disk) {
 
     //setup root directory
     std::shared_ptr<INode> inode = this->inode_table->alloc_inode();
+    inode->set_type(S_IFDIR);
     IDirectory root_dir(*inode);
     root_dir.initializeEmpty();
     root_dir.add_file(".", *inode);
     root_dir.add_file("..", *inode);
-    inode->set_type(S_IFDIR);
     this->root_inode_index = inode->inode_table_idx;
     //serialize to disk
     {
@@ -623,27 +940,38 @@ void SuperBlock::init(double inode_table_size_rel_to_disk) {
 
         uint64_t offset = 0;
 
-        data_slots[0] = superblock_size_chunks;
-        data_slots[1] = disk_size_bytes;
-        data_slots[2] = disk_size_chunks;
-        data_slots[3] = disk_chunk_size;
-        data_slots[4] = disk_block_map_offset;
-        data_slots[5] = disk_block_map_size_chunks;
-        data_slots[6] = inode_table_offset;
-        data_slots[7] = inode_table_size_chunks;
-        data_slots[8] = inode_table_inode_count;
-        data_slots[9] = data_offset;
-        data_slots[10] = segment_size_chunks;
-        data_slots[11] = this->num_segments;
-        data_slots[12] = root_inode_index;
-        //the segment controller will be able to write to this offset on disk, currently 13
+        data_slots[SUPERBLOCK_SIZE_SLOT] = superblock_size_chunks;
+        data_slots[DISK_SIZE_BYTES_SLOT] = disk_size_bytes;
+        data_slots[DISK_SIZE_CHUNKS_SLOT] = disk_size_chunks;
+        data_slots[CHUNK_SIZE_SLOT] = disk_chunk_size;
+        data_slots[BLOCK_MAP_OFFSET_SLOT] = disk_block_map_offset;
+        data_slots[BLOCK_MAP_SIZE_SLOT] = disk_block_map_size_chunks;
+        data_slots[INODE_TABLE_OFFSET_SLOT] = inode_table_offset;
+        data_slots[INODE_TABLE_SIZE_SLOT] = inode_table_size_chunks;
+        data_slots[INODE_COUNT_SLOT] = inode_table_inode_count;
+        data_slots[DATA_OFFSET_SLOT] = data_offset;
+        data_slots[SEGMENT_SIZE_SLOT] = segment_size_chunks;
+        data_slots[NUM_SEGMENTS_SLOT] = this->num_segments;
+        data_slots[ROOT_INODE_SLOT] = root_inode_index;
+        //the segment controller will be able to write to this offset on disk
         data_slots[segment_controller.free_segment_stat_offset] = segment_controller.num_free_segments;
+        data_slots[DEVICE_COUNT_SLOT] = device_count;
+        data_slots[STRIPE_UNIT_SLOT] = stripe_unit_bytes;
+        data_slots[CHECKSUMS_SLOT] = checksums ? SUMMARY_CHECKSUMS_CRC32C : 0;
+        data_slots[DEDUP_TABLE_OFFSET_SLOT] = dedup_table_offset;
+        data_slots[DEDUP_TABLE_SIZE_SLOT] = dedup_table_size_chunks;
+        //and the count of segments that were never used, since its first segment was taken
+        data_slots[FAST_SIZE_SLOT] = fast_size_chunks;
+        data_slots[SUMMARY_TABLE_SLOT] = summary_table_offset;
+        data_slots[WARM_SET_OFFSET_SLOT] = warm_set_offset;
+        data_slots[WARM_SET_SIZE_SLOT] = warm_set_size_chunks;
+        sb_chunk->mark_dirty();
 
         disk->flush_chunk(*sb_chunk);
     }
 }
 
-void SuperBlock::load_from_disk() {
+void SuperBlock::load_from_disk(bool pin_metadata) {
     std::cout << "ENTERING LOAD_FROM_DISK" << std::endl;
     auto sb_chunk = disk->get_chunk(0);
     auto sb_data = sb_chunk->data;
@@ -651,20 +979,29 @@ void SuperBlock::load_from_disk() {
     //superblock_size_chunks = *(uint64_t *)(sb_data + offset);
     //TODO: throw an error code that filesystem was corrupted instead /////////////////////////////////////////////
 
-    assert(superblock_size_chunks == data_slots[0]);
-    assert(disk_size_bytes == data_slots[1]);
-    assert(disk_size_chunks == data_slots[2]);
-    assert(disk_chunk_size == data_slots[3]);
-    disk_block_map_offset = data_slots[4];
-    disk_block_map_size_chunks = data_slots[5];
-    inode_table_offset = data_slots[6];
-    inode_table_size_chunks = data_slots[7];
-    inode_table_inode_count = data_slots[8];
-    data_offset = data_slots[9];
-    segment_size_chunks = data_slots[10];
-    this->num_segments = data_slots[11];
-    root_inode_index = data_slots[12];
-
+    assert(superblock_size_chunks == data_slots[SUPERBLOCK_SIZE_SLOT]);
+    assert(disk_size_bytes == data_slots[DISK_SIZE_BYTES_SLOT]);
+    assert(disk_size_chunks == data_slots[DISK_SIZE_CHUNKS_SLOT]);
+    assert(disk_chunk_size == data_slots[CHUNK_SIZE_SLOT]);
+    disk_block_map_offset = data_slots[BLOCK_MAP_OFFSET_SLOT];
+    disk_block_map_size_chunks = data_slots[BLOCK_MAP_SIZE_SLOT];
+    inode_table_offset = data_slots[INODE_TABLE_OFFSET_SLOT];
+    inode_table_size_chunks = data_slots[INODE_TABLE_SIZE_SLOT];
+    inode_table_inode_count = data_slots[INODE_COUNT_SLOT];
+    data_offset = data_slots[DATA_OFFSET_SLOT];
+    segment_size_chunks = data_slots[SEGMENT_SIZE_SLOT];
+    this->num_segments = data_slots[NUM_SEGMENTS_SLOT];
+    root_inode_index = data_slots[ROOT_INODE_SLOT];
+    device_count = data_slots[DEVICE_COUNT_SLOT] == 0 ? 1 : data_slots[DEVICE_COUNT_SLOT];
+    stripe_unit_bytes = data_slots[STRIPE_UNIT_SLOT];
+    checksums = data_slots[CHECKSUMS_SLOT] == SUMMARY_CHECKSUMS_CRC32C;
+    dedup_table_offset = data_slots[DEDUP_TABLE_OFFSET_SLOT];
+    dedup_table_size_chunks = data_slots[DEDUP_TABLE_SIZE_SLOT];
+    dedup = dedup_table_size_chunks != 0;
+    fast_size_chunks = data_slots[FAST_SIZE_SLOT];
+    summary_table_offset = data_slots[SUMMARY_TABLE_SLOT];
+    warm_set_offset = data_slots[WARM_SET_OFFSET_SLOT];
+    warm_set_size_chunks = data_slots[WARM_SET_SIZE_SLOT];
 
     std::cout << "We don't need to do this next part, but here we go" << std::endl;
 
@@ -706,16 +1043,58 @@ void SuperBlock::load_from_disk() {
     segment_controller.data_offset = this->data_offset;
     segment_controller.segment_size = segment_size_chunks;
     segment_controller.num_segments = this->num_segments;
-    segment_controller.free_segment_stat_offset = 13;
+    segment_controller.free_segment_stat_offset = FREE_SEGMENTS_SLOT;
     segment_controller.num_free_segments = data_slots[segment_controller.free_segment_stat_offset];
+    if (data_slots[UNINITIALIZED_SLOT] > this->num_segments) {
+        throw FileSystemException("The superblock counts more unused segments than there are");
+    }
+    segment_controller.initialized_segments = this->num_segments - data_slots[UNINITIALIZED_SLOT];
+    segment_controller.summary_table_offset = this->summary_table_offset;
+    segment_controller.fast_segments = this->fast_segments();
+    segment_controller.num_free_fast_segments = 0;
+    for (uint64_t sn = 0; sn < segment_controller.fast_segments; ++sn) {
+        if (segment_controller.get_segment_usage(sn) == 0) {
+            segment_controller.num_free_fast_segments++;
+        }
+    }
 
     //Attempt at per segment locking
     /*for(int i = 0; i < num_segments; i++) {
         segment_controller.single_segment_locks.emplace_back();
     }*/
 
+    // inodes are looked up by number all over the ilist, reading ahead of one 
+    // only drags in inodes no one asked for
+    disk->advise(this->inode_table->inode_ilist_offset, 
+        this->inode_table_offset + this->inode_table_size_chunks - this->inode_table->inode_ilist_offset, 
+        AccessPattern::RANDOM);
+
+    if (pin_metadata) {
+        // the superblock, disk block map and used inodes bitmap sit back to back 
+        // in front of the ilist. the ilist itself can be a tenth of the disk so 
+        // it is left to the cache
+        disk->pin(0, this->inode_table->inode_ilist_offset);
+
+        // every allocation and every clean reads the segment summaries. they are 
+        // one chunk per segment, locking each of their pages would split the 
+        // mapping up into a piece per segment so they are only held in the cache. 
+        // the ones of segments that were never used are pinned as they are taken
+        for (uint64_t sn = 0; sn < segment_controller.initialized_segments; ++sn) {
+            disk->pin(segment_controller.summary_idx(sn), 1, false);
+        }
+        segment_controller.pin_summaries = true;
+    }
+    this->attach_summaries();
+    if (this->dedup) {
+        this->dedup_index = std::unique_ptr<DedupIndex>(
+            new DedupIndex(this, this->dedup_table_offset, this->dedup_table_size_chunks));
+        this->dedup_index->load();
+        segment_controller.dedup = this->dedup_index.get();
+    }
+
     //prepare for writes!
     segment_controller.set_new_free_segment();
+    segment_controller.set_new_meta_segment();
 
     // fprintf(stdout, "loaded segment_controller with options:\n"
     //     "\tdata offset: %llu\n" 
@@ -735,9 +1114,45 @@ void SuperBlock::load_from_disk() {
         }
     }
 
+    // what was hot when the file system was last unmounted (or checkpointed) is 
+    // read back in the background, ahead of it being faulted in a chunk at a time
+    if (this->warm_set_size_chunks != 0) {
+        disk->configure_warm_set(this->warm_set_offset, this->warm_set_size_chunks);
+        disk->load_warm_set();
+    }
+
     std::cout << "EXITING LOAD FROM DISK" << std::endl;
 }
 
+void SuperBlock::attach_summaries() {
+    segment_controller.checksums = this->checksums;
+    segment_controller.compression = false;
+    if (!this->checksums) {
+        //the compressed chunks are kept track of next to the checksums
+        if (this->compression) {
+            throw FileSystemException("compression needs a file system made with checksums");
+        }
+        return ;
+    }
+    this->segment_summaries = std::make_shared<SegmentSummaries>(
+        disk, this->data_offset, this->segment_size_chunks, this->num_segments, 
+        this->summary_table_offset, segment_controller.initialized_segments);
+    disk->set_checksums(this->segment_summaries);
+
+    if (disk->zero_copy()) {
+        //a chunk handed out in zero copy mode is its own place on the disk, compressed ones have none
+        if (this->compression) {
+            throw FileSystemException("compression can not be used in zero copy mode");
+        }
+        if (segment_controller.compression_stats().chunks != 0) {
+            throw FileSystemException("the file system holds compressed segments, it can not be mounted in zero copy mode");
+        }
+        return ;
+    }
+    disk->set_extents(this->segment_summaries);
+    segment_controller.compression = this->compression;
+}
+
 void FileSystem::printForDebug() {
   //TODO: write this function
   throw FileSystemException("thomas you idiot...");
@@ -1032,58 +1447,552 @@ std::vector< std::unique_ptr<IDirectory::DirEntry> > IDirectory::get_files() {
 }
 
 
+/*
+* Dedup Index
+*/
+
+DedupIndex::DedupIndex(SuperBlock *superblock, uint64_t table_offset, uint64_t table_size_chunks) 
+    : superblock(superblock), disk(superblock->disk), table_offset(table_offset), table_size_chunks(table_size_chunks), 
+    entries_per_chunk(superblock->disk_chunk_size / ENTRY_BYTES) {
+}
+
+uint64_t DedupIndex::table_chunks_for(uint64_t disk_size_chunks, uint64_t chunk_size) {
+    //room for every chunk of the disk to be indexed
+    const uint64_t entries_per_chunk = chunk_size / ENTRY_BYTES;
+    return (disk_size_chunks + entries_per_chunk - 1) / entries_per_chunk;
+}
+
+uint64_t DedupIndex::fingerprint(const Byte *data, size_t length) {
+    //four independent lanes of multiply and rotate (in the manner of xxHash), folded together at the end
+    const uint64_t PRIME1 = 0x9E3779B185EBCA87ULL;
+    const uint64_t PRIME2 = 0xC2B2AE3D27D4EB4FULL;
+    uint64_t lanes[4] = {PRIME1 + PRIME2, PRIME2, 0, 0 - PRIME1};
+    size_t idx = 0;
+    for (; idx + 32 <= length; idx += 32) {
+        for (int lane = 0; lane < 4; lane++) {
+            uint64_t word;
+            std::memcpy(&word, data + idx + lane * 8, 8);
+            lanes[lane] += word * PRIME2;
+            lanes[lane] = (lanes[lane] << 31) | (lanes[lane] >> 33);
+            lanes[lane] *= PRIME1;
+        }
+    }
+    uint64_t hash = length;
+    for (int lane = 0; lane < 4; lane++) {
+        hash ^= lanes[lane] * PRIME2;
+        hash = ((hash << 27) | (hash >> 37)) * PRIME1;
+    }
+    for (; idx < length; idx++) {
+        hash = (hash ^ data[idx]) * PRIME1;
+    }
+    hash ^= hash >> 33;
+    hash *= PRIME2;
+    hash ^= hash >> 29;
+    return hash;
+}
+
+DedupIndex::Entry DedupIndex::read_slot(uint64_t slot) {
+    ChunkRef chunk = disk->get_chunk(table_offset + slot / entries_per_chunk);
+    Entry entry;
+    std::memcpy(&entry, chunk->data + (slot % entries_per_chunk) * ENTRY_BYTES, ENTRY_BYTES);
+    return entry;
+}
+
+void DedupIndex::write_slot(uint64_t slot, const Entry &entry) {
+    ChunkRef chunk = disk->get_chunk(table_offset + slot / entries_per_chunk);
+    chunk->memcpy(chunk->data + (slot % entries_per_chunk) * ENTRY_BYTES, &entry, ENTRY_BYTES);
+}
+
+uint64_t DedupIndex::take_slot() {
+    if (!free_slots.empty()) {
+        uint64_t slot = free_slots.back();
+        free_slots.pop_back();
+        return slot;
+    }
+    if (high_water == table_size_chunks * entries_per_chunk) {
+        return high_water;
+    }
+    //the mark goes up before the slot is used, a slot past it would not be read back at mount
+    high_water++;
+    ChunkRef chunk = disk->get_chunk(0);
+    ((uint64_t*)chunk->data)[SuperBlock::HIGH_WATER_SLOT] = high_water;
+    chunk->mark_dirty();
+    return high_water - 1;
+}
+
+void DedupIndex::drop_slot(uint64_t slot) {
+    write_slot(slot, Entry());
+    free_slots.push_back(slot);
+}
+
+void DedupIndex::load() {
+    std::lock_guard<std::mutex> g(lock);
+    {
+        ChunkRef chunk = disk->get_chunk(0);
+        high_water = ((const uint64_t*)chunk->data)[SuperBlock::HIGH_WATER_SLOT];
+    }
+    if (high_water > table_size_chunks * entries_per_chunk) {
+        throw FileSystemException("The deduplication table became corrupted when attempting to load it");
+    }
+    const uint64_t used_chunks = (high_water + entries_per_chunk - 1) / entries_per_chunk;
+    disk->advise(table_offset, used_chunks, AccessPattern::SEQUENTIAL);
+    for (uint64_t slot = 0; slot < high_water; slot++) {
+        Entry entry = read_slot(slot);
+        if (entry.chunk_idx == 0) {
+            free_slots.push_back(slot);
+            continue;
+        }
+        by_fingerprint[entry.fingerprint] = slot;
+        by_chunk[entry.chunk_idx] = slot;
+    }
+    disk->advise(table_offset, used_chunks, AccessPattern::NORMAL);
+    //only an indexed chunk can be marked shared
+    referrers_known = by_chunk.empty();
+}
+
+static void add_once(std::vector<uint64_t> &inodes, uint64_t inode_number) {
+    if (std::find(inodes.begin(), inodes.end(), inode_number) == inodes.end()) {
+        inodes.push_back(inode_number);
+    }
+}
+
+uint64_t DedupIndex::share(const Chunk &chunk, uint64_t inode_number) {
+    const uint64_t fingerprint = DedupIndex::fingerprint(chunk.data, chunk.size_bytes);
+    std::lock_guard<std::mutex> g(lock);
+    lookups++;
+
+    auto found = by_fingerprint.find(fingerprint);
+    if (found != by_fingerprint.end()) {
+        Entry entry = read_slot(found->second);
+        if (entry.chunk_idx == chunk.chunk_idx) {
+            return 0;
+        }
+        //a fingerprint is not proof, the contents are compared before anything is shared
+        ChunkRef stored = disk->get_chunk(entry.chunk_idx);
+        if (std::memcmp(stored->data, chunk.data, chunk.size_bytes) != 0) {
+            return 0;
+        }
+        //the file that wrote it first may go while others still point at it
+        std::vector<uint64_t> &pointing = referrers[entry.chunk_idx];
+        if (entry.references == 1) {
+            const uint64_t owner = superblock->segment_controller.set_chunk_shared(entry.chunk_idx);
+            if (owner != SegmentController::SHARED_CHUNK_OWNER) {
+                add_once(pointing, owner);
+            }
+        }
+        add_once(pointing, inode_number);
+        entry.references++;
+        write_slot(found->second, entry);
+        duplicates++;
+        return entry.chunk_idx;
+    }
+
+    //the first copy, it is indexed for the ones that follow
+    const uint64_t slot = take_slot();
+    if (slot == table_size_chunks * entries_per_chunk) {
+        return 0;
+    }
+    Entry entry;
+    entry.fingerprint = fingerprint;
+    entry.chunk_idx = chunk.chunk_idx;
+    entry.references = 1;
+    write_slot(slot, entry);
+    by_fingerprint[fingerprint] = slot;
+    by_chunk[chunk.chunk_idx] = slot;
+    return 0;
+}
+
+bool DedupIndex::release(uint64_t chunk_idx) {
+    std::lock_guard<std::mutex> g(lock);
+    auto found = by_chunk.find(chunk_idx);
+    if (found == by_chunk.end()) {
+        return false;
+    }
+    const uint64_t slot = found->second;
+    Entry entry = read_slot(slot);
+    if (entry.references > 1) {
+        entry.references--;
+        write_slot(slot, entry);
+        return true;
+    }
+    //the last pointer to it is gone, so is the chunk
+    by_fingerprint.erase(entry.fingerprint);
+    by_chunk.erase(found);
+    referrers.erase(chunk_idx);
+    drop_slot(slot);
+    return false;
+}
+
+uint64_t DedupIndex::references(uint64_t chunk_idx) {
+    std::lock_guard<std::mutex> g(lock);
+    auto found = by_chunk.find(chunk_idx);
+    if (found == by_chunk.end()) {
+        return 1;
+    }
+    return read_slot(found->second).references;
+}
+
+void DedupIndex::moved(uint64_t old_chunk_idx, uint64_t new_chunk_idx) {
+    std::lock_guard<std::mutex> g(lock);
+    auto found = by_chunk.find(old_chunk_idx);
+    if (found == by_chunk.end()) {
+        return ;
+    }
+    const uint64_t slot = found->second;
+    by_chunk.erase(found);
+    by_chunk[new_chunk_idx] = slot;
+    Entry entry = read_slot(slot);
+    entry.chunk_idx = new_chunk_idx;
+    write_slot(slot, entry);
+
+    auto pointing = referrers.find(old_chunk_idx);
+    if (pointing != referrers.end()) {
+        std::vector<uint64_t> inodes = std::move(pointing->second);
+        referrers.erase(pointing);
+        referrers[new_chunk_idx] = std::move(inodes);
+    }
+}
+
+bool DedupIndex::knows_referrers() {
+    std::lock_guard<std::mutex> g(lock);
+    return referrers_known;
+}
+
+void DedupIndex::add_referrer(uint64_t chunk_idx, uint64_t inode_number) {
+    std::lock_guard<std::mutex> g(lock);
+    add_once(referrers[chunk_idx], inode_number);
+}
+
+void DedupIndex::set_referrers_known() {
+    std::lock_guard<std::mutex> g(lock);
+    referrers_known = true;
+}
+
+std::vector<uint64_t> DedupIndex::referrers_of(const std::vector<uint64_t> &chunk_idxs) {
+    std::lock_guard<std::mutex> g(lock);
+    std::vector<uint64_t> inodes;
+    for (uint64_t chunk_idx : chunk_idxs) {
+        auto pointing = referrers.find(chunk_idx);
+        if (pointing != referrers.end()) {
+            inodes.insert(inodes.end(), pointing->second.begin(), pointing->second.end());
+        }
+    }
+    std::sort(inodes.begin(), inodes.end());
+    inodes.erase(std::unique(inodes.begin(), inodes.end()), inodes.end());
+    return inodes;
+}
+
+DedupIndex::Stats DedupIndex::stats() {
+    std::lock_guard<std::mutex> g(lock);
+    Stats stats;
+    stats.indexed_chunks = by_chunk.size();
+    for (auto &indexed : by_chunk) {
+        const uint64_t references = read_slot(indexed.second).references;
+        stats.references += references;
+        if (references > 1) {
+            stats.shared_chunks++;
+        }
+    }
+    stats.capacity = table_size_chunks * entries_per_chunk;
+    stats.lookups = lookups;
+    stats.duplicates = duplicates;
+    //a node per entry in each map (key, value and the link to the next) plus their buckets
+    const uint64_t node_bytes = 2 * sizeof(uint64_t) + sizeof(void *);
+    stats.memory_bytes = (by_fingerprint.size() + by_chunk.size()) * node_bytes + 
+        (by_fingerprint.bucket_count() + by_chunk.bucket_count()) * sizeof(void *) + 
+        free_slots.capacity() * sizeof(uint64_t);
+    for (auto &pointing : referrers) {
+        stats.memory_bytes += sizeof(pointing) + sizeof(void *) + pointing.second.capacity() * sizeof(uint64_t);
+    }
+    return stats;
+}
+
+/*
+* Segment Summaries
+*/
+
+SegmentSummaries::SegmentSummaries(Disk *disk, uint64_t data_offset, uint64_t segment_size, uint64_t num_segments, 
+    uint64_t summary_table_offset, uint64_t initialized_segments) 
+    : disk(disk), data_offset(data_offset), segment_size(segment_size), num_segments(num_segments), 
+    summaries(num_segments), attached(0), summary_table_offset(summary_table_offset), 
+    segment_locks(new std::mutex[num_segments]) {
+    for (uint64_t sn = 0; sn < initialized_segments; ++sn) {
+        attach(sn);
+    }
+}
+
+void SegmentSummaries::attach(uint64_t segment_number) {
+    assert(segment_number == attached.load());
+    // pinned so flush_all writes them out with everything else, the references 
+    // kept here are what the disk's lookups go through
+    const uint64_t summary_idx = summary_table_offset != 0 ? 
+        summary_table_offset + segment_number : data_offset + segment_number * segment_size;
+    disk->pin(summary_idx, 1, false);
+    summaries[segment_number] = disk->get_chunk(summary_idx);
+    attached.store(segment_number + 1, std::memory_order_release);
+}
+
+bool SegmentSummaries::covers(Size chunk_idx) {
+    if (chunk_idx < data_offset || chunk_idx >= data_offset + num_segments * segment_size) {
+        return false;
+    }
+    //nothing in a segment that was never used has a checksum yet
+    if ((chunk_idx - data_offset) / segment_size >= attached.load(std::memory_order_acquire)) {
+        return false;
+    }
+    //the summaries hold the checksums, they have none themselves. the first chunk of a 
+    //segment is its summary or, with a table of them, never used
+    return (chunk_idx - data_offset) % segment_size != 0;
+}
+
+uint32_t SegmentSummaries::checksum(Size chunk_idx) {
+    const uint64_t segment_number = (chunk_idx - data_offset) / segment_size;
+    const uint64_t chunk_number = (chunk_idx - data_offset) % segment_size;
+    return checksums_in(*summaries[segment_number], segment_size)[chunk_number];
+}
+
+Chunk *SegmentSummaries::record(Size chunk_idx, uint32_t checksum) {
+    const uint64_t segment_number = (chunk_idx - data_offset) / segment_size;
+    const uint64_t chunk_number = (chunk_idx - data_offset) % segment_size;
+    Chunk &summary = *summaries[segment_number];
+    uint32_t &stored = checksums_in(summary, segment_size)[chunk_number];
+    //a chunk that is written back unchanged leaves its summary clean
+    if (stored != checksum) {
+        stored = checksum;
+        summary.mark_dirty();
+    }
+    return &summary;
+}
+
+bool SegmentSummaries::extent(Size chunk_idx, Size &offset, Size &length) {
+    if (!covers(chunk_idx)) {
+        return false;
+    }
+    const uint64_t segment_number = (chunk_idx - data_offset) / segment_size;
+    const uint64_t chunk_number = (chunk_idx - data_offset) % segment_size;
+    const uint32_t *entries = extents_in(*summaries[segment_number], segment_size);
+    if (!compressed_entry(entries[chunk_number])) {
+        return false;
+    }
+    //the blocks are packed in order from the chunk behind the summary on
+    uint64_t packed = 0;
+    for (uint64_t cn = 1; cn < chunk_number; cn++) {
+        packed += entries[cn] & ~EXTENT_DROPPED;
+    }
+    offset = (data_offset + segment_number * segment_size + 1) * disk->chunk_size() + packed;
+    length = entries[chunk_number];
+    return true;
+}
+
+void SegmentSummaries::expand(Size chunk_idx) {
+    if (!covers(chunk_idx)) {
+        return ;
+    }
+    const uint64_t segment_number = (chunk_idx - data_offset) / segment_size;
+    const uint64_t segment_start = data_offset + segment_number * segment_size;
+    //two writers that change chunks of the segment at once expand it once, the other 
+    //finds nothing left to do
+    std::lock_guard<std::mutex> g(segment_locks[segment_number]);
+    Chunk &summary = *summaries[segment_number];
+    uint32_t *entries = extents_in(summary, segment_size);
+
+    std::vector<Size> chunk_idxs;
+    for (uint64_t cn = 1; cn < segment_size; cn++) {
+        if (compressed_entry(entries[cn])) {
+            chunk_idxs.push_back(segment_start + cn);
+        }
+    }
+    if (chunk_idxs.empty()) {
+        return ;
+    }
+
+    //once one of them is written back to its own place the blocks of the others 
+    //are gone, so they are all read in first and all written back as they are. 
+    //they are on the device before the summary stops pointing at the blocks, 
+    //otherwise a crash in between has them read from places holding packed bytes. 
+    //held until then, none of them is read in again meanwhile
+    std::vector<ChunkRef> chunks = disk->get_chunks(chunk_idxs);
+    for (ChunkRef &chunk : chunks) {
+        chunk->compressed = false;
+        chunk->mark_dirty();
+    }
+    disk->sync(chunk_idxs.front(), chunk_idxs.back() - chunk_idxs.front() + 1);
+
+    for (Size idx : chunk_idxs) {
+        entries[idx - segment_start] |= EXTENT_DROPPED;
+    }
+    summary.mark_dirty();
+    disk->sync(summary.chunk_idx, 1);
+}
+
 /*
 * Segment Controller
 */
 
 uint64_t SegmentController::get_segment_usage(uint64_t segment_number) {
-    std::shared_ptr<Chunk> chunk = disk->get_chunk(data_offset + segment_number * segment_size);
+    if (segment_number >= initialized_segments) {
+        return 0;
+    }
+    ChunkRef chunk = disk->get_chunk(summary_idx(segment_number));
     return *((uint64_t*)chunk->data);
 }
 
 void SegmentController::set_segment_usage(uint64_t segment_number, uint64_t segment_usage) {
     assert(segment_usage <= segment_size);
-    std::shared_ptr<Chunk> chunk = disk->get_chunk(data_offset + segment_number * segment_size);
+    assert(segment_number < initialized_segments);
+    ChunkRef chunk = disk->get_chunk(summary_idx(segment_number));
 
     uint64_t old_usage = *((uint64_t*)chunk->data);
+    if (segment_number < fast_segments && (old_usage == 0) != (segment_usage == 0)) {
+        num_free_fast_segments += segment_usage == 0 ? 1 : -1;
+    }
     if (old_usage == 0 && segment_usage != 0) {
         num_free_segments--;
-        std::shared_ptr<Chunk> chunk = disk->get_chunk(0);
+        ChunkRef chunk = disk->get_chunk(0);
         ((uint64_t*)chunk->data)[free_segment_stat_offset] = num_free_segments;
+        chunk->mark_dirty();
     } else if (old_usage != 0 && segment_usage == 0) {
         num_free_segments++;
-        std::shared_ptr<Chunk> chunk = disk->get_chunk(0);
+        ChunkRef chunk = disk->get_chunk(0);
         ((uint64_t*)chunk->data)[free_segment_stat_offset] = num_free_segments;
+        chunk->mark_dirty();
+        // nothing in the segment is needed anymore, the device can have it back. the first 
+        // chunk is left alone, it holds the summary (or is never used), and so are the 
+        // segments still being filled
+        if (segment_number != current_segment && segment_number != meta_segment) {
+            disk->discard(data_offset + segment_number * segment_size + 1, segment_size - 1);
+        }
     }
     *((uint64_t*)chunk->data) = segment_usage;
+    chunk->mark_dirty();
 }
 
 uint64_t SegmentController::get_segment_chunk_to_inode(uint64_t segment_number, uint64_t chunk_number) {
-    std::shared_ptr<Chunk> chunk = disk->get_chunk(data_offset + segment_number * segment_size);
+    if (segment_number >= initialized_segments) {
+        return 0;
+    }
+    ChunkRef chunk = disk->get_chunk(summary_idx(segment_number));
     return ((uint64_t*)chunk->data)[chunk_number];
 }
 
 void SegmentController::set_segment_chunk_to_inode(uint64_t segment_number, uint64_t chunk_number, uint64_t inode_number) {
-    assert(inode_number <= superblock->inode_table_inode_count);
-    std::shared_ptr<Chunk> chunk = disk->get_chunk(data_offset + segment_number * segment_size);
+    assert(inode_number <= superblock->inode_table_inode_count || inode_number == SHARED_CHUNK_OWNER);
+    assert(segment_number < initialized_segments);
+    ChunkRef chunk = disk->get_chunk(summary_idx(segment_number));
     ((uint64_t*)chunk->data)[chunk_number] = inode_number;
+    chunk->mark_dirty();
+    if (checksums) {
+        std::lock_guard<std::mutex> g(superblock->segment_summaries->segment_locks[segment_number]);
+        SegmentSummaries::checksums_in(*chunk, segment_size)[chunk_number] = 0;
+        uint32_t &entry = SegmentSummaries::extents_in(*chunk, segment_size)[chunk_number];
+        if (entry != 0) {
+            entry |= SegmentSummaries::EXTENT_DROPPED;
+        }
+    }
 }
 
-void SegmentController::clear_all_segments() {
-    for(int i = 0; i < num_segments; i++) {
-        std::shared_ptr<Chunk> chunk = disk->get_chunk(data_offset + i * segment_size);
-        std::memset(chunk->data, 0, chunk->size_bytes);
-        //std::cout << "Zeroed " << i << " of " << num_segments << " segments" << std::endl;
+uint64_t SegmentController::set_chunk_shared(uint64_t chunk_idx) {
+    const uint64_t segment_number = (chunk_idx - data_offset) / segment_size;
+    const uint64_t chunk_number = (chunk_idx - data_offset) % segment_size;
+    assert(segment_number < initialized_segments);
+    ChunkRef chunk = disk->get_chunk(summary_idx(segment_number));
+    const uint64_t owner = ((uint64_t*)chunk->data)[chunk_number];
+    ((uint64_t*)chunk->data)[chunk_number] = SHARED_CHUNK_OWNER;
+    chunk->mark_dirty();
+    return owner;
+}
+
+void SegmentController::find_referrers() {
+    INodeTable &inode_table = *superblock->inode_table;
+    std::vector<uint64_t> locations;
+    for(uint64_t idx = 0; idx < inode_table.inode_count; idx++) {
+        if(!inode_table.used_inodes->get(idx)) {
+            continue;
+        }
+        locations.clear();
+        inode_table.get_inode(idx)->chunk_locations(locations);
+        for(uint64_t chunk_idx : locations) {
+            if(chunk_idx < data_offset || chunk_idx >= data_offset + num_segments * segment_size) {
+                continue;
+            }
+            const uint64_t sn = (chunk_idx - data_offset) / segment_size;
+            const uint64_t cn = (chunk_idx - data_offset) % segment_size;
+            if(get_segment_chunk_to_inode(sn, cn) == SHARED_CHUNK_OWNER) {
+                dedup->add_referrer(chunk_idx, idx);
+            }
+        }
+    }
+    dedup->set_referrers_known();
+}
+
+SegmentController::CompressionStats SegmentController::segment_compression(uint64_t segment_number) {
+    CompressionStats stats;
+    if (!checksums || segment_number >= initialized_segments) {
+        return stats;
+    }
+    ChunkRef chunk = disk->get_chunk(summary_idx(segment_number));
+    const uint32_t *entries = SegmentSummaries::extents_in(*chunk, segment_size);
+    for (uint64_t cn = 1; cn < segment_size; cn++) {
+        if (SegmentSummaries::compressed_entry(entries[cn])) {
+            stats.chunks++;
+            stats.plain_bytes += disk->chunk_size();
+            stats.stored_bytes += entries[cn];
+        }
+    }
+    return stats;
+}
+
+SegmentController::CompressionStats SegmentController::compression_stats() {
+    CompressionStats stats;
+    for (uint64_t sn = 0; sn < num_segments; sn++) {
+        CompressionStats segment = segment_compression(sn);
+        stats.chunks += segment.chunks;
+        stats.plain_bytes += segment.plain_bytes;
+        stats.stored_bytes += segment.stored_bytes;
     }
+    return stats;
+}
+
+void SegmentController::clear_all_segments() {
+    // zeroing every summary here would touch a chunk in each segment, on a 
+    // large device that is most of the time mkfs takes. they are zeroed as 
+    // the segments are taken instead, lowest first
+    initialized_segments = 0;
     num_free_segments = num_segments;
-    std::shared_ptr<Chunk> chunk = disk->get_chunk(0);
+    num_free_fast_segments = fast_segments;
+    ChunkRef chunk = disk->get_chunk(0);
     ((uint64_t*)chunk->data)[free_segment_stat_offset] = num_free_segments;
+    ((uint64_t*)chunk->data)[SuperBlock::UNINITIALIZED_SLOT] = num_segments;
+    chunk->mark_dirty();
+}
+
+void SegmentController::initialize_segment(uint64_t segment_number) {
+    assert(segment_number < num_segments);
+    if (segment_number < initialized_segments) {
+        return ;
+    }
+    for (uint64_t sn = initialized_segments; sn <= segment_number; sn++) {
+        ChunkRef chunk = disk->get_chunk(summary_idx(sn));
+        chunk->memset(chunk->data, 0, chunk->size_bytes);
+        if (pin_summaries) {
+            disk->pin(summary_idx(sn), 1, false);
+        }
+        if (superblock->segment_summaries) {
+            superblock->segment_summaries->attach(sn);
+        }
+    }
+    initialized_segments = segment_number + 1;
+    ChunkRef chunk = disk->get_chunk(0);
+    ((uint64_t*)chunk->data)[SuperBlock::UNINITIALIZED_SLOT] = num_segments - initialized_segments;
+    chunk->mark_dirty();
 }
 
 //Find a new free segment
 void SegmentController::set_new_free_segment() {
-    for(int i = 0; i < num_segments; i++) {
+    //the file data stays out of the fast segments
+    for(uint64_t i = fast_segments; i < num_segments; i++) {
         if(get_segment_usage(i) == 0) {
+            initialize_segment(i);
             current_segment = i;
             current_chunk = 1;
             return;
@@ -1092,31 +2001,76 @@ void SegmentController::set_new_free_segment() {
     current_segment = -1;
 }
 
+void SegmentController::set_new_meta_segment() {
+    for(uint64_t i = 0; i < fast_segments; i++) {
+        if(get_segment_usage(i) == 0 && meta_segment != i) {
+            initialize_segment(i);
+            meta_segment = i;
+            meta_chunk = 1;
+            return;
+        }
+    }
+    meta_segment = -1;
+    meta_chunk = segment_size;
+}
+
+bool SegmentController::needs_cleaning(double threshold) const {
+    if(fast_segments == 0) {
+        return num_free_segments <= num_segments * threshold;
+    }
+    const uint64_t bulk_segments = num_segments - fast_segments;
+    return num_free_segments - num_free_fast_segments <= bulk_segments * threshold || 
+        num_free_fast_segments <= fast_segments * threshold;
+}
+
 void SegmentController::clean() {
     // lock the segment controller
     std::lock_guard<std::mutex> lock(segment_controller_lock);
+    // the cleaner's I/O must not get in the way of what it is cleaning for
+    IOClassScope scope(IOClass::CLEANER);
+
+    if(fast_segments == 0) {
+        clean_segments(0, num_segments);
+        return ;
+    }
+
+    //the fast segments are cleaned when they are the ones running out. when there is nothing 
+    //to clean in them the metadata goes to the other segments, which are cleaned as usual
+    const uint64_t bulk_segments = num_segments - fast_segments;
+    const uint64_t num_free_bulk_segments = num_free_segments - num_free_fast_segments;
+    if(num_free_fast_segments * bulk_segments < num_free_bulk_segments * fast_segments) {
+        try {
+            if(clean_segments(0, fast_segments)) {
+                return ;
+            }
+        } catch (const FileSystemException &e) {
+        }
+    }
+    clean_segments(fast_segments, num_segments);
+}
 
+bool SegmentController::clean_segments(uint64_t first_segment, uint64_t end_segment) {
     std::vector<uint64_t> segments_to_clean;
     //initialized poorly so we catch later
     uint64_t new_segment1 = num_segments + 1;
     uint64_t new_segment2 = num_segments + 1;
 
-    int i = 0;
+    uint64_t i = first_segment;
 
     if(num_free_segments == 0) {
-        return ;
+        return false;
     }
 
     //get two clean segments
-    for(i; i < num_segments; i++) {
-        if(get_segment_usage(i) == 0 && current_segment != i) {
+    for(i; i < end_segment; i++) {
+        if(get_segment_usage(i) == 0 && current_segment != i && meta_segment != i) {
             new_segment1 = i;
             break;
         }
     }
     i += 1;
-    for(i; i < num_segments; i++) {
-        if(get_segment_usage(i) == 0 && current_segment != i) {
+    for(i; i < end_segment; i++) {
+        if(get_segment_usage(i) == 0 && current_segment != i && meta_segment != i) {
             new_segment2 = i;
             break;
         }
@@ -1124,17 +2078,17 @@ void SegmentController::clean() {
 
     //Fail silently when disk is almost full
     if(new_segment1 > num_segments || new_segment2 > num_segments) {
-        return ;
+        return false;
     }
 
     uint64_t num_chunks_to_combine = 0;
-    i = 0;
+    i = first_segment;
     std::cout << std::endl << std::endl << std::endl;
-    while(i < num_segments) {
+    while(i < end_segment) {
         //only grab non empty segments to clean
         uint64_t usage = get_segment_usage(i);
         std::cout << usage << " ";
-        if(usage != 0 && usage != segment_size - 1 && current_segment != i) {
+        if(usage != 0 && usage != segment_size - 1 && current_segment != i && meta_segment != i) {
             //try to add this segment to the clean up list
             //Remember to reserve one chunk for meta data
             if(num_chunks_to_combine + usage <= 2 * (segment_size - 1) ) {
@@ -1179,12 +2133,18 @@ void SegmentController::clean() {
     if(segments_to_clean.size() <= 1) {
         std::cout << "NOTHING TO CLEAN" << std::endl;
         throw FileSystemException("Disk is full");
-        return ;
+        return false;
     }
 
     assert(num_chunks_to_combine > 0);
     assert(num_chunks_to_combine <= 2 * (segment_size - 1));
 
+    //which files point at the shared chunks is not kept on disk, the first clean 
+    //after mount has to look through every file for them. the ones after it do not
+    if(dedup != nullptr && !dedup->knows_referrers()) {
+        find_referrers();
+    }
+
     //create the new segment first
     uint64_t usage1 = num_chunks_to_combine;
     if(usage1 > segment_size - 1) {
@@ -1192,18 +2152,40 @@ void SegmentController::clean() {
     }
     uint64_t usage2 = num_chunks_to_combine - usage1;
 
+    initialize_segment(new_segment1);
+    initialize_segment(new_segment2);
     set_segment_usage(new_segment1, usage1);
     set_segment_usage(new_segment2, usage2);
+    if(checksums) {
+        //whatever was compressed in them before is gone
+        for(uint64_t sn : {new_segment1, new_segment2}) {
+            ChunkRef chunk = disk->get_chunk(summary_idx(sn));
+            chunk->memset(SegmentSummaries::extents_in(*chunk, segment_size), 0, segment_size * sizeof(uint32_t));
+        }
+    }
     uint64_t write_head = 1;
 
     uint64_t current_new_segment = new_segment1;
 
     //track which inodes are touched
     std::unordered_map<uint64_t, std::unordered_map<uint64_t, uint64_t> > inode_changes_to_apply;
+    //a shared chunk is pointed at by files other than the one that wrote it first
+    std::unordered_map<uint64_t, uint64_t> shared_changes_to_apply;
+
+    //with compression the new segments are held in memory until they are final
+    std::vector<ChunkSpan> held_spans;
 
     for(uint64_t sn : segments_to_clean) {
         //hold this for performance
-        //std::shared_ptr<Chunk> metadata_chunk = disk->get_chunk(data_offset + sn * segment_size);
+        //ChunkRef metadata_chunk = disk->get_chunk(data_offset + sn * segment_size);
+
+        //the live chunks land on consecutive chunks of the new segments, a run per new segment they land in
+        struct CopyRun {
+            uint64_t new_segment;
+            uint64_t first_head;
+            std::vector<uint64_t> old_cns;
+        };
+        std::vector<CopyRun> runs;
 
         //loop over the segment and grab all of the actual data
         //std::cout << "STARTING ON SEGMENT " << sn << std::endl;
@@ -1218,31 +2200,86 @@ void SegmentController::clean() {
                 }
                 //update the inode mapping in the new segment
                 set_segment_chunk_to_inode(current_new_segment, write_head, inode_num);
-                //copy the data over
+                //queue the data to be copied over
                 uint64_t abs_old_chunk_idx = data_offset + sn * segment_size + cn;
                 uint64_t abs_new_chunk_idx = data_offset + current_new_segment * segment_size + write_head;
-                std::shared_ptr<Chunk> to_read = disk->get_chunk(abs_old_chunk_idx);
-                std::shared_ptr<Chunk> to_write = disk->get_chunk(abs_new_chunk_idx);
-                to_write->memcpy((void*)to_write->data, (void*)to_read->data, to_read->size_bytes);
+                if(runs.empty() || runs.back().new_segment != current_new_segment) {
+                    runs.push_back(CopyRun{current_new_segment, write_head, {}});
+                }
+                runs.back().old_cns.push_back(cn);
 
-                //add the inode remapping to our to do list
-                inode_changes_to_apply[inode_num][abs_old_chunk_idx] = abs_new_chunk_idx;
+                //add the inode remapping to our to do list, a shared chunk has no one owner
+                if(inode_num == SHARED_CHUNK_OWNER) {
+                    shared_changes_to_apply[abs_old_chunk_idx] = abs_new_chunk_idx;
+                } else {
+                    inode_changes_to_apply[inode_num][abs_old_chunk_idx] = abs_new_chunk_idx;
+                }
+                if(dedup != nullptr) {
+                    dedup->moved(abs_old_chunk_idx, abs_new_chunk_idx);
+                }
 
                 //go to the next chunk
                 write_head += 1;
             }
         }
+
+        if(runs.empty()) {
+            continue;
+        }
+
+        //copy the data over, the old segment is read front to back exactly once as a single span 
+        //from its first live chunk to its last, dead chunks in between included
+        const uint64_t first_cn = runs.front().old_cns.front();
+        const uint64_t end_cn = runs.back().old_cns.back() + 1;
+        disk->advise(data_offset + sn * segment_size, segment_size, AccessPattern::SEQUENTIAL);
+        ChunkSpan old_span = disk->get_span(data_offset + sn * segment_size + first_cn, end_cn - first_cn);
+        for(CopyRun &run : runs) {
+            ChunkSpan new_span = disk->get_span(data_offset + run.new_segment * segment_size + run.first_head, run.old_cns.size());
+            for(size_t idx = 0; idx < run.old_cns.size(); idx++) {
+                new_span.copy_chunks(idx, old_span, run.old_cns[idx] - first_cn, 1);
+            }
+            if(compression) {
+                held_spans.push_back(std::move(new_span));
+            }
+        }
+        old_span.release();
+        //the segment gets reused for new data, which is accessed like any other
+        disk->advise(data_offset + sn * segment_size, segment_size, AccessPattern::NORMAL);
     }
 
     //update pointers
     for(auto & thing : inode_changes_to_apply) {
         superblock->inode_table->get_inode(thing.first)->update_chunk_locations(thing.second);
     }
+    //a shared chunk has no one owner, the dedup index knows which files point at it
+    if(!shared_changes_to_apply.empty()) {
+        std::vector<uint64_t> moved_to;
+        for(auto &change : shared_changes_to_apply) {
+            moved_to.push_back(change.second);
+        }
+        INodeTable &inode_table = *superblock->inode_table;
+        for(uint64_t idx : dedup->referrers_of(moved_to)) {
+            if(inode_table.used_inodes->get(idx)) {
+                inode_table.get_inode(idx)->update_chunk_locations(shared_changes_to_apply);
+            }
+        }
+    }
+
+    //the indirection tables in the new segments were just updated, only now can they be compressed
+    if(compression) {
+        for(uint64_t sn : {new_segment1, new_segment2}) {
+            uint64_t usage = get_segment_usage(sn);
+            if(usage != 0) {
+                compress_segment(sn, usage);
+            }
+        }
+        held_spans.clear();
+    }
 
     //remove the old data
     for(uint64_t sn : segments_to_clean) {
         set_segment_usage(sn, 0);
-        std::shared_ptr<Chunk> chunk = disk->get_chunk(data_offset + sn * segment_size);
+        ChunkRef chunk = disk->get_chunk(summary_idx(sn));
         chunk->memset(chunk->data, 0, chunk->size_bytes);
     }
 
@@ -1255,14 +2292,72 @@ void SegmentController::clean() {
     std::cout << std::endl;
 
     std::cout << "FREE SEGMENTS NOW " << num_free_segments << std::endl;
+    return true;
+}
+
+bool SegmentController::compress_segment(uint64_t segment_number, uint64_t usage) {
+    const uint64_t chunk_size = disk->chunk_size();
+    const uint64_t first_chunk = data_offset + segment_number * segment_size + 1;
+    ChunkSpan span = disk->get_span(first_chunk, usage);
+
+    //the blocks are packed one after the other, a chunk that does not compress is stored as it is
+    std::vector<Byte> packed(usage * chunk_size);
+    std::vector<uint32_t> lengths(usage);
+    uint64_t packed_bytes = 0;
+    for(uint64_t idx = 0; idx < usage; idx++) {
+        const Byte *plain = span.chunk(idx).data;
+        size_t length = lz4_compress(plain, chunk_size, packed.data() + packed_bytes, chunk_size - 1);
+        if(length == 0) {
+            std::memcpy(packed.data() + packed_bytes, plain, chunk_size);
+            length = chunk_size;
+        }
+        lengths[idx] = length;
+        packed_bytes += length;
+    }
+    //not worth it unless the segment gets at least one chunk shorter
+    const uint64_t packed_chunks = (packed_bytes + chunk_size - 1) / chunk_size;
+    if(packed_chunks >= usage) {
+        return false;
+    }
+
+    //the copies in memory are still what the chunks hold but are never written back, 
+    //one that is about to change is expanded first. it waits for the entries below
+    std::lock_guard<std::mutex> g(superblock->segment_summaries->segment_locks[segment_number]);
+    for(uint64_t idx = 0; idx < usage; idx++) {
+        span.chunk(idx).dirty = false;
+        span.chunk(idx).compressed = true;
+    }
+    disk->write_through(first_chunk, packed_chunks, packed.data());
+
+    //the disk never writes these chunks back itself, their checksums are recorded here
+    ChunkRef summary = disk->get_chunk(summary_idx(segment_number));
+    uint32_t *crcs = SegmentSummaries::checksums_in(*summary, segment_size);
+    uint32_t *entries = SegmentSummaries::extents_in(*summary, segment_size);
+    for(uint64_t idx = 0; idx < usage; idx++) {
+        crcs[idx + 1] = crc32c(span.chunk(idx).data, chunk_size);
+        entries[idx + 1] = lengths[idx];
+    }
+    //only once all the entries are in, a writeback meanwhile must not leave it clean without them
+    summary->mark_dirty();
+    return true;
 }
 
-uint64_t SegmentController::alloc_next(uint64_t inode_number) {
+uint64_t SegmentController::alloc_next(uint64_t inode_number, bool metadata) {
     assert(inode_number <= superblock->inode_table_inode_count);
 
     //lock the segment controller, releases automatically at function exit
     std::lock_guard<std::mutex> lock(segment_controller_lock);
 
+    //metadata that does not fit in the fast segments goes with the file data
+    if(metadata && fast_segments != 0) {
+        if(meta_chunk == segment_size) {
+            set_new_meta_segment();
+        }
+        if(meta_segment != -1) {
+            return alloc_in(meta_segment, meta_chunk, inode_number);
+        }
+    }
+
     //make sure we still have chunks available in this segment
     if(current_chunk == segment_size) {
         set_new_free_segment();
@@ -1273,32 +2368,38 @@ uint64_t SegmentController::alloc_next(uint64_t inode_number) {
         throw FileSystemException("FileSystem out of space -- unable to allocate a new chunk");
     }
 
+    return alloc_in(current_segment, current_chunk, inode_number);
+}
+
+uint64_t SegmentController::alloc_in(uint64_t &segment, uint64_t &chunk, uint64_t inode_number) {
     //increment segment usage
-    uint64_t usage = get_segment_usage(current_segment);
-    set_segment_usage(current_segment, get_segment_usage(current_segment) + 1);	
+    set_segment_usage(segment, get_segment_usage(segment) + 1);	
 
     //set the inode mapping
-    set_segment_chunk_to_inode(current_segment, current_chunk, inode_number);
+    set_segment_chunk_to_inode(segment, chunk, inode_number);
 
     //compute absolute index of current chunk
-    uint64_t ret = data_offset + current_segment * segment_size + current_chunk;
-
-    //update current chunk
+    uint64_t ret = data_offset + segment * segment_size + chunk;
 
     // fprintf(stdout, "allocated chunk %d in segment %d for inode %d, absolute chunk id: %d\n"
     // 	"\tusage: %d out of %d\n", 
-    // 	current_chunk, current_segment, inode_number, ret,
-    // 	get_segment_usage(current_segment), segment_size - 1);
-    
-    current_chunk++;
+    // 	chunk, segment, inode_number, ret,
+    // 	get_segment_usage(segment), segment_size - 1);
+
+    //update current chunk
+    chunk++;
 
     return ret;
 }
 
-void SegmentController::free_chunk(std::shared_ptr<Chunk> chunk_to_free) {
-    if (!chunk_to_free.unique()) {
-        throw FileSystemException("FileSystem free chunk failed -- the chunk passed was not 'unique', something else is using it");
+void SegmentController::free_chunk(ChunkRef chunk_to_free) {
+    // a shared chunk stays for as long as anything else points at it
+    if (dedup != nullptr && dedup->release(chunk_to_free->chunk_idx)) {
+        return ;
     }
+    // the disk's buffer cache holds its own reference, a freed chunk has no reason to stay resident. 
+    // its threads (readahead, writeback, a flush) hold chunks for a moment too, those are waited out
+    disk->evict_unshared(chunk_to_free);
     // lock the segment controller
     std::lock_guard<std::mutex> lock(segment_controller_lock);
     // get the segment and relative chunk number
@@ -1311,4 +2412,6 @@ void SegmentController::free_chunk(std::shared_ptr<Chunk> chunk_to_free) {
     //decrement segment usage
     uint64_t usage = get_segment_usage(segment_number);
     set_segment_usage(segment_number, usage - 1);
+    // nothing references the contents anymore, don't bother writing them back
+    chunk_to_free->dirty = false;
 }
@@ -26,6 +26,165 @@ struct FileSystemException : public StorageException {
 
 struct SuperBlock;
 
+/*
+	the checksums of the chunks in the segments (file data, indirection tables 
+	and directories), stored in each segment's summary chunk right behind its 
+	chunk to inode map, and behind those where the chunks of a segment the 
+	cleaner compressed are kept (see SegmentController::clean). the disk looks 
+	both up while it holds its own locks, so the summaries are pinned for as 
+	long as the file system is mounted and read and written here without going 
+	through the disk
+*/
+struct SegmentSummaries : public ChunkChecksums, public ChunkExtents {
+	// an extent entry is the length of the chunk's compressed block, 0 for a 
+	// chunk stored as it is. a chunk that is freed or expanded keeps its 
+	// length, with this bit set, the blocks behind it have not moved
+	static constexpr uint32_t EXTENT_DROPPED = 1u << 31;
+
+	Disk *const disk;
+	const uint64_t data_offset;
+	const uint64_t segment_size;
+	const uint64_t num_segments;
+	// one for each segment, only the first attached of them are set. the 
+	// disk reads the count without a lock, a segment is attached before 
+	// any of its chunks is allocated
+	std::vector<ChunkRef> summaries;
+	std::atomic<uint64_t> attached;
+	const uint64_t summary_table_offset; // see SegmentController
+	// one for each segment, held while its extent entries change: as it is 
+	// expanded, compressed or one of its chunks is freed
+	std::unique_ptr<std::mutex[]> segment_locks;
+
+	SegmentSummaries(Disk *disk, uint64_t data_offset, uint64_t segment_size, uint64_t num_segments, 
+		uint64_t summary_table_offset, uint64_t initialized_segments);
+
+	// picks up the summary of the next segment as it is initialized
+	void attach(uint64_t segment_number);
+
+	// where the checksums of a segment start in its summary
+	static inline uint32_t *checksums_in(Chunk &summary, uint64_t segment_size) {
+		return (uint32_t *)(summary.data + segment_size * sizeof(uint64_t));
+	}
+
+	// and where its extent entries start, they are only there along with the checksums
+	static inline uint32_t *extents_in(Chunk &summary, uint64_t segment_size) {
+		return (uint32_t *)(summary.data + segment_size * (sizeof(uint64_t) + sizeof(uint32_t)));
+	}
+
+	// whether the chunk at that entry is read from its compressed block
+	static inline bool compressed_entry(uint32_t entry) {
+		return entry != 0 && (entry & EXTENT_DROPPED) == 0;
+	}
+
+	bool covers(Size chunk_idx) override;
+	uint32_t checksum(Size chunk_idx) override;
+	Chunk *record(Size chunk_idx, uint32_t checksum) override;
+
+	bool extent(Size chunk_idx, Size &offset, Size &length) override;
+	// every compressed chunk of the segment is read in and written back as it 
+	// is, they overlap each other's places. they are synced before the summary 
+	// drops their extents, which is then synced as well
+	void expand(Size chunk_idx) override;
+};
+
+/*
+	finds chunks of file data that are already stored, by a fingerprint of 
+	their contents, so that a file can point at the stored copy rather than 
+	have a chunk of its own. every indexed chunk carries a count of the 
+	pointers to it, a chunk is only freed once the last of them is dropped. 
+	the index is kept in memory and mirrored, an entry per slot, into a table 
+	that mkfs reserves in front of the segments. a chunk that is not indexed 
+	has exactly one pointer to it, as without deduplication
+*/
+struct DedupIndex {
+	struct Entry {
+		uint64_t fingerprint = 0;
+		uint64_t chunk_idx = 0; // 0 for a slot that is not in use
+		uint64_t references = 0;
+	};
+
+	static constexpr uint64_t ENTRY_BYTES = sizeof(Entry);
+
+	struct Stats {
+		uint64_t indexed_chunks = 0; // chunks stored once that are in the index
+		uint64_t shared_chunks = 0; // of those, the ones more than one pointer leads to
+		uint64_t references = 0; // pointers to indexed chunks, what they would take up without sharing
+		uint64_t capacity = 0; // entries the table has room for
+		uint64_t lookups = 0; // whole chunks looked up as they were written since mount
+		uint64_t duplicates = 0; // of those, the ones that were found
+		uint64_t memory_bytes = 0; // roughly what the index takes up in memory
+	};
+
+	std::mutex lock;
+	SuperBlock *const superblock;
+	Disk *const disk;
+	const uint64_t table_offset;
+	const uint64_t table_size_chunks;
+	const uint64_t entries_per_chunk;
+
+	// slot of each indexed chunk, by its fingerprint and by where it is stored
+	std::unordered_map<uint64_t, uint64_t> by_fingerprint;
+	std::unordered_map<uint64_t, uint64_t> by_chunk;
+	// slots below the high water mark that were freed again, the slots past 
+	// the mark were never used and are not read at mount
+	std::vector<uint64_t> free_slots;
+	uint64_t high_water = 0;
+	uint64_t lookups = 0;
+	uint64_t duplicates = 0;
+
+	// the files pointing at each chunk that is marked shared in its segment 
+	// summary, so that the cleaner only has to update those when it moves one. 
+	// it is not kept on disk, after mount every file is looked through once 
+	// to find them (see SegmentController::find_referrers). a file that has 
+	// dropped its pointer since may still be listed, updating it changes nothing
+	std::unordered_map<uint64_t, std::vector<uint64_t>> referrers;
+	bool referrers_known = true;
+
+	// the table takes up table_size_chunks from table_offset on
+	DedupIndex(SuperBlock *superblock, uint64_t table_offset, uint64_t table_size_chunks);
+
+	// the table size mkfs reserves for a disk of disk_size_chunks
+	static uint64_t table_chunks_for(uint64_t disk_size_chunks, uint64_t chunk_size);
+
+	// a 64 bit hash of a chunk's contents, two chunks with the same fingerprint 
+	// are still compared before they are shared
+	static uint64_t fingerprint(const Byte *data, size_t length);
+
+	// reads the table in (up to the high water mark kept in the superblock)
+	void load();
+
+	// looks up the contents of the chunk that inode_number just wrote at 
+	// chunk_idx. returns where an identical chunk is already stored, which now 
+	// has one more pointer to it, or 0 when there is none (the chunk is 
+	// indexed then, while there is room)
+	uint64_t share(const Chunk &chunk, uint64_t inode_number);
+
+	// a pointer to the chunk is dropped, returns true when others are left 
+	// and the chunk must not be freed
+	bool release(uint64_t chunk_idx);
+
+	// the number of pointers to the chunk, 1 for one that is not indexed
+	uint64_t references(uint64_t chunk_idx);
+
+	// the cleaner moved an indexed chunk
+	void moved(uint64_t old_chunk_idx, uint64_t new_chunk_idx);
+
+	// whether the files pointing at the shared chunks are known since mount
+	bool knows_referrers();
+	void add_referrer(uint64_t chunk_idx, uint64_t inode_number);
+	void set_referrers_known();
+	// the files that may point at any of the shared chunks, each once
+	std::vector<uint64_t> referrers_of(const std::vector<uint64_t> &chunk_idxs);
+
+	Stats stats();
+
+private:
+	Entry read_slot(uint64_t slot);
+	void write_slot(uint64_t slot, const Entry &entry);
+	uint64_t take_slot();
+	void drop_slot(uint64_t slot);
+};
+
 struct SegmentController {
 	std::mutex segment_controller_lock;
 	//std::vector<std::mutex> single_segment_locks;
@@ -38,6 +197,45 @@ struct SegmentController {
 	uint64_t current_chunk;
 	uint64_t num_free_segments;
 	uint64_t free_segment_stat_offset;
+	// the owner the segment summary names for a chunk that more than one file 
+	// has pointed at, which of them still do is not kept anywhere
+	static constexpr uint64_t SHARED_CHUNK_OWNER = ~0ull;
+
+	// segments from this one on have never been used, their summaries are 
+	// whatever was on the device and are zeroed as they are first taken
+	uint64_t initialized_segments = 0;
+	bool pin_summaries = false; // pins each summary as it is initialized
+	bool checksums = false; // whether the summaries hold checksums, see SegmentSummaries
+
+	// with a fast device, the segments that lie on it (from segment 0 on) hold 
+	// the indirection tables and directories and the others the file data. 
+	// each is cleaned into itself. 0 when there is only one device
+	uint64_t fast_segments = 0;
+	uint64_t num_free_fast_segments = 0;
+	// where metadata is allocated in the fast segments, -1 when they are full
+	uint64_t meta_segment = -1;
+	uint64_t meta_chunk = 0;
+	// a table of the segment summaries, one chunk per segment, when they are 
+	// not kept in the first chunk of each segment (which is then left unused)
+	uint64_t summary_table_offset = 0;
+
+	bool compression = false; // whether clean compresses the segments it writes
+	DedupIndex *dedup = nullptr; // counts the pointers to shared chunks, when there are any
+
+	// how much the compressed segments save, stored_bytes is what their 
+	// compressed chunks take up on the device
+	struct CompressionStats {
+		uint64_t chunks = 0;
+		uint64_t plain_bytes = 0;
+		uint64_t stored_bytes = 0;
+	};
+
+	inline uint64_t summary_idx(uint64_t segment_number) const {
+		if (summary_table_offset != 0) {
+			return summary_table_offset + segment_number;
+		}
+		return data_offset + segment_number * segment_size;
+	}
 
 	uint64_t get_segment_usage(uint64_t segment_number);
 
@@ -45,22 +243,100 @@ struct SegmentController {
 
 	uint64_t get_segment_chunk_to_inode(uint64_t segment_number, uint64_t chunk_number);
 
+	// also forgets the chunk's checksum, whatever it holds now was not written by its new owner, 
+	// and its compressed block
 	void set_segment_chunk_to_inode(uint64_t segment_number, uint64_t chunk_number, uint64_t inode_number);
 
+	// names no owner for the chunk from now on but SHARED_CHUNK_OWNER, its checksum 
+	// and compressed block are left as they are. returns the owner it named before
+	uint64_t set_chunk_shared(uint64_t chunk_idx);
+
+	// tells the dedup index which files point at the chunks marked shared, by 
+	// looking through every file
+	void find_referrers();
+
+	CompressionStats segment_compression(uint64_t segment_number);
+	CompressionStats compression_stats();
+
+	// marks every segment free without touching their summaries, see initialize_segment
 	void clear_all_segments();
 
+	// zeroes the summaries of the segments up to this one that have not been used yet
+	void initialize_segment(uint64_t segment_number);
+
 	//Find a new free segment
 	void set_new_free_segment();
+	// and one in the fast segments for metadata
+	void set_new_meta_segment();
+
+	// whether the free segments are down to threshold of them, of either tier
+	bool needs_cleaning(double threshold) const;
 
 	//NOTE: only call clean under lock
+	// with a fast device, the tier with the smaller share of its segments free 
+	// is cleaned. with compression, the chunks of each segment clean writes are compressed 
+	// and packed one after the other from the segment's first chunk on, when 
+	// that leaves at least one of its chunks unwritten
 	void clean();
 
-	uint64_t alloc_next(uint64_t inode_number);
+	// packs the first usage chunks of a segment clean just wrote, false when 
+	// they do not compress well enough and are left as they are
+	bool compress_segment(uint64_t segment_number, uint64_t usage);
+
+	// metadata is allocated in the fast segments, while they have room
+	uint64_t alloc_next(uint64_t inode_number, bool metadata = false);
+
+	void free_chunk(ChunkRef chunk_to_free);
 
-	void free_chunk(std::shared_ptr<Chunk> chunk_to_free);
+private:
+	// cleans some of the segments in [first_segment, end_segment) into two free ones 
+	// of them, false when there are not two free ones
+	bool clean_segments(uint64_t first_segment, uint64_t end_segment);
+
+	// the next chunk of the segment being filled
+	uint64_t alloc_in(uint64_t &segment, uint64_t &chunk, uint64_t inode_number);
 };
 
 struct SuperBlock {
+	// chunk sizes a file system can be made with: powers of two in between these
+	static constexpr uint64_t MIN_CHUNK_SIZE = 512;
+	static constexpr uint64_t MAX_CHUNK_SIZE = 1024 * 1024;
+	static constexpr uint64_t DEFAULT_CHUNK_SIZE = 4096;
+
+	// marks a file system whose segment summaries hold CRC32C checksums
+	static constexpr uint64_t SUMMARY_CHECKSUMS_CRC32C = 1;
+
+	// the superblock is chunk 0 read as an array of uint64_t, these are what 
+	// each of its slots holds. file systems made before a slot was added have 
+	// 0 in it
+	enum Slot {
+		SUPERBLOCK_SIZE_SLOT = 0,
+		DISK_SIZE_BYTES_SLOT = 1,
+		DISK_SIZE_CHUNKS_SLOT = 2,
+		CHUNK_SIZE_SLOT = 3,
+		BLOCK_MAP_OFFSET_SLOT = 4,
+		BLOCK_MAP_SIZE_SLOT = 5,
+		INODE_TABLE_OFFSET_SLOT = 6,
+		INODE_TABLE_SIZE_SLOT = 7,
+		INODE_COUNT_SLOT = 8,
+		DATA_OFFSET_SLOT = 9,
+		SEGMENT_SIZE_SLOT = 10,
+		NUM_SEGMENTS_SLOT = 11,
+		ROOT_INODE_SLOT = 12,
+		FREE_SEGMENTS_SLOT = 13, // kept up to date by the segment controller
+		DEVICE_COUNT_SLOT = 14,
+		STRIPE_UNIT_SLOT = 15,
+		CHECKSUMS_SLOT = 16,
+		DEDUP_TABLE_OFFSET_SLOT = 17,
+		DEDUP_TABLE_SIZE_SLOT = 18,
+		HIGH_WATER_SLOT = 19, // of the dedup table, kept up to date by DedupIndex
+		UNINITIALIZED_SLOT = 20, // segments never used, kept up to date by the segment controller
+		FAST_SIZE_SLOT = 21,
+		SUMMARY_TABLE_SLOT = 22,
+		WARM_SET_OFFSET_SLOT = 23,
+		WARM_SET_SIZE_SLOT = 24
+	};
+
 	Disk *disk = nullptr;
 	const uint64_t superblock_size_chunks = 1;
 	const uint64_t disk_size_bytes;
@@ -79,20 +355,85 @@ struct SuperBlock {
 	uint64_t data_offset = 0; //where free chunks begin
 	uint64_t root_inode_index = 0;
 
+	// how the disk is striped over its devices, set before init. only recorded 
+	// so that myfs can check it is given the same devices it was made on
+	uint64_t device_count = 1;
+	uint64_t stripe_unit_bytes = 0;
+
+	// how many chunks from the start of the disk are on a fast device, set 
+	// before init, 0 when there is none. the superblock, bitmaps, inode table 
+	// and segment summaries must fit in there, the segments that fit in what 
+	// is left of it hold the indirection tables and directories
+	uint64_t fast_size_chunks = 0;
+	uint64_t summary_table_offset = 0; // see SegmentController
+
+	// the segments that lie wholly on the fast device, 0 when there is none 
+	// or it holds every segment
+	uint64_t fast_segments() const;
+
+	// whether every chunk in the segments is checksummed, set before init. 
+	// file systems made before checksums were added are mounted without
+	bool checksums = true;
+	// whether the cleaner compresses the segments it writes, set before init 
+	// or load. not recorded, the compressed segments are read back either way. 
+	// needs checksums and a disk that is not zero copy
+	bool compression = false;
+	std::shared_ptr<SegmentSummaries> segment_summaries;
+
+	// whether whole chunks of file data are deduplicated as they are written, 
+	// set before init. mkfs reserves the table for the index, a file system 
+	// that has one is always mounted with it
+	bool dedup = false;
+	uint64_t dedup_table_offset = 0;
+	uint64_t dedup_table_size_chunks = 0;
+	std::unique_ptr<DedupIndex> dedup_index;
+
+	// the chunks mkfs reserves for the disk's warm set (see Disk::configure_warm_set), 
+	// which is read back in when the file system is mounted. 0 on file systems 
+	// made without one
+	static constexpr uint64_t WARM_SET_MAX_CHUNKS = 128;
+	uint64_t warm_set_offset = 0;
+	uint64_t warm_set_size_chunks = 0;
+
 	SegmentController segment_controller;
 	uint64_t segment_size_chunks = 0;
 	uint64_t num_segments = 0;
 	uint64_t num_free_segments = 0;
 
 	SuperBlock(Disk *disk);
+	// saves the warm set, as the file system is unmounted
+	~SuperBlock();
+
+	static bool valid_chunk_size(uint64_t chunk_size);
+
+	struct DeviceLayout {
+		uint64_t chunk_size = 0;
+		uint64_t device_count = 1;
+		uint64_t stripe_unit_bytes = 0; // 0 when there is a single device
+		uint64_t fast_size_bytes = 0; // 0 when there is no fast device
+	};
+
+	// reads how the file system on the device was laid out straight out of 
+	// its superblock, before there is a Disk to read it through (which needs 
+	// to know the chunk size). of a striped disk this is the first device and 
+	// of a tiered one the fast device, they hold the superblock. throws a FileSystemException when the device does 
+	// not start with a valid superblock
+	static DeviceLayout read_device_layout(int fd);
+	static uint64_t read_chunk_size(int fd);
 
 	void init(double inode_table_size_rel_to_disk);
-	void load_from_disk();
+	// with pin_metadata the superblock, bitmaps and segment summaries are 
+	// loaded up front and kept in memory for as long as the disk is open
+	void load_from_disk(bool pin_metadata = false);
 
-	std::shared_ptr<Chunk> allocate_chunk(uint64_t inode_number) {
+	// hands the disk the checksums and compressed extents kept in the segment 
+	// summaries, once the segment controller is set up
+	void attach_summaries();
+
+	ChunkRef allocate_chunk(uint64_t inode_number, bool metadata = false) {
 		//Allocate the next chunk, does error handling internally
-		uint64_t chunk_index = segment_controller.alloc_next(inode_number);
-		std::shared_ptr<Chunk> chunk = this->disk->get_chunk(chunk_index);
+		uint64_t chunk_index = segment_controller.alloc_next(inode_number, metadata);
+		ChunkRef chunk = this->disk->get_chunk(chunk_index);
 		
 		// zero the newly allocated chunk before we return it
 		chunk->memset(chunk->data, 0, this->disk_chunk_size); 
@@ -162,6 +503,13 @@ struct INode {
 	static constexpr uint64_t ADDRESS_COUNT = DIRECT_ADDRESS_COUNT + INDIRECT_ADDRESS_COUNT + DOUBLE_INDIRECT_ADDRESS_COUNT + TRIPPLE_INDIRECT_ADDRESS_COUNT;
 	static const uint64_t INDIRECT_TABLE_SIZES[4];
 
+	// read asks the disk for up to this many chunks of a range at once
+	static constexpr uint64_t READ_BATCH_CHUNKS = 64;
+
+	// bounds of the readahead window of a file that is being read sequentially
+	static constexpr uint64_t READAHEAD_MIN_CHUNKS = 4;
+	static constexpr uint64_t READAHEAD_MAX_CHUNKS = 128;
+
 	static constexpr uint8_t FLAG_IF_DIR = 1;
 	static constexpr uint8_t FLAG_IF_REG = 2;
 
@@ -184,6 +532,14 @@ struct INode {
 	INodeData data;
 	SuperBlock *superblock = nullptr;	
 
+	// tracks whether reads of the file are sequential, only kept in memory
+	struct ReadaheadState {
+		uint64_t next_chunk_number = 0; // where a sequential read would carry on
+		uint64_t window = 0; // chunks to read ahead, 0 while the reads look random
+		uint64_t prefetched_until = 0; // readahead has been issued up to this chunk number
+	};
+	ReadaheadState readahead;
+
 	~INode() {
 		if (this->superblock != nullptr) {
 			// stores the data for this inode back into the inode table now that it is 
@@ -192,8 +548,24 @@ struct INode {
 		}
 	}
 
-	std::shared_ptr<Chunk> resolve_indirection(uint64_t chunk_number, bool createIfNotExists);
+	ChunkRef resolve_indirection(uint64_t chunk_number, bool createIfNotExists);
+	// finds where the chunk_number'th chunk of the file lives without loading it 
+	// (only the indirection tables on the way), 0 if it has not been allocated
+	uint64_t lookup_chunk_idx(uint64_t chunk_number);
+	// called by read with the chunk numbers [first, end) it is about to read, 
+	// grows the readahead window while the reads keep following on from each 
+	// other and prefetches that far past the read
+	void read_ahead(uint64_t first_chunk_number, uint64_t end_chunk_number);
 	void update_chunk_locations(const std::unordered_map<uint64_t, uint64_t> &mapping);
+	// appends where every chunk of the file is stored, its indirection tables included
+	void chunk_locations(std::vector<uint64_t> &locations);
+	// points the chunk_number'th chunk of the file at chunk_idx, the tables on 
+	// the way must already belong to this file alone (i.e. have just been 
+	// written by resolve_indirection)
+	void set_chunk_idx(uint64_t chunk_number, uint64_t chunk_idx);
+	// with deduplication, a whole chunk that was just written is swapped for 
+	// an identical one that is already stored, if there is one
+	void deduplicate(uint64_t chunk_number, ChunkRef chunk);
 
 	static uint64_t get_file_size();
 
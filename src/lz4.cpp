@@ -0,0 +1,174 @@
+#include <cstring>
+
+#include "lz4.hpp"
+
+// matches are at least this long, the token stores their length less this
+static const size_t MIN_MATCH = 4;
+// a block always ends in at least this many literals
+static const size_t LAST_LITERALS = 5;
+// and its last match starts at least this far from its end
+static const size_t MATCH_FIND_LIMIT = 12;
+static const size_t MAX_OFFSET = 65535;
+
+// positions of recently seen 4 byte sequences, 4096 of them
+static const unsigned HASH_BITS = 12;
+
+static inline uint32_t read32(const uint8_t *p) {
+	uint32_t value;
+	std::memcpy(&value, p, sizeof(value));
+	return value;
+}
+
+static inline uint32_t hash_of(uint32_t sequence) {
+	return (sequence * 2654435761U) >> (32 - HASH_BITS);
+}
+
+// writes what is left of a length that did not fit in its half of the token
+static inline uint8_t *write_length(uint8_t *op, size_t length) {
+	while (length >= 255) {
+		*op++ = 255;
+		length -= 255;
+	}
+	*op++ = (uint8_t)length;
+	return op;
+}
+
+size_t lz4_compress(const uint8_t *src, size_t length, uint8_t *dst, size_t capacity) {
+	// the table holds positions plus one, 0 marks an empty slot
+	uint32_t table[1 << HASH_BITS];
+	std::memset(table, 0, sizeof(table));
+
+	uint8_t *op = dst;
+	uint8_t *const op_end = dst + capacity;
+	size_t anchor = 0; // start of the literals not yet written out
+	size_t ip = 0;
+
+	if (length > MATCH_FIND_LIMIT) {
+		const size_t match_find_end = length - MATCH_FIND_LIMIT;
+		const size_t match_end = length - LAST_LITERALS;
+
+		while (ip < match_find_end) {
+			const uint32_t sequence = read32(src + ip);
+			const uint32_t h = hash_of(sequence);
+			const uint32_t entry = table[h];
+			table[h] = (uint32_t)ip + 1;
+
+			if (entry == 0 || ip - (entry - 1) > MAX_OFFSET || read32(src + entry - 1) != sequence) {
+				ip++;
+				continue ;
+			}
+			size_t ref = entry - 1;
+
+			// the match may well have started before where it was found
+			while (ip > anchor && ref > 0 && src[ip - 1] == src[ref - 1]) {
+				ip--;
+				ref--;
+			}
+			size_t match_length = MIN_MATCH;
+			while (ip + match_length < match_end && src[ref + match_length] == src[ip + match_length]) {
+				match_length++;
+			}
+
+			const size_t literals = ip - anchor;
+			if ((size_t)(op_end - op) < 1 + literals / 255 + 1 + literals + 2 + match_length / 255 + 1 + LAST_LITERALS + 1)
+				return 0;
+
+			uint8_t *token = op++;
+			*token = (uint8_t)((literals >= 15 ? 15 : literals) << 4);
+			if (literals >= 15)
+				op = write_length(op, literals - 15);
+			std::memcpy(op, src + anchor, literals);
+			op += literals;
+
+			const size_t offset = ip - ref;
+			*op++ = (uint8_t)(offset & 0xFF);
+			*op++ = (uint8_t)(offset >> 8);
+
+			const size_t stored_length = match_length - MIN_MATCH;
+			*token |= (uint8_t)(stored_length >= 15 ? 15 : stored_length);
+			if (stored_length >= 15)
+				op = write_length(op, stored_length - 15);
+
+			ip += match_length;
+			anchor = ip;
+			// the position just behind the match is a likely start for the next one
+			if (ip - 2 < match_find_end)
+				table[hash_of(read32(src + ip - 2))] = (uint32_t)(ip - 2) + 1;
+		}
+	}
+
+	// whatever is left goes out as literals
+	const size_t literals = length - anchor;
+	if ((size_t)(op_end - op) < 1 + literals / 255 + 1 + literals)
+		return 0;
+	uint8_t *token = op++;
+	*token = (uint8_t)((literals >= 15 ? 15 : literals) << 4);
+	if (literals >= 15)
+		op = write_length(op, literals - 15);
+	std::memcpy(op, src + anchor, literals);
+	op += literals;
+
+	return op - dst;
+}
+
+bool lz4_decompress(const uint8_t *src, size_t length, uint8_t *dst, size_t out_length) {
+	size_t ip = 0;
+	size_t op = 0;
+
+	while (ip < length) {
+		const uint8_t token = src[ip++];
+
+		size_t literals = token >> 4;
+		if (literals == 15) {
+			uint8_t more;
+			do {
+				if (ip >= length)
+					return false;
+				more = src[ip++];
+				literals += more;
+			} while (more == 255);
+		}
+		if (literals > length - ip || literals > out_length - op)
+			return false;
+		std::memcpy(dst + op, src + ip, literals);
+		ip += literals;
+		op += literals;
+
+		// the last sequence has no match
+		if (ip == length)
+			break ;
+
+		if (length - ip < 2)
+			return false;
+		const size_t offset = src[ip] | ((size_t)src[ip + 1] << 8);
+		ip += 2;
+		if (offset == 0 || offset > op)
+			return false;
+
+		size_t match_length = token & 15;
+		if (match_length == 15) {
+			uint8_t more;
+			do {
+				if (ip >= length)
+					return false;
+				more = src[ip++];
+				match_length += more;
+			} while (more == 255);
+		}
+		match_length += MIN_MATCH;
+		if (match_length > out_length - op)
+			return false;
+
+		if (offset >= match_length) {
+			std::memcpy(dst + op, dst + op - offset, match_length);
+		} else {
+			// the match overlaps what it is copying, i.e. a run of one byte
+			for (size_t idx = 0; idx < match_length; ++idx) {
+				dst[op + idx] = dst[op - offset + idx];
+			}
+		}
+		op += match_length;
+	}
+
+	return op == out_length;
+}
@@ -0,0 +1,29 @@
+#ifndef LZ4_HPP
+#define LZ4_HPP
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+	a small implementation of the LZ4 block format, for compressing whole
+	chunks. compression is a single greedy pass with a hash table of recent
+	positions (like LZ4's fast mode) and decompression is a tight copy loop,
+	both run at memory speed rather than device speed. blocks produced here
+	can be read by any LZ4 block decoder and the other way around
+*/
+
+// the most a block of length bytes can grow to when it does not compress
+inline size_t lz4_compress_bound(size_t length) {
+	return length + length / 255 + 16;
+}
+
+// compresses length bytes at src into dst, returns the size of the block or
+// 0 if it does not fit in capacity bytes
+size_t lz4_compress(const uint8_t *src, size_t length, uint8_t *dst, size_t capacity);
+
+// decompresses a block of length bytes at src into exactly out_length bytes
+// at dst, returns false if the block is malformed or does not decompress to
+// out_length bytes
+bool lz4_decompress(const uint8_t *src, size_t length, uint8_t *dst, size_t out_length);
+
+#endif
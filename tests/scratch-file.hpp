@@ -0,0 +1,41 @@
+#ifndef SCRATCH_FILE_HPP
+#define SCRATCH_FILE_HPP
+
+#include <cstring>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "catch.hpp"
+
+#include "diskinterface.hpp"
+
+// a file in /tmp that is sized up front and removed again once the test is 
+// done, whether or not it passed
+struct ScratchFile {
+	char path[64];
+	int fd = -1;
+
+	ScratchFile(Size size_bytes) {
+		strcpy(path, "/tmp/mayanfest-test-XXXXXX");
+		fd = mkstemp(path);
+		REQUIRE(fd != -1);
+		// the destructor does not run for a constructor that throws
+		const bool sized = ftruncate(fd, size_bytes) == 0;
+		if (!sized) {
+			close(fd);
+			unlink(path);
+		}
+		REQUIRE(sized);
+	}
+
+	~ScratchFile() {
+		close(fd);
+		unlink(path);
+	}
+
+	ScratchFile(const ScratchFile &) = delete;
+	ScratchFile &operator=(const ScratchFile &) = delete;
+};
+
+#endif
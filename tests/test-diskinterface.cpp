@@ -1,13 +1,29 @@
 #include <iostream>
+#include <algorithm>
+#include <thread>
+#include <chrono>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <set>
+#include <functional>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
 #include "catch.hpp"
 
 #include "diskinterface.hpp"
+#include "diskbackend.hpp"
+#include "chunkpool.hpp"
+#include "crc32c.hpp"
+#include "lz4.hpp"
+#include "scratch-file.hpp"
 
-TEST_CASE( "Disk interface should work", "[diskinterface]" ) {
-	std::unique_ptr<Disk> disk(new Disk(256, 16));
+static void test_disk_interface(std::unique_ptr<Disk> disk) {
 
-	std::shared_ptr<Chunk> chunk0;
+	ChunkRef chunk0;
 	SECTION("can get a chunk") {
 		chunk0 = disk->get_chunk(0);
 		REQUIRE(chunk0 != nullptr);
@@ -26,7 +42,7 @@ TEST_CASE( "Disk interface should work", "[diskinterface]" ) {
 	}
 
 	SECTION("can get many chunks and trigger a sweep of the chunk cache without segfaulting") {
-		std::shared_ptr<Chunk> chunk;
+		ChunkRef chunk;
 		for (size_t i = 0; i < 128; ++i) {
 			chunk = disk->get_chunk(i);
 			REQUIRE(chunk != nullptr);
@@ -34,30 +50,2133 @@ TEST_CASE( "Disk interface should work", "[diskinterface]" ) {
 	}
 
 	SECTION("can get many chunks again, hold on to them, and then free them all at once") {
-		std::vector<std::shared_ptr<Chunk>> chunkvec;
+		std::vector<ChunkRef> chunkvec;
 		for (size_t i = 0; i < 128; ++i) {
 			chunkvec.push_back(disk->get_chunk(i));
 		}
 	}
 
 	SECTION("can get two references to the same chunk, change a value in one, and see it in the other") {
-		std::shared_ptr<Chunk> refA = disk->get_chunk(2);
-		std::shared_ptr<Chunk> refB = disk->get_chunk(2);
+		ChunkRef refA = disk->get_chunk(2);
+		ChunkRef refB = disk->get_chunk(2);
 		refA->data[0] = 1;
+		refA->mark_dirty();
 		REQUIRE(refB->data[0] == 1);
 	}
 
 	SECTION("can get a reference, release it thus flushing chunk to disk, and then get a new reference and find the same data") {
 		{
-			std::shared_ptr<Chunk> refA = disk->get_chunk(4);
+			ChunkRef refA = disk->get_chunk(4);
 			refA->data[0] = 1;
+			refA->mark_dirty();
 		}
 		
 		{
-			std::shared_ptr<Chunk> refB = disk->get_chunk(4);
+			ChunkRef refB = disk->get_chunk(4);
 			REQUIRE(refB->data[0] == 1);
 		}
 	}
+
+	SECTION("should refuse to hand out a chunk past the end of the disk") {
+		REQUIRE_THROWS_AS(disk->get_chunk(disk->size_chunks()), DiskException);
+	}
+}
+
+TEST_CASE( "Disk interface should work", "[diskinterface]" ) {
+	test_disk_interface(std::unique_ptr<Disk>(new Disk(256, 16)));
+}
+
+TEST_CASE( "Disk interface should work in zero copy mode", "[diskinterface][zerocopy]" ) {
+	test_disk_interface(std::unique_ptr<Disk>(new Disk(256, 16, MAP_PRIVATE | MAP_ANONYMOUS, -1, true)));
+
+	SECTION("neighbouring chunks are views onto the same contiguous mapping") {
+		std::unique_ptr<Disk> disk(new Disk(256, 16, MAP_PRIVATE | MAP_ANONYMOUS, -1, true));
+		ChunkRef chunk0 = disk->get_chunk(0);
+		ChunkRef chunk1 = disk->get_chunk(1);
+		REQUIRE(chunk1->data == chunk0->data + disk->chunk_size());
+	}
+}
+
+TEST_CASE( "Disk interface should work on the pread backend", "[diskinterface][backend]" ) {
+	ScratchFile file(256 * 16);
+	test_disk_interface(std::unique_ptr<Disk>(new Disk(256, 16, 
+		std::unique_ptr<DiskBackend>(new PreadBackend(file.fd, 256 * 16)))));
+
+	SECTION("zero copy mode is refused without a memory mapping") {
+		REQUIRE_THROWS_AS(Disk(256, 16, std::unique_ptr<DiskBackend>(new PreadBackend(file.fd, 256 * 16)), true), DiskException);
+	}
+}
+
+TEST_CASE( "Disk interface should work on the O_DIRECT backend", "[diskinterface][backend]" ) {
+	ScratchFile file(256 * PreadBackend::DIRECT_IO_ALIGNMENT);
+	std::unique_ptr<DiskBackend> backend;
+	try {
+		backend = make_disk_backend("direct", file.fd, 256 * PreadBackend::DIRECT_IO_ALIGNMENT);
+	} catch (const DiskException &e) {
+		WARN("skipping, /tmp does not support O_DIRECT: " << e.message);
+		return ;
+	}
+	test_disk_interface(std::unique_ptr<Disk>(new Disk(256, PreadBackend::DIRECT_IO_ALIGNMENT, std::move(backend))));
+
+	SECTION("chunks smaller than the direct I/O alignment are refused") {
+		REQUIRE_THROWS_AS(Disk(256, 512, make_disk_backend("direct", file.fd, 256 * 512)), DiskException);
+	}
+}
+
+TEST_CASE( "Disk backends should agree on what is stored on the device", "[diskinterface][backend]" ) {
+	ScratchFile file(64 * 512);
+
+	for (const char *writer : {"pread", "mmap"}) {
+		const char *reader = strcmp(writer, "pread") == 0 ? "mmap" : "pread";
+		{
+			Disk disk(64, 512, make_disk_backend(writer, file.fd, 64 * 512));
+			for (size_t i = 0; i < 64; ++i) {
+				ChunkRef chunk = disk.get_chunk(i);
+				chunk->memset(chunk->data, (Byte)(i + writer[0]), chunk->size_bytes);
+			}
+		}
+		{
+			Disk disk(64, 512, make_disk_backend(reader, file.fd, 64 * 512));
+			for (size_t i = 0; i < 64; ++i) {
+				ChunkRef chunk = disk.get_chunk(i);
+				REQUIRE(chunk->data[0] == (Byte)(i + writer[0]));
+				REQUIRE(chunk->data[511] == (Byte)(i + writer[0]));
+			}
+		}
+	}
+}
+
+static std::unique_ptr<StripedBackend> make_striped(std::vector<ScratchFile *> files, const char *backend, Size size_bytes, Size stripe_unit) {
+	std::vector<std::unique_ptr<DiskBackend>> devices;
+	for (ScratchFile *file : files) {
+		devices.push_back(make_disk_backend(backend, file->fd, size_bytes));
+	}
+	return std::unique_ptr<StripedBackend>(new StripedBackend(std::move(devices), stripe_unit));
+}
+
+TEST_CASE( "Disk interface should work striped over several devices", "[diskinterface][backend][striped]" ) {
+	ScratchFile a(64 * 1024), b(64 * 1024), c(64 * 1024);
+
+	SECTION("on the pread backend") {
+		test_disk_interface(std::unique_ptr<Disk>(new Disk(256, 16, make_striped({&a, &b, &c}, "pread", 64 * 1024, 64))));
+	}
+
+	SECTION("on the mmap backend") {
+		test_disk_interface(std::unique_ptr<Disk>(new Disk(256, 16, make_striped({&a, &b, &c}, "mmap", 64 * 1024, 64))));
+	}
+
+	SECTION("the size is what fits of every device in whole stripe units") {
+		std::unique_ptr<StripedBackend> backend = make_striped({&a, &b, &c}, "pread", 64 * 1024 - 100, 4096);
+		REQUIRE(backend->device_count() == 3);
+		REQUIRE(backend->size_bytes() == 3 * 15 * 4096);
+	}
+
+	SECTION("bad stripe units are refused") {
+		REQUIRE_THROWS_AS(make_striped({&a, &b}, "pread", 64 * 1024, 0), DiskException);
+		REQUIRE_THROWS_AS(StripedBackend(std::vector<std::unique_ptr<DiskBackend>>()), DiskException);
+	}
+}
+
+TEST_CASE( "Striped devices should place every stripe unit on the right device", "[diskinterface][backend][striped]" ) {
+	const Size chunk_size = 512;
+	const Size unit = 2 * chunk_size;
+	ScratchFile a(64 * chunk_size), b(64 * chunk_size), c(64 * chunk_size);
+	ScratchFile *files[] = {&a, &b, &c};
+
+	{
+		Disk disk(96, chunk_size, make_striped({&a, &b, &c}, "pread", 32 * chunk_size, unit));
+		// one batch across every device
+		ChunkSpan span = disk.get_span(0, 96);
+		for (size_t i = 0; i < 96; ++i) {
+			span.fill(i * chunk_size, (Byte)(i + 1), chunk_size);
+		}
+		span.release();
+		disk.flush_all();
+	}
+
+	for (size_t i = 0; i < 96; ++i) {
+		const Size offset = i * chunk_size;
+		const size_t device = (offset / unit) % 3;
+		const Size device_offset = (offset / unit / 3) * unit + offset % unit;
+		Byte first = 0, last = 0;
+		REQUIRE(pread(files[device]->fd, &first, 1, device_offset) == 1);
+		REQUIRE(pread(files[device]->fd, &last, 1, device_offset + chunk_size - 1) == 1);
+		REQUIRE(first == (Byte)(i + 1));
+		REQUIRE(last == (Byte)(i + 1));
+	}
+
+	SECTION("transfers crossing stripe units are split up and put back together") {
+		std::unique_ptr<StripedBackend> backend = make_striped({&a, &b, &c}, "pread", 32 * chunk_size, unit);
+		std::vector<Byte> buf(11 * chunk_size);
+		backend->read(3 * chunk_size, &buf[0], buf.size());
+		for (size_t i = 0; i < 11; ++i) {
+			REQUIRE(buf[i * chunk_size] == (Byte)(i + 4));
+		}
+
+		std::fill(buf.begin(), buf.end(), 0xEE);
+		backend->write(5 * chunk_size, &buf[0], 7 * chunk_size);
+		backend->sync_ranges({{5 * chunk_size, 7 * chunk_size}, {20 * chunk_size, chunk_size}});
+		std::vector<Byte> read_back(9 * chunk_size);
+		backend->read_batch({{4 * chunk_size, &read_back[0], 9 * chunk_size}});
+		REQUIRE(read_back[0] == (Byte)5);
+		for (size_t i = 1; i < 8; ++i) {
+			REQUIRE(read_back[i * chunk_size] == 0xEE);
+		}
+		REQUIRE(read_back[8 * chunk_size] == (Byte)13);
+	}
+
+	SECTION("every batch for a device runs on the same thread") {
+		struct ThreadRecordingBackend : public PreadBackend {
+			std::set<std::thread::id> &threads;
+			bool failing = false;
+			ThreadRecordingBackend(int fd, Size size_bytes, std::set<std::thread::id> &threads) 
+				: PreadBackend(fd, size_bytes), threads(threads) { }
+			void read_batch(const std::vector<IORequest> &requests) override {
+				threads.insert(std::this_thread::get_id());
+				if (failing) 
+					throw DiskException("the device failed the read");
+				PreadBackend::read_batch(requests);
+			}
+		};
+		std::set<std::thread::id> threads[3];
+		std::vector<std::unique_ptr<DiskBackend>> devices;
+		for (size_t idx = 0; idx < 3; ++idx) {
+			devices.emplace_back(new ThreadRecordingBackend(files[idx]->fd, 32 * chunk_size, threads[idx]));
+		}
+		ThreadRecordingBackend &last = (ThreadRecordingBackend &)*devices[2];
+		StripedBackend backend(std::move(devices), unit);
+
+		std::vector<Byte> buf(3 * unit);
+		for (int round = 0; round < 10; ++round) {
+			backend.read_batch({{0, &buf[0], buf.size()}});
+		}
+		REQUIRE(buf[0] == (Byte)1);
+		REQUIRE(buf[2 * unit] == (Byte)5);
+		// the caller takes the first device, the others stay on their worker
+		REQUIRE(threads[0] == std::set<std::thread::id>{std::this_thread::get_id()});
+		REQUIRE(threads[1].size() == 1);
+		REQUIRE(threads[2].size() == 1);
+		REQUIRE(*threads[1].begin() != std::this_thread::get_id());
+		REQUIRE(*threads[1].begin() != *threads[2].begin());
+
+		// an error on a worker still reaches the caller
+		last.failing = true;
+		REQUIRE_THROWS_AS(backend.read_batch({{0, &buf[0], buf.size()}}), DiskException);
+		last.failing = false;
+		backend.read_batch({{0, &buf[0], buf.size()}});
+	}
+}
+
+static void test_batched_io(ScratchFile &file, const char *backend) {
+	{
+		Disk disk(256, 512, make_disk_backend(backend, file.fd, 256 * 512));
+		for (size_t i = 0; i < 256; ++i) {
+			ChunkRef chunk = disk.get_chunk(i);
+			chunk->memset(chunk->data, (Byte)i, chunk->size_bytes);
+		}
+	}
+
+	Disk disk(256, 512, make_disk_backend(backend, file.fd, 256 * 512));
+
+	SECTION("get_chunks hands back the chunks in the order they were asked for") {
+		std::vector<Size> chunk_idxs;
+		for (size_t i = 256; i > 0; --i) 
+			chunk_idxs.push_back(i - 1);
+
+		std::vector<ChunkRef> chunks = disk.get_chunks(chunk_idxs);
+		REQUIRE(chunks.size() == 256);
+		for (size_t i = 0; i < chunks.size(); ++i) {
+			REQUIRE(chunks[i]->chunk_idx == chunk_idxs[i]);
+			REQUIRE(chunks[i]->data[0] == (Byte)chunk_idxs[i]);
+			REQUIRE(chunks[i]->data[511] == (Byte)chunk_idxs[i]);
+		}
+		REQUIRE(disk.cache_stats().misses == 256);
+	}
+
+	SECTION("get_chunks shares chunks that are already in memory, even within a batch") {
+		ChunkRef held = disk.get_chunk(7);
+		std::vector<ChunkRef> chunks = disk.get_chunks(std::vector<Size>{7, 8, 8, 9});
+		REQUIRE(chunks[0] == held);
+		REQUIRE(chunks[1] == chunks[2]);
+		REQUIRE(chunks[3]->data[0] == 9);
+
+		Disk::CacheStats stats = disk.cache_stats();
+		REQUIRE(stats.misses == 3);
+		REQUIRE(stats.hits == 2);
+	}
+
+	SECTION("get_chunks refuses a batch that reaches past the end of the disk") {
+		REQUIRE_THROWS_AS(disk.get_chunks(std::vector<Size>{0, 256}), DiskException);
+		REQUIRE(disk.cache_stats().misses == 0);
+	}
+
+	SECTION("flush_all writes the dirty chunks back as one batch") {
+		disk.configure_cache(256 * 512);
+		std::vector<Size> chunk_idxs;
+		for (size_t i = 0; i < 256; ++i) 
+			chunk_idxs.push_back(i);
+		{
+			std::vector<ChunkRef> chunks = disk.get_chunks(chunk_idxs);
+			for (ChunkRef &chunk : chunks) 
+				chunk->memset(chunk->data, 0xAB, chunk->size_bytes);
+		}
+		disk.flush_all();
+		REQUIRE(disk.cache_stats().dirty_chunks == 0);
+
+		Disk other(256, 512, make_disk_backend("pread", file.fd, 256 * 512));
+		for (size_t i = 0; i < 256; ++i) {
+			REQUIRE(other.get_chunk(i)->data[100] == 0xAB);
+		}
+	}
+}
+
+TEST_CASE( "Disk should batch chunk I/O", "[diskinterface][backend]" ) {
+	ScratchFile file(256 * 512);
+	for (const char *backend : {"mmap", "pread", "uring"}) {
+		DYNAMIC_SECTION("on the " << backend << " backend") {
+			test_batched_io(file, backend);
+		}
+	}
+}
+
+TEST_CASE( "Disk interface should work on the io_uring backend", "[diskinterface][backend]" ) {
+	ScratchFile file(256 * 16);
+	std::unique_ptr<DiskBackend> backend;
+	try {
+		backend = std::unique_ptr<DiskBackend>(new UringBackend(file.fd, 256 * 16));
+	} catch (const DiskException &e) {
+		WARN("skipping, io_uring is not available: " << e.message);
+		REQUIRE(strcmp(make_disk_backend("uring", file.fd, 256 * 16)->name(), "pread") == 0);
+		return ;
+	}
+	test_disk_interface(std::unique_ptr<Disk>(new Disk(256, 16, std::move(backend))));
+
+	SECTION("a batch much larger than the queue depth is pushed through the ring") {
+		UringBackend uring(file.fd, 256 * 16, false, 4);
+		REQUIRE(uring.queue_depth() == 4);
+
+		std::vector<Byte> out(256 * 16), in(256 * 16, 0);
+		std::vector<DiskBackend::IORequest> writes, reads;
+		for (size_t i = 0; i < 256; ++i) {
+			std::memset(&out[i * 16], (Byte)(255 - i), 16);
+			writes.push_back(DiskBackend::IORequest{i * 16, &out[i * 16], 16});
+			reads.push_back(DiskBackend::IORequest{i * 16, &in[i * 16], 16});
+		}
+		uring.write_batch(writes);
+		uring.read_batch(reads);
+		REQUIRE(in == out);
+	}
+
+	SECTION("reading past the end of the file reads zeros") {
+		ScratchFile empty(0);
+		UringBackend uring(empty.fd, 4096);
+		std::vector<Byte> in(4096, 0xFF);
+		uring.read(0, in.data(), in.size());
+		REQUIRE(in == std::vector<Byte>(4096, 0));
+	}
+}
+
+// a device with round numbers, so what it charges can be worked out by hand: 
+// 512 bytes take 100 ns and any seek takes 10 us
+static DeviceModel round_model(unsigned queue_depth) {
+	DeviceModel model;
+	model.name = "round";
+	model.read_latency_ns = 1000;
+	model.write_latency_ns = 500;
+	model.seek_min_ns = 10000;
+	model.seek_max_ns = 10000;
+	model.read_bytes_per_sec = 5120ull * 1000 * 1000;
+	model.write_bytes_per_sec = 5120ull * 1000 * 1000;
+	model.queue_depth = queue_depth;
+	model.sync_ns = 7;
+	return model;
+}
+
+static std::unique_ptr<SimulatedBackend> make_simulated(const DeviceModel &model, Size size_bytes) {
+	return std::unique_ptr<SimulatedBackend>(new SimulatedBackend(
+		std::unique_ptr<DiskBackend>(new MmapBackend(size_bytes)), model, false));
+}
+
+TEST_CASE( "Simulated devices should charge every I/O what the model says", "[diskinterface][backend][simulated]" ) {
+	SECTION("the disk interface works on top of one") {
+		test_disk_interface(std::unique_ptr<Disk>(new Disk(256, 16, make_simulated(DeviceModel::nvme(), 256 * 16))));
+	}
+
+	SECTION("single I/Os pay their latency, transfer and seeks") {
+		std::unique_ptr<SimulatedBackend> device = make_simulated(round_model(1), 64 * 512);
+		std::vector<Byte> out(512, 0x5A), in(512, 0);
+
+		device->read(0, in.data(), 512);
+		REQUIRE(device->stats().busy_ns == 1100);
+		// carries on where the last one ended, no seek
+		device->read(512, in.data(), 512);
+		REQUIRE(device->stats().busy_ns == 2200);
+		device->read(10 * 512, in.data(), 512);
+		REQUIRE(device->stats().busy_ns == 2200 + 10000 + 1100);
+		device->write(11 * 512, out.data(), 512);
+		REQUIRE(device->stats().busy_ns == 13300 + 600);
+		device->sync_ranges({DiskBackend::SyncRange{0, 512}, DiskBackend::SyncRange{4096, 512}});
+		REQUIRE(device->stats().busy_ns == 13900 + 7);
+
+		SimulatedBackend::Stats stats = device->stats();
+		REQUIRE(stats.reads == 3);
+		REQUIRE(stats.writes == 1);
+		REQUIRE(stats.bytes_read == 3 * 512);
+		REQUIRE(stats.bytes_written == 512);
+		REQUIRE(stats.seeks == 1);
+		REQUIRE(stats.syncs == 1);
+
+		// the data still goes to the device underneath
+		device->read(11 * 512, in.data(), 512);
+		REQUIRE(in == out);
+	}
+
+	SECTION("a batch is spread over the queue, up to the bandwidth") {
+		std::vector<Byte> buf(8 * 4096);
+		std::vector<DiskBackend::IORequest> small, large;
+		for (size_t i = 0; i < 8; ++i) {
+			small.push_back(DiskBackend::IORequest{i * 512, &buf[i * 512], 512});
+			large.push_back(DiskBackend::IORequest{i * 4096, &buf[i * 4096], 4096});
+		}
+
+		// 1100 ns each, one after another or two to each of four slots
+		REQUIRE(make_simulated(round_model(1), 8 * 4096)->stats().busy_ns == 0);
+		std::unique_ptr<SimulatedBackend> serial = make_simulated(round_model(1), 8 * 4096);
+		serial->read_batch(small);
+		REQUIRE(serial->stats().busy_ns == 8 * 1100);
+		std::unique_ptr<SimulatedBackend> queued = make_simulated(round_model(4), 8 * 4096);
+		queued->read_batch(small);
+		REQUIRE(queued->stats().busy_ns == 2 * 1100);
+
+		// 1800 ns each all at once, but 32 KB take 6400 ns to get through
+		std::unique_ptr<SimulatedBackend> wide = make_simulated(round_model(8), 8 * 4096);
+		wide->read_batch(large);
+		REQUIRE(wide->stats().busy_ns == 8 * 800);
+	}
+
+	SECTION("the presets rank as the devices do and cost the same every time") {
+		auto random_reads = [](const DeviceModel &model) {
+			std::unique_ptr<SimulatedBackend> device = make_simulated(model, 256 * 4096);
+			SimulatedBackend *simulated = device.get();
+			Disk disk(256, 4096, std::move(device));
+			for (size_t i = 0; i < 64; ++i) {
+				disk.get_chunk((i * 97) % 256);
+			}
+			return simulated->stats();
+		};
+		SimulatedBackend::Stats hdd = random_reads(DeviceModel::hdd());
+		SimulatedBackend::Stats ssd = random_reads(DeviceModel::sata_ssd());
+		SimulatedBackend::Stats nvme = random_reads(DeviceModel::nvme());
+		REQUIRE(hdd.seeks > 0);
+		REQUIRE(ssd.seeks == 0);
+		REQUIRE(hdd.busy_ns > 10 * ssd.busy_ns);
+		REQUIRE(ssd.busy_ns > nvme.busy_ns);
+		REQUIRE(random_reads(DeviceModel::hdd()).busy_ns == hdd.busy_ns);
+	}
+
+	SECTION("they are made by name") {
+		ScratchFile file(64 * 4096);
+		REQUIRE(strcmp(make_disk_backend("sim-hdd", file.fd, 64 * 4096)->name(), "sim-hdd") == 0);
+		REQUIRE(strcmp(make_disk_backend("sim-nvme", file.fd, 64 * 4096)->name(), "sim-nvme") == 0);
+		REQUIRE_THROWS_AS(make_disk_backend("sim-tape", file.fd, 64 * 4096), DiskException);
+	}
+}
+
+// a device whose writes wait until the test lets them through, it logs where 
+// every I/O went in the order they reached it
+class GatedBackend : public MmapBackend {
+public:
+	std::mutex lock;
+	std::condition_variable cv;
+	bool open = true;
+	size_t blocked = 0;
+	std::vector<Size> log;
+
+	GatedBackend(Size size_bytes) : MmapBackend(size_bytes) { };
+
+	void read(Size offset, Byte *buf, Size length) override {
+		{
+			std::lock_guard<std::mutex> g(this->lock);
+			this->log.push_back(offset);
+		}
+		MmapBackend::read(offset, buf, length);
+	}
+
+	void write(Size offset, const Byte *buf, Size length) override {
+		{
+			std::unique_lock<std::mutex> l(this->lock);
+			this->log.push_back(offset);
+			this->blocked++;
+			this->cv.notify_all();
+			this->cv.wait(l, [this]() { return this->open; });
+			this->blocked--;
+		}
+		MmapBackend::write(offset, buf, length);
+	}
+
+	void set_open(bool open) {
+		std::lock_guard<std::mutex> g(this->lock);
+		this->open = open;
+		this->cv.notify_all();
+	}
+
+	void wait_blocked(size_t count) {
+		std::unique_lock<std::mutex> l(this->lock);
+		this->cv.wait(l, [this, count]() { return this->blocked == count; });
+	}
+};
+
+static void wait_waiting(ScheduledBackend &scheduler, size_t count) {
+	while (scheduler.waiting() != count) {
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+}
+
+TEST_CASE( "The I/O scheduler should put the foreground ahead of the background", "[diskinterface][backend][scheduler]" ) {
+	std::vector<Byte> buf(1024 * 1024, 0x3C);
+
+	SECTION("I/O is counted under the class of the thread doing it") {
+		ScheduledBackend scheduler(std::unique_ptr<DiskBackend>(new MmapBackend(4 * 1024 * 1024)));
+		scheduler.read(0, buf.data(), 512);
+		scheduler.write(0, buf.data(), 512);
+		{
+			IOClassScope scope(IOClass::CLEANER);
+			scheduler.write(0, buf.data(), buf.size());
+			{
+				IOClassScope inner(IOClass::WRITEBACK);
+				scheduler.write(0, buf.data(), 4096);
+			}
+			REQUIRE(IOClassScope::current(false) == IOClass::CLEANER);
+		}
+		REQUIRE(IOClassScope::current(false) == IOClass::INTERACTIVE_READ);
+		REQUIRE(IOClassScope::current(true) == IOClass::FOREGROUND_WRITE);
+
+		REQUIRE(scheduler.stats(IOClass::INTERACTIVE_READ).requests == 1);
+		REQUIRE(scheduler.stats(IOClass::INTERACTIVE_READ).bytes == 512);
+		REQUIRE(scheduler.stats(IOClass::FOREGROUND_WRITE).requests == 1);
+		// the background goes in pieces
+		REQUIRE(scheduler.stats(IOClass::CLEANER).requests == buf.size() / ScheduledBackend::BACKGROUND_PIECE_BYTES);
+		REQUIRE(scheduler.stats(IOClass::CLEANER).bytes == buf.size());
+		REQUIRE(scheduler.stats(IOClass::WRITEBACK).bytes == 4096);
+
+		// so is what it passes on
+		std::vector<Byte> read_back(buf.size());
+		scheduler.read(0, read_back.data(), read_back.size());
+		REQUIRE(read_back == buf);
+	}
+
+	SECTION("the disk's background writeback is tagged as such") {
+		std::unique_ptr<ScheduledBackend> backend(new ScheduledBackend(std::unique_ptr<DiskBackend>(new MmapBackend(64 * 4096))));
+		ScheduledBackend *scheduler = backend.get();
+		Disk disk(64, 4096, std::move(backend));
+		for (Size chunk_idx = 0; chunk_idx < 8; ++chunk_idx) {
+			ChunkRef chunk = disk.get_chunk(chunk_idx);
+			chunk->memset(chunk->data, 1, 4096);
+		}
+		disk.configure_writeback(0, 20);
+		while (disk.cache_stats().dirty_chunks != 0) {
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		}
+		disk.stop_writeback();
+		REQUIRE(scheduler->stats(IOClass::WRITEBACK).bytes >= 8 * 4096);
+		REQUIRE(scheduler->stats(IOClass::FOREGROUND_WRITE).bytes == 0);
+	}
+
+	SECTION("background I/O leaves the last slot to the foreground") {
+		std::unique_ptr<GatedBackend> device(new GatedBackend(64 * 4096));
+		GatedBackend *gated = device.get();
+		ScheduledBackend scheduler(std::move(device), 2);
+		gated->set_open(false);
+
+		auto clean = [&scheduler, &buf](Size offset) {
+			IOClassScope scope(IOClass::CLEANER);
+			scheduler.write(offset, buf.data(), 4096);
+		};
+		std::thread first(clean, 0);
+		gated->wait_blocked(1);
+		std::thread second(clean, 4096);
+		wait_waiting(scheduler, 1);
+
+		// goes straight through, while the second cleaner write waits
+		std::vector<Byte> in(4096);
+		scheduler.read(8192, in.data(), in.size());
+		REQUIRE(scheduler.waiting() == 1);
+
+		gated->set_open(true);
+		first.join();
+		second.join();
+		REQUIRE(gated->log == std::vector<Size>({0, 8192, 4096}));
+	}
+
+	SECTION("of the waiting classes the one that had the least of the device goes first") {
+		std::unique_ptr<GatedBackend> device(new GatedBackend(64 * 4096));
+		GatedBackend *gated = device.get();
+		ScheduledBackend scheduler(std::move(device), 1);
+		gated->set_open(false);
+
+		std::thread first([&scheduler, &buf]() {
+			IOClassScope scope(IOClass::CLEANER);
+			scheduler.write(0, buf.data(), 4096);
+		});
+		gated->wait_blocked(1);
+		std::thread second([&scheduler, &buf]() {
+			IOClassScope scope(IOClass::CLEANER);
+			scheduler.write(4096, buf.data(), 4096);
+		});
+		wait_waiting(scheduler, 1);
+		std::thread reader([&scheduler]() {
+			std::vector<Byte> in(4096);
+			scheduler.read(8192, in.data(), in.size());
+		});
+		wait_waiting(scheduler, 2);
+
+		gated->set_open(true);
+		first.join();
+		second.join();
+		reader.join();
+		REQUIRE(gated->log == std::vector<Size>({0, 8192, 4096}));
+		REQUIRE(scheduler.stats(IOClass::INTERACTIVE_READ).wait_ns > 0);
+	}
+
+	SECTION("a background class can be held to a rate") {
+		ScheduledBackend scheduler(std::unique_ptr<DiskBackend>(new MmapBackend(4 * 1024 * 1024)));
+		ScheduledBackend::ClassConfig config = scheduler.config(IOClass::CLEANER);
+		config.rate_bytes_per_sec = 4 * 1024 * 1024;
+		config.burst_bytes = 64 * 1024;
+		scheduler.configure(IOClass::CLEANER, config);
+
+		// the first 256 KB piece goes on the full bucket, every later one waits 
+		// for it to fill back up to the burst, 3 times 62.5 ms at 4 MB/s
+		const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		{
+			IOClassScope scope(IOClass::CLEANER);
+			scheduler.write(0, buf.data(), buf.size());
+		}
+		REQUIRE(std::chrono::steady_clock::now() - start >= std::chrono::milliseconds(150));
+		REQUIRE(scheduler.stats(IOClass::CLEANER).wait_ns >= 150ull * 1000 * 1000);
+
+		// the foreground is not held back by it
+		scheduler.write(0, buf.data(), buf.size());
+		REQUIRE(scheduler.stats(IOClass::FOREGROUND_WRITE).wait_ns < 100ull * 1000 * 1000);
+
+		config.burst_bytes = 0;
+		REQUIRE_THROWS_AS(scheduler.configure(IOClass::CLEANER, config), DiskException);
+	}
+
+	SECTION("latencies are kept as a histogram") {
+		ScheduledBackend scheduler(std::unique_ptr<DiskBackend>(new MmapBackend(64 * 4096)));
+		REQUIRE(scheduler.stats(IOClass::INTERACTIVE_READ).percentile_ns(0.99) == 0);
+		std::vector<Byte> in(4096);
+		for (size_t i = 0; i < 100; ++i) {
+			scheduler.read(i % 64 * 4096, in.data(), in.size());
+		}
+		ScheduledBackend::ClassStats stats = scheduler.stats(IOClass::INTERACTIVE_READ);
+		REQUIRE(stats.requests == 100);
+		REQUIRE(stats.percentile_ns(0.5) > 0);
+		REQUIRE(stats.percentile_ns(0.5) <= stats.percentile_ns(0.99));
+		REQUIRE(stats.percentile_ns(0.99) <= 2 * stats.max_latency_ns + 2000);
+	}
+}
+
+TEST_CASE( "Chunk buffer pool should hand out aligned, reusable buffers", "[diskinterface][pool]" ) {
+	SECTION("buffers are aligned, distinct, and reused once released") {
+		ChunkPool pool(4096, 4096);
+		std::vector<Byte *> buffers;
+		for (size_t i = 0; i < 1000; ++i) {
+			Byte *buffer = pool.allocate();
+			REQUIRE((size_t)buffer % 4096 == 0);
+			std::memset(buffer, (Byte)i, 4096);
+			buffers.push_back(buffer);
+		}
+		std::sort(buffers.begin(), buffers.end());
+		REQUIRE(std::adjacent_find(buffers.begin(), buffers.end()) == buffers.end());
+
+		ChunkPool::Stats stats = pool.stats();
+		REQUIRE(stats.buffers_in_use == 1000);
+		REQUIRE(stats.buffers >= 1000);
+		REQUIRE(stats.slab_bytes == stats.slabs * ChunkPool::HUGE_PAGE_SIZE);
+
+		for (Byte *buffer : buffers) 
+			pool.release(buffer);
+		REQUIRE(pool.stats().buffers_in_use == 0);
+
+		// a thread gets back what it released without the pool growing
+		Byte *again = pool.allocate();
+		REQUIRE(std::binary_search(buffers.begin(), buffers.end(), again));
+		REQUIRE(pool.stats().slabs == stats.slabs);
+		pool.release(again);
+	}
+
+	SECTION("small buffers are packed on cache lines") {
+		ChunkPool pool(16, 64);
+		Byte *a = pool.allocate();
+		Byte *b = pool.allocate();
+		REQUIRE((size_t)a % 64 == 0);
+		REQUIRE((size_t)(b > a ? b - a : a - b) == 64);
+		pool.release(a);
+		pool.release(b);
+	}
+
+	SECTION("huge page slabs are aligned to the huge page size") {
+		ChunkPool pool(4096, 4096, true);
+		Byte *buffer = pool.allocate();
+		REQUIRE((size_t)buffer % ChunkPool::HUGE_PAGE_SIZE == 0);
+		if (pool.stats().huge_page_slabs == 0) {
+			WARN("neither reserved nor transparent huge pages are available");
+		}
+		pool.release(buffer);
+	}
+
+	SECTION("many threads can share the pool") {
+		ChunkPool pool(512, 64);
+		std::vector<std::thread> threads;
+		std::atomic<bool> failed(false);
+		for (int t = 0; t < 8; ++t) {
+			threads.push_back(std::thread([&pool, &failed, t]() {
+				std::vector<Byte *> held;
+				for (int round = 0; round < 200; ++round) {
+					for (int i = 0; i < 16; ++i) {
+						Byte *buffer = pool.allocate();
+						std::memset(buffer, t, 512);
+						held.push_back(buffer);
+					}
+					for (Byte *buffer : held) {
+						if (buffer[0] != t || buffer[511] != t) 
+							failed = true;
+						pool.release(buffer);
+					}
+					held.clear();
+				}
+			}));
+		}
+		for (std::thread &thread : threads) 
+			thread.join();
+		REQUIRE_FALSE(failed);
+		REQUIRE(pool.stats().buffers_in_use == 0);
+	}
+
+	SECTION("the disk reports how much of its pool is in use") {
+		Disk disk(256, 4096);
+		disk.configure_cache(8 * 4096);
+		{
+			std::vector<ChunkRef> held;
+			for (size_t i = 0; i < 32; ++i) 
+				held.push_back(disk.get_chunk(i));
+			REQUIRE(disk.cache_stats().pool_buffers_in_use == 32);
+			REQUIRE_THROWS_AS(disk.configure_buffers(true), DiskException);
+		}
+		Disk::CacheStats stats = disk.cache_stats();
+		REQUIRE(stats.pool_buffers_in_use == stats.resident_chunks);
+		REQUIRE(stats.pool_bytes >= 32 * 4096);
+
+		disk.configure_cache(0);
+		REQUIRE(disk.cache_stats().pool_buffers_in_use == 0);
+		disk.configure_buffers(true);
+		{
+			ChunkRef chunk = disk.get_chunk(3);
+			chunk->memset(chunk->data, 3, 4096);
+		}
+		REQUIRE(disk.get_chunk(3)->data[4095] == 3);
+	}
+}
+
+static void test_readahead(std::unique_ptr<Disk> disk) {
+	disk->configure_cache(64 * disk->chunk_size());
+
+	SECTION("prefetched chunks are loaded in the background and count as readahead hits") {
+		disk->prefetch(std::vector<Size>{10, 11, 12, 13});
+		disk->wait_for_readahead();
+
+		Disk::CacheStats stats = disk->cache_stats();
+		REQUIRE(stats.readahead_chunks == 4);
+		REQUIRE(stats.resident_chunks == 4);
+
+		disk->get_chunk(10);
+		disk->get_chunks(std::vector<Size>{11, 12});
+		disk->get_chunk(11); // only the first use of a prefetched chunk counts
+
+		stats = disk->cache_stats();
+		REQUIRE(stats.readahead_hits == 3);
+		REQUIRE(stats.misses == 4);
+	}
+
+	SECTION("chunks already in memory are not read ahead again") {
+		ChunkRef held = disk->get_chunk(20);
+		disk->prefetch(std::vector<Size>{20, 21});
+		disk->wait_for_readahead();
+		REQUIRE(disk->cache_stats().readahead_chunks == 1);
+		REQUIRE_FALSE(held->prefetched);
+	}
+
+	SECTION("readahead is skipped without a cache to hold on to the chunks") {
+		disk->configure_cache(0);
+		disk->prefetch(std::vector<Size>{1, 2, 3});
+		disk->wait_for_readahead();
+		REQUIRE(disk->cache_stats().readahead_chunks == 0);
+	}
+
+	SECTION("prefetching past the end of the disk is refused") {
+		REQUIRE_THROWS_AS(disk->prefetch(std::vector<Size>{disk->size_chunks()}), DiskException);
+	}
+}
+
+TEST_CASE( "Disk should read ahead on the mmap backend", "[diskinterface][readahead]" ) {
+	test_readahead(std::unique_ptr<Disk>(new Disk(256, 4096)));
+}
+
+TEST_CASE( "Disk should read ahead on the pread backend", "[diskinterface][readahead]" ) {
+	ScratchFile file(256 * 4096);
+	test_readahead(std::unique_ptr<Disk>(new Disk(256, 4096, make_disk_backend("pread", file.fd, 256 * 4096))));
+}
+
+TEST_CASE( "Disk should save its warm set and read it back in when reopened", "[diskinterface][readahead][warmset]" ) {
+	ScratchFile file(256 * 4096);
+	// chunk 0 holds the warm set
+	SECTION("the hottest chunks are saved and prefetched again") {
+		{
+			Disk disk(256, 4096, make_disk_backend("pread", file.fd, 256 * 4096));
+			disk.configure_warm_set(0, 1);
+			ChunkRef held = disk.get_chunk(100);
+			for (Size chunk_idx = 10; chunk_idx < 20; ++chunk_idx) {
+				disk.get_chunk(chunk_idx);
+			}
+			std::vector<Size> hot = disk.hot_chunks(256);
+			REQUIRE(hot.size() == 11);
+			REQUIRE(std::find(hot.begin(), hot.end(), 100) != hot.end());
+			REQUIRE(disk.hot_chunks(4).size() == 4);
+			// saved again as the disk is closed
+		}
+
+		Disk disk(256, 4096, make_disk_backend("pread", file.fd, 256 * 4096));
+		disk.configure_warm_set(0, 1);
+		REQUIRE(disk.load_warm_set() == 11);
+		disk.wait_for_readahead();
+		Disk::CacheStats stats = disk.cache_stats();
+		REQUIRE(stats.warm_set_prefetched == 11);
+		REQUIRE(stats.readahead_chunks == 11);
+
+		disk.get_chunk(100);
+		disk.get_chunk(15);
+		REQUIRE(disk.cache_stats().readahead_hits == 2);
+	}
+
+	SECTION("only as many chunks as the cache holds are read back") {
+		{
+			Disk disk(256, 4096, make_disk_backend("pread", file.fd, 256 * 4096));
+			disk.configure_warm_set(0, 1);
+			for (Size chunk_idx = 10; chunk_idx < 50; ++chunk_idx) {
+				disk.get_chunk(chunk_idx);
+			}
+			disk.save_warm_set();
+			REQUIRE(disk.cache_stats().warm_set_saves == 1);
+		}
+
+		Disk disk(256, 4096, make_disk_backend("pread", file.fd, 256 * 4096));
+		disk.configure_cache(8 * 4096);
+		disk.configure_warm_set(0, 1);
+		REQUIRE(disk.load_warm_set() == 8);
+	}
+
+	SECTION("the buffer cache's chunks are the hottest in the order it keeps them") {
+		Disk disk(256, 4096, make_disk_backend("pread", file.fd, 256 * 4096));
+		disk.configure_cache(64 * 4096, Disk::CachePolicy::LRU);
+		// all in the same shard
+		disk.get_chunk(16);
+		disk.get_chunk(32);
+		disk.get_chunk(48);
+		disk.get_chunk(16);
+		REQUIRE(disk.hot_chunks(3) == std::vector<Size>({16, 48, 32}));
+	}
+
+	SECTION("a range that does not hold a warm set is ignored") {
+		std::vector<uint64_t> garbage(512, 0xA5A5A5A5A5A5A5A5ull);
+		REQUIRE(pwrite(file.fd, &garbage[0], 4096, 0) == 4096);
+		Disk disk(256, 4096, make_disk_backend("pread", file.fd, 256 * 4096));
+		disk.configure_warm_set(0, 1);
+		REQUIRE(disk.load_warm_set() == 0);
+		disk.configure_warm_set(0, 0);
+	}
+
+	SECTION("warm sets past the end of the disk are refused") {
+		Disk disk(256, 4096);
+		REQUIRE_THROWS_AS(disk.configure_warm_set(250, 8), DiskException);
+	}
+}
+
+TEST_CASE( "Disk should only write back chunks that were changed", "[diskinterface][dirty]" ) {
+	Disk disk(1024, 512);
+	disk.configure_cache(16 * 512);
+
+	SECTION("chunks that are only read are never written back, even when evicted") {
+		for (size_t i = 0; i < 1024; ++i) {
+			ChunkRef chunk = disk.get_chunk(i);
+			REQUIRE(chunk->data[0] == 0);
+			REQUIRE_FALSE(chunk->dirty);
+		}
+		disk.flush_all();
+		disk.sync_all();
+
+		Disk::CacheStats stats = disk.cache_stats();
+		REQUIRE(stats.evictions > 0);
+		REQUIRE(stats.writebacks == 0);
+	}
+
+	SECTION("memcpy, memset and mark_dirty mark the chunk dirty") {
+		ChunkRef a = disk.get_chunk(1);
+		ChunkRef b = disk.get_chunk(2);
+		ChunkRef c = disk.get_chunk(3);
+		a->memset(a->data, 1, 8);
+		b->memcpy(b->data, "hi", 2);
+		c->data[0] = 1;
+		c->mark_dirty();
+		REQUIRE(a->dirty);
+		REQUIRE(b->dirty);
+		REQUIRE(c->dirty);
+		REQUIRE(disk.cache_stats().dirty_chunks == 3);
+
+		disk.flush_all();
+		REQUIRE(disk.cache_stats().writebacks == 3);
+		REQUIRE_FALSE(a->dirty);
+	}
+}
+
+TEST_CASE( "Chunk references should be counted in the chunk", "[diskinterface][chunkref]" ) {
+	Disk disk(64, 512);
+	disk.configure_cache(0);
+
+	SECTION("copies count, moves do not, and every get shares the one chunk") {
+		ChunkRef a = disk.get_chunk(5);
+		REQUIRE(a.unique());
+		ChunkRef b = disk.get_chunk(5);
+		REQUIRE(a == b);
+		REQUIRE(a.use_count() == 2);
+
+		ChunkRef c = a;
+		REQUIRE(a.use_count() == 3);
+		ChunkRef d = std::move(c);
+		REQUIRE(c == nullptr);
+		REQUIRE(d.use_count() == 3);
+
+		ChunkRef e = ChunkRef::acquire(a.get());
+		REQUIRE(e == a);
+		REQUIRE(a.use_count() == 4);
+		b.reset();
+		d.reset();
+		e = nullptr;
+		REQUIRE(a.unique());
+	}
+
+	SECTION("the last reference going writes the chunk back and drops it") {
+		ChunkRef a = disk.get_chunk(7);
+		ChunkRef b = a;
+		a->memset(a->data, 7, 16);
+		a = nullptr;
+		REQUIRE(disk.cache_stats().writebacks == 0);
+		b = nullptr;
+		REQUIRE(disk.cache_stats().writebacks == 1);
+
+		ChunkRef again = disk.get_chunk(7);
+		REQUIRE(again.unique());
+		REQUIRE(again->data[15] == 7);
+		REQUIRE_FALSE(again->dirty);
+	}
+
+	SECTION("the buffer cache holds a reference of its own") {
+		disk.configure_cache(64 * 512);
+		ChunkRef a = disk.get_chunk(9);
+		REQUIRE(a.use_count() == 2);
+		disk.evict_chunk(9);
+		REQUIRE(a.unique());
+	}
+}
+
+// a pread backend that remembers the length of every batch of writes it was 
+// handed, and fails as many writes (batches or single ones) as it is told to
+struct RecordingPreadBackend : public PreadBackend {
+	std::vector<Size> write_lengths;
+	std::atomic<int> failing_writes {0};
+
+	RecordingPreadBackend(int fd, Size size_bytes) : PreadBackend(fd, size_bytes) { }
+
+	void write(Size offset, const Byte *buf, Size length) override {
+		if (failing_writes > 0) {
+			failing_writes--;
+			throw DiskException("the device failed the write");
+		}
+		PreadBackend::write(offset, buf, length);
+	}
+
+	void write_batch(const std::vector<IORequest> &requests) override {
+		if (failing_writes > 0) {
+			failing_writes--;
+			throw DiskException("the device failed the write");
+		}
+		for (const IORequest &request : requests) {
+			write_lengths.push_back(request.length);
+		}
+		PreadBackend::write_batch(requests);
+	}
+};
+
+// polls until the condition holds, the writeback thread works on its own time
+template<typename F>
+static bool eventually(F condition) {
+	for (int attempt = 0; attempt < 500; ++attempt) {
+		if (condition()) 
+			return true;
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	}
+	return condition();
+}
+
+TEST_CASE( "Disk should write dirty chunks back in the background", "[diskinterface][writeback]" ) {
+	ScratchFile file(256 * 4096);
+	RecordingPreadBackend *backend = new RecordingPreadBackend(file.fd, 256 * 4096);
+	std::unique_ptr<Disk> disk(new Disk(256, 4096, std::unique_ptr<DiskBackend>(backend)));
+	disk->configure_cache(64 * 4096);
+
+	SECTION("adjacent dirty chunks are written back as one run") {
+		for (Size idx = 10; idx < 42; ++idx) {
+			ChunkRef chunk = disk->get_chunk(idx);
+			chunk->memset(chunk->data, 1, chunk->size_bytes);
+		}
+		ChunkRef lone = disk->get_chunk(100);
+		lone->memset(lone->data, 1, lone->size_bytes);
+
+		disk->flush_all();
+		REQUIRE(backend->write_lengths.size() == 2);
+		REQUIRE(backend->write_lengths[0] == 32 * 4096);
+		REQUIRE(backend->write_lengths[1] == 4096);
+
+		Disk::CacheStats stats = disk->cache_stats();
+		REQUIRE(stats.writebacks == 33);
+		REQUIRE(stats.writeback_runs == 1);
+		REQUIRE(stats.dirty_chunks == 0);
+
+		Byte on_disk[4096];
+		REQUIRE(pread(file.fd, on_disk, 4096, 41 * 4096) == 4096);
+		REQUIRE(on_disk[4095] == 1);
+	}
+
+	SECTION("chunks are written back once they expire, even while in use") {
+		disk->configure_writeback(20, 100, 10);
+		ChunkRef chunk = disk->get_chunk(7);
+		chunk->memset(chunk->data, 3, chunk->size_bytes);
+
+		REQUIRE(eventually([&chunk]() { return !chunk->dirty; }));
+		REQUIRE(disk->cache_stats().background_writebacks == 1);
+		Byte on_disk[4096];
+		REQUIRE(pread(file.fd, on_disk, 4096, 7 * 4096) == 4096);
+		REQUIRE(on_disk[0] == 3);
+
+		// releasing it costs no further write
+		chunk = nullptr;
+		disk->configure_cache(0);
+		REQUIRE(disk->cache_stats().writebacks == 1);
+	}
+
+	SECTION("a round that fails is reported by the next sync, once") {
+		backend->failing_writes = 1;
+		disk->configure_writeback(20, 100, 10);
+		ChunkRef chunk = disk->get_chunk(7);
+		chunk->memset(chunk->data, 3, chunk->size_bytes);
+
+		REQUIRE(eventually([&disk]() { return disk->cache_stats().deferred_errors == 1; }));
+		disk->stop_writeback();
+		REQUIRE_THROWS_AS(disk->sync_all(), DiskException);
+
+		// the chunk made it all the same
+		Byte on_disk[4096];
+		REQUIRE(pread(file.fd, on_disk, 4096, 7 * 4096) == 4096);
+		REQUIRE(on_disk[0] == 3);
+		disk->sync_all();
+	}
+
+	SECTION("going over the dirty ratio starts writeback before anything expires") {
+		// a quarter of the 64 chunk cache may be dirty
+		disk->configure_writeback(60 * 60 * 1000, 25, 60 * 60 * 1000);
+		for (Size idx = 0; idx < 32; ++idx) {
+			ChunkRef chunk = disk->get_chunk(idx);
+			chunk->memset(chunk->data, 5, chunk->size_bytes);
+		}
+
+		REQUIRE(eventually([&disk]() { return disk->cache_stats().background_writebacks > 0; }));
+		disk->stop_writeback();
+		REQUIRE(disk->cache_stats().dirty_chunks < 32);
+	}
+
+	SECTION("without the thread a round can be run by hand") {
+		ChunkRef chunk = disk->get_chunk(3);
+		chunk->memset(chunk->data, 1, chunk->size_bytes);
+		// nothing has expired and one chunk is well below the default ratio
+		disk->run_writeback();
+		REQUIRE(chunk->dirty);
+		REQUIRE(disk->cache_stats().writeback_passes == 1);
+	}
+}
+
+TEST_CASE( "Disk should report a chunk that fails to write back as it is released", "[diskinterface][writeback]" ) {
+	ScratchFile file(256 * 4096);
+	RecordingPreadBackend *backend = new RecordingPreadBackend(file.fd, 256 * 4096);
+	std::unique_ptr<Disk> disk(new Disk(256, 4096, std::unique_ptr<DiskBackend>(backend)));
+	disk->configure_cache(0);
+
+	backend->failing_writes = 1;
+	{
+		ChunkRef chunk = disk->get_chunk(7);
+		chunk->memset(chunk->data, 3, chunk->size_bytes);
+		// without a cache the last reference going writes it back, nothing is thrown out of that
+	}
+	REQUIRE(disk->cache_stats().deferred_errors == 1);
+	REQUIRE_THROWS_AS(disk->sync_all(), DiskException);
+
+	// reported once, the disk goes on working
+	disk->sync_all();
+	{
+		ChunkRef chunk = disk->get_chunk(8);
+		chunk->memset(chunk->data, 4, chunk->size_bytes);
+	}
+	Byte on_disk[4096];
+	REQUIRE(pread(file.fd, on_disk, 4096, 8 * 4096) == 4096);
+	REQUIRE(on_disk[0] == 4);
+}
+
+// a file backed mapping that remembers every range it was asked to sync
+struct RecordingMmapBackend : public MmapBackend {
+	std::vector<SyncRange> synced;
+
+	RecordingMmapBackend(int fd, Size size_bytes) : MmapBackend(size_bytes, MAP_FILE | MAP_SHARED, fd) { }
+
+	void sync(Size offset, Size length) override {
+		synced.push_back(SyncRange{offset, length});
+		MmapBackend::sync(offset, length);
+	}
+};
+
+TEST_CASE( "Disk sync should merge adjacent chunks into few large syncs", "[diskinterface][sync]" ) {
+	ScratchFile file(256 * 4096);
+	RecordingMmapBackend *backend = new RecordingMmapBackend(file.fd, 256 * 4096);
+	Disk disk(256, 4096, std::unique_ptr<DiskBackend>(backend));
+
+	auto write_chunks = [&disk](Size first, Size count, Byte value) {
+		for (Size i = first; i < first + count; ++i) {
+			ChunkRef chunk = disk.get_chunk(i);
+			chunk->memset(chunk->data, value, chunk->size_bytes);
+		}
+	};
+
+	SECTION("a run of adjacent chunks takes a single sync") {
+		write_chunks(0, 64, 1);
+		disk.sync_all();
+		REQUIRE(backend->synced.size() == 1);
+		REQUIRE(backend->synced[0].offset == 0);
+		REQUIRE(backend->synced[0].length == 64 * 4096);
+
+		Disk::CacheStats stats = disk.cache_stats();
+		REQUIRE(stats.syncs == 1);
+		REQUIRE(stats.unsynced_chunks == 0);
+		REQUIRE(stats.dirty_chunks == 0);
+
+		// nothing left to do the second time around
+		disk.sync_all();
+		REQUIRE(backend->synced.size() == 1);
+	}
+
+	SECTION("separate runs are synced separately, in order") {
+		write_chunks(20, 10, 1);
+		write_chunks(0, 10, 1);
+		disk.sync_all();
+		REQUIRE(backend->synced.size() == 2);
+		REQUIRE(backend->synced[0].offset == 0);
+		REQUIRE(backend->synced[0].length == 10 * 4096);
+		REQUIRE(backend->synced[1].offset == 20 * 4096);
+		REQUIRE(backend->synced[1].length == 10 * 4096);
+	}
+
+	SECTION("syncing part of a run leaves the rest of it unsynced") {
+		disk.configure_cache(0);
+		write_chunks(0, 20, 1);
+		REQUIRE(disk.cache_stats().unsynced_chunks == 20);
+
+		disk.sync(5, 10);
+		REQUIRE(backend->synced.size() == 1);
+		REQUIRE(backend->synced[0].offset == 5 * 4096);
+		REQUIRE(backend->synced[0].length == 10 * 4096);
+		REQUIRE(disk.cache_stats().unsynced_chunks == 10);
+
+		disk.sync_all();
+		REQUIRE(backend->synced.size() == 3);
+		REQUIRE(disk.cache_stats().unsynced_chunks == 0);
+	}
+
+	SECTION("chunks that are still in use are written back by sync") {
+		ChunkRef held = disk.get_chunk(42);
+		held->memset(held->data, 0x5A, held->size_bytes);
+		disk.sync_all();
+
+		Disk other(256, 4096, make_disk_backend("pread", file.fd, 256 * 4096));
+		REQUIRE(other.get_chunk(42)->data[17] == 0x5A);
+	}
+
+	SECTION("a sync range past the end of the disk is refused") {
+		REQUIRE_THROWS_AS(disk.sync(200, 57), DiskException);
+	}
+}
+
+// bytes of the file that are actually allocated
+static Size allocated_bytes(int fd) {
+	struct stat st;
+	REQUIRE(fstat(fd, &st) == 0);
+	return st.st_blocks * 512;
+}
+
+static Byte byte_on_disk(int fd, Size offset) {
+	Byte value = 0xFF;
+	REQUIRE(pread(fd, &value, 1, offset) == 1);
+	return value;
+}
+
+TEST_CASE( "Disk should give freed ranges back to the device", "[diskinterface][discard]" ) {
+	ScratchFile file(64 * 4096);
+	std::unique_ptr<Disk> disk(new Disk(64, 4096, std::unique_ptr<DiskBackend>(new PreadBackend(file.fd, 64 * 4096))));
+	for (Size idx = 0; idx < 64; ++idx) {
+		ChunkRef chunk = disk->get_chunk(idx);
+		chunk->memset(chunk->data, 1, chunk->size_bytes);
+	}
+	disk->flush_all();
+	REQUIRE(allocated_bytes(file.fd) >= 64 * 4096);
+
+	SECTION("nothing is discarded unless it was configured") {
+		disk->discard(16, 32);
+		disk->run_writeback();
+		REQUIRE(disk->cache_stats().discard_pending_chunks == 0);
+		REQUIRE(byte_on_disk(file.fd, 20 * 4096) == 1);
+	}
+
+	SECTION("a freed range is punched out of the file by the next round") {
+		disk->configure_discard(1024 * 1024 * 1024);
+		disk->discard(16, 32);
+		REQUIRE(disk->cache_stats().discard_pending_chunks == 32);
+		REQUIRE(byte_on_disk(file.fd, 20 * 4096) == 1);
+
+		disk->run_writeback();
+		Disk::CacheStats stats = disk->cache_stats();
+		REQUIRE(stats.discards == 1);
+		REQUIRE(stats.discarded_bytes == 32 * 4096);
+		REQUIRE(stats.discard_pending_chunks == 0);
+		REQUIRE(allocated_bytes(file.fd) <= 32 * 4096);
+		REQUIRE(byte_on_disk(file.fd, 16 * 4096) == 0);
+		REQUIRE(byte_on_disk(file.fd, 48 * 4096 - 1) == 0);
+		REQUIRE(byte_on_disk(file.fd, 16 * 4096 - 1) == 1);
+		REQUIRE(byte_on_disk(file.fd, 48 * 4096) == 1);
+	}
+
+	SECTION("a chunk written again before the discard goes out is kept") {
+		disk->configure_discard(1024 * 1024 * 1024);
+		disk->discard(16, 32);
+		{
+			ChunkRef chunk = disk->get_chunk(20);
+			chunk->memset(chunk->data, 7, chunk->size_bytes);
+		}
+		disk->flush_all();
+		REQUIRE(disk->cache_stats().discard_pending_chunks == 31);
+
+		disk->run_writeback();
+		REQUIRE(disk->cache_stats().discards == 2);
+		REQUIRE(byte_on_disk(file.fd, 20 * 4096) == 7);
+		REQUIRE(byte_on_disk(file.fd, 19 * 4096) == 0);
+		REQUIRE(byte_on_disk(file.fd, 21 * 4096) == 0);
+	}
+
+	SECTION("a discard waits for the chunks that were dirty when it was queued") {
+		disk->configure_discard(1024 * 1024 * 1024);
+		ChunkRef moved_to = disk->get_chunk(60);
+		moved_to->memset(moved_to->data, 9, moved_to->size_bytes);
+		disk->discard(16, 32);
+
+		// nothing has expired, so the chunk is still dirty after this round
+		disk->run_writeback();
+		REQUIRE(moved_to->dirty);
+		REQUIRE(disk->cache_stats().discards == 0);
+		REQUIRE(byte_on_disk(file.fd, 20 * 4096) == 1);
+
+		disk->flush_all();
+		disk->run_writeback();
+		REQUIRE(disk->cache_stats().discards == 1);
+		REQUIRE(byte_on_disk(file.fd, 20 * 4096) == 0);
+	}
+
+	SECTION("discards are rate limited and the rest goes out as the disk is closed") {
+		disk->configure_discard(16 * 4096);
+		disk->discard(0, 64);
+		disk->run_writeback();
+		Disk::CacheStats stats = disk->cache_stats();
+		REQUIRE(stats.discarded_bytes == 16 * 4096);
+		REQUIRE(stats.discard_pending_chunks == 48);
+		REQUIRE(byte_on_disk(file.fd, 16 * 4096) == 1);
+
+		disk = nullptr;
+		REQUIRE(allocated_bytes(file.fd) == 0);
+		REQUIRE(byte_on_disk(file.fd, 63 * 4096) == 0);
+	}
+
+	SECTION("a backend that can not discard switches discards off") {
+		struct NoDiscardBackend : public PreadBackend {
+			NoDiscardBackend(int fd, Size size_bytes) : PreadBackend(fd, size_bytes) { }
+			bool discard(Size offset, Size length) override { return false; }
+		};
+		disk = nullptr;
+		disk = std::unique_ptr<Disk>(new Disk(64, 4096, std::unique_ptr<DiskBackend>(new NoDiscardBackend(file.fd, 64 * 4096))));
+		disk->configure_discard(1024 * 1024 * 1024);
+		REQUIRE(disk->cache_stats().discard_enabled);
+		disk->discard(16, 32);
+		disk->run_writeback();
+
+		Disk::CacheStats stats = disk->cache_stats();
+		REQUIRE_FALSE(stats.discard_enabled);
+		REQUIRE(stats.discard_pending_chunks == 0);
+		REQUIRE(stats.deferred_errors == 0);
+		REQUIRE(byte_on_disk(file.fd, 20 * 4096) == 1);
+	}
+
+	SECTION("zero copy chunks can not be discarded") {
+		Disk mapped(64, 4096, MAP_PRIVATE | MAP_ANONYMOUS, -1, true);
+		REQUIRE_THROWS_AS(mapped.configure_discard(), DiskException);
+	}
+}
+
+TEST_CASE( "Striped devices should only discard their own share of a range", "[diskinterface][backend][striped][discard]" ) {
+	const Size unit = 8192;
+	ScratchFile a(8 * unit), b(8 * unit);
+	std::unique_ptr<StripedBackend> backend = make_striped({&a, &b}, "pread", 8 * unit, unit);
+	std::vector<Byte> ones(16 * unit, 1);
+	backend->write(0, &ones[0], ones.size());
+
+	// units 1 to 3, the first of b, the second of a and the second of b
+	REQUIRE(backend->discard(unit, 3 * unit));
+	REQUIRE(byte_on_disk(a.fd, unit - 1) == 1);
+	REQUIRE(byte_on_disk(a.fd, unit) == 0);
+	REQUIRE(byte_on_disk(a.fd, 2 * unit - 1) == 0);
+	REQUIRE(byte_on_disk(a.fd, 2 * unit) == 1);
+	REQUIRE(byte_on_disk(b.fd, 0) == 0);
+	REQUIRE(byte_on_disk(b.fd, 2 * unit - 1) == 0);
+	REQUIRE(byte_on_disk(b.fd, 2 * unit) == 1);
+}
+
+static void test_buffer_cache(Disk::CachePolicy policy) {
+	// four resident chunks in each shard of the cache
+	const size_t budget_chunks = 4 * Disk::CHUNK_CACHE_SHARDS;
+	std::unique_ptr<Disk> disk(new Disk(256, 16));
+	disk->configure_cache(budget_chunks * disk->chunk_size(), policy);
+
+	SECTION("a chunk that is released stays resident and is a hit the next time") {
+		disk->get_chunk(3);
+		disk->get_chunk(3);
+		Disk::CacheStats stats = disk->cache_stats();
+		REQUIRE(stats.misses == 1);
+		REQUIRE(stats.hits == 1);
+		REQUIRE(stats.resident_chunks == 1);
+	}
+
+	SECTION("the cache never holds more than its budget") {
+		for (size_t i = 0; i < 256; ++i) {
+			disk->get_chunk(i);
+		}
+		Disk::CacheStats stats = disk->cache_stats();
+		REQUIRE(stats.capacity_chunks == budget_chunks);
+		REQUIRE(stats.resident_chunks == budget_chunks);
+		REQUIRE(stats.evictions == 256 - budget_chunks);
+	}
+
+	SECTION("evicted chunks are written back and can be read again") {
+		for (size_t i = 0; i < 256; ++i) {
+			ChunkRef chunk = disk->get_chunk(i);
+			chunk->memset(chunk->data, (Byte)i, chunk->size_bytes);
+		}
+		for (size_t i = 0; i < 256; ++i) {
+			ChunkRef chunk = disk->get_chunk(i);
+			REQUIRE(chunk->data[0] == (Byte)i);
+			REQUIRE(chunk->data[chunk->size_bytes - 1] == (Byte)i);
+		}
+	}
+
+	SECTION("a chunk in constant use survives a scan through many other chunks") {
+		for (size_t i = 1; i < 256; ++i) {
+			disk->get_chunk(0);
+			disk->get_chunk(i);
+		}
+		uint64_t misses = disk->cache_stats().misses;
+		disk->get_chunk(0);
+		REQUIRE(disk->cache_stats().misses == misses);
+	}
+
+	SECTION("flushing writes back dirty chunks but keeps them resident") {
+		for (size_t i = 0; i < 8; ++i) {
+			ChunkRef chunk = disk->get_chunk(i);
+			chunk->memset(chunk->data, 1, chunk->size_bytes);
+		}
+		REQUIRE(disk->cache_stats().dirty_chunks == 8);
+		disk->flush_all();
+		Disk::CacheStats stats = disk->cache_stats();
+		REQUIRE(stats.dirty_chunks == 0);
+		REQUIRE(stats.resident_chunks == 8);
+	}
+
+	SECTION("shrinking the budget evicts down to the new size, a budget of 0 disables the cache") {
+		for (size_t i = 0; i < budget_chunks; ++i) {
+			disk->get_chunk(i);
+		}
+		disk->configure_cache(Disk::CHUNK_CACHE_SHARDS * disk->chunk_size(), policy);
+		REQUIRE(disk->cache_stats().resident_chunks == Disk::CHUNK_CACHE_SHARDS);
+		disk->configure_cache(0, policy);
+		REQUIRE(disk->cache_stats().resident_chunks == 0);
+		disk->get_chunk(100);
+		REQUIRE(disk->cache_stats().resident_chunks == 0);
+	}
+}
+
+TEST_CASE( "Disk buffer cache should work with CLOCK eviction", "[diskinterface][cache]" ) {
+	test_buffer_cache(Disk::CachePolicy::CLOCK);
+}
+
+TEST_CASE( "Disk buffer cache should work with LRU eviction", "[diskinterface][cache]" ) {
+	test_buffer_cache(Disk::CachePolicy::LRU);
+}
+
+static void test_chunk_span(std::unique_ptr<Disk> disk) {
+	SECTION("a span covers a run of chunks as one range of bytes") {
+		ChunkSpan span = disk->get_span(10, 4);
+		REQUIRE(span.first_chunk() == 10);
+		REQUIRE(span.size_chunks() == 4);
+		REQUIRE(span.size_bytes() == 4 * 512);
+
+		std::vector<Byte> pattern(3 * 512);
+		for (size_t i = 0; i < pattern.size(); ++i) {
+			pattern[i] = (Byte)(i * 7);
+		}
+		// straddles the first three chunks, the last one is never touched
+		span.write(100, &pattern[0], pattern.size() - 200);
+		REQUIRE(span.chunk(0).dirty);
+		REQUIRE(span.chunk(2).dirty);
+		REQUIRE_FALSE(span.chunk(3).dirty);
+
+		std::vector<Byte> read_back(pattern.size() - 200);
+		span.read(100, &read_back[0], read_back.size());
+		REQUIRE(std::equal(read_back.begin(), read_back.end(), pattern.begin()));
+
+		// the chunks are the ones get_chunk hands out
+		ChunkRef chunk = disk->get_chunk(11);
+		REQUIRE(chunk.get() == &span.chunk(1));
+		REQUIRE(chunk->data[0] == pattern[512 - 100]);
+	}
+
+	SECTION("whole chunks can be copied from one span to another") {
+		ChunkSpan from = disk->get_span(0, 8);
+		from.fill(0, 9, from.size_bytes());
+		ChunkSpan to = disk->get_span(100, 3);
+		to.copy_chunks(1, from, 5, 2);
+
+		REQUIRE(disk->get_chunk(100)->data[0] == 0);
+		REQUIRE(disk->get_chunk(101)->data[0] == 9);
+		REQUIRE(disk->get_chunk(102)->data[511] == 9);
+	}
+
+	SECTION("a span keeps its chunks in memory until it is released") {
+		disk->configure_cache(0);
+		const uint64_t misses = disk->cache_stats().misses;
+		ChunkSpan span = disk->get_span(200, 16);
+		REQUIRE(disk->cache_stats().pool_buffers_in_use == (disk->zero_copy() ? 0 : 16));
+		disk->get_span(200, 16);
+		REQUIRE(disk->cache_stats().misses == misses + 16);
+
+		span.release();
+		REQUIRE(span.size_chunks() == 0);
+		REQUIRE(disk->cache_stats().pool_buffers_in_use == 0);
+	}
+
+	SECTION("spans past the end of the disk are refused") {
+		REQUIRE_THROWS_AS(disk->get_span(disk->size_chunks() - 2, 3), DiskException);
+		REQUIRE(disk->get_span(disk->size_chunks(), 0).size_chunks() == 0);
+	}
+}
+
+TEST_CASE( "Disk spans should cover contiguous runs of chunks", "[diskinterface][span]" ) {
+	test_chunk_span(std::unique_ptr<Disk>(new Disk(256, 512)));
+}
+
+TEST_CASE( "Disk spans should be contiguous in memory in zero copy mode", "[diskinterface][span][zerocopy]" ) {
+	std::unique_ptr<Disk> disk(new Disk(256, 512, MAP_PRIVATE | MAP_ANONYMOUS, -1, true));
+	REQUIRE(disk->get_span(3, 5).contiguous_data() == disk->get_chunk(3)->data);
+	test_chunk_span(std::move(disk));
+}
+
+// records the hints and page locks Disk hands down
+struct AdvisedMmapBackend : public MmapBackend {
+	struct Advice {
+		Size offset;
+		Size length;
+		AccessPattern pattern;
+	};
+	std::vector<Advice> advised;
+	std::vector<SyncRange> lock_requests;
+
+	AdvisedMmapBackend(int fd, Size size_bytes) : MmapBackend(size_bytes, MAP_FILE | MAP_SHARED, fd) { }
+
+	void advise(Size offset, Size length, AccessPattern pattern) override {
+		advised.push_back(Advice{offset, length, pattern});
+		MmapBackend::advise(offset, length, pattern);
+	}
+
+	bool lock_in_memory(Size offset, Size length) override {
+		lock_requests.push_back(SyncRange{offset, length});
+		return MmapBackend::lock_in_memory(offset, length);
+	}
+};
+
+TEST_CASE( "Disk should pass access hints on and keep pinned chunks in memory", "[diskinterface][pin]" ) {
+	ScratchFile file(256 * 4096);
+	AdvisedMmapBackend *backend = new AdvisedMmapBackend(file.fd, 256 * 4096);
+	std::unique_ptr<Disk> disk(new Disk(256, 4096, std::unique_ptr<DiskBackend>(backend)));
+
+	SECTION("hints are handed to the backend in bytes") {
+		disk->advise(10, 20, AccessPattern::RANDOM);
+		REQUIRE(backend->advised.size() == 1);
+		REQUIRE(backend->advised[0].offset == 10 * 4096);
+		REQUIRE(backend->advised[0].length == 20 * 4096);
+		REQUIRE(backend->advised[0].pattern == AccessPattern::RANDOM);
+
+		REQUIRE_THROWS_AS(disk->advise(250, 10, AccessPattern::SEQUENTIAL), DiskException);
+	}
+
+	SECTION("pinned chunks survive a scan through a small cache") {
+		disk->configure_cache(8 * 4096);
+		disk->pin(0, 4);
+		disk->pin(100, 1, false);
+		REQUIRE(backend->lock_requests.size() == 1);
+		REQUIRE(backend->lock_requests[0].offset == 0);
+		REQUIRE(backend->lock_requests[0].length == 4 * 4096);
+
+		Disk::CacheStats stats = disk->cache_stats();
+		REQUIRE(stats.pinned_chunks == 5);
+		// mlock is allowed to fail under a low RLIMIT_MEMLOCK
+		REQUIRE((stats.locked_bytes == 0 || stats.locked_bytes == 4 * 4096));
+
+		for (Size idx = 120; idx < 256; ++idx) {
+			disk->get_chunk(idx);
+		}
+
+		const Size misses = disk->cache_stats().misses;
+		for (Size idx = 0; idx < 4; ++idx) {
+			disk->get_chunk(idx);
+		}
+		disk->get_chunk(100);
+		REQUIRE(disk->cache_stats().misses == misses);
+	}
+
+	SECTION("pinned chunks are written back by flush_all and when unpinned") {
+		disk->configure_cache(0);
+		disk->pin(0, 2);
+		{
+			ChunkRef chunk = disk->get_chunk(1);
+			chunk->memset(chunk->data, 7, chunk->size_bytes);
+		}
+		// nothing is resident, the pin is the only thing holding the change
+		REQUIRE(backend->mapping()[4096] == 0);
+		disk->flush_all();
+		REQUIRE(backend->mapping()[4096] == 7);
+
+		{
+			ChunkRef chunk = disk->get_chunk(0);
+			chunk->memset(chunk->data, 9, chunk->size_bytes);
+		}
+		disk->unpin_all();
+		REQUIRE(backend->mapping()[0] == 9);
+		REQUIRE(disk->cache_stats().pinned_chunks == 0);
+		REQUIRE(disk->cache_stats().locked_bytes == 0);
+	}
+}
+
+TEST_CASE( "CRC32C should match the standard check values", "[diskinterface][checksum]" ) {
+	REQUIRE(crc32c("123456789", 9) == 0xE3069283);
+	REQUIRE(crc32c("", 0) == 0);
+
+	std::vector<Byte> zeroes(32, 0);
+	REQUIRE(crc32c(&zeroes[0], zeroes.size()) == 0x8A9136AA);
+	std::vector<Byte> ones(32, 0xFF);
+	REQUIRE(crc32c(&ones[0], ones.size()) == 0x62A8AB43);
+
+	// the same whichever way it is cut up, and whatever the alignment
+	std::vector<Byte> buf(4096 + 7);
+	for (size_t i = 0; i < buf.size(); ++i) {
+		buf[i] = (Byte)(i * 31 + 7);
+	}
+	const uint32_t whole = crc32c(&buf[1], 4096);
+	REQUIRE(crc32c(&buf[1 + 1000], 4096 - 1000, crc32c(&buf[1], 1000)) == whole);
+	REQUIRE(crc32c(&buf[1 + 3], 4096 - 3, crc32c(&buf[1], 3)) == whole);
+}
+
+// keeps the checksums of chunks 1 and up in chunk 0, the way the file 
+// system keeps them in its segment summaries
+struct TableChecksums : public ChunkChecksums {
+	ChunkRef table;
+	// called as a checksum is recorded, i.e. to change the chunk meanwhile
+	std::function<void(Size)> on_record;
+
+	TableChecksums(Disk &disk) : table(disk.get_chunk(0)) { }
+
+	bool covers(Size chunk_idx) override {
+		return chunk_idx != 0;
+	}
+
+	uint32_t checksum(Size chunk_idx) override {
+		return ((uint32_t *)table->data)[chunk_idx];
+	}
+
+	Chunk *record(Size chunk_idx, uint32_t checksum) override {
+		if (on_record) 
+			on_record(chunk_idx);
+		((uint32_t *)table->data)[chunk_idx] = checksum;
+		table->mark_dirty();
+		return table.get();
+	}
+};
+
+TEST_CASE( "Disk should checksum chunks as they are written back and verify them on a miss", "[diskinterface][checksum]" ) {
+	ScratchFile file(64 * 512);
+	std::unique_ptr<Disk> disk(new Disk(64, 512, make_disk_backend("pread", file.fd, 64 * 512)));
+	std::shared_ptr<TableChecksums> checksums = std::make_shared<TableChecksums>(*disk);
+	disk->set_checksums(checksums);
+
+	for (Size idx = 1; idx < 64; ++idx) {
+		ChunkRef chunk = disk->get_chunk(idx);
+		chunk->memset(chunk->data, (Byte)idx, chunk->size_bytes);
+	}
+	disk->flush_all();
+
+	// the table went out with the batch that changed it
+	Disk::CacheStats stats = disk->cache_stats();
+	REQUIRE(stats.checksums_computed == 63);
+	REQUIRE(stats.dirty_chunks == 0);
+	REQUIRE_FALSE(checksums->table->dirty);
+	uint32_t on_disk = 0;
+	REQUIRE(pread(file.fd, &on_disk, sizeof(on_disk), 5 * sizeof(uint32_t)) == sizeof(on_disk));
+	std::vector<Byte> expected(512, 5);
+	REQUIRE(on_disk == crc32c(&expected[0], expected.size()));
+
+	SECTION("chunks that are read back in are checked") {
+		disk->configure_cache(0);
+		for (Size idx = 1; idx < 64; ++idx) {
+			REQUIRE(disk->get_chunk(idx)->data[0] == (Byte)idx);
+		}
+		REQUIRE(disk->cache_stats().checksums_verified == 63);
+		REQUIRE(disk->cache_stats().checksum_failures == 0);
+
+		// hits are trusted
+		ChunkRef held = disk->get_chunk(7);
+		disk->get_chunk(7);
+		REQUIRE(disk->cache_stats().checksums_verified == 64);
+	}
+
+	SECTION("a chunk that changed on the device is refused") {
+		disk->configure_cache(0);
+		Byte flipped = 0xAA;
+		REQUIRE(pwrite(file.fd, &flipped, 1, 9 * 512 + 100) == 1);
+		REQUIRE_THROWS_AS(disk->get_chunk(9), DiskException);
+		REQUIRE_THROWS_AS(disk->get_chunks({8, 9, 10}), DiskException);
+		REQUIRE(disk->cache_stats().checksum_failures == 2);
+
+		// and is not left in the cache half loaded
+		REQUIRE(disk->get_chunk(8)->data[0] == 8);
+		REQUIRE_THROWS_AS(disk->get_chunk(9), DiskException);
+	}
+
+	SECTION("a chunk changed after its checksum was computed is left dirty") {
+		ChunkRef chunk = disk->get_chunk(12);
+		chunk->memset(chunk->data, 1, chunk->size_bytes);
+		checksums->on_record = [&chunk](Size chunk_idx) {
+			if (chunk_idx == 12) 
+				chunk->memset(chunk->data, 2, chunk->size_bytes);
+		};
+		disk->flush_all();
+		checksums->on_record = nullptr;
+		REQUIRE(chunk->dirty);
+
+		// and goes out with the checksum of what it holds now
+		disk->flush_all();
+		REQUIRE_FALSE(chunk->dirty);
+		chunk = nullptr;
+		disk->configure_cache(0);
+		REQUIRE(disk->get_chunk(12)->data[0] == 2);
+		REQUIRE(disk->cache_stats().checksum_failures == 0);
+	}
+
+	SECTION("what is written is what the checksum was computed of, however the chunk changes meanwhile") {
+		auto on_device = [&file](Size chunk_idx) {
+			std::vector<Byte> contents(512);
+			REQUIRE(pread(file.fd, &contents[0], contents.size(), chunk_idx * 512) == (ssize_t)contents.size());
+			return contents;
+		};
+		ChunkRef chunk = disk->get_chunk(12);
+		Byte next = 1;
+		chunk->memset(chunk->data, next, chunk->size_bytes);
+		checksums->on_record = [&chunk, &next](Size chunk_idx) {
+			if (chunk_idx == 12)
+				chunk->memset(chunk->data, ++next, chunk->size_bytes);
+		};
+
+		// in a batch
+		disk->flush_all();
+		REQUIRE(on_device(12) == std::vector<Byte>(512, 1));
+		REQUIRE(checksums->checksum(12) == crc32c(&on_device(12)[0], 512));
+
+		// and on its own
+		disk->flush_chunk(*chunk);
+		REQUIRE(on_device(12) == std::vector<Byte>(512, 2));
+		REQUIRE(checksums->checksum(12) == crc32c(&on_device(12)[0], 512));
+		checksums->on_record = nullptr;
+		REQUIRE(chunk->dirty);
+	}
+
+	SECTION("chunks without a checksum are not checked") {
+		disk->set_checksums(nullptr);
+		disk->configure_cache(0);
+		Byte flipped = 0xAA;
+		REQUIRE(pwrite(file.fd, &flipped, 1, 9 * 512 + 100) == 1);
+		REQUIRE(disk->get_chunk(9)->data[100] == 0xAA);
+	}
+
+	checksums = nullptr;
+	disk->set_checksums(nullptr);
+}
+
+TEST_CASE( "LZ4 blocks should decompress to what was compressed", "[diskinterface][compression]" ) {
+	auto roundtrip = [](const std::vector<Byte> &input) {
+		std::vector<Byte> block(lz4_compress_bound(input.size()));
+		const size_t length = lz4_compress(input.data(), input.size(), block.data(), block.size());
+		REQUIRE(length != 0);
+		std::vector<Byte> output(input.size());
+		REQUIRE(lz4_decompress(block.data(), length, output.data(), output.size()));
+		REQUIRE(output == input);
+		return length;
+	};
+
+	std::vector<Byte> text;
+	while (text.size() < 4096) {
+		const std::string line = "line " + std::to_string(text.size()) + " of a chunk of text\n";
+		text.insert(text.end(), line.begin(), line.end());
+	}
+	text.resize(4096);
+	REQUIRE(roundtrip(text) < 4096 / 3);
+
+	std::vector<Byte> zeroes(4096, 0);
+	REQUIRE(roundtrip(zeroes) < 64);
+
+	std::vector<Byte> noise(4096);
+	for (size_t i = 0; i < noise.size(); ++i) {
+		noise[i] = (Byte)rand();
+	}
+	REQUIRE(roundtrip(noise) > 4096);
+
+	for (size_t size = 0; size < 20; ++size) {
+		roundtrip(std::vector<Byte>(size, 'a'));
+	}
+
+	SECTION("a block that does not fit is not produced") {
+		std::vector<Byte> block(4095);
+		REQUIRE(lz4_compress(noise.data(), noise.size(), block.data(), block.size()) == 0);
+	}
+
+	SECTION("a damaged block is refused rather than overrunning its output") {
+		std::vector<Byte> block(lz4_compress_bound(text.size()));
+		const size_t length = lz4_compress(text.data(), text.size(), block.data(), block.size());
+		std::vector<Byte> output(text.size());
+		REQUIRE_FALSE(lz4_decompress(block.data(), length - 1, output.data(), output.size()));
+		REQUIRE_FALSE(lz4_decompress(block.data(), length, output.data(), output.size() - 1));
+		for (size_t i = 0; i < length; i += 7) {
+			std::vector<Byte> damaged(block.begin(), block.begin() + length);
+			damaged[i] ^= 0xFF;
+			// whatever it decompresses to, it stays within its output
+			lz4_decompress(damaged.data(), damaged.size(), output.data(), output.size());
+		}
+	}
+}
+
+// chunk 2 is kept compressed in chunk 10, the way the cleaner packs them
+struct OneExtent : public ChunkExtents {
+	Size offset;
+	Size length;
+	int expanded = 0;
+
+	bool extent(Size chunk_idx, Size &offset, Size &length) override {
+		if (chunk_idx != 2 || this->expanded != 0) 
+			return false;
+		offset = this->offset;
+		length = this->length;
+		return true;
+	}
+
+	void expand(Size chunk_idx) override {
+		this->expanded++;
+	}
+};
+
+TEST_CASE( "Disk should read compressed chunks from their extents", "[diskinterface][compression]" ) {
+	ScratchFile file(64 * 512);
+	std::unique_ptr<Disk> disk(new Disk(64, 512, make_disk_backend("pread", file.fd, 64 * 512)));
+
+	std::vector<Byte> plain(512);
+	for (size_t i = 0; i < plain.size(); ++i) {
+		plain[i] = (Byte)('a' + i % 13);
+	}
+	std::vector<Byte> packed(512);
+	const size_t length = lz4_compress(plain.data(), plain.size(), packed.data() + 100, packed.size() - 100);
+	REQUIRE(length != 0);
+	disk->write_through(10, 1, packed.data());
+
+	std::shared_ptr<OneExtent> extents = std::make_shared<OneExtent>();
+	extents->offset = 10 * 512 + 100;
+	extents->length = length;
+	disk->set_extents(extents);
+	disk->configure_cache(0);
+
+	{
+		ChunkRef chunk = disk->get_chunk(2);
+		REQUIRE(chunk->compressed);
+		REQUIRE(std::equal(plain.begin(), plain.end(), chunk->data));
+	}
+	std::vector<ChunkRef> chunks = disk->get_chunks({1, 2, 3});
+	REQUIRE(std::equal(plain.begin(), plain.end(), chunks[1]->data));
+	REQUIRE_FALSE(chunks[0]->compressed);
+	REQUIRE(disk->cache_stats().extent_reads == 2);
+	REQUIRE(disk->cache_stats().extent_bytes_read == 2 * length);
+
+	// changing it has the chunk expanded first, then it is a chunk like any other
+	chunks[1]->data[0] = 'z';
+	chunks[1]->mark_dirty();
+	REQUIRE(extents->expanded == 1);
+	REQUIRE_FALSE(chunks[1]->compressed);
+	chunks.clear();
+	REQUIRE(disk->get_chunk(2)->data[0] == 'z');
+	REQUIRE(disk->cache_stats().expansions == 1);
+
+	SECTION("a damaged extent is refused") {
+		extents->expanded = 0;
+		Byte flipped = 0xFF;
+		REQUIRE(pwrite(file.fd, &flipped, 1, 10 * 512 + 100) == 1);
+		REQUIRE_THROWS_AS(disk->get_chunk(2), DiskException);
+	}
+
+	disk->set_extents(nullptr);
+
+	SECTION("not in zero copy mode") {
+		std::unique_ptr<Disk> mapped(new Disk(64, 512, MAP_FILE | MAP_SHARED, file.fd, true));
+		REQUIRE_THROWS_AS(mapped->set_extents(extents), DiskException);
+	}
+}
+
+TEST_CASE( "Disk should serve get_chunk from many threads at once", "[diskinterface][threads]" ) {
+	constexpr size_t CHUNK_COUNT = 4096;
+	constexpr size_t OPS_PER_THREAD = 200000;
+	constexpr size_t THREAD_COUNT = 4;
+
+	if (std::thread::hardware_concurrency() < THREAD_COUNT) {
+		WARN("skipping, fewer than " << THREAD_COUNT << " hardware threads to scale over");
+		return;
+	}
+
+	std::unique_ptr<Disk> disk(new Disk(CHUNK_COUNT, 64));
+	for (size_t i = 0; i < CHUNK_COUNT; ++i) {
+		ChunkRef chunk = disk->get_chunk(i);
+		chunk->memset(chunk->data, (Byte)i, chunk->size_bytes);
+	}
+
+	// the best of a few rounds, so that one round the scheduler spoiled does 
+	// not decide the outcome
+	auto ops_per_sec = [&disk](size_t thread_count) {
+		double best = 0;
+		for (size_t round = 0; round < 3; ++round) {
+			std::atomic<size_t> mismatches(0);
+			std::vector<std::thread> threads;
+
+			auto start = std::chrono::steady_clock::now();
+			for (size_t t = 0; t < thread_count; ++t) {
+				threads.push_back(std::thread([&disk, &mismatches, t]() {
+					uint64_t state = t * 7919 + 1;
+					for (size_t op = 0; op < OPS_PER_THREAD; ++op) {
+						state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+						Size chunk_idx = (state >> 33) % CHUNK_COUNT;
+						ChunkRef chunk = disk->get_chunk(chunk_idx);
+						if (chunk->data[0] != (Byte)chunk_idx) 
+							mismatches++;
+					}
+				}));
+			}
+			for (std::thread &thread : threads) {
+				thread.join();
+			}
+			std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+			REQUIRE(mismatches == 0);
+
+			best = std::max(best, thread_count * OPS_PER_THREAD / elapsed.count());
+		}
+		return best;
+	};
+
+	// hits on different shards take different locks, so the threads must 
+	// not end up waiting on one another
+	const double single = ops_per_sec(1);
+	const double parallel = ops_per_sec(THREAD_COUNT);
+	INFO("get_chunk ops/sec, 1 thread: " << single << ", " << THREAD_COUNT << " threads: " << parallel);
+	REQUIRE(parallel >= 1.5 * single);
+}
+
+// a pread backend whose reads of one offset wait until they are let through
+struct GatedPreadBackend : public PreadBackend {
+	std::mutex lock;
+	std::condition_variable cv;
+	const Size gated_offset;
+	std::atomic<bool> closed {false};
+	std::atomic<bool> gate_writes {false}; // batches of writes are held up as well
+	bool waiting = false;
+
+	GatedPreadBackend(int fd, Size size_bytes, Size gated_offset) : 
+		PreadBackend(fd, size_bytes), gated_offset(gated_offset) { }
+
+	void gate() {
+		std::unique_lock<std::mutex> l(lock);
+		waiting = true;
+		cv.notify_all();
+		cv.wait(l, [this]() { return !closed; });
+	}
+
+	void read(Size offset, Byte *buf, Size length) override {
+		if (offset == gated_offset && closed) 
+			gate();
+		PreadBackend::read(offset, buf, length);
+	}
+
+	void write_batch(const std::vector<IORequest> &requests) override {
+		if (gate_writes && closed) 
+			gate();
+		PreadBackend::write_batch(requests);
+	}
+
+	void wait_for_reader() {
+		std::unique_lock<std::mutex> l(lock);
+		cv.wait(l, [this]() { return waiting; });
+	}
+
+	void let_through() {
+		std::lock_guard<std::mutex> g(lock);
+		closed = false;
+		cv.notify_all();
+	}
+};
+
+TEST_CASE( "Disk should not hold a shard lock while it reads a chunk in", "[diskinterface][threads]" ) {
+	constexpr Size CHUNK_SIZE = 512;
+	constexpr Size GATED = 3;
+	// shares the gated chunk's shard
+	constexpr Size NEIGHBOUR = GATED + Disk::CHUNK_CACHE_SHARDS;
+	ScratchFile file(256 * CHUNK_SIZE);
+	GatedPreadBackend *backend = new GatedPreadBackend(file.fd, 256 * CHUNK_SIZE, GATED * CHUNK_SIZE);
+	Disk disk(256, CHUNK_SIZE, std::unique_ptr<DiskBackend>(backend));
+
+	{
+		ChunkRef chunk = disk.get_chunk(GATED);
+		chunk->memset(chunk->data, 7, CHUNK_SIZE);
+	}
+	disk.flush_all();
+	disk.evict_chunk(GATED);
+	backend->closed = true;
+
+	SECTION("a miss only holds up those who want the same chunk") {
+		ChunkRef first, second;
+		std::thread loader([&]() { first = disk.get_chunk(GATED); });
+		backend->wait_for_reader();
+		std::thread waiter([&]() { second = disk.get_chunk(GATED); });
+
+		// the shard is free for everyone else meanwhile
+		ChunkRef neighbour = disk.get_chunk(NEIGHBOUR);
+		REQUIRE(neighbour->chunk_idx == NEIGHBOUR);
+		REQUIRE(disk.get_chunks({NEIGHBOUR, NEIGHBOUR + Disk::CHUNK_CACHE_SHARDS}).size() == 2);
+
+		backend->let_through();
+		loader.join();
+		waiter.join();
+		REQUIRE(first == second);
+		REQUIRE(first->data[0] == 7);
+		REQUIRE(disk.cache_stats().misses == 4);
+	}
+
+	SECTION("so does a batch") {
+		std::vector<ChunkRef> batch;
+		std::thread loader([&]() { batch = disk.get_chunks({GATED - 1, GATED, GATED + 1}); });
+		backend->wait_for_reader();
+
+		ChunkRef neighbour = disk.get_chunk(NEIGHBOUR);
+		REQUIRE(neighbour->chunk_idx == NEIGHBOUR);
+
+		backend->let_through();
+		loader.join();
+		REQUIRE(batch.size() == 3);
+		REQUIRE(batch[1]->data[0] == 7);
+		REQUIRE(disk.get_chunk(GATED) == batch[1]);
+	}
+}
+
+TEST_CASE( "Disk should not hold the shard locks while it flushes or syncs", "[diskinterface][threads]" ) {
+	constexpr Size CHUNK_SIZE = 512;
+	constexpr Size DIRTY = 3;
+	constexpr Size NEIGHBOUR = DIRTY + Disk::CHUNK_CACHE_SHARDS;
+	ScratchFile file(256 * CHUNK_SIZE);
+	GatedPreadBackend *backend = new GatedPreadBackend(file.fd, 256 * CHUNK_SIZE, 0);
+	Disk disk(256, CHUNK_SIZE, std::unique_ptr<DiskBackend>(backend));
+
+	{
+		ChunkRef chunk = disk.get_chunk(DIRTY);
+		chunk->memset(chunk->data, 7, CHUNK_SIZE);
+	}
+	backend->gate_writes = true;
+	backend->closed = true;
+
+	auto lookups_go_on = [&](std::function<void()> write) {
+		std::thread writer(write);
+		backend->wait_for_reader();
+
+		// the chunk on its way out and the rest of its shard can still be had
+		REQUIRE(disk.get_chunk(DIRTY)->data[0] == 7);
+		REQUIRE(disk.get_chunk(NEIGHBOUR)->chunk_idx == NEIGHBOUR);
+
+		backend->let_through();
+		writer.join();
+		REQUIRE(disk.cache_stats().dirty_chunks == 0);
+	};
+
+	SECTION("flush_all") {
+		lookups_go_on([&disk]() { disk.flush_all(); });
+	}
+
+	SECTION("sync") {
+		lookups_go_on([&disk]() { disk.sync(0, 256); });
+	}
+
+	SECTION("sync of a few chunks") {
+		lookups_go_on([&disk]() { disk.sync(DIRTY, 1); });
+	}
+}
+
+TEST_CASE( "Disk should wait for its own threads to let go of a chunk that is evicted as unshared", "[diskinterface][threads]" ) {
+	constexpr Size CHUNK_SIZE = 512;
+	constexpr Size DIRTY = 3;
+	ScratchFile file(256 * CHUNK_SIZE);
+	GatedPreadBackend *backend = new GatedPreadBackend(file.fd, 256 * CHUNK_SIZE, 0);
+	Disk disk(256, CHUNK_SIZE, std::unique_ptr<DiskBackend>(backend));
+
+	ChunkRef chunk = disk.get_chunk(DIRTY);
+	chunk->memset(chunk->data, 7, CHUNK_SIZE);
+	backend->gate_writes = true;
+	backend->closed = true;
+
+	// the flush holds the chunk for as long as its write is held up, however long that is
+	std::thread flusher([&disk]() { disk.flush_all(); });
+	backend->wait_for_reader();
+	std::atomic<bool> evicted {false};
+	std::thread evicter([&]() {
+		disk.evict_unshared(chunk);
+		evicted = true;
+	});
+	std::this_thread::sleep_for(std::chrono::milliseconds(50));
+	REQUIRE_FALSE(evicted);
+
+	backend->let_through();
+	flusher.join();
+	evicter.join();
+	REQUIRE(evicted);
+	REQUIRE(chunk.unique());
+}
+
+TEST_CASE( "Shared object cache should find what is still held and forget what is not", "[diskinterface][sharedcache]" ) {
+	SharedObjectCache<uint64_t, uint64_t> cache;
+
+	SECTION("an object is found for as long as someone holds it") {
+		std::shared_ptr<uint64_t> held(new uint64_t(7));
+		cache.put(7, held);
+		REQUIRE(cache.get(7) == held);
+		REQUIRE(cache.get(8) == nullptr);
+		held = nullptr;
+		REQUIRE(cache.get(7) == nullptr);
+	}
+
+	SECTION("putting a key again replaces it, erasing removes it") {
+		std::shared_ptr<uint64_t> first(new uint64_t(1)), second(new uint64_t(2));
+		cache.put(1, first);
+		cache.put(1, second);
+		REQUIRE(cache.get(1) == second);
+		REQUIRE(cache.size() == 1);
+		cache.erase(1);
+		REQUIRE(cache.get(1) == nullptr);
+		REQUIRE(cache.size() == 0);
+	}
+
+	SECTION("it grows to hold everything that is held") {
+		std::vector<std::shared_ptr<uint64_t>> held;
+		for (uint64_t key = 0; key < 1000; ++key) {
+			held.emplace_back(new uint64_t(key));
+			cache.put(key, held.back());
+		}
+		REQUIRE(cache.capacity() >= 1000);
+		for (uint64_t key = 0; key < 1000; ++key) {
+			REQUIRE(cache.get(key) == held[key]);
+		}
+	}
+
+	SECTION("expired entries are dropped as others are put, it does not grow for them") {
+		std::shared_ptr<uint64_t> held(new uint64_t(0));
+		cache.put(0, held);
+		for (uint64_t key = 1; key < 100000; ++key) {
+			cache.put(key, std::shared_ptr<uint64_t>(new uint64_t(key)));
+		}
+		REQUIRE(cache.capacity() <= 64);
+		REQUIRE(cache.get(0) == held);
+	}
+
+	SECTION("lookups from many threads see every held object while others come and go") {
+		const uint64_t held_count = 256;
+		std::vector<std::shared_ptr<uint64_t>> held;
+		for (uint64_t key = 0; key < held_count; ++key) {
+			held.emplace_back(new uint64_t(key));
+			cache.put(key, held.back());
+		}
+
+		std::atomic<uint64_t> wrong {0};
+		std::vector<std::thread> threads;
+		for (int t = 0; t < 32; ++t) {
+			threads.emplace_back([&cache, &wrong, t]() {
+				for (uint64_t round = 0; round < 20000; ++round) {
+					const uint64_t key = (round * 31 + t) % held_count;
+					std::shared_ptr<uint64_t> found = cache.get(key);
+					if (found == nullptr || *found != key) 
+						wrong++;
+					// the ones that come and go may be found or not, but never as something else
+					std::shared_ptr<uint64_t> passing = cache.get(held_count + round % 1024);
+					if (passing != nullptr && *passing != held_count + round % 1024) 
+						wrong++;
+				}
+			});
+		}
+		// enough to make the table grow, drop entries and free them meanwhile
+		std::vector<std::shared_ptr<uint64_t>> recent(512);
+		for (uint64_t round = 0; round < 20000; ++round) {
+			const uint64_t key = held_count + round % 1024;
+			recent[round % recent.size()] = std::shared_ptr<uint64_t>(new uint64_t(key));
+			cache.put(key, recent[round % recent.size()]);
+		}
+		for (std::thread &thread : threads) {
+			thread.join();
+		}
+		REQUIRE(wrong == 0);
+	}
 }
 
 TEST_CASE( "Disk bitmap should work", "[bitmap]" ) {
@@ -2,11 +2,22 @@
 #include <cstdlib>
 #include <ctime>
 #include <vector>
+#include <cstring>
+#include <functional>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
 #include "catch.hpp"
 
 #include "diskinterface.hpp"
 #include "filesystem.hpp"
+#include "diskbackend.hpp"
+#include "scratch-file.hpp"
+#include "crc32c.hpp"
 
 const auto get_random_buffer = [](size_t size, bool nullTerminate = false) -> std::vector<char> {
 	std::vector<char> buf;
@@ -29,243 +40,1292 @@ const auto get_random_buffer = [](size_t size, bool nullTerminate = false) -> st
 };
 
 
+// the chunk sizes mkfs is tested with, from the smallest to the largest it accepts
+static const uint64_t TESTED_CHUNK_SIZES[] = {512, 4096, 64 * 1024, 1024 * 1024};
+
+// enough chunks for a few dozen segments whatever the chunk size
+static uint64_t chunk_count_for(uint64_t chunk_size) {
+	return std::max<uint64_t>(128, 16 * 1024 * 1024 / chunk_size);
+}
+
+// enough chunks for size_bytes, but never fewer than min_chunks. 64 are what 
+// mkfs needs for its metadata and 20 segments, a test that puts every file in 
+// a chunk of its own needs more
+static uint64_t chunk_count_for(uint64_t chunk_size, uint64_t size_bytes, uint64_t min_chunks = 64) {
+	return std::max<uint64_t>(min_chunks, size_bytes / chunk_size);
+}
+
 TEST_CASE( "Making a filesystem should work", "[filesystem]" ) {
-	constexpr uint64_t CHUNK_COUNT = 4096;
-	constexpr uint64_t CHUNK_SIZE = 4096;
+	for (uint64_t chunk_size : TESTED_CHUNK_SIZES) {
+		DYNAMIC_SECTION("with " << chunk_size << " byte chunks") {
+			std::unique_ptr<Disk> disk(new Disk(chunk_count_for(chunk_size), chunk_size));
+			{
+				std::unique_ptr<FileSystem> fs(new FileSystem(disk.get()));
+				fs->superblock->init(0.1);
+				fs = nullptr;
+			}
+
+			{
+				std::cout << "Load the filesystem from the disk" << std::endl;
+				std::unique_ptr<FileSystem> fs(new FileSystem(disk.get()));
+				fs->superblock->load_from_disk();
+				REQUIRE(fs->superblock->disk_chunk_size == chunk_size);
+				fs = nullptr;
+			}
+		}
+	}
+
+	SECTION("chunk sizes that are not a power of two in range are refused") {
+		std::unique_ptr<Disk> disk(new Disk(4096, 256));
+		std::unique_ptr<FileSystem> fs(new FileSystem(disk.get()));
+		REQUIRE_THROWS_AS(fs->superblock->init(0.1), FileSystemException);
+		REQUIRE_FALSE(SuperBlock::valid_chunk_size(3000));
+		REQUIRE_FALSE(SuperBlock::valid_chunk_size(2 * 1024 * 1024));
+	}
+}
+
+static void test_chunk_size(uint64_t chunk_size) {
+	const uint64_t chunk_count = chunk_count_for(chunk_size);
+	ScratchFile image(chunk_count * chunk_size);
+	const int fd = image.fd;
 
-	std::unique_ptr<Disk> disk(new Disk(CHUNK_COUNT, CHUNK_SIZE));
+	// spills over the direct addresses into the indirect table
+	std::vector<char> contents = get_random_buffer((INode::DIRECT_ADDRESS_COUNT + 2) * chunk_size + 123);
+	uint64_t dir_idx = 0;
+
+	// what mkfs does
 	{
+		std::unique_ptr<Disk> disk(new Disk(chunk_count, chunk_size, MAP_FILE | MAP_SHARED, fd));
 		std::unique_ptr<FileSystem> fs(new FileSystem(disk.get()));
 		fs->superblock->init(0.1);
+
+		std::shared_ptr<INode> dir = fs->superblock->inode_table->alloc_inode();
+		std::shared_ptr<INode> file = fs->superblock->inode_table->alloc_inode();
+		REQUIRE(file->write(0, &contents[0], contents.size()) == contents.size());
+		dir_idx = dir->inode_table_idx;
+
+		IDirectory directory(*dir);
+		directory.initializeEmpty();
+		directory.add_file("media", *file);
+		directory.flush();
+
+		file = nullptr;
+		dir = nullptr;
 		fs = nullptr;
 	}
 
+	// and what myfs does when it mounts
+	REQUIRE(SuperBlock::read_chunk_size(fd) == chunk_size);
 	{
-		std::cout << "Load the filesystem from the disk" << std::endl;
+		std::unique_ptr<Disk> disk(new Disk(chunk_count, SuperBlock::read_chunk_size(fd), MAP_FILE | MAP_SHARED, fd));
 		std::unique_ptr<FileSystem> fs(new FileSystem(disk.get()));
 		fs->superblock->load_from_disk();
+
+		std::shared_ptr<INode> dir = fs->superblock->inode_table->get_inode(dir_idx);
+		IDirectory directory(*dir);
+		std::unique_ptr<IDirectory::DirEntry> entry = directory.get_file("media");
+		REQUIRE(entry != nullptr);
+
+		std::shared_ptr<INode> file = fs->superblock->inode_table->get_inode(entry->inode_idx);
+		REQUIRE(file->data.file_size == contents.size());
+		std::vector<char> read_back(contents.size());
+		file->read(0, &read_back[0], read_back.size());
+		REQUIRE(read_back == contents);
+
+		entry = nullptr;
+		file = nullptr;
+		dir = nullptr;
 		fs = nullptr;
 	}
+
 }
 
-TEST_CASE("INode read/write test", "[filesystem][readwritem][readwrite.orderly]") {
-	const auto test_inode = [](int offset, int length) {
-		std::unique_ptr<Disk> disk(new Disk(1024, 512));
-		std::vector<char> read_back;
+TEST_CASE( "File systems can be made and mounted with any supported chunk size", "[filesystem][chunksize]" ) {
+	for (uint64_t chunk_size : TESTED_CHUNK_SIZES) {
+		DYNAMIC_SECTION("with " << chunk_size << " byte chunks") {
+			test_chunk_size(chunk_size);
+		}
+	}
 
-		std::vector<char> to_write = get_random_buffer(length);
-		int64_t inode_idx = 0;
+	SECTION("a device without a file system has no chunk size") {
+		ScratchFile image(1024 * 1024);
+		const int fd = image.fd;
+		REQUIRE_THROWS_AS(SuperBlock::read_chunk_size(fd), FileSystemException);
+	}
+}
 
-		to_write.push_back('\0');
-		{
-			std::unique_ptr<FileSystem> fs(new FileSystem(disk.get()));
-			fs->superblock->init(0.1);
+TEST_CASE( "File systems can be striped over several devices", "[filesystem][striped]" ) {
+	const uint64_t chunk_size = 4096;
+	const uint64_t device_size = 4 * 1024 * 1024;
+	const uint64_t stripe_unit = 4 * chunk_size;
 
-			read_back.resize(to_write.size());
-			
-			std::shared_ptr<INode> inode = fs->superblock->inode_table->alloc_inode();
-			inode_idx = inode->inode_table_idx;
+	std::vector<std::unique_ptr<ScratchFile>> images;
+	std::vector<int> fds;
+	for (size_t i = 0; i < 3; ++i) {
+		images.emplace_back(new ScratchFile(device_size));
+		fds.push_back(images.back()->fd);
+	}
 
-			inode->superblock = fs->superblock.get();
-			REQUIRE(inode->superblock->disk == disk.get());
+	std::vector<char> contents = get_random_buffer(300 * 1024);
+	uint64_t file_idx = 0;
 
-			REQUIRE(inode->write(offset, &(to_write[0]), length) == length);
-			REQUIRE(inode->read(offset, &(read_back[0]), length) == length);
+	// what mkfs does
+	{
+		std::unique_ptr<DiskBackend> backend = make_disk_backend("mmap", fds, device_size, stripe_unit);
+		const uint64_t chunk_count = backend->size_bytes() / chunk_size;
+		REQUIRE(chunk_count == 3 * device_size / chunk_size);
+		std::unique_ptr<Disk> disk(new Disk(chunk_count, chunk_size, std::move(backend)));
+		std::unique_ptr<FileSystem> fs(new FileSystem(disk.get()));
+		fs->superblock->device_count = 3;
+		fs->superblock->stripe_unit_bytes = stripe_unit;
+		fs->superblock->init(0.1);
 
-			REQUIRE(strcmp(&to_write[0], &read_back[0]) == 0);
+		std::shared_ptr<INode> file = fs->superblock->inode_table->alloc_inode();
+		REQUIRE(file->write(0, &contents[0], contents.size()) == contents.size());
+		file_idx = file->inode_table_idx;
+		file = nullptr;
+		fs = nullptr;
+	}
 
-			// NOTE: the order that these are nulled in IS important
-			inode = nullptr;
-			fs = nullptr;
-		}
+	// the superblock lives on the first device and describes the others
+	SuperBlock::DeviceLayout layout = SuperBlock::read_device_layout(fds[0]);
+	REQUIRE(layout.chunk_size == chunk_size);
+	REQUIRE(layout.device_count == 3);
+	REQUIRE(layout.stripe_unit_bytes == stripe_unit);
 
-		{
-			std::unique_ptr<FileSystem> fs(new FileSystem(disk.get()));
-			fs->superblock->load_from_disk();
-			std::shared_ptr<Chunk> page0 = disk->get_chunk(0);
+	// and what myfs does when it mounts
+	{
+		std::unique_ptr<DiskBackend> backend = make_disk_backend("pread", fds, device_size, layout.stripe_unit_bytes);
+		const uint64_t chunk_count = backend->size_bytes() / layout.chunk_size;
+		std::unique_ptr<Disk> disk(new Disk(chunk_count, layout.chunk_size, std::move(backend)));
+		std::unique_ptr<FileSystem> fs(new FileSystem(disk.get()));
+		fs->superblock->load_from_disk();
+		REQUIRE(fs->superblock->device_count == 3);
+
+		std::shared_ptr<INode> file = fs->superblock->inode_table->get_inode(file_idx);
+		REQUIRE(file->data.file_size == contents.size());
+		std::vector<char> read_back(contents.size());
+		file->read(0, &read_back[0], read_back.size());
+		REQUIRE(read_back == contents);
+		file = nullptr;
+		fs = nullptr;
+	}
 
-			std::vector<char> read_back1;
-			read_back1.resize(to_write.size());
+}
 
-			std::shared_ptr<INode> inode = fs->superblock->inode_table->get_inode(inode_idx);
-			inode->superblock = fs->superblock.get();
-			REQUIRE(inode->superblock->disk == disk.get());
-			
-			REQUIRE(inode->read(offset, &(read_back1[0]), length) == length);
-			REQUIRE(strcmp(&to_write[0], &read_back1[0]) == 0);
+TEST_CASE( "Metadata can be kept on a fast device and file data on a bulk one", "[filesystem][tiered]" ) {
+	const uint64_t chunk_size = 4096;
+	const uint64_t fast_size = 1024 * chunk_size;
+	const uint64_t bulk_size = 3072 * chunk_size;
 
-			inode = nullptr;
-			fs = nullptr;
+	ScratchFile fast(fast_size), bulk(bulk_size);
+	const int fast_fd = fast.fd;
+	const int bulk_fd = bulk.fd;
+
+	auto make_disk = [&](const char *backend, uint64_t fast_bytes) {
+		std::unique_ptr<DiskBackend> tiered(new TieredBackend(
+			make_disk_backend(backend, fast_fd, fast_size), make_disk_backend(backend, bulk_fd, bulk_size), fast_bytes));
+		const uint64_t chunk_count = tiered->size_bytes() / chunk_size;
+		return std::unique_ptr<Disk>(new Disk(chunk_count, chunk_size, std::move(tiered)));
+	};
+
+	// the tables of a file that needs double indirection are metadata, the rest is data
+	auto check_placement = [&](SuperBlock &sb, INode &file, uint64_t chunks) {
+		const uint64_t bulk_start = sb.data_offset + sb.segment_controller.fast_segments * sb.segment_size_chunks;
+		REQUIRE(file.data.addresses[INode::DIRECT_ADDRESS_COUNT] < sb.fast_size_chunks);
+		REQUIRE(file.data.addresses[INode::DIRECT_ADDRESS_COUNT] >= sb.data_offset);
+		REQUIRE(file.data.addresses[INode::DIRECT_ADDRESS_COUNT + 1] < sb.fast_size_chunks);
+		for (uint64_t cn = 0; cn < chunks; ++cn) {
+			REQUIRE(file.lookup_chunk_idx(cn) >= bulk_start);
 		}
 	};
 
+	std::vector<char> contents = get_random_buffer(600 * chunk_size);
+	uint64_t file_idx = 0;
 
-	SECTION("Can write strings of length 1 - 5000") {
-		std::cout << "RUNNING MY TEST, WRITING 100000 BYTES" << std::endl;
-		test_inode(0, 100000);
+	// what mkfs does
+	{
+		std::unique_ptr<Disk> disk = make_disk("mmap", fast_size);
+		std::unique_ptr<FileSystem> fs(new FileSystem(disk.get()));
+		fs->superblock->fast_size_chunks = fast_size / chunk_size;
+		fs->superblock->init(0.1);
+		SuperBlock &sb = *fs->superblock;
+		REQUIRE(sb.segment_controller.fast_segments >= 2);
+		REQUIRE(sb.segment_controller.summary_idx(sb.num_segments - 1) < sb.fast_size_chunks);
+		// the root directory is metadata too
+		std::shared_ptr<INode> root = sb.inode_table->get_inode(sb.root_inode_index);
+		REQUIRE(root->data.addresses[0] < sb.fast_size_chunks);
+		root = nullptr;
+
+		std::shared_ptr<INode> file = sb.inode_table->alloc_inode();
+		REQUIRE(file->write(0, &contents[0], contents.size()) == contents.size());
+		file_idx = file->inode_table_idx;
+		check_placement(sb, *file, 600);
+		file = nullptr;
+		fs = nullptr;
 	}
 
-	SECTION("Can write strings of length 1 - 5000") {
-		for (int i = 0; i < 5000; ++i) {
-			test_inode(0, i);
+	// the superblock is on the fast device
+	SuperBlock::DeviceLayout layout = SuperBlock::read_device_layout(fast_fd);
+	REQUIRE(layout.chunk_size == chunk_size);
+	REQUIRE(layout.fast_size_bytes == fast_size);
+
+	// and what myfs does when it mounts, the file is rewritten until both kinds of 
+	// segments have been cleaned, which keeps each where it was
+	{
+		std::unique_ptr<Disk> disk = make_disk("pread", layout.fast_size_bytes);
+		std::unique_ptr<FileSystem> fs(new FileSystem(disk.get()));
+		fs->superblock->load_from_disk();
+		SuperBlock &sb = *fs->superblock;
+		REQUIRE(sb.fast_size_chunks == fast_size / chunk_size);
+
+		std::shared_ptr<INode> file = sb.inode_table->get_inode(file_idx);
+		std::vector<char> read_back(contents.size());
+		file->read(0, &read_back[0], read_back.size());
+		REQUIRE(read_back == contents);
+
+		for (int i = 0; i < 12; ++i) {
+			contents = get_random_buffer(600 * chunk_size);
+			REQUIRE(file->write(0, &contents[0], contents.size()) == contents.size());
 		}
+		file->read(0, &read_back[0], read_back.size());
+		REQUIRE(read_back == contents);
+		check_placement(sb, *file, 600);
+		file = nullptr;
+		fs = nullptr;
+	}
+
+}
+
+TEST_CASE( "File contents are checksummed in the segment summaries", "[filesystem][checksum]" ) {
+	const uint64_t chunk_size = 4096;
+	const uint64_t chunk_count = 4096;
+	ScratchFile image(chunk_count * chunk_size);
+	const int fd = image.fd;
+
+	std::vector<char> contents = get_random_buffer(20 * chunk_size);
+	uint64_t file_idx = 0;
+	uint64_t data_chunk_idx = 0;
+	{
+		std::unique_ptr<Disk> disk(new Disk(chunk_count, chunk_size, MAP_FILE | MAP_SHARED, fd));
+		std::unique_ptr<FileSystem> fs(new FileSystem(disk.get()));
+		fs->superblock->init(0.1);
+		REQUIRE(fs->superblock->checksums);
+		// room for an inode number and a checksum of every chunk in the summary
+		REQUIRE(fs->superblock->segment_size_chunks * (sizeof(uint64_t) + sizeof(uint32_t)) <= chunk_size);
+
+		std::shared_ptr<INode> file = fs->superblock->inode_table->alloc_inode();
+		REQUIRE(file->write(0, &contents[0], contents.size()) == contents.size());
+		file_idx = file->inode_table_idx;
+		data_chunk_idx = file->data.addresses[3];
+		file = nullptr;
+		fs = nullptr;
+		disk->flush_all();
+		REQUIRE(disk->cache_stats().checksums_computed >= 20);
 	}
 
-	SECTION("Can write strings of length 100 at offsets 1 - 5000") {
-		for (int i = 0; i < 5000; ++i) {
-			test_inode(i, 100);
+	auto mount = [&](std::function<void(FileSystem &, Disk &)> work) {
+		std::unique_ptr<Disk> disk(new Disk(chunk_count, chunk_size, MAP_FILE | MAP_SHARED, fd));
+		std::unique_ptr<FileSystem> fs(new FileSystem(disk.get()));
+		fs->superblock->load_from_disk();
+		work(*fs, *disk);
+		fs = nullptr;
+	};
+
+	mount([&](FileSystem &fs, Disk &disk) {
+		REQUIRE(fs.superblock->checksums);
+		std::shared_ptr<INode> file = fs.superblock->inode_table->get_inode(file_idx);
+		std::vector<char> read_back(contents.size());
+		file->read(0, &read_back[0], read_back.size());
+		REQUIRE(read_back == contents);
+		Disk::CacheStats stats = disk.cache_stats();
+		REQUIRE(stats.checksums_verified >= 20);
+		REQUIRE(stats.checksum_failures == 0);
+	});
+
+	// a bit rots on the device underneath the file system
+	char flipped = ~contents[3 * chunk_size + 10];
+	REQUIRE(pwrite(fd, &flipped, 1, data_chunk_idx * chunk_size + 10) == 1);
+
+	mount([&](FileSystem &fs, Disk &disk) {
+		std::shared_ptr<INode> file = fs.superblock->inode_table->get_inode(file_idx);
+		std::vector<char> read_back(chunk_size);
+		file->read(0, &read_back[0], read_back.size());
+		REQUIRE_THROWS_AS(file->read(3 * chunk_size, &read_back[0], read_back.size()), DiskException);
+		REQUIRE(disk.cache_stats().checksum_failures > 0);
+	});
+
+}
+
+TEST_CASE( "Segments are compressed by the cleaner and read back transparently", "[filesystem][compression]" ) {
+	const uint64_t chunk_size = 4096;
+	const uint64_t chunk_count = 4096;
+	ScratchFile image(chunk_count * chunk_size);
+	const int fd = image.fd;
+
+	// text compresses well, each file's is its own
+	auto contents_of = [](int file) {
+		std::string text;
+		for (int line = 0; text.size() < 40 * 4096; ++line) {
+			text += "file " + std::to_string(file) + " line " + std::to_string(line) + " of some compressible text\n";
+		}
+		text.resize(40 * 4096);
+		return std::vector<char>(text.begin(), text.end());
+	};
+	auto read_all = [](INode &file) {
+		std::vector<char> read_back(file.data.file_size);
+		file.read(0, &read_back[0], read_back.size());
+		return read_back;
+	};
+
+	std::vector<uint64_t> file_idxs;
+	std::vector<char> changed = contents_of(1);
+	{
+		std::unique_ptr<Disk> disk(new Disk(chunk_count, chunk_size, make_disk_backend("pread", fd, chunk_count * chunk_size)));
+		std::unique_ptr<FileSystem> fs(new FileSystem(disk.get()));
+		fs->superblock->compression = true;
+		fs->superblock->init(0.1);
+		SegmentController &segments = fs->superblock->segment_controller;
+		REQUIRE(segments.compression);
+
+		// every other file is deleted, which leaves the segments half used
+		for (int i = 0; i < 12; ++i) {
+			std::shared_ptr<INode> file = fs->superblock->inode_table->alloc_inode();
+			std::vector<char> contents = contents_of(i);
+			REQUIRE(file->write(0, &contents[0], contents.size()) == contents.size());
+			file_idxs.push_back(file->inode_table_idx);
+		}
+		for (int i = 0; i < 12; i += 2) {
+			fs->superblock->inode_table->get_inode(file_idxs[i])->release_chunks();
+		}
+		REQUIRE(segments.compression_stats().chunks == 0);
+		segments.clean();
+
+		SegmentController::CompressionStats stats = segments.compression_stats();
+		REQUIRE(stats.chunks >= 4 * 40);
+		REQUIRE(stats.plain_bytes == stats.chunks * chunk_size);
+		REQUIRE(stats.stored_bytes * 4 < stats.plain_bytes);
+
+		// read from the compressed blocks once they are out of the cache
+		disk->configure_cache(0);
+		for (int i = 1; i < 12; i += 2) {
+			std::shared_ptr<INode> file = fs->superblock->inode_table->get_inode(file_idxs[i]);
+			REQUIRE(read_all(*file) == contents_of(i));
+		}
+		REQUIRE(disk->cache_stats().extent_reads >= 4 * 40);
+		REQUIRE(disk->cache_stats().checksum_failures == 0);
+
+		// the cleaner changes indirection tables in place, the segment a table 
+		// was compressed into is expanded before it changes
+		std::shared_ptr<INode> file = fs->superblock->inode_table->get_inode(file_idxs[1]);
+		{
+			ChunkRef table = disk->get_chunk(file->data.addresses[INode::DIRECT_ADDRESS_COUNT]);
+			REQUIRE(table->compressed);
+			table->mark_dirty();
+			REQUIRE_FALSE(table->compressed);
+		}
+		REQUIRE(disk->cache_stats().expansions == 1);
+		REQUIRE(segments.compression_stats().chunks < stats.chunks);
+
+		// by the time it has been expanded its chunks are in their own places on 
+		// the device, and so is the summary that no longer points at the blocks
+		{
+			const uint64_t table_idx = file->data.addresses[INode::DIRECT_ADDRESS_COUNT];
+			const uint64_t sn = (table_idx - segments.data_offset) / segments.segment_size;
+			std::vector<Byte> summary(chunk_size), chunk(chunk_size);
+			REQUIRE(pread(fd, &summary[0], chunk_size, segments.summary_idx(sn) * chunk_size) == (ssize_t)chunk_size);
+			const uint32_t *crcs = (const uint32_t *)&summary[segments.segment_size * sizeof(uint64_t)];
+			const uint32_t *entries = crcs + segments.segment_size;
+			uint64_t dropped = 0;
+			for (uint64_t cn = 1; cn < segments.segment_size; cn++) {
+				if (entries[cn] == 0 || SegmentSummaries::compressed_entry(entries[cn])) 
+					continue ;
+				const uint64_t chunk_idx = segments.data_offset + sn * segments.segment_size + cn;
+				REQUIRE(pread(fd, &chunk[0], chunk_size, chunk_idx * chunk_size) == (ssize_t)chunk_size);
+				REQUIRE(crc32c(&chunk[0], chunk_size) == crcs[cn]);
+				dropped++;
+			}
+			REQUIRE(dropped > 0);
 		}
+
+		// files are written as usual on top of compressed chunks
+		memset(&changed[20 * chunk_size], 'x', chunk_size);
+		REQUIRE(file->write(20 * chunk_size, &changed[20 * chunk_size], chunk_size) == chunk_size);
+		REQUIRE(read_all(*file) == changed);
+		file = nullptr;
+		fs = nullptr;
+		disk->flush_all();
+	}
+
+	// compression is not recorded, what was compressed is read back regardless
+	{
+		std::unique_ptr<Disk> disk(new Disk(chunk_count, chunk_size, make_disk_backend("pread", fd, chunk_count * chunk_size)));
+		std::unique_ptr<FileSystem> fs(new FileSystem(disk.get()));
+		fs->superblock->load_from_disk();
+		REQUIRE_FALSE(fs->superblock->segment_controller.compression);
+		for (int i = 3; i < 12; i += 2) {
+			std::shared_ptr<INode> file = fs->superblock->inode_table->get_inode(file_idxs[i]);
+			REQUIRE(read_all(*file) == contents_of(i));
+		}
+		std::shared_ptr<INode> file = fs->superblock->inode_table->get_inode(file_idxs[1]);
+		REQUIRE(read_all(*file) == changed);
+		REQUIRE(disk->cache_stats().checksum_failures == 0);
+		file = nullptr;
+		fs = nullptr;
+	}
+
+	// a chunk handed out in zero copy mode has to be its own place on the device
+	{
+		std::unique_ptr<Disk> disk(new Disk(chunk_count, chunk_size, MAP_FILE | MAP_SHARED, fd, true));
+		std::unique_ptr<FileSystem> fs(new FileSystem(disk.get()));
+		REQUIRE_THROWS_AS(fs->superblock->load_from_disk(), FileSystemException);
 	}
 
-	SECTION("Can write strings of length 1000 at offsets 1 - 5000") {
-		for (int i = 0; i < 5000; ++i) {
-			test_inode(i, 1000);
+}
+
+TEST_CASE( "Segments freed by the cleaner are given back to the device", "[filesystem][discard]" ) {
+	const uint64_t chunk_size = 4096;
+	const uint64_t chunk_count = 4096;
+	ScratchFile image(chunk_count * chunk_size);
+	const int fd = image.fd;
+	auto allocated_bytes = [fd]() {
+		struct stat st;
+		REQUIRE(fstat(fd, &st) == 0);
+		return (uint64_t)st.st_blocks * 512;
+	};
+
+	std::vector<uint64_t> file_idxs;
+	std::vector<std::vector<char>> contents;
+	{
+		std::unique_ptr<Disk> disk(new Disk(chunk_count, chunk_size, make_disk_backend("pread", fd, chunk_count * chunk_size)));
+		disk->configure_discard();
+		std::unique_ptr<FileSystem> fs(new FileSystem(disk.get()));
+		fs->superblock->init(0.1);
+		SegmentController &segments = fs->superblock->segment_controller;
+
+		// every other file is deleted, which leaves the segments half used
+		for (int i = 0; i < 12; ++i) {
+			std::shared_ptr<INode> file = fs->superblock->inode_table->alloc_inode();
+			contents.push_back(get_random_buffer(40 * chunk_size));
+			REQUIRE(file->write(0, &contents[i][0], contents[i].size()) == contents[i].size());
+			file_idxs.push_back(file->inode_table_idx);
 		}
+		for (int i = 0; i < 12; i += 2) {
+			fs->superblock->inode_table->get_inode(file_idxs[i])->release_chunks();
+		}
+		disk->flush_all();
+		const uint64_t free_before = segments.num_free_segments;
+		segments.clean();
+		REQUIRE(segments.num_free_segments > free_before);
+		REQUIRE(disk->cache_stats().discard_pending_chunks > 0);
+
+		// only once the chunks the cleaner moved are on the device
+		REQUIRE(disk->cache_stats().discards == 0);
+		disk->flush_all();
+		const uint64_t before = allocated_bytes();
+		disk->run_writeback();
+		Disk::CacheStats stats = disk->cache_stats();
+		REQUIRE(stats.discards > 0);
+		REQUIRE(stats.discarded_bytes >= (segments.segment_size - 1) * chunk_size);
+		REQUIRE(allocated_bytes() < before);
+
+		for (int i = 1; i < 12; i += 2) {
+			std::shared_ptr<INode> file = fs->superblock->inode_table->get_inode(file_idxs[i]);
+			std::vector<char> read_back(contents[i].size());
+			file->read(0, &read_back[0], read_back.size());
+			REQUIRE(read_back == contents[i]);
+		}
+		fs = nullptr;
 	}
 
-	SECTION("Can write strings of length 5000 at offsets 1 - 5000") {
-		for (int i = 0; i < 5000; ++i) {
-			test_inode(i, 5000);
+	{
+		std::unique_ptr<Disk> disk(new Disk(chunk_count, chunk_size, make_disk_backend("pread", fd, chunk_count * chunk_size)));
+		std::unique_ptr<FileSystem> fs(new FileSystem(disk.get()));
+		fs->superblock->load_from_disk();
+		for (int i = 1; i < 12; i += 2) {
+			std::shared_ptr<INode> file = fs->superblock->inode_table->get_inode(file_idxs[i]);
+			std::vector<char> read_back(contents[i].size());
+			file->read(0, &read_back[0], read_back.size());
+			REQUIRE(read_back == contents[i]);
 		}
+		REQUIRE(disk->cache_stats().checksum_failures == 0);
+		fs = nullptr;
 	}
+
 }
 
-TEST_CASE("INode read/write test with random patterns", "[filesystem][readwrite][readwrite.random]") {
-	const auto test_inode = [](INode& inode, int offset, int length) {
-		std::vector<char> to_write;
+TEST_CASE( "Identical chunks of file data are stored once", "[filesystem][dedup]" ) {
+	const uint64_t chunk_size = 4096;
+	const uint64_t chunk_count = 4096;
+	ScratchFile image(chunk_count * chunk_size);
+	const int fd = image.fd;
+
+	std::vector<char> shared = get_random_buffer(30 * chunk_size);
+	auto read_all = [](INode &file) {
+		std::vector<char> read_back(file.data.file_size);
+		file.read(0, &read_back[0], read_back.size());
+		return read_back;
+	};
+	auto used_chunks = [](SegmentController &segments) {
+		uint64_t used = 0;
+		for (uint64_t sn = 0; sn < segments.num_segments; sn++) {
+			used += segments.get_segment_usage(sn);
+		}
+		return used;
+	};
 
-		for (int i = 0; i < length; ++i) {
-			to_write.push_back('a' + (rand() % 26));
+	std::vector<uint64_t> file_idxs;
+	std::vector<uint64_t> filler_idxs;
+	{
+		std::unique_ptr<Disk> disk(new Disk(chunk_count, chunk_size, make_disk_backend("pread", fd, chunk_count * chunk_size)));
+		std::unique_ptr<FileSystem> fs(new FileSystem(disk.get()));
+		fs->superblock->dedup = true;
+		fs->superblock->init(0.1);
+		REQUIRE(fs->superblock->dedup_index != nullptr);
+		SegmentController &segments = fs->superblock->segment_controller;
+		const uint64_t used_before = used_chunks(segments);
+
+		// every copy is followed by a file of its own, so the copies end up spread out
+		for (int i = 0; i < 8; ++i) {
+			std::shared_ptr<INode> file = fs->superblock->inode_table->alloc_inode();
+			REQUIRE(file->write(0, &shared[0], shared.size()) == shared.size());
+			file_idxs.push_back(file->inode_table_idx);
+
+			std::shared_ptr<INode> filler = fs->superblock->inode_table->alloc_inode();
+			std::vector<char> contents = get_random_buffer(30 * chunk_size);
+			REQUIRE(filler->write(0, &contents[0], contents.size()) == contents.size());
+			filler_idxs.push_back(filler->inode_table_idx);
 		}
-		to_write.push_back('\0');
 
-		std::vector<char> read_back;
-		read_back.resize(to_write.size());
+		DedupIndex::Stats stats = fs->superblock->dedup_index->stats();
+		REQUIRE(stats.indexed_chunks == 30 + 8 * 30);
+		REQUIRE(stats.shared_chunks == 30);
+		REQUIRE(stats.references == 8 * 30 + 8 * 30);
+		REQUIRE(stats.duplicates == 7 * 30);
+		REQUIRE(stats.memory_bytes > 0);
+		// the copies take up no chunks of their own, only their indirection tables
+		REQUIRE(used_chunks(segments) - used_before < 9 * 30 + 8 * 4);
+
+		for (uint64_t idx : file_idxs) {
+			REQUIRE(read_all(*fs->superblock->inode_table->get_inode(idx)) == shared);
+		}
 
-		REQUIRE(inode.write(offset, &(to_write[0]), length) == length);
-		REQUIRE(inode.read(offset, &(read_back[0]), length) == length);
-		
-		REQUIRE(strcmp(&to_write[0], &read_back[0]) == 0);
+		// writing to a copy gives it its own chunk again, the others keep theirs
+		{
+			std::shared_ptr<INode> file = fs->superblock->inode_table->get_inode(file_idxs[7]);
+			REQUIRE(file->write(5 * chunk_size + 10, "changed", 7) == 7);
+		}
+		REQUIRE(fs->superblock->dedup_index->stats().references == 8 * 30 + 8 * 30 - 1);
+		REQUIRE(read_all(*fs->superblock->inode_table->get_inode(file_idxs[6])) == shared);
+		fs = nullptr;
+		disk->flush_all();
+	}
+	std::vector<char> changed = shared;
+	memcpy(&changed[5 * chunk_size + 10], "changed", 7);
+
+	auto mount = [&](std::function<void(FileSystem &)> work) {
+		std::unique_ptr<Disk> disk(new Disk(chunk_count, chunk_size, make_disk_backend("pread", fd, chunk_count * chunk_size)));
+		std::unique_ptr<FileSystem> fs(new FileSystem(disk.get()));
+		fs->superblock->load_from_disk();
+		work(*fs);
+		fs = nullptr;
+		disk->flush_all();
 	};
 
-	SECTION("An aggressively random test ;) -- I'm a firin mah lazors") {
-		std::unique_ptr<Disk> disk(new Disk(100 * 1024, 512));
+	// the index comes back with the file system, and the fillers and the first 
+	// copy (whose inode the shared chunks are recorded under) are deleted
+	mount([&](FileSystem &fs) {
+		REQUIRE(fs.superblock->dedup);
+		DedupIndex::Stats stats = fs.superblock->dedup_index->stats();
+		REQUIRE(stats.indexed_chunks == 30 + 8 * 30);
+		REQUIRE(stats.references == 8 * 30 + 8 * 30 - 1);
+
+		for (uint64_t idx : filler_idxs) {
+			fs.superblock->inode_table->get_inode(idx)->release_chunks();
+		}
+		fs.superblock->inode_table->get_inode(file_idxs[0])->release_chunks();
+		stats = fs.superblock->dedup_index->stats();
+		REQUIRE(stats.indexed_chunks == 30);
+		REQUIRE(stats.references == 7 * 30 - 1);
+	});
+
+	// the cleaner moves the shared chunks, every copy has to follow
+	mount([&](FileSystem &fs) {
+		fs.superblock->segment_controller.clean();
+		for (size_t i = 1; i < 7; ++i) {
+			REQUIRE(read_all(*fs.superblock->inode_table->get_inode(file_idxs[i])) == shared);
+		}
+		REQUIRE(read_all(*fs.superblock->inode_table->get_inode(file_idxs[7])) == changed);
+	});
+
+	mount([&](FileSystem &fs) {
+		for (size_t i = 1; i < 7; ++i) {
+			REQUIRE(read_all(*fs.superblock->inode_table->get_inode(file_idxs[i])) == shared);
+		}
+		REQUIRE(fs.superblock->dedup_index->stats().references == 7 * 30 - 1);
+	});
+
+	// mkfs over the image starts an empty index, the table the old file system 
+	// left behind is not zeroed but none of it may be read back
+	{
+		std::unique_ptr<Disk> disk(new Disk(chunk_count, chunk_size, make_disk_backend("pread", fd, chunk_count * chunk_size)));
 		std::unique_ptr<FileSystem> fs(new FileSystem(disk.get()));
+		fs->superblock->dedup = true;
 		fs->superblock->init(0.1);
-		
-		uint64_t seed = std::time(0);
-		fprintf(stdout, "SRAND SEED WAS 0x%x\n", seed);
-		srand(seed);
+		REQUIRE(fs->superblock->dedup_index->stats().indexed_chunks == 0);
+		fs = nullptr;
+		disk->flush_all();
+	}
+	mount([&](FileSystem &fs) {
+		REQUIRE(fs.superblock->dedup_index->stats().indexed_chunks == 0);
+		std::shared_ptr<INode> file = fs.superblock->inode_table->alloc_inode();
+		REQUIRE(file->write(0, &shared[0], shared.size()) == shared.size());
+		REQUIRE(fs.superblock->dedup_index->stats().indexed_chunks == 30);
+		REQUIRE(fs.superblock->dedup_index->stats().shared_chunks == 0);
+	});
+}
+
+TEST_CASE( "A shared chunk whose first writer is deleted follows the last copy when cleaned", "[filesystem][dedup]" ) {
+	const uint64_t chunk_size = 4096;
+	const uint64_t chunk_count = 4096;
+	ScratchFile image(chunk_count * chunk_size);
+	const int fd = image.fd;
+
+	std::vector<char> shared = get_random_buffer(30 * chunk_size);
+	auto read_all = [](INode &file) {
+		std::vector<char> read_back(file.data.file_size);
+		file.read(0, &read_back[0], read_back.size());
+		return read_back;
+	};
+
+	uint64_t survivor_idx = 0;
+	{
+		std::unique_ptr<Disk> disk(new Disk(chunk_count, chunk_size, make_disk_backend("pread", fd, chunk_count * chunk_size)));
+		std::unique_ptr<FileSystem> fs(new FileSystem(disk.get()));
+		fs->superblock->dedup = true;
+		fs->superblock->init(0.1);
+		INodeTable &inode_table = *fs->superblock->inode_table;
+
+		// the first copy owns the shared chunks in the segment summaries
+		std::vector<std::shared_ptr<INode>> fillers;
+		std::shared_ptr<INode> first = inode_table.alloc_inode();
+		REQUIRE(first->write(0, &shared[0], shared.size()) == shared.size());
+		for (int i = 0; i < 4; ++i) {
+			fillers.push_back(inode_table.alloc_inode());
+			std::vector<char> contents = get_random_buffer(30 * chunk_size);
+			REQUIRE(fillers.back()->write(0, &contents[0], contents.size()) == contents.size());
+		}
+		std::shared_ptr<INode> survivor = inode_table.alloc_inode();
+		REQUIRE(survivor->write(0, &shared[0], shared.size()) == shared.size());
+		survivor_idx = survivor->inode_table_idx;
+		survivor = nullptr;
+		REQUIRE(fs->superblock->dedup_index->stats().shared_chunks == 30);
+
+		// the summaries stop naming the first copy as the owner, the second was 
+		// never named
+		SegmentController &segments = fs->superblock->segment_controller;
+		const uint64_t shared_idx = first->data.addresses[0];
+		const uint64_t sn = (shared_idx - segments.data_offset) / segments.segment_size;
+		REQUIRE(segments.get_segment_chunk_to_inode(sn, shared_idx - segments.data_offset - sn * segments.segment_size) == 
+			SegmentController::SHARED_CHUNK_OWNER);
+
+		// deleted the way unlink does it. only one copy is left, and its chunks are 
+		// still recorded under the deleted one
+		first->release_chunks();
+		for (std::shared_ptr<INode> &filler : fillers) {
+			filler->release_chunks();
+		}
+		first = nullptr;
+		fillers.clear();
+		REQUIRE(fs->superblock->dedup_index->stats().references == 30);
+
+		fs->superblock->segment_controller.clean();
+		REQUIRE(read_all(*inode_table.get_inode(survivor_idx)) == shared);
+
+		// new files reuse the segments the chunks were moved out of
+		for (int i = 0; i < 8; ++i) {
+			std::shared_ptr<INode> file = inode_table.alloc_inode();
+			std::vector<char> contents = get_random_buffer(30 * chunk_size);
+			REQUIRE(file->write(0, &contents[0], contents.size()) == contents.size());
+		}
+		REQUIRE(read_all(*inode_table.get_inode(survivor_idx)) == shared);
+		fs = nullptr;
+		disk->flush_all();
+	}
 
-		int64_t bytes_to_write = (uint64_t) (disk->size_bytes() * 0.08); // good margin to write
+	std::unique_ptr<Disk> disk(new Disk(chunk_count, chunk_size, make_disk_backend("pread", fd, chunk_count * chunk_size)));
+	std::unique_ptr<FileSystem> fs(new FileSystem(disk.get()));
+	fs->superblock->load_from_disk();
+	REQUIRE(read_all(*fs->superblock->inode_table->get_inode(survivor_idx)) == shared);
+	fs = nullptr;
+	disk->flush_all();
+}
 
-		while (bytes_to_write > 0) {
+TEST_CASE( "The cleaner only updates the files that point at a shared chunk", "[filesystem][dedup][cleaning]" ) {
+	const uint64_t chunk_size = 4096;
+	const uint64_t chunk_count = 4096;
+	ScratchFile image(chunk_count * chunk_size);
+	const int fd = image.fd;
+
+	std::vector<char> shared = get_random_buffer(8 * chunk_size);
+	auto read_all = [](INode &file) {
+		std::vector<char> read_back(file.data.file_size);
+		file.read(0, &read_back[0], read_back.size());
+		return read_back;
+	};
+	auto write_fillers = [&](INodeTable &inode_table, std::vector<uint64_t> &filler_idxs) {
+		for (int i = 0; i < 4; ++i) {
+			std::shared_ptr<INode> filler = inode_table.alloc_inode();
+			std::vector<char> contents = get_random_buffer(30 * chunk_size);
+			REQUIRE(filler->write(0, &contents[0], contents.size()) == contents.size());
+			filler_idxs.push_back(filler->inode_table_idx);
+		}
+	};
+	auto delete_fillers = [](INodeTable &inode_table, std::vector<uint64_t> &filler_idxs) {
+		for (uint64_t idx : filler_idxs) {
+			inode_table.get_inode(idx)->release_chunks();
+		}
+		filler_idxs.clear();
+	};
 
-			std::shared_ptr<INode> inode = fs->superblock->inode_table->alloc_inode();
-			REQUIRE(inode->superblock->disk == disk.get());
-
-			for (int j = rand() % 100; j > 0; --j) { // write up to 8 segments to the same inode
-				uint64_t bytes = rand() % 5000;
-				uint64_t offset = rand() % 25000;
-				test_inode(*inode, offset, bytes);
-				bytes_to_write -= (bytes / disk->chunk_size() + 1) * disk->chunk_size();
-				//std::cout << "wrote " << bytes << " bytes at offset " << offset << std::endl;
+	std::vector<uint64_t> copy_idxs;
+	std::vector<uint64_t> filler_idxs;
+	{
+		std::unique_ptr<Disk> disk(new Disk(chunk_count, chunk_size, make_disk_backend("pread", fd, chunk_count * chunk_size)));
+		std::unique_ptr<FileSystem> fs(new FileSystem(disk.get()));
+		fs->superblock->dedup = true;
+		fs->superblock->init(0.1);
+		INodeTable &inode_table = *fs->superblock->inode_table;
+		DedupIndex &index = *fs->superblock->dedup_index;
+
+		// three copies among many files that share nothing
+		for (int i = 0; i < 3; ++i) {
+			std::shared_ptr<INode> copy = inode_table.alloc_inode();
+			REQUIRE(copy->write(0, &shared[0], shared.size()) == shared.size());
+			copy_idxs.push_back(copy->inode_table_idx);
+			write_fillers(inode_table, filler_idxs);
+			for (int j = 0; j < 100; ++j) {
+				std::shared_ptr<INode> file = inode_table.alloc_inode();
+				std::vector<char> contents = get_random_buffer(chunk_size);
+				REQUIRE(file->write(0, &contents[0], contents.size()) == contents.size());
 			}
 		}
+		REQUIRE(index.knows_referrers());
+		REQUIRE(index.referrers_of({inode_table.get_inode(copy_idxs[0])->data.addresses[0]}) == copy_idxs);
+
+		delete_fillers(inode_table, filler_idxs);
+		fs->superblock->segment_controller.clean();
+		for (uint64_t idx : copy_idxs) {
+			REQUIRE(read_all(*inode_table.get_inode(idx)) == shared);
+		}
+		write_fillers(inode_table, filler_idxs);
+		fs = nullptr;
+		disk->flush_all();
 	}
+
+	// after mount they are not known until the cleaner first needs them, then 
+	// they are found by looking through every file once
+	std::unique_ptr<Disk> disk(new Disk(chunk_count, chunk_size, make_disk_backend("pread", fd, chunk_count * chunk_size)));
+	std::unique_ptr<FileSystem> fs(new FileSystem(disk.get()));
+	fs->superblock->load_from_disk();
+	INodeTable &inode_table = *fs->superblock->inode_table;
+	DedupIndex &index = *fs->superblock->dedup_index;
+	REQUIRE_FALSE(index.knows_referrers());
+
+	delete_fillers(inode_table, filler_idxs);
+	fs->superblock->segment_controller.clean();
+	REQUIRE(index.knows_referrers());
+	REQUIRE(index.referrers_of({inode_table.get_inode(copy_idxs[0])->data.addresses[0]}) == copy_idxs);
+	for (uint64_t idx : copy_idxs) {
+		REQUIRE(read_all(*inode_table.get_inode(idx)) == shared);
+	}
+	fs = nullptr;
+	disk->flush_all();
 }
 
+TEST_CASE( "Segments are initialized as they are first used rather than by mkfs", "[filesystem][lazyinit]" ) {
+	const uint64_t chunk_size = 4096;
+	const uint64_t chunk_count = 4096;
+	ScratchFile image(0);
+	const int fd = image.fd;
+	// whatever was on the device before
+	std::vector<char> garbage(chunk_count * chunk_size, (char)0xA5);
+	REQUIRE(pwrite(fd, &garbage[0], garbage.size(), 0) == (ssize_t)garbage.size());
+
+	std::vector<char> contents = get_random_buffer(600 * chunk_size);
+	uint64_t file_idx = 0;
+	uint64_t initialized = 0;
+	uint64_t last_summary_idx = 0;
+	{
+		std::unique_ptr<Disk> disk(new Disk(chunk_count, chunk_size, make_disk_backend("pread", fd, chunk_count * chunk_size)));
+		std::unique_ptr<FileSystem> fs(new FileSystem(disk.get()));
+		fs->superblock->init(0.1);
+		SegmentController &segments = fs->superblock->segment_controller;
+		REQUIRE(segments.initialized_segments == 1);
+		// the root directory is in the first of them
+		REQUIRE(segments.num_free_segments == segments.num_segments - 1);
+		last_summary_idx = segments.data_offset + (segments.num_segments - 1) * segments.segment_size;
+
+		std::shared_ptr<INode> file = fs->superblock->inode_table->alloc_inode();
+		REQUIRE(file->write(0, &contents[0], contents.size()) == contents.size());
+		file_idx = file->inode_table_idx;
+		initialized = segments.initialized_segments;
+		REQUIRE(initialized >= 600 / segments.segment_size + 1);
+		REQUIRE(initialized < segments.num_segments);
+		file = nullptr;
+		fs = nullptr;
+		disk->flush_all();
+	}
+
+	// the summary of a segment that was never used is left as it was
+	std::vector<char> summary(chunk_size);
+	REQUIRE(pread(fd, &summary[0], chunk_size, last_summary_idx * chunk_size) == (ssize_t)chunk_size);
+	REQUIRE(summary == std::vector<char>(chunk_size, (char)0xA5));
+
+	{
+		std::unique_ptr<Disk> disk(new Disk(chunk_count, chunk_size, make_disk_backend("pread", fd, chunk_count * chunk_size)));
+		std::unique_ptr<FileSystem> fs(new FileSystem(disk.get()));
+		fs->superblock->load_from_disk();
+		SegmentController &segments = fs->superblock->segment_controller;
+		// the ones it was using are all taken, so a mount starts on the next
+		REQUIRE(segments.initialized_segments == initialized + 1);
+		REQUIRE(segments.current_segment == initialized);
+		REQUIRE(segments.compression_stats().chunks == 0);
+
+		std::shared_ptr<INode> file = fs->superblock->inode_table->get_inode(file_idx);
+		std::vector<char> read_back(contents.size());
+		file->read(0, &read_back[0], read_back.size());
+		REQUIRE(read_back == contents);
+		REQUIRE(disk->cache_stats().checksum_failures == 0);
+
+		// and the next one is taken from where they stop
+		std::shared_ptr<INode> other = fs->superblock->inode_table->alloc_inode();
+		REQUIRE(other->write(0, &contents[0], 300 * chunk_size) == 300 * chunk_size);
+		REQUIRE(segments.initialized_segments > initialized + 1);
+		other->read(0, &read_back[0], 300 * chunk_size);
+		REQUIRE(std::equal(read_back.begin(), read_back.begin() + 300 * chunk_size, contents.begin()));
+		file = nullptr;
+		other = nullptr;
+		fs = nullptr;
+	}
+
+}
+
+TEST_CASE( "Metadata can be pinned in memory at mount", "[filesystem][pin]" ) {
+	std::unique_ptr<Disk> disk(new Disk(4096, 4096));
+	{
+		std::unique_ptr<FileSystem> fs(new FileSystem(disk.get()));
+		fs->superblock->init(0.1);
+	}
+	disk->flush_all();
 
-TEST_CASE("INode write all, then readback all, reconstruct disk, and then do it again!!!", "[filesystem][readwrite][readwrite.rwrecon]") {
-	std::unique_ptr<Disk> disk(new Disk(100 * 1024, 512));
+	std::unique_ptr<FileSystem> fs(new FileSystem(disk.get()));
+	fs->superblock->load_from_disk(true);
+
+	// everything in front of the ilist plus one summary chunk per segment taken so far
+	Disk::CacheStats stats = disk->cache_stats();
+	REQUIRE(stats.pinned_chunks == fs->superblock->inode_table->inode_ilist_offset + 
+		fs->superblock->segment_controller.initialized_segments);
+
+	// the file system works as usual on top of the pinned chunks
+	std::shared_ptr<INode> inode = fs->superblock->inode_table->alloc_inode();
+	std::vector<char> to_write(3 * 4096 + 17, 'p');
+	inode->write(0, &to_write[0], to_write.size());
+
+	std::vector<char> read_back(to_write.size());
+	inode->read(0, &read_back[0], read_back.size());
+	REQUIRE(read_back == to_write);
+
+	disk->unpin_all();
+	REQUIRE(disk->cache_stats().pinned_chunks == 0);
+}
+
+TEST_CASE( "The chunks that were hot at unmount are read back in at mount", "[filesystem][warmset]" ) {
+	const uint64_t chunk_size = 4096;
+	const uint64_t chunk_count = 4096;
+	ScratchFile image(chunk_count * chunk_size);
+	const int fd = image.fd;
+
+	std::vector<char> contents = get_random_buffer(20 * chunk_size);
+	uint64_t file_idx = 0;
+	uint64_t data_chunk = 0;
+	{
+		std::unique_ptr<Disk> disk(new Disk(chunk_count, chunk_size, make_disk_backend("pread", fd, chunk_count * chunk_size)));
+		std::unique_ptr<FileSystem> fs(new FileSystem(disk.get()));
+		fs->superblock->init(0.1);
+		REQUIRE(fs->superblock->warm_set_size_chunks == 1);
+
+		std::shared_ptr<INode> file = fs->superblock->inode_table->alloc_inode();
+		REQUIRE(file->write(0, &contents[0], contents.size()) == contents.size());
+		file_idx = file->inode_table_idx;
+		data_chunk = file->lookup_chunk_idx(3);
+		file = nullptr;
+		// the warm set is saved as the file system goes away
+		fs = nullptr;
+		REQUIRE(disk->cache_stats().warm_set_saves == 1);
+	}
+
+	{
+		std::unique_ptr<Disk> disk(new Disk(chunk_count, chunk_size, make_disk_backend("pread", fd, chunk_count * chunk_size)));
+		std::unique_ptr<FileSystem> fs(new FileSystem(disk.get()));
+		fs->superblock->load_from_disk();
+		disk->wait_for_readahead();
+		Disk::CacheStats stats = disk->cache_stats();
+		REQUIRE(stats.warm_set_prefetched > 20);
+		REQUIRE(stats.readahead_chunks > 0);
+
+		// the file's data was not read by the mount itself
+		disk->get_chunk(data_chunk);
+		REQUIRE(disk->cache_stats().readahead_hits == stats.readahead_hits + 1);
+
+		std::shared_ptr<INode> file = fs->superblock->inode_table->get_inode(file_idx);
+		std::vector<char> read_back(contents.size());
+		file->read(0, &read_back[0], read_back.size());
+		REQUIRE(read_back == contents);
+		file = nullptr;
+		fs = nullptr;
+	}
+
+}
+
+TEST_CASE("INode read/write test", "[filesystem][readwritem][readwrite.orderly]") {
+	for (uint64_t chunk_size : TESTED_CHUNK_SIZES) {
+		DYNAMIC_SECTION("with " << chunk_size << " byte chunks") {
+			const auto test_inode = [chunk_size](int offset, int length) {
+				std::unique_ptr<Disk> disk(new Disk(chunk_count_for(chunk_size, 1024 * 512), chunk_size));
+				std::vector<char> read_back;
+
+				std::vector<char> to_write = get_random_buffer(length);
+				int64_t inode_idx = 0;
+
+				to_write.push_back('\0');
+				{
+					std::unique_ptr<FileSystem> fs(new FileSystem(disk.get()));
+					fs->superblock->init(0.1);
+
+					read_back.resize(to_write.size());
+			
+					std::shared_ptr<INode> inode = fs->superblock->inode_table->alloc_inode();
+					inode_idx = inode->inode_table_idx;
+
+					inode->superblock = fs->superblock.get();
+					REQUIRE(inode->superblock->disk == disk.get());
+
+					REQUIRE(inode->write(offset, &(to_write[0]), length) == length);
+					REQUIRE(inode->read(offset, &(read_back[0]), length) == length);
+
+					REQUIRE(strcmp(&to_write[0], &read_back[0]) == 0);
+
+					// NOTE: the order that these are nulled in IS important
+					inode = nullptr;
+					fs = nullptr;
+				}
+
+				{
+					std::unique_ptr<FileSystem> fs(new FileSystem(disk.get()));
+					fs->superblock->load_from_disk();
+					ChunkRef page0 = disk->get_chunk(0);
+
+					std::vector<char> read_back1;
+					read_back1.resize(to_write.size());
+
+					std::shared_ptr<INode> inode = fs->superblock->inode_table->get_inode(inode_idx);
+					inode->superblock = fs->superblock.get();
+					REQUIRE(inode->superblock->disk == disk.get());
+			
+					REQUIRE(inode->read(offset, &(read_back1[0]), length) == length);
+					REQUIRE(strcmp(&to_write[0], &read_back1[0]) == 0);
+
+					inode = nullptr;
+					fs = nullptr;
+				}
+			};
+
+
+			// with chunks larger than 4 KB every offset and length below falls in 
+			// the first chunk, a sample of them covers as much
+			const int step = std::max<int>(1, chunk_size / 4096);
+
+			SECTION("Can write strings of length 1 - 5000") {
+				std::cout << "RUNNING MY TEST, WRITING 100000 BYTES" << std::endl;
+				test_inode(0, 100000);
+			}
+
+			SECTION("Can write strings of length 1 - 5000") {
+				for (int i = 0; i < 5000; i += step) {
+					test_inode(0, i);
+				}
+			}
+
+			SECTION("Can write strings of length 100 at offsets 1 - 5000") {
+				for (int i = 0; i < 5000; i += step) {
+					test_inode(i, 100);
+				}
+			}
+
+			SECTION("Can write strings of length 1000 at offsets 1 - 5000") {
+				for (int i = 0; i < 5000; i += step) {
+					test_inode(i, 1000);
+				}
+			}
+
+			SECTION("Can write strings of length 5000 at offsets 1 - 5000") {
+				for (int i = 0; i < 5000; i += step) {
+					test_inode(i, 5000);
+				}
+			}
+		}
+	}
+}
+
+TEST_CASE("INode reads stop at the end of the file", "[filesystem][readwrite]") {
+	std::unique_ptr<Disk> disk(new Disk(1024, 512));
 	std::unique_ptr<FileSystem> fs(new FileSystem(disk.get()));
 	fs->superblock->init(0.1);
 
-	const size_t FILE_SIZE = 250 * 1024; // 100 kb
 	std::shared_ptr<INode> inode = fs->superblock->inode_table->alloc_inode();
-	assert(inode->superblock == fs->superblock.get());
+	std::vector<char> contents = get_random_buffer(1300);
+	REQUIRE(inode->write(0, &contents[0], contents.size()) == contents.size());
+
+	std::vector<char> read_back(4096, 'x');
+	SECTION("a read across several chunks returns what is left of the file") {
+		REQUIRE(inode->read(0, &read_back[0], 4096) == 1300);
+		REQUIRE(std::equal(contents.begin(), contents.end(), read_back.begin()));
+		REQUIRE(read_back[1300] == 'x');
+	}
 
-	std::unique_ptr<char[]> mem_file(new char[FILE_SIZE]);
-	std::unique_ptr<char[]> mem_file_readback(new char[FILE_SIZE]);
-	std::memset((void *)mem_file.get(), 0, FILE_SIZE);
-	std::memset((void *)mem_file_readback.get(), 0, FILE_SIZE);
+	SECTION("so does one that starts in the middle") {
+		REQUIRE(inode->read(1000, &read_back[0], 2000) == 300);
+		REQUIRE(std::equal(contents.begin() + 1000, contents.end(), read_back.begin()));
+		REQUIRE(read_back[300] == 'x');
+	}
 
-	for (size_t idx = 0; idx < 2000; ++idx) {
-		size_t size = rand() % (2 * 1024);
-		size_t offset = rand() % (FILE_SIZE - size);
-		// std::cout << "writing size: " << size << " bytes at offset: " << offset << std::endl;
-		std::vector<char> buffer = get_random_buffer(size);
-		REQUIRE(inode->write(offset, &(buffer[0]), size) == size);
-		std::memcpy((void *)(mem_file.get() + offset), &(buffer[0]), size);
+	SECTION("a read at the end of the file returns nothing") {
+		REQUIRE(inode->read(1300, &read_back[0], 100) == 0);
+		REQUIRE(read_back[0] == 'x');
 	}
 
-	// NOTE: YOU MUST WRITE INODES BACK OUT WHEN YOU ARE DONE WITH THEM 
-	inode->data.file_size = FILE_SIZE;
-	uint64_t inode_table_idx = inode->inode_table_idx;
 	inode = nullptr;
+}
+
+TEST_CASE("INodes are only freed once no one else can get hold of them", "[filesystem][inodes][threads]") {
+	std::unique_ptr<Disk> disk(new Disk(1024, 512));
+	std::unique_ptr<FileSystem> fs(new FileSystem(disk.get()));
+	fs->superblock->init(0.1);
+	INodeTable &inode_table = *fs->superblock->inode_table;
+
+	std::shared_ptr<INode> inode = inode_table.alloc_inode();
+	const uint64_t idx = inode->inode_table_idx;
 
-	inode = fs->superblock->inode_table->get_inode(inode_table_idx);
+	SECTION("an inode someone else holds is not freed, and can still be found") {
+		std::shared_ptr<INode> other = inode_table.get_inode(idx);
+		REQUIRE_THROWS_AS(inode_table.free_inode(std::move(inode)), FileSystemException);
+		REQUIRE(inode_table.get_inode(idx) == other);
+		inode_table.free_inode(std::move(other));
+		REQUIRE_THROWS_AS(inode_table.get_inode(idx), FileSystemException);
+	}
 
-	REQUIRE(inode->read(0, mem_file_readback.get(), FILE_SIZE) == FILE_SIZE);
-	for (size_t i = 0; i < FILE_SIZE; ++i) {
-		unsigned char *foo = (unsigned char *)&(mem_file_readback.get()[i]);
-		std::cout << mem_file.get()[i] << " =?= " << mem_file_readback.get()[i] << " (" << (unsigned int)(*foo) << ")";
-		if (mem_file.get()[i] != mem_file_readback.get()[i]) {
-			std::cout << "------------ LOOK HERE DUMMY ---------";
+	SECTION("lookups racing the free either get it before or not at all") {
+		std::atomic<bool> freed {false};
+		std::atomic<uint64_t> found_after_free {0};
+		std::thread reader([&]() {
+			for (int round = 0; round < 100000 && !freed; ++round) {
+				try {
+					std::shared_ptr<INode> found = inode_table.get_inode(idx);
+					if (freed) 
+						found_after_free++;
+				} catch (const FileSystemException &e) {
+					// freed and gone, as it should be
+				}
+			}
+		});
+		for (;;) {
+			try {
+				inode_table.free_inode(std::move(inode));
+				break ;
+			} catch (const FileSystemException &e) {
+				// the reader has it right now
+				inode = inode_table.get_inode(idx);
+				std::this_thread::yield();
+			}
 		}
-		std::cout << std::endl;
-		// REQUIRE(mem_file.get()[i] == mem_file_readback.get()[i]);
+		freed = true;
+		reader.join();
+		REQUIRE(found_after_free == 0);
+		REQUIRE_THROWS_AS(inode_table.get_inode(idx), FileSystemException);
 	}
-	// REQUIRE(std::memcmp(mem_file.get(), mem_file_readback.get(), FILE_SIZE) == 0);
 }
 
-TEST_CASE("Smaller version of INode write all, then readback all, reconstruct disk, and then do it again!!! but using a very high base offset", "[filesystem][readwrite][readwrite.rwrecon]") {
-	const auto get_random_buffer = [](size_t size, bool nullTerminate = false) -> std::vector<char> {
-		std::vector<char> buf;
-		buf.reserve(size + 1);
-		for (size_t i = 0; i < size; ++i) {
-			buf.push_back('a' + rand() % 26);
-		}
-		buf.push_back('\0');
-		return std::move(buf);
-	};
-
-	std::unique_ptr<Disk> disk(new Disk(10 * 1024, 512));
+TEST_CASE("Freeing a chunk waits for the disk's own threads to let go of it", "[filesystem][threads]") {
+	std::unique_ptr<Disk> disk(new Disk(1024, 512));
 	std::unique_ptr<FileSystem> fs(new FileSystem(disk.get()));
 	fs->superblock->init(0.1);
 
-	const size_t BASE_OFFSET = 1024 * 1024;
-	const size_t FILE_SIZE = 25 * 1024; // 100 kb
 	std::shared_ptr<INode> inode = fs->superblock->inode_table->alloc_inode();
-	assert(inode->superblock == fs->superblock.get());
+	std::vector<char> contents = get_random_buffer(3 * 512);
+	REQUIRE(inode->write(0, &contents[0], contents.size()) == contents.size());
+	const uint64_t chunk_idx = inode->data.addresses[1];
+
+	// as readahead or a writeback pass would, for a moment
+	std::atomic<bool> holding {false};
+	std::thread holder([&]() {
+		ChunkRef held = disk->get_chunk(chunk_idx);
+		holding = true;
+		std::this_thread::sleep_for(std::chrono::milliseconds(50));
+	});
+	while (!holding) {
+		std::this_thread::yield();
+	}
+	REQUIRE_NOTHROW(inode->release_chunks());
+	holder.join();
+
+	SegmentController &segments = fs->superblock->segment_controller;
+	const uint64_t sn = (chunk_idx - segments.data_offset) / segments.segment_size;
+	REQUIRE(segments.get_segment_chunk_to_inode(sn, chunk_idx - segments.data_offset - sn * segments.segment_size) == 0);
+	inode = nullptr;
+}
+
+TEST_CASE("INode read/write test with random patterns", "[filesystem][readwrite][readwrite.random]") {
+	for (uint64_t chunk_size : TESTED_CHUNK_SIZES) {
+		DYNAMIC_SECTION("with " << chunk_size << " byte chunks") {
+			const auto test_inode = [](INode& inode, int offset, int length) {
+				std::vector<char> to_write;
 
-	std::unique_ptr<char[]> mem_file(new char[FILE_SIZE]);
-	std::unique_ptr<char[]> mem_file_readback(new char[FILE_SIZE]);
-	std::memset((void *)mem_file.get(), 0, FILE_SIZE);
-	std::memset((void *)mem_file_readback.get(), 0, FILE_SIZE);
+				for (int i = 0; i < length; ++i) {
+					to_write.push_back('a' + (rand() % 26));
+				}
+				to_write.push_back('\0');
 
-	for (size_t idx = 0; idx < 1000; ++idx) {
-		size_t size = rand() % (1 * 1024);
-		size_t offset = rand() % (FILE_SIZE - size) + BASE_OFFSET;
-		// std::cout << "writing size: " << size << " bytes at offset: " << offset << std::endl;
-		std::vector<char> buffer = get_random_buffer(size);
-		REQUIRE(inode->write(offset, &(buffer[0]), size) == size);
-		std::memcpy((void *)(mem_file.get() + offset - BASE_OFFSET), &(buffer[0]), size);
+				std::vector<char> read_back;
+				read_back.resize(to_write.size());
+
+				REQUIRE(inode.write(offset, &(to_write[0]), length) == length);
+				REQUIRE(inode.read(offset, &(read_back[0]), length) == length);
+		
+				REQUIRE(strcmp(&to_write[0], &read_back[0]) == 0);
+			};
+
+			SECTION("An aggressively random test ;) -- I'm a firin mah lazors") {
+				std::unique_ptr<Disk> disk(new Disk(chunk_count_for(chunk_size, 100 * 1024 * 512), chunk_size));
+				std::unique_ptr<FileSystem> fs(new FileSystem(disk.get()));
+				fs->superblock->init(0.1);
+		
+				uint64_t seed = std::time(0);
+				fprintf(stdout, "SRAND SEED WAS 0x%x\n", seed);
+				srand(seed);
+
+				int64_t bytes_to_write = (uint64_t) (disk->size_bytes() * 0.08); // good margin to write
+
+				while (bytes_to_write > 0) {
+
+					std::shared_ptr<INode> inode = fs->superblock->inode_table->alloc_inode();
+					REQUIRE(inode->superblock->disk == disk.get());
+
+					for (int j = rand() % 100; j > 0; --j) { // write up to 8 segments to the same inode
+						uint64_t bytes = rand() % 5000;
+						uint64_t offset = rand() % 25000;
+						test_inode(*inode, offset, bytes);
+						bytes_to_write -= (bytes / disk->chunk_size() + 1) * disk->chunk_size();
+						//std::cout << "wrote " << bytes << " bytes at offset " << offset << std::endl;
+					}
+				}
+			}
+		}
 	}
+}
 
-	REQUIRE(inode->read(BASE_OFFSET, mem_file_readback.get(), FILE_SIZE) == FILE_SIZE);
-	REQUIRE(std::memcmp(mem_file.get(), mem_file_readback.get(), FILE_SIZE) == 0);
 
-	// rebuild the filesystem and make sure that it is still the same :) 
-	uint64_t inode_idx = inode->inode_table_idx;
-	inode = nullptr;
-	fs = nullptr;
-	fs = std::unique_ptr<FileSystem>(new FileSystem(disk.get()));
-	fs->superblock->load_from_disk();
+TEST_CASE("INode write all, then readback all, reconstruct disk, and then do it again!!!", "[filesystem][readwrite][readwrite.rwrecon]") {
+	for (uint64_t chunk_size : TESTED_CHUNK_SIZES) {
+		DYNAMIC_SECTION("with " << chunk_size << " byte chunks") {
+			std::unique_ptr<Disk> disk(new Disk(chunk_count_for(chunk_size, 100 * 1024 * 512), chunk_size));
+			std::unique_ptr<FileSystem> fs(new FileSystem(disk.get()));
+			fs->superblock->init(0.1);
+
+			const size_t FILE_SIZE = 250 * 1024; // 100 kb
+			std::shared_ptr<INode> inode = fs->superblock->inode_table->alloc_inode();
+			assert(inode->superblock == fs->superblock.get());
+
+			std::unique_ptr<char[]> mem_file(new char[FILE_SIZE]);
+			std::unique_ptr<char[]> mem_file_readback(new char[FILE_SIZE]);
+			std::memset((void *)mem_file.get(), 0, FILE_SIZE);
+			std::memset((void *)mem_file_readback.get(), 0, FILE_SIZE);
+
+			for (size_t idx = 0; idx < 2000; ++idx) {
+				size_t size = rand() % (2 * 1024);
+				size_t offset = rand() % (FILE_SIZE - size);
+				// std::cout << "writing size: " << size << " bytes at offset: " << offset << std::endl;
+				std::vector<char> buffer = get_random_buffer(size);
+				REQUIRE(inode->write(offset, &(buffer[0]), size) == size);
+				std::memcpy((void *)(mem_file.get() + offset), &(buffer[0]), size);
+			}
+
+			// NOTE: YOU MUST WRITE INODES BACK OUT WHEN YOU ARE DONE WITH THEM 
+			inode->data.file_size = FILE_SIZE;
+			uint64_t inode_table_idx = inode->inode_table_idx;
+			inode = nullptr;
+
+			inode = fs->superblock->inode_table->get_inode(inode_table_idx);
+
+			REQUIRE(inode->read(0, mem_file_readback.get(), FILE_SIZE) == FILE_SIZE);
+			REQUIRE(std::memcmp(mem_file.get(), mem_file_readback.get(), FILE_SIZE) == 0);
+		}
+	}
+}
+
+TEST_CASE("Smaller version of INode write all, then readback all, reconstruct disk, and then do it again!!! but using a very high base offset", "[filesystem][readwrite][readwrite.rwrecon]") {
+	for (uint64_t chunk_size : TESTED_CHUNK_SIZES) {
+		DYNAMIC_SECTION("with " << chunk_size << " byte chunks") {
+			const auto get_random_buffer = [](size_t size, bool nullTerminate = false) -> std::vector<char> {
+				std::vector<char> buf;
+				buf.reserve(size + 1);
+				for (size_t i = 0; i < size; ++i) {
+					buf.push_back('a' + rand() % 26);
+				}
+				buf.push_back('\0');
+				return std::move(buf);
+			};
+
+			std::unique_ptr<Disk> disk(new Disk(chunk_count_for(chunk_size, 10 * 1024 * 512), chunk_size));
+			std::unique_ptr<FileSystem> fs(new FileSystem(disk.get()));
+			fs->superblock->init(0.1);
+
+			const size_t BASE_OFFSET = 1024 * 1024;
+			const size_t FILE_SIZE = 25 * 1024; // 100 kb
+			std::shared_ptr<INode> inode = fs->superblock->inode_table->alloc_inode();
+			assert(inode->superblock == fs->superblock.get());
+
+			std::unique_ptr<char[]> mem_file(new char[FILE_SIZE]);
+			std::unique_ptr<char[]> mem_file_readback(new char[FILE_SIZE]);
+			std::memset((void *)mem_file.get(), 0, FILE_SIZE);
+			std::memset((void *)mem_file_readback.get(), 0, FILE_SIZE);
+
+			for (size_t idx = 0; idx < 1000; ++idx) {
+				size_t size = rand() % (1 * 1024);
+				size_t offset = rand() % (FILE_SIZE - size) + BASE_OFFSET;
+				// std::cout << "writing size: " << size << " bytes at offset: " << offset << std::endl;
+				std::vector<char> buffer = get_random_buffer(size);
+				REQUIRE(inode->write(offset, &(buffer[0]), size) == size);
+				std::memcpy((void *)(mem_file.get() + offset - BASE_OFFSET), &(buffer[0]), size);
+			}
+			// the random writes need not reach the end, reads stop at the end of the file
+			REQUIRE(inode->write(BASE_OFFSET + FILE_SIZE - 1, mem_file.get() + FILE_SIZE - 1, 1) == 1);
+
+			REQUIRE(inode->read(BASE_OFFSET, mem_file_readback.get(), FILE_SIZE) == FILE_SIZE);
+			REQUIRE(std::memcmp(mem_file.get(), mem_file_readback.get(), FILE_SIZE) == 0);
+
+			// rebuild the filesystem and make sure that it is still the same :) 
+			uint64_t inode_idx = inode->inode_table_idx;
+			inode = nullptr;
+			fs = nullptr;
+			fs = std::unique_ptr<FileSystem>(new FileSystem(disk.get()));
+			fs->superblock->load_from_disk();
 
-	inode = fs->superblock->inode_table->get_inode(inode_idx);
-	REQUIRE(inode->read(BASE_OFFSET, mem_file_readback.get(), FILE_SIZE) == FILE_SIZE);
-	REQUIRE(std::memcmp(mem_file.get(), mem_file_readback.get(), FILE_SIZE) == 0);
+			inode = fs->superblock->inode_table->get_inode(inode_idx);
+			REQUIRE(inode->read(BASE_OFFSET, mem_file_readback.get(), FILE_SIZE) == FILE_SIZE);
+			REQUIRE(std::memcmp(mem_file.get(), mem_file_readback.get(), FILE_SIZE) == 0);
+		}
+	}
 }
 
 // /*
@@ -354,209 +1414,301 @@ TEST_CASE("INode write overlapping strings", "[INode]"){
 }
 
 TEST_CASE("INodes can be used to store and read directories", "[filesystem][idirectory]") {
-	std::unique_ptr<Disk> disk(new Disk(10 * 1024, 512));
-	std::unique_ptr<FileSystem> fs(new FileSystem(disk.get()));
-	fs->superblock->init(0.1);
-
-	SECTION("Can write a SINGLE file to a directory") {
-		std::shared_ptr<INode> inode_dir = fs->superblock->inode_table->alloc_inode();
-		std::shared_ptr<INode> inode_file = fs->superblock->inode_table->alloc_inode();
-		inode_file->write(0, "hello there!!!", sizeof("hello there!!!"));
-
-		IDirectory directory(*inode_dir);
-		directory.initializeEmpty();
-		directory.add_file("hello_world", *inode_file);
-		directory.flush();
-	}
-
-	SECTION("Can write a SINGLE file to a directory AND get it back") {
-		std::shared_ptr<INode> inode_dir = fs->superblock->inode_table->alloc_inode();
-		std::shared_ptr<INode> inode_file = fs->superblock->inode_table->alloc_inode();
-		inode_file->write(0, "hello there!!!", sizeof("hello there!!!"));
-
-		IDirectory directory(*inode_dir);
-		directory.initializeEmpty();
-		directory.add_file("hello_world", *inode_file);
-		directory.flush();
-
-		auto entries = directory.get_files();
-		std::unique_ptr<IDirectory::DirEntry> &entry = entries[0];
-		REQUIRE(entry != nullptr);
-		REQUIRE(entry->inode_idx == inode_file->inode_table_idx);
-		REQUIRE(strcmp(entry->filename.c_str(), "hello_world") == 0);
-	}
-
-	SECTION("Can write TWO files to a directory AND get them back") {
-		std::shared_ptr<INode> inode_dir = fs->superblock->inode_table->alloc_inode();
-		std::shared_ptr<INode> inode_file = fs->superblock->inode_table->alloc_inode();
-		std::shared_ptr<INode> inode_file2 = fs->superblock->inode_table->alloc_inode();
-		inode_file->write(0, "hello there1!!!", sizeof("hello there1!!!"));
-		inode_file2->write(0, "hello there2!!!", sizeof("hello there2!!!"));
-
-		IDirectory directory(*inode_dir);
-		directory.initializeEmpty();
-		directory.add_file("hello_world", *inode_file);
-		directory.add_file("hello_world2", *inode_file2);
-		directory.flush();
-
-		auto entries = directory.get_files();
-		std::unique_ptr<IDirectory::DirEntry>& entry = entries[0];
-		REQUIRE(entry->inode_idx == inode_file->inode_table_idx);
-		REQUIRE(strcmp(entry->filename.c_str(), "hello_world") == 0);
-
-		std::unique_ptr<IDirectory::DirEntry>& entry2 = entries[1];
-		REQUIRE(entry2->inode_idx == inode_file2->inode_table_idx);
-		REQUIRE(strcmp(entry2->filename.c_str(), "hello_world2") == 0);
-	}
+	for (uint64_t chunk_size : TESTED_CHUNK_SIZES) {
+		DYNAMIC_SECTION("with " << chunk_size << " byte chunks") {
+			std::unique_ptr<Disk> disk(new Disk(chunk_count_for(chunk_size, 10 * 1024 * 512, 512), chunk_size));
+			std::unique_ptr<FileSystem> fs(new FileSystem(disk.get()));
+			fs->superblock->init(0.1);
 
-	SECTION("Can write TWO files to a directory AND get them back BY NAME and then remove them both") {
-		std::shared_ptr<INode> inode_dir = fs->superblock->inode_table->alloc_inode();
-		std::shared_ptr<INode> inode_file = fs->superblock->inode_table->alloc_inode();
-		std::shared_ptr<INode> inode_file2 = fs->superblock->inode_table->alloc_inode();
-		inode_file->write(0, "hello there!!!", sizeof("hello there!!!"));
-		inode_file2->write(0, "hello there!!!", sizeof("hello there!!!"));
+			SECTION("Can write a SINGLE file to a directory") {
+				std::shared_ptr<INode> inode_dir = fs->superblock->inode_table->alloc_inode();
+				std::shared_ptr<INode> inode_file = fs->superblock->inode_table->alloc_inode();
+				inode_file->write(0, "hello there!!!", sizeof("hello there!!!"));
 
-		IDirectory directory(*inode_dir);
-		directory.initializeEmpty();
-		directory.add_file("hello_world", *inode_file);
-		directory.add_file("hello_world2", *inode_file2);
-
-		std::unique_ptr<IDirectory::DirEntry> entry = directory.get_file("hello_world");
-		REQUIRE(entry->inode_idx == inode_file->inode_table_idx);
-		REQUIRE(strcmp(entry->filename.c_str(), "hello_world") == 0);
+				IDirectory directory(*inode_dir);
+				directory.initializeEmpty();
+				directory.add_file("hello_world", *inode_file);
+				directory.flush();
+			}
 
-		std::unique_ptr<IDirectory::DirEntry> entry2 = directory.get_file("hello_world2");
-		REQUIRE(entry2->inode_idx == inode_file2->inode_table_idx);
-		REQUIRE(strcmp(entry2->filename.c_str(), "hello_world2") == 0);
+			SECTION("Can write a SINGLE file to a directory AND get it back") {
+				std::shared_ptr<INode> inode_dir = fs->superblock->inode_table->alloc_inode();
+				std::shared_ptr<INode> inode_file = fs->superblock->inode_table->alloc_inode();
+				inode_file->write(0, "hello there!!!", sizeof("hello there!!!"));
+
+				IDirectory directory(*inode_dir);
+				directory.initializeEmpty();
+				directory.add_file("hello_world", *inode_file);
+				directory.flush();
+
+				auto entries = directory.get_files();
+				std::unique_ptr<IDirectory::DirEntry> &entry = entries[0];
+				REQUIRE(entry != nullptr);
+				REQUIRE(entry->inode_idx == inode_file->inode_table_idx);
+				REQUIRE(strcmp(entry->filename.c_str(), "hello_world") == 0);
+			}
 
-		// TEST REMOVING A FILE
-		REQUIRE(directory.remove_file("hello_world") != nullptr);
-		REQUIRE(directory.get_file("hello_world") == nullptr);
+			SECTION("Can write TWO files to a directory AND get them back") {
+				std::shared_ptr<INode> inode_dir = fs->superblock->inode_table->alloc_inode();
+				std::shared_ptr<INode> inode_file = fs->superblock->inode_table->alloc_inode();
+				std::shared_ptr<INode> inode_file2 = fs->superblock->inode_table->alloc_inode();
+				inode_file->write(0, "hello there1!!!", sizeof("hello there1!!!"));
+				inode_file2->write(0, "hello there2!!!", sizeof("hello there2!!!"));
+
+				IDirectory directory(*inode_dir);
+				directory.initializeEmpty();
+				directory.add_file("hello_world", *inode_file);
+				directory.add_file("hello_world2", *inode_file2);
+				directory.flush();
+
+				auto entries = directory.get_files();
+				std::unique_ptr<IDirectory::DirEntry>& entry = entries[0];
+				REQUIRE(entry->inode_idx == inode_file->inode_table_idx);
+				REQUIRE(strcmp(entry->filename.c_str(), "hello_world") == 0);
+
+				std::unique_ptr<IDirectory::DirEntry>& entry2 = entries[1];
+				REQUIRE(entry2->inode_idx == inode_file2->inode_table_idx);
+				REQUIRE(strcmp(entry2->filename.c_str(), "hello_world2") == 0);
+			}
 
-		// TEST REMOVING A FILE
-		REQUIRE(directory.remove_file("hello_world2") != nullptr);
-		REQUIRE(directory.get_file("hello_world2") == nullptr);
-	}
+			SECTION("Can write TWO files to a directory AND get them back BY NAME and then remove them both") {
+				std::shared_ptr<INode> inode_dir = fs->superblock->inode_table->alloc_inode();
+				std::shared_ptr<INode> inode_file = fs->superblock->inode_table->alloc_inode();
+				std::shared_ptr<INode> inode_file2 = fs->superblock->inode_table->alloc_inode();
+				inode_file->write(0, "hello there!!!", sizeof("hello there!!!"));
+				inode_file2->write(0, "hello there!!!", sizeof("hello there!!!"));
+
+				IDirectory directory(*inode_dir);
+				directory.initializeEmpty();
+				directory.add_file("hello_world", *inode_file);
+				directory.add_file("hello_world2", *inode_file2);
+
+				std::unique_ptr<IDirectory::DirEntry> entry = directory.get_file("hello_world");
+				REQUIRE(entry->inode_idx == inode_file->inode_table_idx);
+				REQUIRE(strcmp(entry->filename.c_str(), "hello_world") == 0);
+
+				std::unique_ptr<IDirectory::DirEntry> entry2 = directory.get_file("hello_world2");
+				REQUIRE(entry2->inode_idx == inode_file2->inode_table_idx);
+				REQUIRE(strcmp(entry2->filename.c_str(), "hello_world2") == 0);
+
+				// TEST REMOVING A FILE
+				REQUIRE(directory.remove_file("hello_world") != nullptr);
+				REQUIRE(directory.get_file("hello_world") == nullptr);
+
+				// TEST REMOVING A FILE
+				REQUIRE(directory.remove_file("hello_world2") != nullptr);
+				REQUIRE(directory.get_file("hello_world2") == nullptr);
+			}
 
-	SECTION("can write a thousand files, each of which contains a single number base 10 encoded") {
+			SECTION("can write a thousand files, each of which contains a single number base 10 encoded") {
 		
-		std::shared_ptr<INode> inode_dir = fs->superblock->inode_table->alloc_inode();
-		IDirectory directory(*inode_dir);
-		directory.initializeEmpty();
+				std::shared_ptr<INode> inode_dir = fs->superblock->inode_table->alloc_inode();
+				IDirectory directory(*inode_dir);
+				directory.initializeEmpty();
 
-		for (int i = 0; i < 100; ++i) {
-			char file_name[255];
+				for (int i = 0; i < 100; ++i) {
+					char file_name[255];
 			
-			sprintf(file_name, "file-%d\0", i);
-
-			char file_contents[255];
-			sprintf(file_contents, "the contents of this file is: %d\n", i);
-			std::shared_ptr<INode> inode = fs->superblock->inode_table->alloc_inode();
-			REQUIRE(inode->write(0, file_contents, strlen(file_contents) + 1) == strlen(file_contents) + 1);
-
-			directory.add_file(file_name, *inode);
-		}
-
-		// step 1: confirm that the number of directories matches the # we would expect
-		{
-			auto entries = directory.get_files();
-			size_t count = 0;
-			for (auto &entry : entries) {
-				count++;
-			}
-
-			REQUIRE(count == 100);
-		}
-
-		// step 2: read back each file 1 at a time checking that its contents matches the expected, and then removing it
-		for (int i = 0; i < 100; ++i) {
-			char file_name[255];
-			char file_contents[255];
-			char file_contents_expected[255];
-			memset(file_contents, 0, sizeof(file_contents));
+					sprintf(file_name, "file-%d\0", i);
+
+					char file_contents[255];
+					sprintf(file_contents, "the contents of this file is: %d\n", i);
+					std::shared_ptr<INode> inode = fs->superblock->inode_table->alloc_inode();
+					REQUIRE(inode->write(0, file_contents, strlen(file_contents) + 1) == strlen(file_contents) + 1);
+
+					directory.add_file(file_name, *inode);
+				}
+
+				// step 1: confirm that the number of directories matches the # we would expect
+				{
+					auto entries = directory.get_files();
+					size_t count = 0;
+					for (auto &entry : entries) {
+						count++;
+					}
+
+					REQUIRE(count == 100);
+				}
+
+				// step 2: read back each file 1 at a time checking that its contents matches the expected, and then removing it
+				for (int i = 0; i < 100; ++i) {
+					char file_name[255];
+					char file_contents[255];
+					char file_contents_expected[255];
+					memset(file_contents, 0, sizeof(file_contents));
 			
-			sprintf(file_name, "file-%d\0", i);
-			sprintf(file_contents_expected, "the contents of this file is: %d\n", i);
+					sprintf(file_name, "file-%d\0", i);
+					sprintf(file_contents_expected, "the contents of this file is: %d\n", i);
 
-			// read the file contents
-			auto direntry = directory.get_file(file_name);
-			auto file_inode = fs->superblock->inode_table->get_inode(direntry->inode_idx);
-			file_inode->read(0, file_contents, file_inode->data.file_size);
+					// read the file contents
+					auto direntry = directory.get_file(file_name);
+					auto file_inode = fs->superblock->inode_table->get_inode(direntry->inode_idx);
+					file_inode->read(0, file_contents, file_inode->data.file_size);
 
-			REQUIRE(strcmp(file_contents_expected, file_contents) == 0);
+					REQUIRE(strcmp(file_contents_expected, file_contents) == 0);
 
-			REQUIRE(directory.remove_file(file_name)->inode_idx == direntry->inode_idx);
-		}
+					REQUIRE(directory.remove_file(file_name)->inode_idx == direntry->inode_idx);
+				}
 		
-		// step 2: confirm that the number of directories matches the # we would expect (0 b/c we removed them all)
-		{
-			auto entries = directory.get_files();
-			size_t count = 0;
-			for (auto &entry : entries) {
-				count++;
+				// step 2: confirm that the number of directories matches the # we would expect (0 b/c we removed them all)
+				{
+					auto entries = directory.get_files();
+					size_t count = 0;
+					for (auto &entry : entries) {
+						count++;
+					}
+
+					REQUIRE(count == 0);
+				}
 			}
-
-			REQUIRE(count == 0);
 		}
 	}
 }
 
-TEST_CASE("Many INodes can be written and cleaned", "[filesystem][cleaning]") {
-	std::unique_ptr<Disk> disk(new Disk(1024 * 64, 1024));
+TEST_CASE("Reading files and directories should not write anything back", "[filesystem][dirty]") {
+	std::unique_ptr<Disk> disk(new Disk(10 * 1024, 512));
 	std::unique_ptr<FileSystem> fs(new FileSystem(disk.get()));
 	fs->superblock->init(0.1);
-	uint64_t segment_size_bytes = fs->superblock->segment_controller.segment_size * 1024;
 
-	SECTION("Can write a MANY file to a directory") {
+	const size_t FILE_SIZE = 64 * 1024;
+	std::vector<char> contents = get_random_buffer(FILE_SIZE);
+	uint64_t dir_idx = 0;
+	{
 		std::shared_ptr<INode> inode_dir = fs->superblock->inode_table->alloc_inode();
+		std::shared_ptr<INode> inode_file = fs->superblock->inode_table->alloc_inode();
+		REQUIRE(inode_file->write(0, &contents[0], FILE_SIZE) == FILE_SIZE);
 
-		int i;
-		for(i = 0; i < fs->superblock->segment_controller.num_segments*7/5; i++) {
-			std::shared_ptr<INode> inode_file = fs->superblock->inode_table->alloc_inode();
+		IDirectory directory(*inode_dir);
+		directory.initializeEmpty();
+		directory.add_file("file", *inode_file);
+		directory.flush();
+		dir_idx = inode_dir->inode_table_idx;
+	}
+	disk->sync_all();
+	const uint64_t writebacks = disk->cache_stats().writebacks;
 
-			std::cout << "writing file " << i << " of " << fs->superblock->segment_controller.num_segments*7/5 << std::endl;
+	for (int pass = 0; pass < 10; ++pass) {
+		std::shared_ptr<INode> inode_dir = fs->superblock->inode_table->get_inode(dir_idx);
+		IDirectory directory(*inode_dir);
+		std::unique_ptr<IDirectory::DirEntry> entry = directory.get_file("file");
+		REQUIRE(entry != nullptr);
 
-			std::vector<char> to_write;
-			for (int j = 0; j < segment_size_bytes/7; ++j) {
-				to_write.push_back('A' + i);
-			}
-			to_write.push_back('\0');
+		std::shared_ptr<INode> inode_file = fs->superblock->inode_table->get_inode(entry->inode_idx);
+		std::vector<char> readback(FILE_SIZE);
+		REQUIRE(inode_file->read(0, &readback[0], FILE_SIZE) == FILE_SIZE);
+		REQUIRE(readback == contents);
+	}
 
-			char buf[256];
-			sprintf(buf, "file-%d", i);
+	disk->sync_all();
+	Disk::CacheStats stats = disk->cache_stats();
+	REQUIRE(stats.writebacks == writebacks);
+	REQUIRE(stats.dirty_chunks == 0);
+}
 
-			IDirectory directory(*inode_dir);
-			directory.add_file(buf, *inode_file);
-			inode_file->write(0, &to_write[0], to_write.size());
-			directory.flush();
+TEST_CASE("Sequential reads should be read ahead, random ones should not", "[filesystem][readahead]") {
+	std::unique_ptr<Disk> disk(new Disk(10 * 1024, 512));
+	std::unique_ptr<FileSystem> fs(new FileSystem(disk.get()));
+	fs->superblock->init(0.1);
+
+	const size_t FILE_SIZE = 1024 * 1024;
+	std::vector<char> contents = get_random_buffer(FILE_SIZE);
+	std::shared_ptr<INode> inode = fs->superblock->inode_table->alloc_inode();
+	REQUIRE(inode->write(0, &contents[0], FILE_SIZE) == FILE_SIZE);
+
+	// start out with nothing of the file in memory
+	disk->configure_cache(0);
+	disk->configure_cache(4 * 1024 * 1024);
+	const Disk::CacheStats before = disk->cache_stats();
+
+	SECTION("reading the file front to back reads ahead of the reader") {
+		std::vector<char> readback(FILE_SIZE);
+		for (size_t offset = 0; offset < FILE_SIZE; offset += 4096) {
+			REQUIRE(inode->read(offset, &readback[offset], 4096) == 4096);
+			disk->wait_for_readahead();
 		}
-		for(int j = 0; j < fs->superblock->segment_controller.num_segments*7/5; j++) {
-			if(j % 5 == 0) {
-				continue;
-			}
-			IDirectory directory(*inode_dir);
-			char buf[256];
-			sprintf(buf, "file-%d", j);
-			auto entry = directory.remove_file(buf);
-			REQUIRE(entry != nullptr);
-			fs->superblock->inode_table->get_inode(entry->inode_idx)->release_chunks();
-		}
-		for(i; i < fs->superblock->segment_controller.num_segments*7/5 + fs->superblock->segment_controller.num_segments*7/10; i++) {
-			std::shared_ptr<INode> inode_file = fs->superblock->inode_table->alloc_inode();
-
-			std::vector<char> to_write;
-			for (int j = 0; j < segment_size_bytes/7; ++j) {
-				to_write.push_back('A' + i);
-			}
-			to_write.push_back('\0');
+		REQUIRE(readback == contents);
+
+		Disk::CacheStats stats = disk->cache_stats();
+		const uint64_t readahead_chunks = stats.readahead_chunks - before.readahead_chunks;
+		const uint64_t readahead_hits = stats.readahead_hits - before.readahead_hits;
+		REQUIRE(readahead_chunks > FILE_SIZE / 512 / 2);
+		REQUIRE(readahead_hits == readahead_chunks);
+		REQUIRE(inode->readahead.window == INode::READAHEAD_MAX_CHUNKS);
+	}
 
-			char buf[256];
-			sprintf(buf, "file-%d", i);
+	SECTION("reading all over the file does not") {
+		std::vector<char> readback(4096);
+		// (a read at the very start of a file counts as the start of a stream)
+		for (size_t idx = 1; idx <= 64; ++idx) {
+			size_t offset = (idx * 7919 * 4096) % (FILE_SIZE - 4096);
+			REQUIRE(inode->read(offset, &readback[0], 4096) == 4096);
+			REQUIRE(std::memcmp(&readback[0], &contents[offset], 4096) == 0);
+		}
+		disk->wait_for_readahead();
+		REQUIRE(disk->cache_stats().readahead_chunks == before.readahead_chunks);
+	}
+}
 
-			IDirectory directory(*inode_dir);
-			directory.add_file(buf, *inode_file);
-			inode_file->write(0, &to_write[0], to_write.size());
-			directory.flush();
+TEST_CASE("Many INodes can be written and cleaned", "[filesystem][cleaning]") {
+	for (uint64_t chunk_size : TESTED_CHUNK_SIZES) {
+		DYNAMIC_SECTION("with " << chunk_size << " byte chunks") {
+			std::unique_ptr<Disk> disk(new Disk(chunk_count_for(chunk_size, 1024 * 64 * 1024, 512), chunk_size));
+			std::unique_ptr<FileSystem> fs(new FileSystem(disk.get()));
+			fs->superblock->init(0.1);
+			uint64_t segment_size_bytes = fs->superblock->segment_controller.segment_size * chunk_size;
+
+			SECTION("Can write a MANY file to a directory") {
+				std::shared_ptr<INode> inode_dir = fs->superblock->inode_table->alloc_inode();
+
+				int i;
+				for(i = 0; i < fs->superblock->segment_controller.num_segments*7/5; i++) {
+					std::shared_ptr<INode> inode_file = fs->superblock->inode_table->alloc_inode();
+
+					std::cout << "writing file " << i << " of " << fs->superblock->segment_controller.num_segments*7/5 << std::endl;
+
+					std::vector<char> to_write;
+					for (int j = 0; j < segment_size_bytes/7; ++j) {
+						to_write.push_back('A' + i);
+					}
+					to_write.push_back('\0');
+
+					char buf[256];
+					sprintf(buf, "file-%d", i);
+
+					IDirectory directory(*inode_dir);
+					directory.add_file(buf, *inode_file);
+					inode_file->write(0, &to_write[0], to_write.size());
+					directory.flush();
+				}
+				for(int j = 0; j < fs->superblock->segment_controller.num_segments*7/5; j++) {
+					if(j % 5 == 0) {
+						continue;
+					}
+					IDirectory directory(*inode_dir);
+					char buf[256];
+					sprintf(buf, "file-%d", j);
+					auto entry = directory.remove_file(buf);
+					REQUIRE(entry != nullptr);
+					fs->superblock->inode_table->get_inode(entry->inode_idx)->release_chunks();
+				}
+				for(i; i < fs->superblock->segment_controller.num_segments*7/5 + fs->superblock->segment_controller.num_segments*7/10; i++) {
+					std::shared_ptr<INode> inode_file = fs->superblock->inode_table->alloc_inode();
+
+					std::vector<char> to_write;
+					for (int j = 0; j < segment_size_bytes/7; ++j) {
+						to_write.push_back('A' + i);
+					}
+					to_write.push_back('\0');
+
+					char buf[256];
+					sprintf(buf, "file-%d", i);
+
+					IDirectory directory(*inode_dir);
+					directory.add_file(buf, *inode_file);
+					inode_file->write(0, &to_write[0], to_write.size());
+					directory.flush();
+				}
+			}
 		}
 	}
 }
\ No newline at end of file